@@ -97,18 +97,18 @@ qreal LinkIntervalMeasurement::binThroughput(Timestamp binSize) const
 }
 #endif
 
-void LinkIntervalMeasurement::recordPacket(bool forwarded, Timestamp delayNs)
+void LinkIntervalMeasurement::recordPacket(bool forwarded, Timestamp delayNs, int count)
 {
-	numPacketsInFlight++;
-	numPacketsDropped += forwarded ? 0 : 1;
+	numPacketsInFlight += count;
+	numPacketsDropped += forwarded ? 0 : count;
 	qint16 delay = delayNs /= ms();
 	if (delay > 0) {
 		if (minDelay == 0)
 			minDelay = delay;
 		else
 			minDelay = qMin(minDelay, delay);
-		sumDelay += delay;
-		sumSquaredDelay += delay * delay;
+		sumDelay += delay * count;
+		sumSquaredDelay += qint64(delay) * delay * count;
         maxDelay = qMax(delay, maxDelay);
     }
 }
@@ -41,7 +41,8 @@ public:
 #ifndef LINE_EMULATOR
 	qreal binThroughput(Timestamp binSize) const;
 #endif
-	void recordPacket(bool forwarded, Timestamp delay);
+	// count > 1 records several packets with the same fate and delay (the segments of a super-packet)
+	void recordPacket(bool forwarded, Timestamp delay, int count = 1);
 
 	friend bool operator ==(const LinkIntervalMeasurement &a, const LinkIntervalMeasurement &b);
 	friend bool operator !=(const LinkIntervalMeasurement &a, const LinkIntervalMeasurement &b);
@@ -78,8 +79,9 @@ public:
 							int packetSizeThreshold);
 
 	// Returns the interval that was updated, or -1.
-	virtual bool recordPacketLink(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay) = 0;
-	virtual bool recordPacketPath(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay) = 0;
+	// count is the number of packets recorded at once (see LinkIntervalMeasurement::recordPacket()).
+	virtual bool recordPacketLink(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay, int count = 1) = 0;
+	virtual bool recordPacketPath(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay, int count = 1) = 0;
 
 	virtual LinkIntervalMeasurement readLink(PathPair pp, Link e, int i) const = 0;
 	virtual LinkIntervalMeasurement readLinkPath(PathPair pp, LinkPath ep, int i) const = 0;
@@ -133,86 +133,25 @@ void FlowEvent::handlePacket(Packet *p)
 		return;
 	}
 
-	const struct tcphdr *tcp = (p->l4_protocol == IPPROTO_TCP) ?
-								   (const struct tcphdr *)(p->buffer + p->offsets.l4_offset) :
-								   NULL;
-
 	if (!p->dropped) {
 		fordwardDelay = p->theoretical_delay;
 	}
-	if (tcp) {
+	// The window fields are parsed from the headers by the consumer (see parseTcpWindow())
+	if (p->l4_protocol == IPPROTO_TCP) {
 		tcpFlags = p->tcpFlags;
-		tcpReceiveWindow = ntohs(tcp->window);
-		if (tcp->syn) {
-			// We need to parse the options to get the window scale
-			const unsigned char *tcpopt = (const unsigned char*)(tcp + 1);
-			unsigned tcpHeaderLength = 4*tcp->doff;
-			if (tcpHeaderLength >= sizeof(struct tcphdr)) {
-				const unsigned char *tcppayload = (const unsigned char*)(tcp) + tcpHeaderLength;
-				int tcpoptlen = tcppayload - tcpopt;
-
-				while (tcpoptlen > 0) {
-					// Note that we are not implementing parsing all the possible TCP options, only the one that are
-					// likely to be encountered in our experiments. If an unknown option is encountered, we abort.
-					if (*tcpopt == TCPOPT_EOL) {
-						// End of option list
-						break;
-					} else if (*tcpopt == TCPOPT_NOP) {
-						// No operation
-						tcpopt++, tcpoptlen = tcppayload - tcpopt;
-					} else if (*tcpopt == TCPOPT_MAXSEG) {
-						// Maximum segment size
-						tcpopt += TCPOLEN_MAXSEG, tcpoptlen = tcppayload - tcpopt;
-					} else if (*tcpopt == TCPOPT_WINDOW) {
-						// Window scale factor
-						if (tcpoptlen >= TCPOLEN_WINDOW) {
-							tcpReceiveWindowScale = tcpopt[2];
-							// This is all we wanted, so stop processing
-							break;
-						} else {
-							break;
-						}
-						tcpopt += TCPOLEN_WINDOW, tcpoptlen = tcppayload - tcpopt;
-					} else if (*tcpopt == TCPOPT_SACK_PERMITTED) {
-						// Sack permitted
-						tcpopt += TCPOLEN_SACK_PERMITTED, tcpoptlen = tcppayload - tcpopt;
-					} else if (*tcpopt == TCPOPT_SACK) {
-						// Sack
-						if (tcpoptlen < 2) {
-							break;
-						}
-						unsigned char length = tcpopt[1];
-						if (length > tcpoptlen) {
-							break;
-						}
-						tcpopt += length, tcpoptlen = tcppayload - tcpopt;
-					} else if (*tcpopt == TCPOPT_TIMESTAMP) {
-						// Timestamp
-						tcpopt += TCPOLEN_TIMESTAMP, tcpoptlen = tcppayload - tcpopt;
-					} else if (*tcpopt == 28) {
-						// User timeout
-						tcpopt += 4, tcpoptlen = tcppayload - tcpopt;
-					} else {
-						// not implemented
-						break;
-					}
-				}
-			}
+		tcpReceiveWindow = p->tcpReceiveWindow;
+		if ((p->tcpFlags & TH_SYN) && p->tcpWindowScale >= 0) {
+			tcpReceiveWindowScale = p->tcpWindowScale;
 		}
 	}
 }
 
 void SampledFlowEvents::handlePacket(Packet *p, quint64 tsNow)
 {
-	// Points to a TCP structure if this is a TCP packet, or NULL otherwise
-	const struct tcphdr *tcp = (p->l4_protocol == IPPROTO_TCP) ?
-								   (const struct tcphdr *)(p->buffer + p->offsets.l4_offset) :
-								   NULL;
-
 	// Create a new event on periodic tick, no existing events or new TCP flow
 	if ((flowEvents.isEmpty()) ||
 		(tsNow >= tsLastSample + SEC_TO_NSEC) ||
-		(tcp && tcp->syn)) {
+		(p->l4_protocol == IPPROTO_TCP && (p->tcpFlags & TH_SYN))) {
 		FlowEvent event;
 		event.tsEvent = tsNow;
 		flowEvents.append(event);
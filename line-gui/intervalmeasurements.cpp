@@ -110,7 +110,7 @@ void ExperimentIntervalMeasurements::initialize(quint64 tsStart,
 	}
 }
 
-bool ExperimentIntervalMeasurements::recordPacketLink(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay)
+bool ExperimentIntervalMeasurements::recordPacketLink(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay, int count)
 {
 	Q_UNUSED(pp);
 	if (size < packetSizeThreshold)
@@ -124,17 +124,17 @@ bool ExperimentIntervalMeasurements::recordPacketLink(PathPair pp, LinkPath ep,
 
 	tsLast = qMax(tsLast, tsIn);
 	tsLast = qMax(tsLast, tsOut);
-	globalMeasurements.linkMeasurements[ep.first].recordPacket(forwarded, delay);
-	globalMeasurements.perPathLinkMeasurements[ep].recordPacket(forwarded, delay);
+	globalMeasurements.linkMeasurements[ep.first].recordPacket(forwarded, delay, count);
+	globalMeasurements.perPathLinkMeasurements[ep].recordPacket(forwarded, delay, count);
 
 	for (int i = iIn; i <= iOut; i++) {
-        intervalMeasurements[i].linkMeasurements[ep.first].recordPacket(forwarded, delay);
-		intervalMeasurements[i].perPathLinkMeasurements[ep].recordPacket(forwarded,	delay);
+        intervalMeasurements[i].linkMeasurements[ep.first].recordPacket(forwarded, delay, count);
+		intervalMeasurements[i].perPathLinkMeasurements[ep].recordPacket(forwarded, delay, count);
 	}
 	return true;
 }
 
-bool ExperimentIntervalMeasurements::recordPacketPath(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay)
+bool ExperimentIntervalMeasurements::recordPacketPath(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay, int count)
 {
 	Q_UNUSED(pp);
     if (size < packetSizeThreshold)
@@ -142,7 +142,7 @@ bool ExperimentIntervalMeasurements::recordPacketPath(PathPair pp, LinkPath ep,
 
     tsLast = qMax(tsLast, tsIn);
 	tsLast = qMax(tsLast, tsOut);
-	globalMeasurements.pathMeasurements[ep.second].recordPacket(forwarded, delay);
+	globalMeasurements.pathMeasurements[ep.second].recordPacket(forwarded, delay, count);
 
 	int iIn = timestampToOpenInterval(tsIn);
 	if (iIn < 0)
@@ -152,7 +152,7 @@ bool ExperimentIntervalMeasurements::recordPacketPath(PathPair pp, LinkPath ep,
 		return false;
 
 	for (int i = iIn; i <= iOut; i++) {
-		intervalMeasurements[i].pathMeasurements[ep.second].recordPacket(forwarded, delay);
+		intervalMeasurements[i].pathMeasurements[ep.second].recordPacket(forwarded, delay, count);
 	}
 	return true;
 }
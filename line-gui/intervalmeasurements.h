@@ -50,8 +50,8 @@ public:
                     QList<LinkPath> sparseRoutingMatrixTransposed,
 					int packetSizeThreshold);
 
-	bool recordPacketLink(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay);
-	bool recordPacketPath(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay);
+	bool recordPacketLink(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay, int count = 1);
+	bool recordPacketPath(PathPair pp, LinkPath ep, Timestamp tsIn, Timestamp tsOut, int size, bool forwarded, Timestamp delay, int count = 1);
 
 	LinkIntervalMeasurement readLink(PathPair pp, Link e, int i) const;
 	LinkIntervalMeasurement readLinkPath(PathPair pp, LinkPath ep, int i) const;
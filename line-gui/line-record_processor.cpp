@@ -52,7 +52,8 @@ bool loadGraph(QString expPath, NetGraph &g)
 		qWarning() << __FILE__ << __LINE__ << __FUNCTION__ << "Could not read simulation.txt";
 		return false;
 	}
-	graphName = graphName.replace("graph=", "");
+	// the first line is graph=<name>, followed by other key=value lines
+	graphName = graphName.split('\n').first().replace("graph=", "").trimmed();
 
 	g.setFileName(expPath + "/" + graphName + ".graph");
 	if (!g.loadFromFile()) {
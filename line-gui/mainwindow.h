@@ -247,7 +247,9 @@ private slots:
 	void on_checkGenericTimeout_toggled(bool checked);
 	void generateSimpleTopology(int pairs);
 	void on_txtGenericTimeout_textChanged(const QString &arg1);
-	bool experimentOk(QString testId, QString &reason, double delayErrorLimit = 0.2);
+	// lateFractionLimit: maximum fraction of the packets that the emulator handled later than its lateness
+	// threshold (only checked when the emulator saved emulator-stats.json)
+	bool experimentOk(QString testId, QString &reason, double delayErrorLimit = 0.2, double lateFractionLimit = 0.01);
 	void saveExperimentQueue();
 	void loadExperimentQueue();
 	bool runLongCommand(QString path, QStringList args, QPlainTextEdit *log);
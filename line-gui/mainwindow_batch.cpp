@@ -84,6 +84,12 @@ bool MainWindow::getRunParams(RunParams &params, QPlainTextEdit *log)
 					   ui->spinFakeGLLossMax->value() / 100.0,
 					   ui->spinFakeCLLossNoise->value() / 100.0,
 					   ui->spinFakeGLLossNoise->value() / 100.0);
+#ifdef REMOTE_HOSTS_EMULATORS
+	params.emulatorHostNames = QString(REMOTE_HOSTS_EMULATORS).split(' ', QString::SkipEmptyParts);
+#endif
+#ifdef REMOTE_HOST_IDENTIFICATION
+	params.hostIdentification = REMOTE_HOST_IDENTIFICATION;
+#endif
 	return true;
 }
 
@@ -433,7 +439,57 @@ void MainWindow::on_btnGenericStop_clicked()
 	mustStop = true;
 }
 
-bool MainWindow::experimentOk(QString testId, QString &reason, double delayErrorLimit)
+// The values of all the members with the given name in a JSON file written by the emulator (numbers and booleans).
+static QList<qreal> emulatorStatsValues(const QString &json, QString name)
+{
+	QList<qreal> result;
+	QRegExp rx(QString("\"%1\": ([-+0-9.eE]+|true|false)").arg(QRegExp::escape(name)));
+	for (int pos = 0; (pos = rx.indexIn(json, pos)) >= 0; pos += rx.matchedLength()) {
+		QString value = rx.cap(1);
+		result << (value == "true" ? 1.0 : value == "false" ? 0.0 : value.toDouble());
+	}
+	return result;
+}
+
+static bool emulatorStatsOk(const QString &json, QString &reason, double delayErrorLimit, double lateFractionLimit)
+{
+	QList<qreal> packetsReceived = emulatorStatsValues(json, "packetsReceived");
+	QList<qreal> captureDropped = emulatorStatsValues(json, "captureDropped");
+	QList<qreal> maxDelayError = emulatorStatsValues(json, "maxRelativeDelayError");
+	QList<qreal> lateFractions = emulatorStatsValues(json, "lateFraction");
+	QList<qreal> accuracyViolated = emulatorStatsValues(json, "accuracyViolated");
+	if (packetsReceived.isEmpty() || captureDropped.isEmpty() || maxDelayError.isEmpty()) {
+		reason = QString("Emulator stats seem to be incomplete");
+		return false;
+	}
+	if (packetsReceived.first() == 0) {
+		reason = QString("No packets reached the emulator");
+		return false;
+	}
+	if (captureDropped.first() > 0) {
+		reason = QString("Dropped packets during capture: %1").arg(captureDropped.first());
+		return false;
+	}
+	if (maxDelayError.first() > delayErrorLimit) {
+		reason = QString("Maximum delay error too high: %1, limit = %2").arg(maxDelayError.first()).arg(delayErrorLimit);
+		return false;
+	}
+	foreach (qreal lateFraction, lateFractions) {
+		if (lateFraction > lateFractionLimit) {
+			reason = QString("Emulator overhead too high: %1% of the packets were late, limit = %2%")
+					 .arg(lateFraction * 100.0).arg(lateFractionLimit * 100.0);
+			return false;
+		}
+	}
+	if (!accuracyViolated.isEmpty() && accuracyViolated.first() != 0) {
+		reason = QString("The emulator aborted the run (accuracy limit exceeded)");
+		return false;
+	}
+	reason = "All fine.";
+	return true;
+}
+
+bool MainWindow::experimentOk(QString testId, QString &reason, double delayErrorLimit, double lateFractionLimit)
 {
 	QString out, err;
 	if (!readFile(testId + "/" + "emulator.out", out)) {
@@ -451,6 +507,12 @@ bool MainWindow::experimentOk(QString testId, QString &reason, double delayError
 		return true;
 	}
 
+	// Prefer the structured stats over scraping the output
+	QString stats;
+	if (readFile(testId + "/" + "emulator-stats.json", stats, true)) {
+		return emulatorStatsOk(stats, reason, delayErrorLimit, lateFractionLimit);
+	}
+
 	QString allout = out + "\n" + err;
 
 	qreal packetsReceived = -1;
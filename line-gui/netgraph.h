@@ -78,15 +78,22 @@ public:
 	// value: if the node is a host, its index in a list of all host nodes ordered by node ID
 	//        else undefined
 	OVector<quint32> destID2Index;
-	// first index: current node ID
+	// vector index: node ID
+	// value: the IDs of the outgoing edges of the node (i.e. its ports)
+	OVector<OVector<qint32> > nodePorts;
+	// vector index: node ID
+	// value: index of the node's routing table in routeTables. Nodes with identical tables share the same one
+	//        (e.g. all the hosts with a single uplink).
+	OVector<quint32> routeTableIndex;
+	// first index: routeTableIndex[current node ID]
 	// second index: destID2Index[destination node ID]
 	// item: if item == NO_ROUTE: no route
-	// item: else if item & LOAD_BALANCED_ROUTE == 1: index = item & LOAD_BALANCED_MASK; lookup
+	// item: else if (item & LOAD_BALANCED_ROUTE_MASK) != 0: index = item & LOAD_BALANCED_VALUE_MASK; lookup
 	//       loadBalancedRouteCache[index]
-	// item: else: item = next hop node ID
-	OVector<OVector<quint32> > routeCache;
+	// item: else: item = port index, i.e. the next edge is nodePorts[current node ID][item]
+	OVector<OVector<quint32> > routeTables;
 	// first index: see above
-	// loadBalancedRouteCache[index] = vector of all the possible next hop node IDs
+	// loadBalancedRouteCache[index] = vector of all the possible port indices
 	OVector<OVector<qint32> > loadBalancedRouteCache;
 #endif
 
@@ -198,6 +205,11 @@ public:
 
 #ifdef LINE_EMULATOR
 	void prepareEmulation();
+	// Builds nodePorts, routeTableIndex, routeTables and loadBalancedRouteCache. Uses all the available cores.
+	void prepareRouteTables();
+	// Finds the chains of edges that cannot congest and attaches each one to the edge that feeds it (see
+	// NetGraphEdge::collapsedEdges). Needs the route tables.
+	void collapseSegments();
 #endif
 
 	// Returns the optimal queue length (i.e. 1 RTT of traffic for 400B frames) in slots, given the bandwidth (KB/s) and delay (ms) over a link
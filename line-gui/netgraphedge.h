@@ -46,6 +46,7 @@
 
 class Packet;
 class NetGraph;
+class LinkUpdate;
 
 class FlowIdentifier {
 public:
@@ -174,13 +175,23 @@ public:
 
     quint64 rate_Bps;        // link rate in bytes/s
     qint32 lossRate_int;     // packet loss rate (2^31-1 means 100% loss)
+    quint64 delay_ns;        // propagation delay in ns (scaled by the time dilation)
+    quint64 fullDelay_ns;    // same, not shortened by the partition lookahead (for injected packets, never tunneled)
 
     // Queue
     quint64 qcapacity;     // queue size in bytes
     quint64 qload;         // how many bytes are used at time == qts_head
     quint64 qts_head;      // the timestamp at which the first byte begins transmitting
+    // Fluid background traffic (see fluidmodel.h): it is not represented by packets, but it adds to qload
+    quint64 fluidRate_Bps;     // current arrival rate
+    quint64 fluidBytesIn;      // total offered
+    quint64 fluidBytesDropped; // total dropped because the queue was full
 	OVector<QueueItem> queued_packets; // the packets in the queue, with some attributes
 	OVector<Packet*> asyncDrains;
+    // Cut-through (see cutThrough() in pscheduler.cpp): the packet that crosses the empty queue without being
+    // enqueued, and the time when it finishes transmitting. Earlier arrivals revoke the cut-through.
+    Packet *cutThroughPacket;
+    quint64 cutThroughUntil;
 
     // Statistics
     qint32 npaths;
@@ -210,6 +221,10 @@ public:
 
 	void drain(quint64 ts_now, OVector<Packet*> &result);
     bool enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit);
+	// Brings qload up to date at ts_now: the queue drains at rate_Bps and receives the fluid background traffic
+	void advance(quint64 ts_now);
+	// Updates the queue parameters from the edge, during the emulation
+	void reconfigure(const NetGraphEdge &edge, quint64 ts_now);
 };
 
 class TokenBucket {
@@ -231,6 +246,9 @@ public:
 	// Returns true if the packet is accepted, false if dropped.
 	bool filter(Packet *p, quint64 ts_now, bool forcePass = false);
 
+	// Updates the rate and capacity from the edge, during the emulation
+	void reconfigure(const NetGraphEdge &edge, quint64 ts_now);
+
 	qint32 policerIndex;
 
 	// Statistics
@@ -352,9 +370,22 @@ public:
 	// always at least one queue.
 	OVector<NetGraphEdgeQueue> queues;
 
+	// The edges that the packets leaving this edge cross next without queuing, in order (see
+	// NetGraph::collapseSegments()). They are emulated as part of this hop: the packets exit this edge after
+	// the delays of the whole segment, and are routed again only at its end.
+	OVector<qint32> collapsedEdges;
+	// True if the edge receives traffic other than the packets routed by the emulator: fluid background or injected
+	// traffic traces (see NetGraph::prepareEmulation()). Such an edge is never collapsed or cut through.
+	bool hasExtraTraffic;
+
 	void prepareEmulation(int npaths);
     void postEmulation();
 	bool enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit);
+	// Changes the link parameters during the emulation
+	void reconfigure(const LinkUpdate &update, quint64 ts_now);
+	// The fraction of the bandwidth assigned to a queue/policer
+	qreal queueWeight(qint32 index) const;
+	qreal policerWeight(qint32 index) const;
 #endif
 
     bool operator==(const NetGraphEdge &other) const;
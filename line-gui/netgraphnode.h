@@ -39,6 +39,14 @@
 // 0 or 1, based on whether the system allows using the .0 subnet address
 #define IP_OFFSET 1
 
+// Host identification without NAT (see --host_id in line-router): host i sends its packets tagged with the VLAN
+// HOST_VLAN_BASE + i, or from the MAC address 02:4c:4e:xx:xx:xx, with i in the last three bytes.
+#define HOST_VLAN_BASE 2
+#define HOST_VLAN_MAX 4094
+#define HOST_MAC_0 0x02
+#define HOST_MAC_1 0x4c
+#define HOST_MAC_2 0x4e
+
 #ifdef LINE_CLIENT
 #include "../remote_config.h"
 #endif
@@ -103,6 +111,20 @@ public:
 				.arg(((i+IP_OFFSET) & 0x000000FF) >> 0);
 	}
 
+	static int vlanId(int i) {
+		return HOST_VLAN_BASE + i;
+	}
+
+	static QString macAddress(int i) {
+		return QString("%1:%2:%3:%4:%5:%6")
+				.arg(HOST_MAC_0, 2, 16, QChar('0'))
+				.arg(HOST_MAC_1, 2, 16, QChar('0'))
+				.arg(HOST_MAC_2, 2, 16, QChar('0'))
+				.arg((i & 0x00FF0000) >> 16, 2, 16, QChar('0'))
+				.arg((i & 0x0000FF00) >> 8, 2, 16, QChar('0'))
+				.arg((i & 0x000000FF) >> 0, 2, 16, QChar('0'));
+	}
+
 	QString routeTooltip();
 
 	QString toText();
@@ -40,20 +40,25 @@ TrafficTrace::TrafficTrace(qint32 link)
 	: link(link)
 {}
 
-bool TrafficTrace::loadFromPcap()
+QString TrafficTrace::resolvePcapFilePath() const
 {
-	packets.clear();
-
-	QString fileName;
-
 	if (QFile::exists(pcapFileName)) {
-		fileName = pcapFileName;
+		return pcapFileName;
 	} else if (QFile::exists(pcapFullFilePath)) {
-		fileName = pcapFullFilePath;
+		return pcapFullFilePath;
 	} else if (QFile::exists(QDir::homePath() + "/" + pcapFileName)) {
-		fileName = QDir::homePath() + "/" + pcapFileName;
-	} else {
-		qDebug() << "Could not open pcap file" << pcapFileName << pcapFullFilePath;
+		return QDir::homePath() + "/" + pcapFileName;
+	}
+	qDebug() << "Could not open pcap file" << pcapFileName << pcapFullFilePath;
+	return QString();
+}
+
+bool TrafficTrace::loadFromPcap()
+{
+	packets.clear();
+
+	QString fileName = resolvePcapFilePath();
+	if (fileName.isEmpty()) {
 		return false;
 	}
 
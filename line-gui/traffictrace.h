@@ -27,6 +27,9 @@ public:
 	QString pcapFullFilePath;
 
 	bool loadFromPcap();
+	// Returns the path of the pcap file (searching the current directory, pcapFullFilePath and the home directory),
+	// or an empty string if it cannot be found.
+	QString resolvePcapFilePath() const;
 	void setPcapFilePath(QString pcapFilePath);
 	void clear();
 
@@ -0,0 +1,213 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "accuracymonitor.h"
+
+#include "pconsumer.h"
+#include "../util/tinyhistogram.h"
+#include "../util/util.h"
+#include "../util/json.h"
+
+volatile bool accuracyViolated = false;
+
+void abortOnAccuracyViolation()
+{
+	accuracyViolated = true;
+	__sync_synchronize();
+	do_shutdown = 1;
+}
+
+AccuracyMonitor::AccuracyMonitor()
+	: threshold(0),
+	  maxLateFraction(0),
+	  violated(false),
+	  violationPath(-1)
+{
+}
+
+void AccuracyMonitor::init(QString name, int numPaths, quint64 threshold, qreal maxLateFraction)
+{
+	this->name = name;
+	this->threshold = threshold;
+	this->maxLateFraction = maxLateFraction;
+	violated = false;
+	violationPath = -1;
+	paths.resize(numPaths);
+	for (int i = 0; i < numPaths; i++) {
+		memset(&paths[i], 0, sizeof(PathLateness));
+	}
+}
+
+quint64 AccuracyMonitor::percentile(qint32 pathId, qreal fraction) const
+{
+	const PathLateness &path = paths[pathId];
+	if (path.count == 0)
+		return 0;
+	quint64 cumulative = 0;
+	for (int i = 0; i < LATENESS_BINS - 1; i++) {
+		cumulative += path.bins[i];
+		if (qreal(cumulative) >= fraction * qreal(path.count))
+			return qMin(2ULL << i, path.max);
+	}
+	return path.max;
+}
+
+QString AccuracyMonitor::pathToString(qint32 pathId) const
+{
+	if (netGraph && pathId < netGraph->paths.count()) {
+		return QString("%1 -> %2").arg(netGraph->paths[pathId].source).arg(netGraph->paths[pathId].dest);
+	}
+	return QString("injected");
+}
+
+QString AccuracyMonitor::toString(int maxPaths) const
+{
+	QString result;
+	quint64 count = 0;
+	quint64 sum = 0;
+	quint64 max = 0;
+	quint64 numLate = 0;
+	QList<QPair<qreal, qint32> > ranking;
+	for (int i = 0; i < paths.count(); i++) {
+		const PathLateness &path = paths[i];
+		if (path.count == 0)
+			continue;
+		count += path.count;
+		sum += path.sum;
+		max = qMax(max, path.max);
+		numLate += path.numLate;
+		if (path.numLate > 0) {
+			ranking << QPair<qreal, qint32>(-qreal(path.numLate) / qreal(path.count), i);
+		}
+	}
+	qSort(ranking);
+
+	result += QString("%1 lateness (threshold %2): %3 packets, average %4, max %5, late %6 (%7%)\n")
+			  .arg(name)
+			  .arg(time2String(threshold))
+			  .arg(intWithCommas2String(count))
+			  .arg(time2String(count ? sum / count : 0))
+			  .arg(time2String(max))
+			  .arg(intWithCommas2String(numLate))
+			  .arg(count ? numLate * 100.0 / count : 0.0, 0, 'f', 3);
+	if (violated) {
+		result += QString("Accuracy limit (%1% late packets) exceeded on path %2 (%3)\n")
+				  .arg(maxLateFraction * 100.0)
+				  .arg(violationPath)
+				  .arg(pathToString(violationPath));
+	}
+	for (int i = 0; i < ranking.count() && i < maxPaths; i++) {
+		const qint32 p = ranking[i].second;
+		result += QString("Path %1 (%2): late %3 of %4 (%5%), average %6, p99 %7, max %8\n")
+				  .arg(p)
+				  .arg(pathToString(p))
+				  .arg(intWithCommas2String(paths[p].numLate))
+				  .arg(intWithCommas2String(paths[p].count))
+				  .arg(-ranking[i].first * 100.0, 0, 'f', 3)
+				  .arg(time2String(paths[p].sum / paths[p].count))
+				  .arg(time2String(percentile(p, 0.99)))
+				  .arg(time2String(paths[p].max));
+	}
+	if (ranking.count() > maxPaths) {
+		result += QString("(%1 more paths with late packets)\n").arg(ranking.count() - maxPaths);
+	}
+	return result;
+}
+
+QString AccuracyMonitor::rangeToString(QString label, int firstPath, int numPaths) const
+{
+	quint64 count = 0;
+	quint64 sum = 0;
+	quint64 max = 0;
+	quint64 numLate = 0;
+	quint64 bins[LATENESS_BINS];
+	memset(bins, 0, sizeof(bins));
+	for (int i = firstPath; i < firstPath + numPaths && i < paths.count(); i++) {
+		const PathLateness &path = paths[i];
+		count += path.count;
+		sum += path.sum;
+		max = qMax(max, path.max);
+		numLate += path.numLate;
+		for (int b = 0; b < LATENESS_BINS; b++) {
+			bins[b] += path.bins[b];
+		}
+	}
+	quint64 p99 = max;
+	quint64 cumulative = 0;
+	for (int b = 0; b < LATENESS_BINS - 1; b++) {
+		cumulative += bins[b];
+		if (qreal(cumulative) >= 0.99 * qreal(count)) {
+			p99 = qMin(2ULL << b, max);
+			break;
+		}
+	}
+	return QString("%1 %2 lateness: %3 packets, average %4, p99 %5, max %6, late %7 (%8%)\n")
+			.arg(label)
+			.arg(name.toLower())
+			.arg(intWithCommas2String(count))
+			.arg(time2String(count ? sum / count : 0))
+			.arg(time2String(count ? p99 : 0))
+			.arg(time2String(max))
+			.arg(intWithCommas2String(numLate))
+			.arg(count ? numLate * 100.0 / count : 0.0, 0, 'f', 3);
+}
+
+QString toJson(const AccuracyMonitor &d)
+{
+	quint64 count = 0;
+	quint64 sum = 0;
+	quint64 max = 0;
+	quint64 numLate = 0;
+	for (int i = 0; i < d.paths.count(); i++) {
+		count += d.paths[i].count;
+		sum += d.paths[i].sum;
+		max = qMax(max, d.paths[i].max);
+		numLate += d.paths[i].numLate;
+	}
+
+	JsonObjectPrinter p;
+	p.addMember("name", d.name);
+	p.addMember("threshold", d.threshold);
+	p.addMember("packets", count);
+	p.addMember("averageLateness", count ? sum / count : 0ULL);
+	p.addMember("maxLateness", max);
+	p.addMember("latePackets", numLate);
+	p.addMember("lateFraction", count ? qreal(numLate) / qreal(count) : 0.0);
+	p.addMember("violated", d.violated);
+	p.addMember("violationPath", d.violated ? d.violationPath : -1);
+	return p.json();
+}
+
+bool AccuracyMonitor::save(QString fileName) const
+{
+	QString result;
+	result += "# path count late average_ns p99_ns max_ns\n";
+	for (int i = 0; i < paths.count(); i++) {
+		const PathLateness &path = paths[i];
+		if (path.count == 0)
+			continue;
+		result += QString("%1 %2 %3 %4 %5 %6\n")
+				  .arg(i)
+				  .arg(path.count)
+				  .arg(path.numLate)
+				  .arg(path.sum / path.count)
+				  .arg(percentile(i, 0.99))
+				  .arg(path.max);
+	}
+	return saveFile(fileName, result);
+}
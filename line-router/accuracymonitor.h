@@ -0,0 +1,116 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef ACCURACYMONITOR_H
+#define ACCURACYMONITOR_H
+
+#include <QtCore>
+
+#include "../util/ovector.h"
+
+// Number of log2 bins of the per-path lateness histograms (the last one collects everything above 2^30 ns)
+#define LATENESS_BINS 31
+
+// A path is considered inaccurate only after this many samples, so that a single late packet at the start of a
+// flow does not abort the run
+#define LATENESS_MIN_SAMPLES 1000
+
+// Lateness statistics of one path.
+struct PathLateness {
+	quint64 count;
+	quint64 sum;
+	quint64 max;
+	// Packets later than the threshold
+	quint64 numLate;
+	quint32 bins[LATENESS_BINS];
+};
+
+// Online per-path statistics of how late packets leave relative to their scheduled time.
+// Each thread that takes measurements owns its monitor, so recording does not need any synchronization.
+class AccuracyMonitor
+{
+public:
+	AccuracyMonitor();
+
+	// Allocates the per-path counters. threshold is the lateness above which a packet counts as late;
+	// if maxLateFraction > 0, the monitor reports a violation when the fraction of late packets on a path exceeds it.
+	void init(QString name, int numPaths, quint64 threshold, qreal maxLateFraction);
+
+	// Records the lateness of a packet. Returns true only for the event that first violates the accuracy limit.
+	inline bool record(qint32 pathId, quint64 lateness) {
+		if (pathId < 0 || pathId >= paths.count())
+			return false;
+		PathLateness &path = paths[pathId];
+		path.count++;
+		path.sum += lateness;
+		path.max = qMax(path.max, lateness);
+		path.bins[latenessBin(lateness)]++;
+		if (lateness <= threshold)
+			return false;
+		path.numLate++;
+		if (violated || maxLateFraction <= 0 || path.count < LATENESS_MIN_SAMPLES)
+			return false;
+		if (qreal(path.numLate) > maxLateFraction * qreal(path.count)) {
+			violated = true;
+			violationPath = pathId;
+			return true;
+		}
+		return false;
+	}
+
+	bool isViolated() const { return violated; }
+
+	// Upper bound of the lateness of the given fraction of the packets of the path (e.g. 0.99 for the 99th percentile).
+	quint64 percentile(qint32 pathId, qreal fraction) const;
+
+	// Summary for the stats output: totals and the worst paths (by fraction of late packets).
+	QString toString(int maxPaths = 10) const;
+	// Totals over the paths [firstPath, firstPath + numPaths), e.g. those of a tenant.
+	QString rangeToString(QString label, int firstPath, int numPaths) const;
+	// One line per path.
+	bool save(QString fileName) const;
+
+	// Totals over all paths, for the structured stats file.
+	friend QString toJson(const AccuracyMonitor &d);
+
+protected:
+	static inline int latenessBin(quint64 value) {
+		if (value == 0)
+			return 0;
+		int logarithm = 63 - __builtin_clzll(value);
+		return qMin(logarithm, LATENESS_BINS - 1);
+	}
+	QString pathToString(qint32 pathId) const;
+
+	QString name;
+	OVector<PathLateness> paths;
+	quint64 threshold;
+	qreal maxLateFraction;
+	bool violated;
+	qint32 violationPath;
+};
+
+QString toJson(const AccuracyMonitor &d);
+
+// Set when a monitor reports a violation (only possible when --lateness_abort is given)
+extern volatile bool accuracyViolated;
+
+// Stops the emulation; the run is reported as failed.
+void abortOnAccuracyViolation();
+
+#endif // ACCURACYMONITOR_H
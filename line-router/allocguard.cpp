@@ -0,0 +1,77 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "allocguard.h"
+
+#include "pconsumer.h"
+#include "../malloc_profile/malloc_profile_wrapper.h"
+#include "../util/util.h"
+
+quint64 allocGuardWarmup;
+
+// Number of threads whose guard was armed; updated with atomic builtins, since the threads arm concurrently.
+static int numArmedThreads;
+
+AllocGuard::AllocGuard(const char *threadName, quint64 tsStart)
+	: threadName(threadName),
+	  tsArm(tsStart + allocGuardWarmup),
+	  armed(false)
+{
+}
+
+void AllocGuard::check()
+{
+	if (get_current_time() < tsArm)
+		return;
+	armed = true;
+	__sync_fetch_and_add(&numArmedThreads, 1);
+	malloc_profile_guard_arm_wrapper(threadName);
+}
+
+void AllocGuard::disarm()
+{
+	if (!armed)
+		return;
+	malloc_profile_guard_disarm_wrapper();
+	armed = false;
+}
+
+bool allocGuardReport()
+{
+	if (allocGuardWarmup == 0)
+		return true;
+	printf("===== Allocation guard ====\n");
+	const long long count = malloc_profile_guard_get_count_wrapper();
+	if (count < 0) {
+		printf("Nothing audited: run with LD_PRELOAD=/usr/lib/malloc_profile.so\n");
+		return false;
+	}
+	const int numArmed = __sync_fetch_and_add(&numArmedThreads, 0);
+	if (numArmed == 0) {
+		printf("Nothing audited: the run ended before the warm-up of %s was over\n",
+			   time2String(allocGuardWarmup).toLatin1().constData());
+		return false;
+	}
+	fflush(stdout);
+	malloc_profile_guard_print_report_wrapper();
+	printf("Heap operations in the %d emulation threads after the warm-up of %s: %s\n",
+		   numArmed,
+		   time2String(allocGuardWarmup).toLatin1().constData(),
+		   withCommas(quint64(count)));
+	return count == 0;
+}
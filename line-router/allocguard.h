@@ -0,0 +1,59 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef ALLOCGUARD_H
+#define ALLOCGUARD_H
+
+#include <QtCore>
+
+// Audits the heap allocations of the emulation threads. With --alloc_guard <warmup>, each thread that owns an
+// AllocGuard has its malloc/realloc/calloc/free calls counted and attributed to call sites by malloc_profile.so
+// (which must be preloaded with LD_PRELOAD), starting once the warm-up has passed. The steady state is expected
+// to be allocation-free, so any call counts as a failure.
+
+// Warm-up in nanoseconds after the start of the emulation. Set by --alloc_guard, default: 0 (disabled).
+extern quint64 allocGuardWarmup;
+
+class AllocGuard
+{
+public:
+	// tsStart: the start of the emulation.
+	AllocGuard(const char *threadName, quint64 tsStart);
+
+	// Call from the loop of the thread; arms the guard once the warm-up is over. Only the first calls read the clock.
+	inline void update() {
+		if (!armed && allocGuardWarmup > 0)
+			check();
+	}
+
+	// Call when the thread leaves its loop.
+	void disarm();
+
+protected:
+	const char *threadName;
+	quint64 tsArm;
+	bool armed;
+
+	void check();
+};
+
+// Prints the allocation report of the guarded threads. Returns false if the guard is enabled and either found
+// allocations or could not audit (malloc_profile.so not loaded, or no thread outlived the warm-up).
+bool allocGuardReport();
+
+#endif // ALLOCGUARD_H
@@ -0,0 +1,373 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Scheduler microbenchmark: runs the routing and queuing code of the scheduler on synthetic packet arrivals, in real
+// time, without PF_RING or NICs. Usage:
+//   line-router-bench <graph file> [--rate <packets/s>] [--flows <count>] [--sizes <bytes>:<weight>,...]
+//                     [--poisson] [--duration <ns>] [--warmup <ns>] [--seed <seed>] [--results <file>]
+//                     [emulator options...]
+// The emulator options are the same as those of line-router (e.g. --queuing_discipline, --ecmp_hash).
+// With --results, a tab-separated line with the main metrics is appended to the file (see perf-regression.sh).
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "pconsumer.h"
+#include "pscheduler.h"
+#include "flightrecorder.h"
+#include "coreplacement.h"
+#include "flowtable.h"
+#include "allocguard.h"
+#include "../remote_config.h"
+#include "../util/util.h"
+#include "../util/tinyhistogram.h"
+
+// A synthetic flow, between the endpoints of a path of the graph.
+struct BenchmarkFlow {
+	qint32 source;
+	qint32 dest;
+	quint16 srcPort;
+	quint16 dstPort;
+};
+
+// Parses a packet size mix such as "64:7,576:4,1500:1" (frame size in bytes : relative weight).
+static bool parseSizeMix(QString text, QVector<int> &sizes, QVector<qreal> &cumulativeWeights)
+{
+	sizes.clear();
+	cumulativeWeights.clear();
+	qreal total = 0;
+	foreach (QString item, text.split(',', QString::SkipEmptyParts)) {
+		QStringList tokens = item.split(':');
+		bool ok1 = true;
+		bool ok2 = true;
+		int size = tokens[0].toInt(&ok1);
+		qreal weight = tokens.count() > 1 ? tokens[1].toDouble(&ok2) : 1.0;
+		if (!ok1 || !ok2 || size < 64 || size > 1514 || weight <= 0)
+			return false;
+		total += weight;
+		sizes << size;
+		cumulativeWeights << total;
+	}
+	for (int i = 0; i < cumulativeWeights.count(); i++) {
+		cumulativeWeights[i] /= total;
+	}
+	return !sizes.isEmpty();
+}
+
+static quint64 percentile(const OVector<quint64> &sorted, qreal fraction)
+{
+	if (sorted.isEmpty())
+		return 0;
+	int index = qMin(sorted.count() - 1, int(fraction * sorted.count()));
+	return sorted[index];
+}
+
+int main(int argc, char *argv[])
+{
+	argc--, argv++;
+	if (argc < 1) {
+		fprintf(stderr, "Usage: line-router-bench <graph file> [--rate <packets/s>] [--flows <count>] "
+				"[--sizes <bytes>:<weight>,...] [--poisson] [--duration <ns>] [--warmup <ns>] [--seed <seed>] "
+				"[--results <file>] [emulator options...]\n");
+		return EXIT_FAILURE;
+	}
+
+	qreal rate = 1.0e6;
+	int numFlows = 1000;
+	QVector<int> sizes;
+	QVector<qreal> cumulativeWeights;
+	parseSizeMix("1500", sizes, cumulativeWeights);
+	bool poisson = false;
+	quint64 duration = 10 * SEC_TO_NSEC;
+	quint64 warmup = 1 * SEC_TO_NSEC;
+	unsigned int seed = 1;
+	QString resultsFileName;
+
+	// The benchmark options are removed, the rest are passed to the emulator
+	QList<QByteArray> emulatorArgs;
+	emulatorArgs << QByteArray(argv[0]) << QByteArray("benchmark");
+	for (int i = 1; i < argc; i++) {
+		QString arg = argv[i];
+		bool ok = true;
+		if (arg == "--rate" && i + 1 < argc) {
+			rate = QString(argv[++i]).toDouble(&ok);
+			ok = ok && rate > 0;
+		} else if (arg == "--flows" && i + 1 < argc) {
+			numFlows = QString(argv[++i]).toInt(&ok);
+			ok = ok && numFlows > 0;
+		} else if (arg == "--sizes" && i + 1 < argc) {
+			ok = parseSizeMix(argv[++i], sizes, cumulativeWeights);
+		} else if (arg == "--poisson") {
+			poisson = true;
+		} else if (arg == "--duration" && i + 1 < argc) {
+			duration = QString(argv[++i]).toULongLong(&ok);
+		} else if (arg == "--warmup" && i + 1 < argc) {
+			warmup = QString(argv[++i]).toULongLong(&ok);
+		} else if (arg == "--seed" && i + 1 < argc) {
+			seed = QString(argv[++i]).toUInt(&ok);
+		} else if (arg == "--results" && i + 1 < argc) {
+			// resolved now, since the working directory changes to the simulation directory
+			resultsFileName = QFileInfo(QString(argv[++i])).absoluteFilePath();
+		} else {
+			emulatorArgs << QByteArray(argv[i]);
+		}
+		if (!ok) {
+			fprintf(stderr, "Bad value for %s\n", arg.toLatin1().constData());
+			return EXIT_FAILURE;
+		}
+	}
+	srand(seed);
+
+	QVector<char*> emulatorArgv;
+	for (int i = 0; i < emulatorArgs.count(); i++) {
+		emulatorArgv << emulatorArgs[i].data();
+	}
+	QString graphFileName;
+	quint64 intervalSize;
+	do_shutdown = 0;
+	parseEmulatorArgs(emulatorArgv.count(), emulatorArgv.data(), graphFileName, intervalSize);
+	// Loading the graph, building the route tables and the queues
+	quint64 tsSetupStart = get_current_time();
+	prepareExperiment(graphFileName, intervalSize);
+	const quint64 setupTime = get_current_time() - tsSetupStart;
+
+	if (netGraph->paths.isEmpty()) {
+		fprintf(stderr, "The graph has no paths; compute the routes first\n");
+		return EXIT_FAILURE;
+	}
+
+	QVector<BenchmarkFlow> flows;
+	for (int i = 0; i < numFlows; i++) {
+		const NetGraphPath &path = netGraph->paths[rand() % netGraph->paths.count()];
+		BenchmarkFlow flow;
+		flow.source = path.source;
+		flow.dest = path.dest;
+		flow.srcPort = 32768 + i % 28000;
+		flow.dstPort = 8000 + rand() % 1000;
+		flows << flow;
+	}
+
+	// Enough packets to fill all the queues
+	qint64 numPackets = 0;
+	foreach (NetGraphEdge e, netGraph->edges) {
+		numPackets += e.queueLength * e.queueCount;
+	}
+	numPackets = qMax(numPackets * 4, 10000LL);
+	OVector<Packet*> pool;
+	pool.reserve(numPackets);
+	for (qint64 i = 0; i < numPackets; i++) {
+		pool.append(new Packet());
+	}
+
+	setupCorePlacement(emulatorInterface);
+	if (bind2core(corePlacement.cpu(CoreScheduler)) != 0) {
+		printf("Failed to set the affinity to core %d\n", corePlacement.cpu(CoreScheduler));
+	}
+	warmMallocCache();
+	initFlowletTable();
+
+	OVector<Packet*> events;
+	events.reserve(10000);
+	// One sample per non-idle loop iteration
+	OVector<quint64> loopDelays;
+	loopDelays.reserve(qMin(quint64(50000000ULL), quint64(rate * duration / SEC_TO_NSEC) + 1));
+	TinyHistogram routeCycles;
+
+	quint64 numArrivals = 0;
+	quint64 numRoutingEvents = 0;
+	quint64 numDropped = 0;
+	quint64 numForwarded = 0;
+	quint64 numPoolEmpty = 0;
+	quint64 totalCycles = 0;
+	quint64 tsMeasureStart = 0;
+
+	const quint64 tsStart = get_current_time();
+	const quint64 tsEnd = tsStart + warmup + duration;
+	quint64 tsNextArrival = tsStart;
+	bool measuring = false;
+	quint64 tscMeasureStart = 0;
+	AllocGuard allocGuard("benchmark", tsStart);
+	while (1) {
+		quint64 ts_now = get_current_time();
+		if (ts_now >= tsEnd)
+			break;
+		allocGuard.update();
+		if (!measuring && ts_now >= tsStart + warmup) {
+			measuring = true;
+			tsMeasureStart = ts_now;
+			tscMeasureStart = rdtsc();
+			numArrivals = numRoutingEvents = numDropped = numForwarded = numPoolEmpty = totalCycles = 0;
+		}
+		quint64 tscStart = rdtsc();
+		int numWork = 0;
+
+		// synthetic arrivals
+		for (; tsNextArrival <= ts_now; numWork++) {
+			const BenchmarkFlow &flow = flows[rand() % flows.count()];
+			qreal r = frand();
+			int size = sizes.last();
+			for (int i = 0; i < sizes.count(); i++) {
+				if (r <= cumulativeWeights[i]) {
+					size = sizes[i];
+					break;
+				}
+			}
+			qreal interval = 1.0 / rate;
+			if (poisson) {
+				interval = -log(1.0 - frandex()) * interval;
+			}
+			quint64 tsArrival = tsNextArrival;
+			tsNextArrival += qMax(1ULL, quint64(interval * SEC_TO_NSEC));
+			if (pool.isEmpty()) {
+				numPoolEmpty++;
+				continue;
+			}
+			Packet *p = pool.takeLast();
+			p->init();
+			p->generateNewId();
+			p->ts_driver_rx = tsArrival;
+			p->ts_userspace_rx = tsArrival;
+			p->ts_start_proc = ts_now;
+			p->length = size;
+			p->wireLength = p->length;
+			p->src_ip = NAT_SUBNET | htonl(flow.source + IP_OFFSET);
+			p->dst_ip = NAT_SUBNET | NAT_FOREIGN | htonl(flow.dest + IP_OFFSET);
+			p->src_id = flow.source;
+			p->dst_id = flow.dest;
+			p->l4_protocol = IPPROTO_UDP;
+			p->l4_src_port = flow.srcPort;
+			p->l4_dst_port = flow.dstPort;
+			setFlowHash(p);
+			numArrivals++;
+			numRoutingEvents++;
+			quint64 ts_next;
+			int state = routePacket(p, ts_now, ts_next);
+			if (state != PKT_QUEUED) {
+				numDropped += state == PKT_DROPPED;
+				pool.append(p);
+			}
+		}
+
+		// queue events
+		for (drain(ts_now, events); !events.isEmpty(); drain(ts_now, events)) {
+			for (int i = 0; i < events.count(); i++) {
+				Packet *p = events[i];
+				numWork++;
+				numRoutingEvents++;
+				quint64 ts_next;
+				int state = routePacket(p, ts_now, ts_next);
+				if (state != PKT_QUEUED) {
+					if (state == PKT_DROPPED || p->dropped) {
+						numDropped++;
+					} else {
+						numForwarded++;
+					}
+					pool.append(p);
+				}
+			}
+		}
+
+		if (numWork > 0 && measuring) {
+			quint64 cycles = rdtsc() - tscStart;
+			totalCycles += cycles;
+			routeCycles.recordEvent(cycles / numWork);
+			if (loopDelays.count() < loopDelays.capacity()) {
+				loopDelays.append(get_current_time() - ts_now);
+			}
+		}
+	}
+	allocGuard.disarm();
+	const quint64 tsMeasureEnd = get_current_time();
+	const quint64 measureDuration = qMax(1ULL, tsMeasureEnd - tsMeasureStart);
+	const qreal cyclesPerNs = qreal(rdtsc() - tscMeasureStart) / qreal(measureDuration);
+
+	qSort(loopDelays.begin(), loopDelays.end());
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	// kilobytes on Linux
+	const quint64 peakMemory = usage.ru_maxrss;
+
+	printf("===== Scheduler benchmark ====\n");
+	printf("Graph: %s, %d nodes, %d edges, %d paths\n",
+		   graphFileName.toLatin1().constData(),
+		   netGraph->nodes.count(),
+		   netGraph->edges.count(),
+		   netGraph->paths.count());
+	printf("Offered load: %s p/s (%s), %d flows, %d packet sizes\n",
+		   withCommas(quint64(rate)), poisson ? "Poisson" : "constant rate", flows.count(), sizes.count());
+	printf("Measured for %s after a warmup of %s\n",
+		   time2String(measureDuration).toLatin1().constData(),
+		   time2String(warmup).toLatin1().constData());
+	printf("Packets: %s arrived, %s forwarded, %s dropped, %s not generated (empty pool)\n",
+		   withCommas(numArrivals), withCommas(numForwarded), withCommas(numDropped), withCommas(numPoolEmpty));
+	printf("Throughput: %s p/s, %s routing events/s\n",
+		   withCommas(quint64(numArrivals * 1.0e9 / measureDuration)),
+		   withCommas(quint64(numRoutingEvents * 1.0e9 / measureDuration)));
+	printf("Cycles per packet: %.1f, per routing event: %.1f (%.3f cycles/ns)\n",
+		   numArrivals ? qreal(totalCycles) / numArrivals : 0.0,
+		   numRoutingEvents ? qreal(totalCycles) / numRoutingEvents : 0.0,
+		   cyclesPerNs);
+	printf("Non-idle loop time: p50 %s, p90 %s, p99 %s, p99.9 %s, max %s (%s samples)\n",
+		   time2String(percentile(loopDelays, 0.50)).toLatin1().constData(),
+		   time2String(percentile(loopDelays, 0.90)).toLatin1().constData(),
+		   time2String(percentile(loopDelays, 0.99)).toLatin1().constData(),
+		   time2String(percentile(loopDelays, 0.999)).toLatin1().constData(),
+		   time2String(loopDelays.isEmpty() ? 0 : loopDelays.last()).toLatin1().constData(),
+		   withCommas(loopDelays.count()));
+	printf("Cycles per routing event, per loop iteration:\n");
+	printf("%s\n", routeCycles.toString(&intWithCommas2String).toLatin1().constData());
+	printf("Setup time: %s, peak memory: %s kB\n",
+		   time2String(setupTime).toLatin1().constData(),
+		   withCommas(peakMemory));
+	if (flowTracking) {
+		printf("%s\n", flowTable.toString().toLatin1().constData());
+	}
+
+	if (!resultsFileName.isEmpty()) {
+		QFile file(resultsFileName);
+		bool header = !file.exists() || file.size() == 0;
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+			fprintf(stderr, "Could not open %s\n", resultsFileName.toLatin1().constData());
+			return EXIT_FAILURE;
+		}
+		QTextStream out(&file);
+		if (header) {
+			out << "graph\tnodes\tedges\tpaths\tsetup_ns\tpeak_memory_kB\tpackets_per_s\tcycles_per_packet\t"
+				   "loop_p50_ns\tloop_p99_ns\n";
+		}
+		out << QFileInfo(graphFileName).fileName() << "\t"
+			<< netGraph->nodes.count() << "\t"
+			<< netGraph->edges.count() << "\t"
+			<< netGraph->paths.count() << "\t"
+			<< setupTime << "\t"
+			<< peakMemory << "\t"
+			<< quint64(numArrivals * 1.0e9 / measureDuration) << "\t"
+			<< QString::number(numArrivals ? qreal(totalCycles) / numArrivals : 0.0, 'f', 1) << "\t"
+			<< percentile(loopDelays, 0.50) << "\t"
+			<< percentile(loopDelays, 0.99) << "\n";
+	}
+
+	if (!allocGuardReport())
+		return EXIT_FAILURE;
+
+	return 0;
+}
@@ -0,0 +1,370 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "coreplacement.h"
+
+#include "pconsumer.h"
+#include "pscheduler.h"
+#include "psender.h"
+#include "pdistributed.h"
+#include "../util/util.h"
+
+QString corePlacementMode = "auto";
+bool steerNicIrqs;
+CorePlacement corePlacement;
+
+const char *coreRoleName(int role)
+{
+	switch (role) {
+	case CoreConsumer:
+		return "consumer";
+	case CoreScheduler:
+		return "scheduler";
+	case CoreSender:
+		return "sender";
+	case CoreTunnel:
+		return "tunnel";
+	default:
+		return "unknown";
+	}
+}
+
+// The tunnel thread only runs in distributed emulations
+static inline bool roleRuns(int role)
+{
+	return role != CoreTunnel || partitionIndex >= 0;
+}
+
+// Parses a sysfs CPU list such as "0-3,8,10-11".
+static QList<qint32> parseCpuList(QString text)
+{
+	QList<qint32> result;
+	foreach (QString range, text.trimmed().split(',', QString::SkipEmptyParts)) {
+		QStringList bounds = range.split('-');
+		bool ok1 = false;
+		bool ok2 = true;
+		qint32 first = bounds[0].toInt(&ok1);
+		qint32 last = bounds.count() > 1 ? bounds[1].toInt(&ok2) : first;
+		if (!ok1 || !ok2)
+			continue;
+		for (qint32 cpu = first; cpu <= last; cpu++) {
+			result << cpu;
+		}
+	}
+	return result;
+}
+
+static qint32 readSysfsInt(QString fileName, qint32 defaultValue)
+{
+	QString text;
+	if (!readFile(fileName, text, true))
+		return defaultValue;
+	bool ok;
+	qint32 value = text.trimmed().toInt(&ok);
+	return ok ? value : defaultValue;
+}
+
+CorePlacement::CorePlacement()
+	: nicNumaNode(-1)
+{
+	cpus[CoreConsumer] = CORE_CONSUMER;
+	cpus[CoreScheduler] = CORE_SCHEDULER;
+	cpus[CoreSender] = CORE_SENDER;
+	cpus[CoreTunnel] = CORE_TUNNEL;
+}
+
+bool CorePlacement::readTopology()
+{
+	topology.clear();
+
+	QString text;
+	if (!readFile("/sys/devices/system/cpu/online", text, true))
+		return false;
+	QList<qint32> online = parseCpuList(text);
+
+	QSet<qint32> isolated;
+	if (readFile("/sys/devices/system/cpu/isolated", text, true)) {
+		isolated = parseCpuList(text).toSet();
+	}
+
+	QHash<qint32, qint32> cpuNode;
+	QDir nodeDir("/sys/devices/system/node");
+	foreach (QString nodeName, nodeDir.entryList(QStringList() << "node*", QDir::Dirs)) {
+		bool ok;
+		qint32 node = nodeName.mid(4).toInt(&ok);
+		if (!ok || !readFile(nodeDir.filePath(nodeName + "/cpulist"), text, true))
+			continue;
+		foreach (qint32 cpu, parseCpuList(text)) {
+			cpuNode[cpu] = node;
+		}
+	}
+
+	foreach (qint32 cpu, online) {
+		LogicalCpu c;
+		c.cpu = cpu;
+		c.package = readSysfsInt(QString("/sys/devices/system/cpu/cpu%1/topology/physical_package_id").arg(cpu), 0);
+		c.core = readSysfsInt(QString("/sys/devices/system/cpu/cpu%1/topology/core_id").arg(cpu), cpu);
+		c.numaNode = cpuNode.value(cpu, 0);
+		c.isolated = isolated.contains(cpu);
+		topology << c;
+	}
+	return !topology.isEmpty();
+}
+
+bool CorePlacement::computeAutomatic(QString interfaceName, int slot)
+{
+	warnings.clear();
+	nicNumaNode = -1;
+	if (!readTopology()) {
+		warnings << "Could not read the CPU topology from sysfs, using the default cores";
+		return false;
+	}
+	if (!interfaceName.isEmpty()) {
+		nicNumaNode = readSysfsInt(QString("/sys/class/net/%1/device/numa_node").arg(interfaceName), -1);
+	}
+
+	// Group the hyperthreads by physical core; the first one (lowest CPU number) represents the core
+	QMap<QPair<qint32, qint32>, QList<LogicalCpu> > physicalCores;
+	foreach (LogicalCpu c, topology) {
+		physicalCores[QPair<qint32, qint32>(c.package, c.core)] << c;
+	}
+	QPair<qint32, qint32> housekeepingCore(-1, -1);
+	foreach (LogicalCpu c, topology) {
+		if (c.cpu == 0) {
+			housekeepingCore = QPair<qint32, qint32>(c.package, c.core);
+		}
+	}
+
+	// Lower is better: on the NIC's node, isolated, not the housekeeping core; then by CPU number
+	QList<QPair<qint32, qint32> > primary;
+	QList<QPair<qint32, qint32> > siblings;
+	foreach (QPair<qint32, qint32> key, physicalCores.keys()) {
+		const QList<LogicalCpu> &threads = physicalCores[key];
+		for (int i = 0; i < threads.count(); i++) {
+			const LogicalCpu &c = threads[i];
+			qint32 score = 0;
+			score += (nicNumaNode >= 0 && c.numaNode != nicNumaNode) ? 4 : 0;
+			score += c.isolated ? 0 : 2;
+			score += key == housekeepingCore ? 1 : 0;
+			if (i == 0) {
+				primary << QPair<qint32, qint32>(score, c.cpu);
+			} else {
+				siblings << QPair<qint32, qint32>(score, c.cpu);
+			}
+		}
+	}
+	qSort(primary);
+	qSort(siblings);
+	QList<QPair<qint32, qint32> > candidates = primary + siblings;
+
+	int numRoles = 0;
+	for (int role = 0; role < CoreRoleCount; role++) {
+		numRoles += roleRuns(role) ? 1 : 0;
+	}
+	int index = slot * numRoles;
+	for (int role = 0; role < CoreRoleCount; role++) {
+		if (!roleRuns(role)) {
+			cpus[role] = -1;
+			continue;
+		}
+		if (index < candidates.count()) {
+			cpus[role] = candidates[index].second;
+			if (index >= primary.count()) {
+				warnings << QString("Not enough physical cores: the %1 thread shares a core with another thread")
+							.arg(coreRoleName(role));
+			}
+			if (candidates[index].first >= 4) {
+				warnings << QString("The %1 thread runs on another NUMA node than the NIC").arg(coreRoleName(role));
+			}
+		} else {
+			cpus[role] = candidates[index % candidates.count()].second;
+			warnings << QString("Not enough CPUs: the %1 thread shares a CPU with another thread")
+						.arg(coreRoleName(role));
+		}
+		index++;
+	}
+	return true;
+}
+
+bool CorePlacement::parse(QString cpuList)
+{
+	QStringList tokens = cpuList.split(',', QString::SkipEmptyParts);
+	if (tokens.count() < CoreTunnel || tokens.count() > CoreRoleCount)
+		return false;
+	for (int role = 0; role < tokens.count(); role++) {
+		bool ok;
+		qint32 cpu = tokens[role].toInt(&ok);
+		if (!ok || cpu < 0)
+			return false;
+		cpus[role] = cpu;
+	}
+	return true;
+}
+
+int CorePlacement::steerIrqs(QString interfaceName)
+{
+	if (topology.isEmpty() && !readTopology())
+		return -1;
+	if (nicNumaNode < 0) {
+		nicNumaNode = readSysfsInt(QString("/sys/class/net/%1/device/numa_node").arg(interfaceName), -1);
+	}
+
+	// The IRQs of the NIC: the MSI vectors, or the lines of /proc/interrupts that mention the interface
+	QList<qint32> irqs;
+	QDir msiDir(QString("/sys/class/net/%1/device/msi_irqs").arg(interfaceName));
+	foreach (QString entry, msiDir.entryList(QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot)) {
+		bool ok;
+		qint32 irq = entry.toInt(&ok);
+		if (ok) {
+			irqs << irq;
+		}
+	}
+	QString text;
+	if (irqs.isEmpty() && readFile("/proc/interrupts", text, true)) {
+		foreach (QString line, text.split('\n')) {
+			if (!line.contains(interfaceName))
+				continue;
+			bool ok;
+			qint32 irq = line.section(':', 0, 0).trimmed().toInt(&ok);
+			if (ok) {
+				irqs << irq;
+			}
+		}
+	}
+	if (irqs.isEmpty())
+		return 0;
+
+	// All the CPUs except those of the threads (and their hyperthreads), preferably on the NIC's node
+	QSet<QPair<qint32, qint32> > usedCores;
+	foreach (LogicalCpu c, topology) {
+		for (int role = 0; role < CoreRoleCount; role++) {
+			if (roleRuns(role) && c.cpu == cpus[role]) {
+				usedCores << QPair<qint32, qint32>(c.package, c.core);
+			}
+		}
+	}
+	QStringList local;
+	QStringList any;
+	foreach (LogicalCpu c, topology) {
+		if (usedCores.contains(QPair<qint32, qint32>(c.package, c.core)))
+			continue;
+		any << QString::number(c.cpu);
+		if (nicNumaNode < 0 || c.numaNode == nicNumaNode) {
+			local << QString::number(c.cpu);
+		}
+	}
+	QString affinity = !local.isEmpty() ? local.join(",") : any.join(",");
+	if (affinity.isEmpty()) {
+		warnings << "No CPU left for the NIC interrupts";
+		return -1;
+	}
+
+	int changed = 0;
+	foreach (qint32 irq, irqs) {
+		QString fileName = QString("/proc/irq/%1/smp_affinity_list").arg(irq);
+		QString previous;
+		if (!readFile(fileName, previous, true)) {
+			warnings << QString("Could not read the affinity of IRQ %1").arg(irq);
+			continue;
+		}
+		QFile file(fileName);
+		if (!file.open(QIODevice::WriteOnly) || file.write(affinity.toLatin1()) < 0) {
+			warnings << QString("Could not set the affinity of IRQ %1").arg(irq);
+			continue;
+		}
+		savedIrqAffinities << QPair<qint32, QString>(irq, previous.trimmed());
+		changed++;
+	}
+	printf("NIC %s: %d IRQs steered to CPUs %s\n",
+		   interfaceName.toLatin1().constData(),
+		   changed,
+		   affinity.toLatin1().constData());
+	return changed;
+}
+
+void CorePlacement::restoreIrqs()
+{
+	int restored = 0;
+	for (int i = 0; i < savedIrqAffinities.count(); i++) {
+		QFile file(QString("/proc/irq/%1/smp_affinity_list").arg(savedIrqAffinities[i].first));
+		if (file.open(QIODevice::WriteOnly) && file.write(savedIrqAffinities[i].second.toLatin1()) >= 0) {
+			restored++;
+		} else {
+			fprintf(stderr, "Could not restore the affinity of IRQ %d\n", savedIrqAffinities[i].first);
+		}
+	}
+	if (!savedIrqAffinities.isEmpty()) {
+		printf("NIC: %d IRQ affinities restored\n", restored);
+	}
+	savedIrqAffinities.clear();
+}
+
+QString CorePlacement::toString() const
+{
+	QString result;
+	result += QString("Core placement (NIC NUMA node %1):\n").arg(nicNumaNode);
+	for (int role = 0; role < CoreRoleCount; role++) {
+		if (!roleRuns(role) || cpus[role] < 0) {
+			result += QString("  %1: not used\n").arg(coreRoleName(role));
+			continue;
+		}
+		QString details;
+		foreach (LogicalCpu c, topology) {
+			if (c.cpu == cpus[role]) {
+				details = QString(" (package %1, core %2, node %3%4)")
+						  .arg(c.package)
+						  .arg(c.core)
+						  .arg(c.numaNode)
+						  .arg(c.isolated ? ", isolated" : "");
+			}
+		}
+		result += QString("  %1: CPU %2%3\n").arg(coreRoleName(role)).arg(cpus[role]).arg(details);
+	}
+	foreach (QString warning, warnings) {
+		result += QString("  Warning: %1\n").arg(warning);
+	}
+	return result;
+}
+
+static void restoreIrqsAtExit()
+{
+	corePlacement.restoreIrqs();
+}
+
+void setupCorePlacement(QString interfaceName)
+{
+	if (corePlacementMode == "auto") {
+		// Partitions on the same machine take distinct cores, in the order of their indices
+		int slot = 0;
+		for (int i = 0; i < partitionIndex && i < partitioning.peers.count(); i++) {
+			if (partitioning.peers[i].host == partitioning.peers[partitionIndex].host) {
+				slot++;
+			}
+		}
+		corePlacement.computeAutomatic(interfaceName, slot);
+	} else if (corePlacementMode != "fixed") {
+		if (!corePlacement.parse(corePlacementMode)) {
+			fprintf(stderr, "Bad value for --cores: %s\n", corePlacementMode.toLatin1().constData());
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (steerNicIrqs && corePlacement.steerIrqs(interfaceName) > 0) {
+		atexit(restoreIrqsAtExit);
+	}
+	printf("%s", corePlacement.toString().toLatin1().constData());
+}
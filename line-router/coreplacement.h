@@ -0,0 +1,102 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef COREPLACEMENT_H
+#define COREPLACEMENT_H
+
+#include <QtCore>
+
+// The threads that are pinned to a core.
+enum CoreRole {
+	CoreConsumer = 0,
+	CoreScheduler,
+	CoreSender,
+	CoreTunnel,
+	CoreRoleCount
+};
+
+const char *coreRoleName(int role);
+
+// A logical CPU, as described in /sys/devices/system/cpu.
+class LogicalCpu {
+public:
+	qint32 cpu;
+	qint32 package;
+	qint32 core;
+	qint32 numaNode;
+	bool isolated;
+};
+
+// Chooses the cores of the line-router threads.
+//
+// The automatic placement reads the CPU topology from sysfs and gives each thread its own physical core (never two
+// hyperthreads of the same core) on the NUMA node of the NIC, preferring the cores isolated from the kernel scheduler
+// (isolcpus) and avoiding the physical core of CPU 0, which handles most of the housekeeping. If there are not enough
+// physical cores, hyperthreads are used, with a warning. The tunnel thread only gets a core in distributed runs.
+// Partitions running on the same machine each take the next group of cores, in the order of their indices.
+class CorePlacement {
+public:
+	// Starts with the compile-time CORE_* constants.
+	CorePlacement();
+
+	// Reads the topology from sysfs and chooses the cores; returns false (keeping the current placement) if the
+	// topology cannot be read. interfaceName is the NIC used for capture (may be empty). slot is the index of this
+	// line-router instance among those running on the same machine (the first one uses slot 0).
+	bool computeAutomatic(QString interfaceName, int slot = 0);
+
+	// Parses an explicit placement: a comma separated list of CPUs in the order consumer, scheduler, sender[, tunnel].
+	bool parse(QString cpuList);
+
+	// Sets the affinity of the interrupts of the NIC to the CPUs of its NUMA node that are not used by the threads.
+	// Requires root; returns the number of IRQs changed, or -1 on errors. The previous affinities are saved.
+	int steerIrqs(QString interfaceName);
+	// Restores the IRQ affinities changed by steerIrqs().
+	void restoreIrqs();
+
+	QString toString() const;
+
+	// -1 if the role has no thread in this run
+	inline int cpu(CoreRole role) const {
+		return cpus[role];
+	}
+
+protected:
+	bool readTopology();
+
+	qint32 cpus[CoreRoleCount];
+	// IRQ, affinity before steerIrqs()
+	QList<QPair<qint32, QString> > savedIrqAffinities;
+	// Filled by readTopology()
+	QList<LogicalCpu> topology;
+	qint32 nicNumaNode;
+	QStringList warnings;
+};
+
+// Set by the parameter --cores: "auto" (default), "fixed" (the CORE_* constants) or an explicit list of CPUs
+// (see CorePlacement::parse).
+extern QString corePlacementMode;
+// Set by the parameter --steer_irqs.
+extern bool steerNicIrqs;
+
+extern CorePlacement corePlacement;
+
+// Applies corePlacementMode and steerNicIrqs, and logs the placement. Call after loading the partitions and before
+// starting the threads. The IRQ affinities are restored at exit.
+void setupCorePlacement(QString interfaceName);
+
+#endif // COREPLACEMENT_H
@@ -0,0 +1,355 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "emulationimage.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pconsumer.h"
+#include "../util/debug.h"
+#include "../util/util.h"
+
+QString emulationImagePath;
+
+// Increment when the layout changes
+#define EMULATION_IMAGE_VERSION 1
+
+// All offsets are in bytes, relative to the start of the file.
+// Sections (all of them little endian, host order):
+//   qint64 tracePacketCounts[numTraces]
+//   quint32 destID2Index[numNodes]
+//   quint32 nodePortsStart[numNodes + 1]; qint32 nodePorts[nodePortsStart[numNodes]]
+//   quint32 routeTableIndex[numNodes]
+//   quint32 routeTables[numRouteTables * numHosts]
+//   quint32 loadBalancedStart[numLoadBalanced + 1]; qint32 loadBalanced[loadBalancedStart[numLoadBalanced]]
+struct EmulationImageHeader {
+	char magic[8];
+	quint32 version;
+	quint32 headerSize;
+	char digest[20];
+	quint32 numNodes;
+	quint32 numEdges;
+	quint32 numHosts;
+	quint32 numTraces;
+	quint32 numRouteTables;
+	quint32 numLoadBalanced;
+	quint64 fileSize;
+	quint64 tracePacketCountsOffset;
+	quint64 destID2IndexOffset;
+	quint64 nodePortsStartOffset;
+	quint64 nodePortsOffset;
+	quint64 routeTableIndexOffset;
+	quint64 routeTablesOffset;
+	quint64 loadBalancedStartOffset;
+	quint64 loadBalancedOffset;
+};
+
+static const char emulationImageMagic[8] = {'L', 'I', 'N', 'E', 'I', 'M', 'G', '\0'};
+
+EmulationImage::EmulationImage()
+{
+}
+
+QByteArray EmulationImage::digest(NetGraph *netGraph)
+{
+	// Hash the graph in memory rather than the graph file: with --tenant, the graphs of the other tenants are
+	// appended to it before the emulation is prepared. The nodes (with their routes) and the edges are all the route
+	// tables depend on.
+	QByteArray graphData;
+	{
+		QDataStream out(&graphData, QIODevice::WriteOnly);
+		out.setVersion(QDataStream::Qt_4_0);
+		out << netGraph->nodes;
+		out << netGraph->edges;
+		if (out.status() != QDataStream::Ok)
+			return QByteArray();
+	}
+	QCryptographicHash hash(QCryptographicHash::Sha1);
+	hash.addData(graphData);
+	foreach (TrafficTrace trace, netGraph->trafficTraces) {
+		QFileInfo info(trace.resolvePcapFilePath());
+		hash.addData(info.absoluteFilePath().toUtf8());
+		hash.addData(QString(" %1 %2\n").arg(info.size()).arg(info.lastModified().toTime_t()).toLatin1());
+	}
+	return hash.result();
+}
+
+template <typename T>
+static void appendRaw(QByteArray &data, const T &value)
+{
+	data.append((const char*)&value, sizeof(T));
+}
+
+template <typename T>
+static T readRaw(const uchar *base, quint64 offset, quint64 index = 0)
+{
+	T value;
+	memcpy(&value, base + offset + index * sizeof(T), sizeof(T));
+	return value;
+}
+
+bool EmulationImage::save(QString fileName, NetGraph *netGraph)
+{
+	quint64 tsStart = get_current_time();
+
+	QByteArray graphDigest = digest(netGraph);
+	if (graphDigest.isEmpty())
+		return false;
+
+	const quint32 numNodes = netGraph->nodes.count();
+	const quint32 numHosts = netGraph->getHostNodes().count();
+
+	EmulationImageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, emulationImageMagic, sizeof(header.magic));
+	header.version = EMULATION_IMAGE_VERSION;
+	header.headerSize = sizeof(header);
+	memcpy(header.digest, graphDigest.constData(), qMin(graphDigest.size(), int(sizeof(header.digest))));
+	header.numNodes = numNodes;
+	header.numEdges = netGraph->edges.count();
+	header.numHosts = numHosts;
+	header.numTraces = tracePacketCounts.count();
+	header.numRouteTables = netGraph->routeTables.count();
+	header.numLoadBalanced = netGraph->loadBalancedRouteCache.count();
+
+	QByteArray body;
+
+	header.tracePacketCountsOffset = sizeof(header) + body.size();
+	for (int i = 0; i < tracePacketCounts.count(); i++) {
+		appendRaw(body, tracePacketCounts[i]);
+	}
+
+	header.destID2IndexOffset = sizeof(header) + body.size();
+	for (quint32 n = 0; n < numNodes; n++) {
+		appendRaw(body, netGraph->destID2Index[n]);
+	}
+
+	header.nodePortsStartOffset = sizeof(header) + body.size();
+	quint32 start = 0;
+	for (quint32 n = 0; n < numNodes; n++) {
+		appendRaw(body, start);
+		start += netGraph->nodePorts[n].count();
+	}
+	appendRaw(body, start);
+
+	header.nodePortsOffset = sizeof(header) + body.size();
+	for (quint32 n = 0; n < numNodes; n++) {
+		for (int i = 0; i < netGraph->nodePorts[n].count(); i++) {
+			appendRaw(body, netGraph->nodePorts[n][i]);
+		}
+	}
+
+	header.routeTableIndexOffset = sizeof(header) + body.size();
+	for (quint32 n = 0; n < numNodes; n++) {
+		appendRaw(body, netGraph->routeTableIndex[n]);
+	}
+
+	header.routeTablesOffset = sizeof(header) + body.size();
+	for (int t = 0; t < netGraph->routeTables.count(); t++) {
+		Q_ASSERT_FORCE(quint32(netGraph->routeTables[t].count()) == numHosts);
+		for (quint32 i = 0; i < numHosts; i++) {
+			appendRaw(body, netGraph->routeTables[t][i]);
+		}
+	}
+
+	header.loadBalancedStartOffset = sizeof(header) + body.size();
+	start = 0;
+	for (int i = 0; i < netGraph->loadBalancedRouteCache.count(); i++) {
+		appendRaw(body, start);
+		start += netGraph->loadBalancedRouteCache[i].count();
+	}
+	appendRaw(body, start);
+
+	header.loadBalancedOffset = sizeof(header) + body.size();
+	for (int i = 0; i < netGraph->loadBalancedRouteCache.count(); i++) {
+		for (int j = 0; j < netGraph->loadBalancedRouteCache[i].count(); j++) {
+			appendRaw(body, netGraph->loadBalancedRouteCache[i][j]);
+		}
+	}
+
+	header.fileSize = sizeof(header) + body.size();
+
+	QString tmpFileName = QString("%1.tmp.%2").arg(fileName).arg(getpid());
+	QFile file(tmpFileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qDebug() << __FILE__ << __LINE__ << "Failed to open file:" << tmpFileName;
+		return false;
+	}
+	if (file.write((const char*)&header, sizeof(header)) != sizeof(header) ||
+		file.write(body) != body.size()) {
+		qDebug() << __FILE__ << __LINE__ << "Failed to write file:" << tmpFileName;
+		file.close();
+		file.remove();
+		return false;
+	}
+	file.close();
+	if (rename(tmpFileName.toLocal8Bit().constData(), fileName.toLocal8Bit().constData()) != 0) {
+		qDebug() << __FILE__ << __LINE__ << "Failed to rename file:" << tmpFileName << "to" << fileName;
+		QFile::remove(tmpFileName);
+		return false;
+	}
+
+	printf("Emulation image: saved %s (%s B) in %s\n",
+		   fileName.toLatin1().constData(),
+		   withCommas(header.fileSize),
+		   time2String(get_current_time() - tsStart).toLatin1().constData());
+	return true;
+}
+
+// Checks that count elements of type T starting at offset lie within the file.
+template <typename T>
+static bool sectionFits(const EmulationImageHeader &header, quint64 offset, quint64 count)
+{
+	return offset >= sizeof(header) &&
+			offset <= header.fileSize &&
+			count <= (header.fileSize - offset) / sizeof(T);
+}
+
+bool EmulationImage::load(QString fileName, NetGraph *netGraph)
+{
+	quint64 tsStart = get_current_time();
+
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+	if (file.size() < qint64(sizeof(EmulationImageHeader)))
+		return false;
+	const uchar *base = file.map(0, file.size());
+	if (!base) {
+		qDebug() << __FILE__ << __LINE__ << "Failed to map file:" << fileName;
+		return false;
+	}
+
+	EmulationImageHeader header = readRaw<EmulationImageHeader>(base, 0);
+	if (memcmp(header.magic, emulationImageMagic, sizeof(header.magic)) != 0 ||
+		header.version != EMULATION_IMAGE_VERSION ||
+		header.headerSize != sizeof(header) ||
+		header.fileSize != quint64(file.size())) {
+		qDebug() << "Emulation image" << fileName << "has an unknown format, ignoring";
+		return false;
+	}
+
+	QByteArray graphDigest = digest(netGraph);
+	if (graphDigest.size() != int(sizeof(header.digest)) ||
+		memcmp(header.digest, graphDigest.constData(), sizeof(header.digest)) != 0 ||
+		header.numNodes != quint32(netGraph->nodes.count()) ||
+		header.numEdges != quint32(netGraph->edges.count()) ||
+		header.numHosts != quint32(netGraph->getHostNodes().count()) ||
+		header.numTraces != quint32(netGraph->trafficTraces.count())) {
+		qDebug() << "Emulation image" << fileName << "does not match the graph or the traces, ignoring";
+		return false;
+	}
+
+	const quint32 numNodes = header.numNodes;
+	const quint32 numHosts = header.numHosts;
+
+	// Everything is read and validated into local copies first; netGraph is only modified once the whole image has
+	// been found consistent.
+	bool ok = sectionFits<qint64>(header, header.tracePacketCountsOffset, header.numTraces) &&
+			  sectionFits<quint32>(header, header.destID2IndexOffset, numNodes) &&
+			  sectionFits<quint32>(header, header.nodePortsStartOffset, quint64(numNodes) + 1) &&
+			  sectionFits<quint32>(header, header.routeTableIndexOffset, numNodes) &&
+			  sectionFits<quint32>(header, header.routeTablesOffset, quint64(header.numRouteTables) * numHosts) &&
+			  sectionFits<quint32>(header, header.loadBalancedStartOffset, quint64(header.numLoadBalanced) + 1);
+	if (ok) {
+		const quint32 numNodePorts = readRaw<quint32>(base, header.nodePortsStartOffset, numNodes);
+		const quint32 numLoadBalancedPorts = readRaw<quint32>(base, header.loadBalancedStartOffset, header.numLoadBalanced);
+		ok = sectionFits<qint32>(header, header.nodePortsOffset, numNodePorts) &&
+			 sectionFits<qint32>(header, header.loadBalancedOffset, numLoadBalancedPorts);
+	}
+	if (!ok) {
+		file.unmap((uchar*)base);
+		qDebug() << "Emulation image" << fileName << "is truncated, ignoring";
+		return false;
+	}
+
+	QVector<qint64> loadedTracePacketCounts(header.numTraces);
+	for (quint32 i = 0; i < header.numTraces; i++) {
+		loadedTracePacketCounts[i] = readRaw<qint64>(base, header.tracePacketCountsOffset, i);
+	}
+
+	const quint32 numNodePorts = readRaw<quint32>(base, header.nodePortsStartOffset, numNodes);
+	OVector<quint32> destID2Index;
+	OVector<OVector<qint32> > nodePorts;
+	OVector<quint32> routeTableIndex;
+	destID2Index.resize(numNodes);
+	nodePorts.resize(numNodes);
+	routeTableIndex.resize(numNodes);
+	for (quint32 n = 0; n < numNodes && ok; n++) {
+		destID2Index[n] = readRaw<quint32>(base, header.destID2IndexOffset, n);
+		routeTableIndex[n] = readRaw<quint32>(base, header.routeTableIndexOffset, n);
+		quint32 first = readRaw<quint32>(base, header.nodePortsStartOffset, n);
+		quint32 last = readRaw<quint32>(base, header.nodePortsStartOffset, n + 1);
+		if (routeTableIndex[n] >= header.numRouteTables || first > last || last > numNodePorts) {
+			ok = false;
+			break;
+		}
+		nodePorts[n].reserve(last - first);
+		for (quint32 i = first; i < last; i++) {
+			nodePorts[n].append(readRaw<qint32>(base, header.nodePortsOffset, i));
+		}
+	}
+
+	OVector<OVector<quint32> > routeTables;
+	routeTables.resize(header.numRouteTables);
+	for (quint32 t = 0; t < header.numRouteTables && ok; t++) {
+		OVector<quint32> &table = routeTables[t];
+		table.resize(numHosts);
+		for (quint32 i = 0; i < numHosts; i++) {
+			table[i] = readRaw<quint32>(base, header.routeTablesOffset, quint64(t) * numHosts + i);
+		}
+	}
+
+	OVector<OVector<qint32> > loadBalancedRouteCache;
+	loadBalancedRouteCache.resize(header.numLoadBalanced);
+	const quint32 numLoadBalancedPorts = readRaw<quint32>(base, header.loadBalancedStartOffset, header.numLoadBalanced);
+	for (quint32 i = 0; i < header.numLoadBalanced && ok; i++) {
+		quint32 first = readRaw<quint32>(base, header.loadBalancedStartOffset, i);
+		quint32 last = readRaw<quint32>(base, header.loadBalancedStartOffset, i + 1);
+		if (first > last || last > numLoadBalancedPorts) {
+			ok = false;
+			break;
+		}
+		loadBalancedRouteCache[i].reserve(last - first);
+		for (quint32 j = first; j < last; j++) {
+			loadBalancedRouteCache[i].append(readRaw<qint32>(base, header.loadBalancedOffset, j));
+		}
+	}
+
+	file.unmap((uchar*)base);
+
+	if (!ok) {
+		qDebug() << "Emulation image" << fileName << "is corrupt, ignoring";
+		return false;
+	}
+
+	tracePacketCounts = loadedTracePacketCounts;
+	netGraph->destID2Index.swap(destID2Index);
+	netGraph->nodePorts.swap(nodePorts);
+	netGraph->routeTableIndex.swap(routeTableIndex);
+	netGraph->routeTables.swap(routeTables);
+	netGraph->loadBalancedRouteCache.swap(loadBalancedRouteCache);
+
+	printf("Emulation image: loaded %s (%d unique route tables, %d load balancing sets) in %s\n",
+		   fileName.toLatin1().constData(),
+		   netGraph->routeTables.count(),
+		   netGraph->loadBalancedRouteCache.count(),
+		   time2String(get_current_time() - tsStart).toLatin1().constData());
+	return true;
+}
@@ -0,0 +1,56 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef EMULATIONIMAGE_H
+#define EMULATIONIMAGE_H
+
+#include <QtCore>
+
+#include "../line-gui/netgraph.h"
+
+// Path of the precompiled emulation image; if empty, no image is used.
+// Set by the parameter --emulation_image.
+extern QString emulationImagePath;
+
+// A flat binary file with everything prepareEmulation() derives from the graph and the traces that is
+// expensive to compute: the node ports, the route tables, the host indices and the packet counts of the
+// traffic traces. All the sections are addressed by offsets relative to the start of the file.
+// load() maps the file only to read it: the sections are validated and copied into the OVectors of the NetGraph,
+// so loading is linear in the size of the image (but avoids computing the routes).
+// The image is tied to the graph in memory (nodes with their routes and edges, after the tenants are appended) and
+// the pcap files (file sizes and modification times); a stale image is ignored and rebuilt.
+class EmulationImage
+{
+public:
+	EmulationImage();
+
+	// Loads the image from fileName into netGraph, if it matches it. Returns false if the image is missing,
+	// corrupt or stale; in that case netGraph is not modified.
+	bool load(QString fileName, NetGraph *netGraph);
+
+	// Saves the data already computed by NetGraph::prepareEmulation() for netGraph, and tracePacketCounts.
+	// The file is written under a temporary name and then renamed, so that concurrent runs never see a partial image.
+	bool save(QString fileName, NetGraph *netGraph);
+
+	// Packet counts of the traffic traces (valid after load() or save()).
+	QVector<qint64> tracePacketCounts;
+
+	static QByteArray digest(NetGraph *netGraph);
+};
+
+#endif // EMULATIONIMAGE_H
@@ -0,0 +1,136 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "flightrecorder.h"
+
+#include "../util/debug.h"
+#include "../util/util.h"
+
+const char *schedulerPhaseName(int phase)
+{
+	switch (phase) {
+	case SchedulerPhaseFlush:
+		return "flush";
+	case SchedulerPhaseDequeue:
+		return "dequeue";
+	case SchedulerPhaseInjection:
+		return "injection";
+	case SchedulerPhaseDrain:
+		return "drain";
+	case SchedulerPhaseRoute:
+		return "route";
+	default:
+		return "unknown";
+	}
+}
+
+FlightRecorder::FlightRecorder(int capacity, int maxDumps)
+	: position(0),
+	  maxDumps(maxDumps),
+	  droppedDumps(0),
+	  numCalibrations(0)
+{
+	Q_ASSERT_FORCE(capacity > 0 && (capacity & (capacity - 1)) == 0);
+	ring.resize(capacity);
+	for (int i = 0; i < capacity; i++) {
+		memset(&ring[i], 0, sizeof(FlightRecorderEntry));
+	}
+	dumpTs.reserve(maxDumps);
+	dumpDelay.reserve(maxDumps);
+	dumps.reserve(maxDumps * capacity);
+	calibrationTs[0] = calibrationTs[1] = 0;
+	calibrationTsc[0] = calibrationTsc[1] = 0;
+}
+
+void FlightRecorder::calibrate(quint64 ts_now)
+{
+	int index = qMin(numCalibrations, 1);
+	calibrationTs[index] = ts_now;
+	calibrationTsc[index] = rdtsc();
+	numCalibrations++;
+}
+
+qreal FlightRecorder::cyclesPerNs() const
+{
+	if (numCalibrations < 2 || calibrationTs[1] <= calibrationTs[0])
+		return 0;
+	return qreal(calibrationTsc[1] - calibrationTsc[0]) / qreal(calibrationTs[1] - calibrationTs[0]);
+}
+
+void FlightRecorder::recordEvent(const FlightRecorderEntry &entry)
+{
+	for (int phase = 0; phase < SchedulerPhaseCount; phase++) {
+		phaseCycles[phase].recordEvent(entry.cycles[phase]);
+	}
+}
+
+void FlightRecorder::dump(quint64 ts_now, quint64 loop_delay)
+{
+	if (dumpTs.count() >= maxDumps) {
+		droppedDumps++;
+		return;
+	}
+	dumpTs.append(ts_now);
+	dumpDelay.append(loop_delay);
+	// oldest entry first
+	const quint64 capacity = ring.count();
+	quint64 first = position > capacity ? position - capacity : 0;
+	for (quint64 i = first; i < position; i++) {
+		dumps.append(ring[i & (capacity - 1)]);
+	}
+	// pad short dumps (before the ring wrapped around) so that each dump has the same size
+	for (quint64 i = position - first; i < capacity; i++) {
+		FlightRecorderEntry empty;
+		memset(&empty, 0, sizeof(empty));
+		dumps.append(empty);
+	}
+}
+
+QString FlightRecorder::toString()
+{
+	QString result;
+	const qreal cpn = cyclesPerNs();
+	result += QString("Cycles per ns: %1\n").arg(cpn, 0, 'f', 3);
+	result += QString("Dumps: %1 (%2 not recorded)\n").arg(dumpTs.count()).arg(droppedDumps);
+	for (int iDump = 0; iDump < dumpTs.count(); iDump++) {
+		result += QString("Stall at t = %1, loop time %2\n")
+				  .arg(time2String(dumpTs[iDump] - calibrationTs[0]))
+				  .arg(time2String(dumpDelay[iDump]));
+		result += "ts";
+		for (int phase = 0; phase < SchedulerPhaseCount; phase++) {
+			result += QString(" %1").arg(schedulerPhaseName(phase));
+		}
+		result += " new_packets events\n";
+		for (int i = 0; i < ring.count(); i++) {
+			const FlightRecorderEntry &entry = dumps[iDump * ring.count() + i];
+			if (entry.ts == 0)
+				continue;
+			result += QString("%1").arg(entry.ts - calibrationTs[0]);
+			for (int phase = 0; phase < SchedulerPhaseCount; phase++) {
+				result += QString(" %1").arg(entry.cycles[phase]);
+			}
+			result += QString(" %1 %2\n").arg(entry.numNewPackets).arg(entry.numEvents);
+		}
+	}
+	return result;
+}
+
+bool FlightRecorder::save(QString fileName)
+{
+	return saveFile(fileName, toString());
+}
@@ -0,0 +1,108 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef FLIGHTRECORDER_H
+#define FLIGHTRECORDER_H
+
+#include <QtCore>
+
+#include "../util/ovector.h"
+#include "../util/tinyhistogram.h"
+
+// Reads the CPU timestamp counter. Cheap enough (a few tens of cycles) to be called
+// several times per scheduler loop iteration.
+inline quint64 rdtsc()
+{
+	quint32 lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return (quint64(hi) << 32) | quint64(lo);
+}
+
+// The phases of one iteration of the scheduler loop, in execution order.
+enum SchedulerPhase {
+	SchedulerPhaseFlush = 0,   // handing processed packets to the sender
+	SchedulerPhaseDequeue,     // packetsIn.dequeueAll()
+	SchedulerPhaseInjection,   // trace injection
+	SchedulerPhaseDrain,       // draining the queues and routing the events (before the new packets)
+	SchedulerPhaseRoute,       // routePacket() for new packets
+	SchedulerPhaseCount
+};
+
+const char *schedulerPhaseName(int phase);
+
+// Per-phase cycle counts of one scheduler loop iteration.
+struct FlightRecorderEntry {
+	// Start of the iteration (get_current_time())
+	quint64 ts;
+	quint64 cycles[SchedulerPhaseCount];
+	qint32 numNewPackets;
+	qint32 numEvents;
+};
+
+// Fixed-size ring of the last non-idle scheduler loop iterations.
+// When an iteration exceeds the latency threshold, the ring is copied into preallocated storage
+// (nothing is allocated or written to disk from the scheduler thread); the snapshots are saved
+// after the emulation ends.
+class FlightRecorder
+{
+public:
+	// capacity must be a power of 2.
+	FlightRecorder(int capacity = 64, int maxDumps = 16);
+
+	// Must be called at the start and at the end of the emulation, to convert cycles to nanoseconds.
+	void calibrate(quint64 ts_now);
+
+	inline FlightRecorderEntry &next() {
+		FlightRecorderEntry &entry = ring[position & (ring.count() - 1)];
+		position++;
+		return entry;
+	}
+
+	// Records the iteration stats into the per-phase histograms.
+	void recordEvent(const FlightRecorderEntry &entry);
+
+	// Takes a snapshot of the ring. Call after the iteration has been recorded.
+	void dump(quint64 ts_now, quint64 loop_delay);
+
+	QString toString();
+	bool save(QString fileName);
+
+	int numDumps() const { return dumpTs.count(); }
+	int numDroppedDumps() const { return droppedDumps; }
+
+	// Cycles per nanosecond, as measured between the two calibrate() calls.
+	qreal cyclesPerNs() const;
+
+	TinyHistogram phaseCycles[SchedulerPhaseCount];
+
+protected:
+	OVector<FlightRecorderEntry> ring;
+	quint64 position;
+
+	int maxDumps;
+	int droppedDumps;
+	OVector<quint64> dumpTs;
+	OVector<quint64> dumpDelay;
+	OVector<FlightRecorderEntry> dumps;
+
+	quint64 calibrationTs[2];
+	quint64 calibrationTsc[2];
+	int numCalibrations;
+};
+
+#endif // FLIGHTRECORDER_H
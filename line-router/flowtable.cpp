@@ -0,0 +1,225 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "flowtable.h"
+
+#include "pconsumer.h"
+#include "../util/util.h"
+#include "../util/json.h"
+
+int flowTableSize = 131072;
+FlowTable flowTable;
+
+FlowTable::FlowTable()
+	: count(0),
+	  peakCount(0),
+	  lookups(0),
+	  probes(0),
+	  inserts(0),
+	  evictions(0),
+	  mask(0),
+	  maxCount(0),
+	  store(NULL)
+{
+}
+
+void FlowTable::init(int capacity, SampledPathFlowEvents *store)
+{
+	this->store = store;
+	slots.clear();
+	count = peakCount = 0;
+	lookups = probes = inserts = evictions = 0;
+	if (capacity <= 0)
+		return;
+
+	int size = 1;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	slots.resize(size);
+	for (int i = 0; i < size; i++) {
+		slots[i].pathId = -1;
+		slots[i].distance = 0;
+		slots[i].key = 0;
+		slots[i].flow.flowEvents.reserve(FLOW_TABLE_RESERVED_EVENTS);
+	}
+	mask = size - 1;
+	maxCount = qMax(1, int(size * FLOW_TABLE_MAX_LOAD));
+}
+
+void FlowTable::handlePacket(Packet *p, quint64 tsNow)
+{
+	if (!isEnabled()) {
+		store->handlePacket(p, tsNow);
+		return;
+	}
+
+	if (p->path_id < 0 || p->path_id >= store->pathFlows.count()) {
+		qDebug() << __FILE__ << __LINE__ << "Bad index!!!!";
+		return;
+	}
+
+	quint64 key;
+	SampledPathFlowEvents::encodeKey(key, p->l4_protocol, p->l4_src_port, p->l4_dst_port);
+	lookup(p->path_id, key).handlePacket(p, tsNow);
+}
+
+SampledFlowEvents &FlowTable::lookup(qint32 pathId, quint64 key)
+{
+	lookups++;
+	quint32 i = homeSlot(pathId, key);
+	// The entries are ordered by home slot, so the search can stop at the first entry closer to its home slot
+	// than the new flow would be
+	for (qint32 distance = 0; ; distance++, i = (i + 1) & mask) {
+		probes++;
+		FlowTableSlot &slot = slots[i];
+		if (slot.pathId < 0 || slot.distance < distance)
+			break;
+		if (slot.key == key && slot.pathId == pathId)
+			return slot.flow;
+	}
+	return slots[insert(pathId, key)].flow;
+}
+
+quint32 FlowTable::insert(qint32 pathId, quint64 key)
+{
+	const quint32 home = homeSlot(pathId, key);
+	if (count >= maxCount) {
+		evict(home);
+	}
+
+	// Find the position of the new flow: the first slot that is empty or holds an entry closer to its home
+	quint32 position = home;
+	qint32 distance = 0;
+	while (slots[position].pathId >= 0 && slots[position].distance >= distance) {
+		position = (position + 1) & mask;
+		distance++;
+	}
+
+	// Shift the entries from there up to the next empty slot one position forward; the empty slot (with its
+	// preallocated events) ends up at the position of the new flow
+	quint32 empty = position;
+	while (slots[empty].pathId >= 0) {
+		empty = (empty + 1) & mask;
+	}
+	while (empty != position) {
+		quint32 previous = (empty - 1) & mask;
+		qSwap(slots[empty], slots[previous]);
+		slots[empty].distance++;
+		empty = previous;
+	}
+
+	FlowTableSlot &slot = slots[position];
+	slot.pathId = pathId;
+	slot.key = key;
+	slot.distance = distance;
+	slot.flow.tsLastSample = 0;
+
+	count++;
+	peakCount = qMax(peakCount, count);
+	inserts++;
+	return position;
+}
+
+void FlowTable::evict(quint32 home)
+{
+	qint32 victim = -1;
+	quint32 i = home;
+	for (int n = 0; n < FLOW_TABLE_EVICTION_WINDOW || victim < 0; n++, i = (i + 1) & mask) {
+		if (slots[i].pathId < 0)
+			continue;
+		if (victim < 0 || slots[i].flow.tsLastSample < slots[victim].flow.tsLastSample) {
+			victim = i;
+		}
+	}
+	moveToStore(slots[victim]);
+	remove(victim);
+	evictions++;
+}
+
+void FlowTable::moveToStore(FlowTableSlot &slot)
+{
+	SampledFlowEvents &stored = store->pathFlows[slot.pathId][slot.key];
+	stored.flowEvents += slot.flow.flowEvents;
+	stored.tsLastSample = qMax(stored.tsLastSample, slot.flow.tsLastSample);
+}
+
+void FlowTable::remove(quint32 index)
+{
+	// Backward-shift deletion: move back the following entries until an empty slot or an entry at its home slot;
+	// the removed slot travels to the end of the run, keeping its preallocated events
+	quint32 i = index;
+	forever {
+		quint32 next = (i + 1) & mask;
+		if (slots[next].pathId < 0 || slots[next].distance == 0)
+			break;
+		qSwap(slots[i], slots[next]);
+		slots[i].distance--;
+		i = next;
+	}
+	FlowTableSlot &slot = slots[i];
+	slot.pathId = -1;
+	slot.distance = 0;
+	slot.key = 0;
+	slot.flow.tsLastSample = 0;
+	slot.flow.flowEvents.resize(0);
+	count--;
+}
+
+void FlowTable::flush()
+{
+	for (int i = 0; i < slots.count(); i++) {
+		FlowTableSlot &slot = slots[i];
+		if (slot.pathId < 0)
+			continue;
+		moveToStore(slot);
+		slot.pathId = -1;
+		slot.distance = 0;
+		slot.key = 0;
+		slot.flow.tsLastSample = 0;
+		slot.flow.flowEvents.resize(0);
+	}
+	count = 0;
+}
+
+QString FlowTable::toString() const
+{
+	if (!isEnabled())
+		return QString("Flow table: disabled (one hash table per path)");
+	return QString("Flow table: %1 slots, %2 flows (peak %3, limit %4), %5 inserts, %6 evictions, %7 probes per lookup")
+			.arg(withCommasStr(slots.count()))
+			.arg(withCommasStr(count))
+			.arg(withCommasStr(peakCount))
+			.arg(withCommasStr(maxCount))
+			.arg(withCommasStr(inserts))
+			.arg(withCommasStr(evictions))
+			.arg(lookups ? qreal(probes) / lookups : 0.0, 0, 'f', 2);
+}
+
+QString toJson(const FlowTable &d)
+{
+	JsonObjectPrinter p;
+	p.addMember("slots", qint32(d.capacity()));
+	jsonObjectPrinterAddMember(p, d.count);
+	jsonObjectPrinterAddMember(p, d.peakCount);
+	jsonObjectPrinterAddMember(p, d.lookups);
+	jsonObjectPrinterAddMember(p, d.probes);
+	jsonObjectPrinterAddMember(p, d.inserts);
+	jsonObjectPrinterAddMember(p, d.evictions);
+	return p.json();
+}
@@ -0,0 +1,112 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef FLOWTABLE_H
+#define FLOWTABLE_H
+
+#include <QtCore>
+
+#include "../line-gui/flowevent.h"
+
+// Events preallocated in each slot, so that most flows do not allocate when they start.
+#define FLOW_TABLE_RESERVED_EVENTS 4
+
+// Evictions pick the least recently sampled flow among this many slots starting at the home slot of the new flow.
+#define FLOW_TABLE_EVICTION_WINDOW 8
+
+// The table is never filled above this fraction of its slots; beyond it, inserts evict a flow first.
+#define FLOW_TABLE_MAX_LOAD 0.875
+
+struct FlowTableSlot {
+	// Path of the flow, or -1 if the slot is empty
+	qint32 pathId;
+	// Distance from the home slot (number of probes - 1)
+	qint32 distance;
+	// See SampledPathFlowEvents::encodeKey
+	quint64 key;
+	SampledFlowEvents flow;
+};
+
+// Fixed-capacity open-addressing hash table (Robin Hood probing with backward-shift deletion) of the flows
+// tracked with --track_flows, keyed by (path, flow key). It replaces the per-path QHash lookups of
+// SampledPathFlowEvents on the scheduler thread: all the slots are allocated up front, and when the table is full
+// the least recently sampled flow near the new one is evicted into the SampledPathFlowEvents store.
+// flush() moves the remaining flows there too, so the saved data has the same format as before.
+class FlowTable
+{
+public:
+	FlowTable();
+
+	// Allocates the slots. capacity is rounded up to a power of 2; 0 disables the table, in which case packets go
+	// directly to store (the QHash of each path).
+	void init(int capacity, SampledPathFlowEvents *store);
+
+	bool isEnabled() const { return !slots.isEmpty(); }
+
+	void handlePacket(Packet *p, quint64 tsNow);
+
+	// Moves all the flows into the store. Call before saving the store.
+	void flush();
+
+	QString toString() const;
+
+	int capacity() const { return slots.count(); }
+
+	// Flows currently in the table
+	qint32 count;
+	qint32 peakCount;
+	quint64 lookups;
+	quint64 probes;
+	quint64 inserts;
+	quint64 evictions;
+
+protected:
+	QVector<FlowTableSlot> slots;
+	quint32 mask;
+	qint32 maxCount;
+	SampledPathFlowEvents *store;
+
+	inline quint32 homeSlot(qint32 pathId, quint64 key) const {
+		// 64-bit finalizer of MurmurHash3
+		quint64 h = key ^ (quint64(pathId) << 40);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return quint32(h) & mask;
+	}
+
+	SampledFlowEvents &lookup(qint32 pathId, quint64 key);
+	// Inserts a new flow and returns its slot.
+	quint32 insert(qint32 pathId, quint64 key);
+	// Evicts a flow to make room for a new flow with the given home slot.
+	void evict(quint32 home);
+	// Appends the events of the flow in the slot to the store.
+	void moveToStore(FlowTableSlot &slot);
+	// Empties the slot, shifting back the entries that follow it.
+	void remove(quint32 index);
+};
+
+QString toJson(const FlowTable &d);
+
+// Number of slots of the flow table. Set by --flow_table_size, default: 131072. 0 disables the table.
+extern int flowTableSize;
+extern FlowTable flowTable;
+
+#endif // FLOWTABLE_H
@@ -0,0 +1,170 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "fluidmodel.h"
+
+#include "pconsumer.h"
+#include "../util/debug.h"
+#include "../util/util.h"
+
+QString fluidBackgroundPath;
+FluidModel fluidModel;
+
+FluidModel::FluidModel()
+	: nextChange(0)
+{
+}
+
+// Adds to edgeFractions the fraction of the traffic arriving at node (towards dest) that crosses each edge,
+// following the route tables. Load balanced routes are split evenly between the next hops.
+static bool addRouteFractions(NetGraph *netGraph, qint32 node, qint32 dest, qreal fraction, int depth,
+							  QHash<qint32, qreal> &edgeFractions)
+{
+	if (node == dest)
+		return true;
+	if (depth > netGraph->nodes.count()) {
+		qDebug() << "Routing loop towards node" << dest;
+		return false;
+	}
+	quint32 route = netGraph->routeTables[netGraph->routeTableIndex[node]][netGraph->destID2Index[dest]];
+	if (route == NO_ROUTE) {
+		qDebug() << "No route from node" << node << "to node" << dest;
+		return false;
+	}
+	const OVector<qint32> &ports = netGraph->nodePorts[node];
+	if (route & LOAD_BALANCED_ROUTE_MASK) {
+		const OVector<qint32> &nextPorts = netGraph->loadBalancedRouteCache[route & LOAD_BALANCED_VALUE_MASK];
+		for (int i = 0; i < nextPorts.count(); i++) {
+			qint32 edge = ports[nextPorts[i]];
+			edgeFractions[edge] += fraction / nextPorts.count();
+			if (!addRouteFractions(netGraph, netGraph->edges[edge].dest, dest, fraction / nextPorts.count(), depth + 1,
+								   edgeFractions))
+				return false;
+		}
+	} else {
+		qint32 edge = ports[route];
+		edgeFractions[edge] += fraction;
+		if (!addRouteFractions(netGraph, netGraph->edges[edge].dest, dest, fraction, depth + 1, edgeFractions))
+			return false;
+	}
+	return true;
+}
+
+static bool fluidRateChangeLessThan(const FluidRateChange &a, const FluidRateChange &b)
+{
+	return a.ts < b.ts;
+}
+
+bool FluidModel::load(QString fileName, NetGraph *netGraph)
+{
+	QString content;
+	if (!readFile(fileName, content)) {
+		qDebug() << __FILE__ << __LINE__ << "Failed to read file:" << fileName;
+		return false;
+	}
+
+	flows.clear();
+	int lineNumber = 0;
+	foreach (QString line, content.split('\n')) {
+		lineNumber++;
+		if (line.contains('#')) {
+			line = line.left(line.indexOf('#'));
+		}
+		QStringList tokens = line.split(QRegExp("\\s+"), QString::SkipEmptyParts);
+		if (tokens.isEmpty())
+			continue;
+		if (tokens.count() < 3 || tokens.count() > 6) {
+			qDebug() << "Fluid background: wrong number of fields on line" << lineNumber;
+			return false;
+		}
+		bool ok = true;
+		bool okField;
+		FluidFlow flow;
+		flow.source = tokens[0].toInt(&okField);
+		ok = ok && okField;
+		flow.dest = tokens[1].toInt(&okField);
+		ok = ok && okField;
+		flow.rate = tokens[2].toDouble(&okField);
+		ok = ok && okField && flow.rate >= 0;
+		flow.tsStart = 0;
+		flow.tsStop = 0;
+		flow.trafficClass = 0;
+		if (tokens.count() > 3) {
+			flow.tsStart = quint64(tokens[3].toDouble(&okField) * SEC_TO_NSEC);
+			ok = ok && okField;
+		}
+		if (tokens.count() > 4) {
+			flow.tsStop = quint64(tokens[4].toDouble(&okField) * SEC_TO_NSEC);
+			ok = ok && okField && (flow.tsStop == 0 || flow.tsStop > flow.tsStart);
+		}
+		if (tokens.count() > 5) {
+			flow.trafficClass = tokens[5].toInt(&okField);
+			ok = ok && okField;
+		}
+		ok = ok &&
+			 0 <= flow.source && flow.source < netGraph->nodes.count() &&
+			 0 <= flow.dest && flow.dest < netGraph->nodes.count() &&
+			 flow.source != flow.dest &&
+			 netGraph->nodes[flow.dest].nodeType == NETGRAPH_NODE_HOST;
+		if (!ok) {
+			qDebug() << "Fluid background: invalid flow on line" << lineNumber;
+			return false;
+		}
+		flows << flow;
+	}
+
+	QVector<FluidRateChange> allChanges;
+	foreach (FluidFlow flow, flows) {
+		QHash<qint32, qreal> edgeFractions;
+		if (!addRouteFractions(netGraph, flow.source, flow.dest, 1.0, 0, edgeFractions))
+			return false;
+		foreach (qint32 edge, edgeFractions.keys()) {
+			FluidRateChange change;
+			change.edge = edge;
+			change.queue = qMin(netGraph->edges[edge].queueCount - 1, qMax(0, flow.trafficClass));
+			change.delta_Bps = qint64(1000.0 * flow.rate * edgeFractions[edge] / timeDilation);
+			if (change.delta_Bps == 0)
+				continue;
+			change.ts = quint64(flow.tsStart * timeDilation);
+			allChanges << change;
+			if (flow.tsStop > 0) {
+				change.ts = quint64(flow.tsStop * timeDilation);
+				change.delta_Bps = -change.delta_Bps;
+				allChanges << change;
+			}
+		}
+	}
+	qStableSort(allChanges.begin(), allChanges.end(), fluidRateChangeLessThan);
+	changes = OVector<FluidRateChange>(allChanges);
+	nextChange = 0;
+
+	printf("Fluid background: %d flows, %d rate changes\n", flows.count(), changes.count());
+	return true;
+}
+
+void FluidModel::applyDue(NetGraph *netGraph, quint64 ts_now, quint64 tsRelative)
+{
+	while (nextChange < changes.count() && changes[nextChange].ts <= tsRelative) {
+		const FluidRateChange &change = changes[nextChange];
+		NetGraphEdgeQueue &queue = netGraph->edges[change.edge].queues[change.queue];
+		// Integrate the fluid at the old rate first
+		queue.advance(ts_now);
+		queue.fluidRate_Bps = quint64(qint64(queue.fluidRate_Bps) + change.delta_Bps);
+		nextChange++;
+	}
+}
@@ -0,0 +1,97 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef FLUIDMODEL_H
+#define FLUIDMODEL_H
+
+#include <QtCore>
+
+#include "../line-gui/netgraph.h"
+#include "../util/ovector.h"
+
+// Path of the fluid background traffic specification; if empty, there is no fluid traffic.
+// Set by the parameter --fluid_background.
+extern QString fluidBackgroundPath;
+
+// A background traffic aggregate between two hosts, represented as a rate instead of packets.
+class FluidFlow {
+public:
+	qint32 source;
+	qint32 dest;
+	// Selects the queue on each edge, like Packet::traffic_class
+	qint32 trafficClass;
+	// KB/s (same as B/ms), like NetGraphEdge::bandwidth
+	qreal rate;
+	// Nanoseconds since the start of the emulation (before time dilation)
+	quint64 tsStart;
+	// 0 means until the end of the emulation
+	quint64 tsStop;
+};
+
+// A step in the fluid arrival rate of one queue.
+class FluidRateChange {
+public:
+	// Nanoseconds since the start of the emulation (after time dilation)
+	quint64 ts;
+	qint32 edge;
+	qint32 queue;
+	qint64 delta_Bps;
+};
+
+// Hybrid fluid/packet model: the background flows are not emulated packet by packet; instead, each one adds
+// its rate to the queues along its route (split evenly between the next hops of load balanced routes).
+// The queues integrate the fluid arrivals analytically (NetGraphEdgeQueue::advance), so the background
+// traffic consumes capacity, builds up queuing delay and causes drops for the packet-level (foreground) traffic.
+// The fluid is open-loop: it does not react to drops, and drops upstream do not reduce its rate downstream.
+class FluidModel
+{
+public:
+	FluidModel();
+
+	// Reads the flows from fileName and computes the rate changes. Must be called after NetGraph::prepareEmulation().
+	// The file has one flow per line ('#' starts a comment):
+	//   <source node> <dest node> <rate KB/s> [<start s> [<stop s> [<traffic class>]]]
+	bool load(QString fileName, NetGraph *netGraph);
+
+	// Applies the rate changes due at tsRelative (nanoseconds since the start of the emulation).
+	// Returns true if any changes were applied.
+	inline bool apply(NetGraph *netGraph, quint64 ts_now, quint64 tsRelative) {
+		if (nextChange >= changes.count() || changes[nextChange].ts > tsRelative)
+			return false;
+		applyDue(netGraph, ts_now, tsRelative);
+		return true;
+	}
+
+	// Time (relative to the start of the emulation) of the next rate change, or ULLONG_MAX if there are none left.
+	quint64 nextChangeTime() const {
+		return nextChange < changes.count() ? changes[nextChange].ts : ULLONG_MAX;
+	}
+
+	QList<FluidFlow> flows;
+	OVector<FluidRateChange> changes;
+
+protected:
+	void applyDue(NetGraph *netGraph, quint64 ts_now, quint64 tsRelative);
+
+	int nextChange;
+};
+
+// The fluid background traffic of the emulation (loaded by NetGraph::prepareEmulation()).
+extern FluidModel fluidModel;
+
+#endif // FLUIDMODEL_H
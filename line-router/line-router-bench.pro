@@ -0,0 +1,16 @@
+#-------------------------------------------------
+#
+# Scheduler microbenchmark (see benchmark.cpp): the line-router sources with a
+# main() that generates synthetic traffic instead of capturing with PF_RING.
+#
+#-------------------------------------------------
+
+LINE_ROUTER_BENCH = 1
+
+include(line-router.pro)
+
+TARGET = line-router-bench
+INSTALLS -= bundle
+
+SOURCES -= main.cpp
+SOURCES += benchmark.cpp
@@ -0,0 +1,18 @@
+#-------------------------------------------------
+#
+# Scheduler tests (see schedulertest.cpp): the line-router sources with a
+# main() that runs small scenarios in virtual time instead of capturing with
+# PF_RING.
+#
+#-------------------------------------------------
+
+LINE_ROUTER_BENCH = 1
+
+include(line-router.pro)
+
+TARGET = line-router-test
+INSTALLS -= bundle
+
+SOURCES -= main.cpp
+SOURCES += schedulertest.cpp
+HEADERS += ../util/test.h
@@ -4,14 +4,15 @@
 #
 #-------------------------------------------------
 
-exists( ../line.pro ) {
+# The benchmark (line-router-bench.pro) and the tests (line-router-test.pro) are always built locally
+exists( ../line.pro ):isEmpty(LINE_ROUTER_BENCH) {
 	system(../line-router/make-remote.sh)
 	TEMPLATE = subdirs
 }
 
 DEFINES += \'SRCDIR=\"$$_PRO_FILE_PWD_\"\'
 
-!exists( ../line.pro ) {
+!exists( ../line.pro )|!isEmpty(LINE_ROUTER_BENCH) {
 	QT       += core xml
 
 	QT       -= gui
@@ -87,6 +88,18 @@ DEFINES += \'SRCDIR=\"$$_PRO_FILE_PWD_\"\'
 		pconsumer.cpp \
 		pscheduler.cpp \
 		psender.cpp \
+		flightrecorder.cpp \
+		traceinjector.cpp \
+		pcontrol.cpp \
+		emulationimage.cpp \
+		fluidmodel.cpp \
+		psimulator.cpp \
+		pdistributed.cpp \
+		accuracymonitor.cpp \
+		coreplacement.cpp \
+		flowtable.cpp \
+		allocguard.cpp \
+		tenants.cpp \
 		../util/bitarray.cpp \
 		../line-gui/netgraphpath.cpp \
     ../line-gui/netgraphnode.cpp \
@@ -114,6 +127,18 @@ DEFINES += \'SRCDIR=\"$$_PRO_FILE_PWD_\"\'
 		pscheduler.h \
 		pconsumer.h \
 		psender.h \
+		flightrecorder.h \
+		traceinjector.h \
+		pcontrol.h \
+		emulationimage.h \
+		fluidmodel.h \
+		psimulator.h \
+		pdistributed.h \
+		accuracymonitor.h \
+		coreplacement.h \
+		flowtable.h \
+		allocguard.h \
+		tenants.h \
 		../util/bitarray.h \
 		../line-gui/netgraphpath.h \
 		../line-gui/netgraphnode.h \
@@ -154,6 +179,8 @@ HEADERS += \
     ../util/json.h \
     ../line-gui/end_to_end_measurements.h \
     ../tomo/fastpcap.h \
+    ../tomo/mmappcap.h \
+    ../util/qbinaryheap.h \
     ../tomo/pcap-common.h \
     ../line-gui/graph_types.h \
     ../util/compresseddevice.h
@@ -166,4 +193,5 @@ SOURCES += \
     ../util/json.cpp \
     ../line-gui/end_to_end_measurements.cpp \
     ../tomo/fastpcap.cpp \
+    ../tomo/mmappcap.cpp \
     ../util/compresseddevice.cpp
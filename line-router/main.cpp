@@ -19,6 +19,7 @@
 #include <stdio.h>
 
 #include "pconsumer.h"
+#include "psimulator.h"
 #include <QtCore>
 #include "qpairingheap.h"
 #include "util.h"
@@ -32,10 +33,6 @@
 #include <cstdlib>
 #include <exception>
 
-void warmMallocCache()
-{
-}
-
 void terminateWithTrace()
 {
 	show_backtrace();
@@ -62,7 +59,12 @@ int main(int argc, char *argv[])
 	srand(seed);
     simulationStartTime = get_current_time();
 	tsFirstSentPacket = 0;
-	runPacketFilter(argc, argv);
+	int result = 0;
+	if (argc > 1 && QString(argv[1]) == "--offline") {
+		result = runOfflineEmulation(argc - 2, argv + 2);
+	} else {
+		result = runPacketFilter(argc, argv);
+	}
 
 #ifdef USE_TC_MALLOC
 	printf("===== TCMalloc stats ===============\n");
@@ -82,6 +84,6 @@ int main(int argc, char *argv[])
 //	__attribute__((aligned(8))) quint64 x = 6ULL;
 //	qDebug() << bit_scan_forward_asm64(x);
 
-    return 0;
+	return result;
 }
 
@@ -32,6 +32,7 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
+#include <netinet/tcp.h>
 #include <net/ethernet.h>     /* the L2 protocols */
 #include <sys/time.h>
 #include <bits/time.h>
@@ -48,9 +49,16 @@ extern "C" {
 #include "../remote_config.h"
 #include "../line-gui/netgraphnode.h"
 #include "../util/ovector.h"
+#include "coreplacement.h"
+#include "pdistributed.h"
+#include "allocguard.h"
+#include "../util/json.h"
 
 #define PROFILE_PCONSUMER 0
 
+// The maximum number of frames received, classified and enqueued together by the consumer
+#define CONSUMER_BURST_SIZE 32
+
 quint64 Packet::next_packet_unique_id = 0;
 
 QString initDoneFilePath;
@@ -77,9 +85,170 @@ static quint64 packetsReceived;
 static quint64 bytesReceived;
 static quint64 miniJumbosReceived;
 static quint64 jumbosReceived;
+static quint64 superPacketsReceived;
+static quint64 segmentsReceived;
+// Frames from hosts emulated by other partitions (see classifyFrame())
+static quint64 remoteFramesIgnored;
+// Non-empty receive bursts
+static quint64 consumerBursts;
 static quint64 tsStart;
 static quint64 emulationDuration;
 
+// Returns the node ID of the host that sent the packet, or -1 if the packet does not come from an emulated host.
+static inline qint32 sourceHost(const struct pfring_pkthdr &hdr)
+{
+	const in_addr_t src_ip = htonl(hdr.extended_hdr.parsed_pkt.ip_src.v4);
+	const in_addr_t dst_ip = htonl(hdr.extended_hdr.parsed_pkt.ip_dst.v4);
+	if ((src_ip & NAT_MASK) != NAT_SUBNET || (dst_ip & NAT_MASK) != NAT_SUBNET)
+		return -1;
+	switch (hostIdentification) {
+	case HostIdentificationNat:
+		if (!(dst_ip & NAT_FOREIGN) || (src_ip & NAT_FOREIGN))
+			return -1;
+		return (ntohl(src_ip) & NAT_HOSTMASK) - IP_OFFSET;
+	case HostIdentificationVlan:
+		if (hdr.extended_hdr.parsed_pkt.vlan_id < HOST_VLAN_BASE)
+			return -1;
+		return hdr.extended_hdr.parsed_pkt.vlan_id - HOST_VLAN_BASE;
+	case HostIdentificationMac: {
+		const u_char *mac = hdr.extended_hdr.parsed_pkt.smac;
+		if (mac[0] != HOST_MAC_0 || mac[1] != HOST_MAC_1 || mac[2] != HOST_MAC_2)
+			return -1;
+		return (qint32(mac[3]) << 16) | (qint32(mac[4]) << 8) | qint32(mac[5]);
+	}
+	}
+	return -1;
+}
+
+// Parses the TCP receive window and, for SYN packets, the window scale option.
+static inline void parseTcpWindow(Packet *p)
+{
+	if (p->offsets.l4_offset + int(sizeof(struct tcphdr)) > p->length)
+		return;
+	const struct tcphdr *tcp = (const struct tcphdr *)(p->buffer + p->offsets.l4_offset);
+	p->tcpReceiveWindow = ntohs(tcp->window);
+	if (!tcp->syn)
+		return;
+	// We need to parse the options to get the window scale
+	const unsigned char *tcpopt = (const unsigned char*)(tcp + 1);
+	unsigned tcpHeaderLength = 4*tcp->doff;
+	if (tcpHeaderLength < sizeof(struct tcphdr) || p->offsets.l4_offset + int(tcpHeaderLength) > p->length)
+		return;
+	const unsigned char *tcppayload = (const unsigned char*)(tcp) + tcpHeaderLength;
+	int tcpoptlen = tcppayload - tcpopt;
+
+	while (tcpoptlen > 0) {
+		// Note that we are not implementing parsing all the possible TCP options, only the one that are
+		// likely to be encountered in our experiments. If an unknown option is encountered, we abort.
+		if (*tcpopt == TCPOPT_EOL) {
+			// End of option list
+			break;
+		} else if (*tcpopt == TCPOPT_NOP) {
+			// No operation
+			tcpopt++, tcpoptlen = tcppayload - tcpopt;
+		} else if (*tcpopt == TCPOPT_MAXSEG) {
+			// Maximum segment size
+			tcpopt += TCPOLEN_MAXSEG, tcpoptlen = tcppayload - tcpopt;
+		} else if (*tcpopt == TCPOPT_WINDOW) {
+			// Window scale factor; this is all we wanted, so stop processing
+			if (tcpoptlen >= TCPOLEN_WINDOW) {
+				p->tcpWindowScale = tcpopt[2];
+			}
+			break;
+		} else if (*tcpopt == TCPOPT_SACK_PERMITTED) {
+			// Sack permitted
+			tcpopt += TCPOLEN_SACK_PERMITTED, tcpoptlen = tcppayload - tcpopt;
+		} else if (*tcpopt == TCPOPT_SACK) {
+			// Sack
+			if (tcpoptlen < 2) {
+				break;
+			}
+			unsigned char length = tcpopt[1];
+			if (length > tcpoptlen) {
+				break;
+			}
+			tcpopt += length, tcpoptlen = tcppayload - tcpopt;
+		} else if (*tcpopt == TCPOPT_TIMESTAMP) {
+			// Timestamp
+			tcpopt += TCPOLEN_TIMESTAMP, tcpoptlen = tcppayload - tcpopt;
+		} else if (*tcpopt == 28) {
+			// User timeout
+			tcpopt += 4, tcpoptlen = tcppayload - tcpopt;
+		} else {
+			// not implemented
+			break;
+		}
+	}
+}
+
+// Fills in the packet fields from the PF_RING header of a received IPv4 frame and rewrites its Ethernet header.
+// Returns false if the frame must be dropped.
+static inline bool classifyFrame(Packet *p, const struct pfring_pkthdr &hdr, quint64 ts_now)
+{
+	const qint32 src_id = sourceHost(hdr);
+	if (src_id < 0) {
+		if (DEBUG_PACKETS)
+			printf("Dropped packet %d.%d.%d.%d -> %d.%d.%d.%d\n",
+				   HIPQUAD(hdr.extended_hdr.parsed_pkt.ip_src.v4),
+				   HIPQUAD(hdr.extended_hdr.parsed_pkt.ip_dst.v4));
+		return false;
+	}
+	if (partitioning.isRemoteNode(src_id)) {
+		// Partitions sharing an L2 segment (or one interface) all see the frame; only the partition that emulates
+		// the source host injects it, the others would route it a second time
+		remoteFramesIgnored++;
+		return false;
+	}
+	if (DEBUG_PACKETS)
+		printf("Accepted packet %d.%d.%d.%d -> %d.%d.%d.%d\n",
+			   HIPQUAD(hdr.extended_hdr.parsed_pkt.ip_src.v4),
+			   HIPQUAD(hdr.extended_hdr.parsed_pkt.ip_dst.v4));
+	p->length = hdr.len;
+	p->offsets = hdr.extended_hdr.parsed_pkt.offset;
+	p->l4_protocol = hdr.extended_hdr.parsed_pkt.l3_proto; // they named it worng
+	if (!p->setSegmentation(emulatedMtu)) {
+		// longer than the MTU, but not TCP
+		jumbosReceived++;
+		return false;
+	}
+	if (p->segments > 1) {
+		superPacketsReceived++;
+		segmentsReceived += p->segments;
+	}
+	packetsReceived++;
+	p->generateNewId();
+	p->ts_driver_rx = hdr.extended_hdr.timestamp_ns ? hdr.extended_hdr.timestamp_ns : ts_now;
+	p->ts_userspace_rx = ts_now;
+	p->src_ip = htonl(hdr.extended_hdr.parsed_pkt.ip_src.v4);
+	p->dst_ip = htonl(hdr.extended_hdr.parsed_pkt.ip_dst.v4);
+	p->src_id = src_id;
+	p->dst_id = (ntohl(p->dst_ip) & NAT_HOSTMASK) - IP_OFFSET;
+	p->l4_src_port = hdr.extended_hdr.parsed_pkt.l4_src_port;
+	p->l4_dst_port = hdr.extended_hdr.parsed_pkt.l4_dst_port;
+	p->tcpFlags = hdr.extended_hdr.parsed_pkt.tcp.flags;
+	p->tcpSeqNum = hdr.extended_hdr.parsed_pkt.tcp.seq_num;
+	p->tcpAckNum = hdr.extended_hdr.parsed_pkt.tcp.ack_num;
+	p->traffic_class = hdr.extended_hdr.parsed_pkt.ip_tos >> 3;
+	setFlowHash(p);
+	if (p->l4_protocol == IPPROTO_TCP) {
+		parseTcpWindow(p);
+	}
+	{
+		p->interface = hdr.extended_hdr.if_index;
+		struct ethhdr *eh;
+		eh = (struct ethhdr *)(p->buffer);
+		for (int i = 0; i < ETH_ALEN; i++) {
+			eh->h_source[i] = hdr.extended_hdr.parsed_pkt.smac[i];
+			eh->h_dest[i] = hdr.extended_hdr.parsed_pkt.dmac[i];
+		}
+		// tagged frames keep their 802.1Q header
+		if (hostIdentification != HostIdentificationVlan) {
+			eh->h_proto = htons(ETH_P_IP);
+		}
+	}
+	return true;
+}
+
 void* packet_consumer_thread(void* ) {
 	barrierInit.wait();
 	__sync_synchronize();
@@ -87,7 +256,7 @@ void* packet_consumer_thread(void* ) {
 	pthread_setname_np(pthread_self(), "line-packet-capture");
 
 	u_int numCPU = sysconf(_SC_NPROCESSORS_ONLN);
-	u_long core_id = CORE_CONSUMER;
+	u_long core_id = corePlacement.cpu(CoreConsumer);
 
 	if (bind2core(core_id) == 0) {
 		printf("Set thread consumer affinity to core %lu/%u\n", core_id, numCPU);
@@ -101,9 +270,26 @@ void* packet_consumer_thread(void* ) {
     bytesReceived = 0;
     miniJumbosReceived = 0;
     jumbosReceived = 0;
+    superPacketsReceived = 0;
+    segmentsReceived = 0;
+    remoteFramesIgnored = 0;
+    consumerBursts = 0;
+    const int maxLength = maxFrameLength();
+    // Frames that might not fit in the inline packet buffer are received without copying (pfring_recv with
+    // a zero buffer length returns a pointer into the ring), then copied into a buffer of the right size.
+    const bool zeroCopyRecv = maxLength > int(sizeof(((Packet*)0)->inlineBuffer));
 
-	struct pfring_pkthdr hdr;
-	memset(&hdr, 0, sizeof(hdr));
+	// Frames received in the current burst, with their PF_RING headers and receive timestamps
+	Packet *frames[CONSUMER_BURST_SIZE];
+	struct pfring_pkthdr hdrs[CONSUMER_BURST_SIZE];
+	quint64 tsRx[CONSUMER_BURST_SIZE];
+	memset(hdrs, 0, sizeof(hdrs));
+	// Packets rejected in the current burst, reused for the next frames
+	Packet *spare[CONSUMER_BURST_SIZE];
+	int numSpare = 0;
+	// The accepted packets of the current burst, handed to the scheduler with a single enqueue
+	OVector<Packet*> batch;
+	batch.reserve(CONSUMER_BURST_SIZE);
 
 #if PROFILE_PCONSUMER
 	quint64 ts_prev = 0;
@@ -120,29 +306,38 @@ void* packet_consumer_thread(void* ) {
 
     tsStart = get_current_time();
 	tsFirstSentPacket = 0;
+	AllocGuard allocGuard("consumer", tsStart);
 
-	Packet *p = nullptr;
 	while (1) {
 		if (do_shutdown)
 			break;
+		allocGuard.update();
 
-		if (p == nullptr) {
-			if (packetPool.tryDequeue(p)) {
+		// Stage 1: receive a burst of frames, until the ring is empty or the burst is full.
+		// Only the frame length is checked here; the copy from the ring (if any) must be done before the next
+		// pfring_recv().
+		int numFrames = 0;
+		while (numFrames < CONSUMER_BURST_SIZE) {
+			Packet *p;
+			if (numSpare > 0) {
+				p = spare[--numSpare];
+			} else if (packetPool.tryDequeue(p)) {
 				p->init();
 			} else {
 				p = new Packet();
 			}
-		}
 
-		quint8 *buffer = p->buffer;
-		quint8 **buffer_ptr = &buffer;
+			struct pfring_pkthdr &hdr = hdrs[numFrames];
+			quint8 *buffer = p->buffer;
+			quint8 **buffer_ptr = &buffer;
 
-		if (pfring_recv(pd, buffer_ptr, sizeof(p->buffer), &hdr, 0) > 0) {
-			if (do_shutdown)
+			if (pfring_recv(pd, buffer_ptr, zeroCopyRecv ? 0 : p->bufferSize(), &hdr, 0) <= 0) {
+				spare[numSpare++] = p;
 				break;
+			}
 			bytesReceived += hdr.len;
-			if (hdr.len > 1514) {
-				if (hdr.len > 1518) {
+			if (int(hdr.len) > maxLength) {
+				if (int(hdr.len) > maxLength + 4) {
 					jumbosReceived++;
 					if (DEBUG_PACKETS) {
 						if (hdr.extended_hdr.parsed_pkt.ip_version == 4) {
@@ -152,73 +347,73 @@ void* packet_consumer_thread(void* ) {
 								   HIPQUAD(hdr.extended_hdr.parsed_pkt.ip_dst.v4));
 						}
 					}
-					continue;
 				} else {
 					miniJumbosReceived++;
 					// these are caused by path MTU discovery, the deployment script should have turned it off!!!
-					continue;
 				}
+				spare[numSpare++] = p;
+				continue;
 			}
 			if (hdr.caplen != hdr.len) {
 				qDebug() << "hdr.caplen != hdr.len:" << hdr.caplen << hdr.len;
+				spare[numSpare++] = p;
 				continue;
 			}
-			if (hdr.extended_hdr.parsed_pkt.ip_version == 4) {
-                if (((htonl(hdr.extended_hdr.parsed_pkt.ip_src.v4) & NAT_MASK) == NAT_SUBNET) &&
-                    ((htonl(hdr.extended_hdr.parsed_pkt.ip_dst.v4) & NAT_MASK) == NAT_SUBNET) &&
-                    (htonl(hdr.extended_hdr.parsed_pkt.ip_dst.v4) & NAT_FOREIGN) &&
-                    !(htonl(hdr.extended_hdr.parsed_pkt.ip_src.v4) & NAT_FOREIGN)) {
-					if (DEBUG_PACKETS)
-						printf("Accepted packet %d.%d.%d.%d -> %d.%d.%d.%d\n",
-							   HIPQUAD(hdr.extended_hdr.parsed_pkt.ip_src.v4),
-							   HIPQUAD(hdr.extended_hdr.parsed_pkt.ip_dst.v4));
-					packetsReceived++;
-					quint64 ts_now = get_current_time();
-#if PROFILE_PCONSUMER
-					printf("sw ts delta = + "TS_FORMAT" \n", TS_FORMAT_PARAM(ts_now-ts_prev));
-					ts_prev = ts_now;
-					//printf("hw ts =  "TS_FORMAT" \n", TS_FORMAT_PARAM((quint64)hdr.extended_hdr.timestamp_ns));
-					//printf("sw ts =  "TS_FORMAT" \n", TS_FORMAT_PARAM(ts_now));
-#endif
-					p->generateNewId();
-					p->ts_driver_rx = hdr.extended_hdr.timestamp_ns ? hdr.extended_hdr.timestamp_ns : ts_now;
-					p->ts_userspace_rx = ts_now;
-					p->src_ip = htonl(hdr.extended_hdr.parsed_pkt.ip_src.v4);
-					p->dst_ip = htonl(hdr.extended_hdr.parsed_pkt.ip_dst.v4);
-                    p->src_id = (ntohl(p->src_ip) & NAT_HOSTMASK) - IP_OFFSET;
-                    p->dst_id = (ntohl(p->dst_ip) & NAT_HOSTMASK) - IP_OFFSET;
-					p->l4_protocol = hdr.extended_hdr.parsed_pkt.l3_proto; // they named it worng
-					p->l4_src_port = hdr.extended_hdr.parsed_pkt.l4_src_port;
-					p->l4_dst_port = hdr.extended_hdr.parsed_pkt.l4_dst_port;
-					p->tcpFlags = hdr.extended_hdr.parsed_pkt.tcp.flags;
-					p->tcpSeqNum = hdr.extended_hdr.parsed_pkt.tcp.seq_num;
-					p->tcpAckNum = hdr.extended_hdr.parsed_pkt.tcp.ack_num;
-					p->offsets = hdr.extended_hdr.parsed_pkt.offset;
-					p->length = hdr.len;
-                    p->traffic_class = hdr.extended_hdr.parsed_pkt.ip_tos >> 3;
-					{
-						p->interface = hdr.extended_hdr.if_index;
-						struct ethhdr *eh;
-						eh = (struct ethhdr *)(p->buffer);
-						for (int i = 0; i < ETH_ALEN; i++) {
-							eh->h_source[i] = hdr.extended_hdr.parsed_pkt.smac[i];
-							eh->h_dest[i] = hdr.extended_hdr.parsed_pkt.dmac[i];
-							eh->h_proto = htons(ETH_P_IP);
-						}
-					}
-					packetsIn.enqueue(p);
-					p = nullptr;
-				} else {
-					if (DEBUG_PACKETS)
-						printf("Dropped packet %d.%d.%d.%d -> %d.%d.%d.%d\n",
-							   HIPQUAD(hdr.extended_hdr.parsed_pkt.ip_src.v4),
-							   HIPQUAD(hdr.extended_hdr.parsed_pkt.ip_dst.v4));
-				}
+			if (hdr.extended_hdr.parsed_pkt.ip_version != 4) {
+				spare[numSpare++] = p;
+				continue;
 			}
-		} else {
+			if (zeroCopyRecv) {
+				p->reserveBuffer(hdr.len);
+				memcpy(p->buffer, buffer, hdr.caplen);
+			}
+			tsRx[numFrames] = get_current_time();
+			frames[numFrames] = p;
+			numFrames++;
+		}
+		if (numFrames == 0) {
 			//sched_yield();
+			continue;
+		}
+		if (do_shutdown) {
+			for (int i = 0; i < numFrames; i++) {
+				spare[numSpare++] = frames[i];
+			}
+			break;
+		}
+		consumerBursts++;
+
+		// Stage 2: classify the burst. Fills in everything the scheduler needs (host IDs, 5-tuple, flow hash,
+		// traffic class, TCP window), so that it never has to read the frame.
+		for (int i = 0; i < numFrames; i++) {
+			if (i + 1 < numFrames) {
+				// The metadata of pooled packets was last written by the sender, on another core
+				__builtin_prefetch(&frames[i + 1]->length, 1);
+				__builtin_prefetch(&frames[i + 1]->src_id, 1);
+			}
+			Packet *p = frames[i];
+			const struct pfring_pkthdr &hdr = hdrs[i];
+			const quint64 ts_now = tsRx[i];
+			if (!classifyFrame(p, hdr, ts_now)) {
+				spare[numSpare++] = p;
+				continue;
+			}
+#if PROFILE_PCONSUMER
+			printf("sw ts delta = + "TS_FORMAT" \n", TS_FORMAT_PARAM(ts_now-ts_prev));
+			ts_prev = ts_now;
+			//printf("hw ts =  "TS_FORMAT" \n", TS_FORMAT_PARAM((quint64)hdr.extended_hdr.timestamp_ns));
+			//printf("sw ts =  "TS_FORMAT" \n", TS_FORMAT_PARAM(ts_now));
+#endif
+			batch.append(p);
+		}
+
+		// Stage 3: hand the burst to the scheduler.
+		if (!batch.isEmpty()) {
+			packetsIn.enqueue(batch);
+			batch.clear();
 		}
 	}
+	allocGuard.disarm();
 	malloc_profile_pause_wrapper();
     emulationDuration = get_current_time() - tsStart;
 
@@ -233,15 +428,27 @@ void print_consumer_stats()
     printf("Total bytes received: %s\n", withCommas(bytesReceived));
 	qreal receiveRate = qreal(bytesReceived) * 8 * 1.0e3 / emulationDuration;
 	printf("Bits received per second: %s Mbps\n", withCommas(receiveRate));
-	int linkSpeedMbps = getInterfaceSpeedMbps(REMOTE_DEDICATED_IF_ROUTER);
+	int linkSpeedMbps = getInterfaceSpeedMbps(emulatorInterface.toLatin1().constData());
 	if (linkSpeedMbps > 0) {
 		printf("Interface link speed: %s Mbps\n", withCommas(linkSpeedMbps));
 		if (receiveRate >= linkSpeedMbps * 0.9) {
 			printf("WARNING: receive rate approaches link rate\n");
 		}
 	}
+    printf("MTU: %d bytes, super-packets %s\n", emulatedMtu, superPacketsEnabled ? "enabled" : "disabled");
     printf("Jumbos received (dropped): %s\n", withCommas(jumbosReceived));
     printf("Jumbos exceeding MTU by up to 4 received (dropped) (means PMTUD enabled): %s\n", withCommas(miniJumbosReceived));
+    printf("Super-packets received: %s (%s segments, %.1f segments per super-packet)\n",
+           withCommas(superPacketsReceived),
+           withCommas(segmentsReceived),
+           superPacketsReceived ? qreal(segmentsReceived) / superPacketsReceived : 0.0);
+    if (partitionIndex >= 0) {
+        printf("Frames from hosts of other partitions (ignored): %s\n", withCommas(remoteFramesIgnored));
+    }
+    printf("Receive bursts: %s (%.1f packets per burst, at most %d)\n",
+           withCommas(consumerBursts),
+           consumerBursts ? qreal(packetsReceived) / consumerBursts : 0.0,
+           CONSUMER_BURST_SIZE);
 
 #if QUEUE_IMPL == QUEUE_IMPL_SPIN
 	printf("Inter-thread communication: spinlock-protected queue\n");
@@ -254,3 +461,19 @@ void print_consumer_stats()
 #else
 #endif
 }
+
+QString consumer_stats_json()
+{
+	JsonObjectPrinter p;
+	jsonObjectPrinterAddMember(p, packetsReceived);
+	jsonObjectPrinterAddMember(p, bytesReceived);
+	jsonObjectPrinterAddMember(p, jumbosReceived);
+	jsonObjectPrinterAddMember(p, miniJumbosReceived);
+	jsonObjectPrinterAddMember(p, superPacketsReceived);
+	jsonObjectPrinterAddMember(p, segmentsReceived);
+	jsonObjectPrinterAddMember(p, remoteFramesIgnored);
+	jsonObjectPrinterAddMember(p, consumerBursts);
+	jsonObjectPrinterAddMember(p, emulatedMtu);
+	jsonObjectPrinterAddMember(p, superPacketsEnabled);
+	return p.json();
+}
@@ -22,6 +22,7 @@
 extern "C" {
 #include <pfring.h>
 }
+#include <netinet/in.h>
 #include <QtCore>
 #include "spinlockedqueue.h"
 
@@ -43,13 +44,23 @@ extern "C" {
 #define NAT_FOREIGN  htonl(0x00800000)  /* 0000 0000 . 1000 0000 . 0000 0000 . 0000 0000 which gives 1.128.0.0/9 */
 #define NAT_HOSTMASK 0x7FFFFF           /* 0000 0000 . 0111 1111 . 1111 1111 . 1111 1111 */
 
+// The largest frame that can be received: a 64 KB IP packet (a GRO/TSO super-packet) with an Ethernet and a VLAN
+// header.
+#define MAX_FRAME_SIZE (65535 + 18)
+
 class Packet {
 public:
-	Packet() {
+	Packet()
+		: largeBuffer(nullptr) {
 		init();
 	}
 
+	~Packet() {
+		delete [] largeBuffer;
+	}
+
 	void init() {
+		buffer = inlineBuffer;
 		ts_driver_rx = 0;
 		ts_userspace_rx = 0;
 		ts_start_proc = 0;
@@ -58,6 +69,9 @@ public:
 		theoretical_delay = 0;
 		preparedForSend = false;
 		length = 0;
+		wireLength = 0;
+		segments = 1;
+		segmentSize = 0;
 		memset(&offsets, 0, sizeof(offsets));
 		src_ip = 0;
 		dst_ip = 0;
@@ -67,6 +81,13 @@ public:
 		tcpFlags = 0;
 		tcpSeqNum = 0;
 		tcpAckNum = 0;
+		tcpReceiveWindow = 0;
+		tcpWindowScale = -1;
+		flowHash = 0;
+		cutThroughEdges.clear();
+		cutThroughEdges.reserve(16);
+		cutThroughArrivals.clear();
+		cutThroughArrivals.reserve(16);
 		trace.clear();
 		trace.reserve(50);
 		src_id = -1;
@@ -89,8 +110,53 @@ public:
 		next_packet_unique_id++;
 	}
 
-    // The packet contents. Use this->offsets to find the offsets of each header.
-	quint8 buffer[2048];
+	// Points buffer to storage for a frame of frameLength bytes. Frames that do not fit in the inline buffer
+	// (jumbo frames and super-packets) use a second buffer, allocated on first use and kept across init().
+	// Returns false if the frame is longer than MAX_FRAME_SIZE.
+	bool reserveBuffer(int frameLength) {
+		if (frameLength <= int(sizeof(inlineBuffer))) {
+			buffer = inlineBuffer;
+			return true;
+		}
+		if (frameLength > MAX_FRAME_SIZE)
+			return false;
+		if (!largeBuffer) {
+			largeBuffer = new quint8[MAX_FRAME_SIZE];
+		}
+		buffer = largeBuffer;
+		return true;
+	}
+
+	int bufferSize() const {
+		return buffer == inlineBuffer ? int(sizeof(inlineBuffer)) : MAX_FRAME_SIZE;
+	}
+
+	// Sets segments, segmentSize and wireLength from length, offsets and l4_protocol, for links with an IP MTU of
+	// mtu bytes. TCP frames longer than the MTU are super-packets (segments coalesced by GRO/TSO on the hosts).
+	// Returns false for other frames longer than the MTU, which cannot be segmented.
+	bool setSegmentation(int mtu) {
+		segments = 1;
+		segmentSize = 0;
+		wireLength = length;
+		if (length - offsets.l3_offset <= mtu)
+			return true;
+		if (l4_protocol != IPPROTO_TCP || offsets.payload_offset <= offsets.l4_offset)
+			return false;
+		segmentSize = mtu - (offsets.payload_offset - offsets.l3_offset);
+		if (segmentSize <= 0)
+			return false;
+		const int payloadLength = length - offsets.payload_offset;
+		segments = (payloadLength + segmentSize - 1) / segmentSize;
+		// each segment repeats the headers
+		wireLength = length + (segments - 1) * offsets.payload_offset;
+		return true;
+	}
+
+	// The packet contents. Use this->offsets to find the offsets of each header.
+	// Points to inlineBuffer, or to largeBuffer for long frames (see reserveBuffer()).
+	quint8 *buffer;
+	quint8 inlineBuffer[2048];
+	quint8 *largeBuffer;
 
     // All timestamps are in nanoseconds.
     // Timestamp for the moment when the driver received the packet (if not available, set to ts_userspace_rx).
@@ -111,6 +177,14 @@ public:
 
     // frame length
     int length;
+	// The number of bytes the frame occupies on the emulated links, used for queuing and serialization: equal to
+	// length, except for super-packets, which are scheduled as one unit with the serialization time of all their
+	// segments.
+	int wireLength;
+	// The number of MTU-sized segments in the frame (1 except for super-packets)
+	qint32 segments;
+	// The TCP payload bytes per segment of a super-packet (0 otherwise)
+	qint32 segmentSize;
 	struct pkt_offset offsets;
 	in_addr_t src_ip;
 	in_addr_t dst_ip;
@@ -122,8 +196,18 @@ public:
 	// TCP sequence number
 	quint32 tcpSeqNum;
 	quint32 tcpAckNum;
+	// TCP receive window (not scaled)
+	quint16 tcpReceiveWindow;
+	// TCP window scale option of SYN packets (-1 if not present)
+	qint8 tcpWindowScale;
+	// The node-independent part of the ECMP hash of the 5-tuple, computed once per packet (see setFlowHash())
+	quint64 flowHash;
     // List of node IDs that the packet traversed. Includes the first and last nodes.
 	OVector<qint32> trace;
+	// The edges of the current cut-through run (empty if the packet is not cutting through), and the time when
+	// the packet arrives on each of them (see cutThrough() in pscheduler.cpp)
+	OVector<qint32> cutThroughEdges;
+	OVector<quint64> cutThroughArrivals;
     // ID of source NetGraphNode
     qint32 src_id;
     // ID of destination NetGraphNode
@@ -153,6 +237,9 @@ public:
 
     // Global counter used to generate unique packet IDs.
 	static quint64 next_packet_unique_id;
+
+private:
+	Q_DISABLE_COPY(Packet)
 };
 
 
@@ -170,7 +257,30 @@ extern QString initDoneFilePath;
 
 extern quint64 estimatedDuration;
 
+// Scheduler loop iterations that take at least this many nanoseconds trigger a flight recorder dump.
+extern quint64 flightRecorderThreshold;
+
+// Packets that leave more than this many nanoseconds after their scheduled time count as late
+// in the per-path accuracy statistics. Set by --lateness_threshold, default: 100 us.
+extern quint64 latenessThreshold;
+// If non-zero, the emulation is aborted as soon as the fraction of late packets on any path exceeds it.
+// Set by --lateness_abort, default: 0.
+extern qreal latenessAbortFraction;
+
+// The IP MTU of the emulated links. Set by --mtu, default: 1500. Raise it (e.g. to 9000) to emulate jumbo frames.
+extern int emulatedMtu;
+// If true, TCP frames longer than the MTU (segments coalesced by GRO or TSO on the hosts) are emulated as
+// super-packets instead of being dropped, and segmented to the MTU when sent. Set by --super_packets.
+extern bool superPacketsEnabled;
+// The longest frame that the consumer accepts, following emulatedMtu and superPacketsEnabled.
+int maxFrameLength();
+// The largest wireLength of a packet: maxFrameLength(), or the length of the largest super-packet once segmented.
+int maxWireLength();
+
 extern pfring *pd;
+// The interface connected to the emulated hosts. Set by --interface, default: REMOTE_DEDICATED_IF_ROUTER.
+// Partitions running on the same machine need one each (see run-partitions-local.sh).
+extern QString emulatorInterface;
 extern quint8 wait_for_packet; // 1 = blocking read, 0 = busy waiting
 extern quint8 dna_mode;
 extern quint8 do_shutdown;
@@ -182,6 +292,10 @@ extern qreal bufferBloatFactor;
 
 extern bool flowTracking;
 
+// If non-zero, a snapshot of the router stats is appended to emulator-stats.jsonl every statsInterval nanoseconds
+// (the final stats are always saved to emulator-stats.json). Set by --stats_interval, default: 0.
+extern quint64 statsInterval;
+
 extern QueuingDiscipline gQueuingDiscipline;
 
 enum QosBufferScaling {
@@ -192,6 +306,82 @@ enum QosBufferScaling {
 
 extern QosBufferScaling qosBufferScaling;
 
+// How load balanced routes choose among the equal-cost next hops.
+enum EcmpHashFunction {
+	// A random next hop for every packet (reorders packets within flows)
+	EcmpHashRandom = 0,
+	// XOR-fold of the 5-tuple, as done by cheap hardware
+	EcmpHashXor,
+	// MurmurHash3 finalizer over the 5-tuple
+	EcmpHashMurmur
+};
+
+extern EcmpHashFunction ecmpHashFunction;
+// Mixed into the flow hash, together with the current node ID (to avoid polarization).
+extern quint64 ecmpHashSeed;
+// If non-zero, a flow that has been idle for at least this many nanoseconds may switch to another next hop
+// (flowlet switching). If zero, a flow always takes the same next hop.
+extern quint64 ecmpFlowletGap;
+
+// If true, packets leaving a queue are routed to the next link at their scheduled exit time, so that a scheduler
+// that falls behind does not shift all the later departures; if false, at the time the scheduler handles them.
+// Cleared by --events_at_current_time (to compare the accuracy of the two), default: true.
+extern bool eventsAtScheduledTime;
+
+// If true, chains of edges that cannot congest (behind relay nodes, fast enough that no frame can catch up with the
+// one ahead of it) are emulated as a single hop with the sum of their delays. Set by --collapse_segments, default:
+// false.
+extern bool segmentCollapsing;
+
+// If true, a packet routed onto a run of empty queues crosses all of them in one step; the run is revoked if another
+// packet arrives on one of its links before the packet has crossed it. Set by --cut_through, default: false.
+extern bool cutThroughEnabled;
+
+// MurmurHash3 64-bit finalizer
+inline quint64 ecmpMix64(quint64 k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+// Sets p->flowHash from the addresses, ports and protocol. Must be called by every packet source after filling in
+// the 5-tuple; the scheduler only mixes in the node ID.
+inline void setFlowHash(Packet *p)
+{
+	if (ecmpHashFunction == EcmpHashXor) {
+		p->flowHash = p->src_ip ^ p->dst_ip ^ ((quint32(p->l4_src_port) << 16) | p->l4_dst_port) ^ p->l4_protocol;
+	} else {
+		quint64 addresses = (quint64(p->src_ip) << 32) | quint64(p->dst_ip);
+		p->flowHash = ecmpMix64(addresses ^ ecmpHashSeed);
+	}
+}
+
+// How the source host of a captured packet is identified (see also HOST_VLAN_BASE and HOST_MAC_0 in netgraphnode.h).
+enum HostIdentification {
+	// Host i sends from 1.0.0.0/8 to the 1.128.0.0/9 address of the destination; the sender rewrites both addresses
+	// and fixes the IP and L4 checksums
+	HostIdentificationNat = 0,
+	// By the VLAN tag; the sender only retags the frame with the VLAN of the destination
+	HostIdentificationVlan,
+	// By the source MAC address; the sender only rewrites the MAC addresses
+	HostIdentificationMac
+};
+
+// Set by the parameter --host_id nat|vlan|mac, default: nat
+extern HostIdentification hostIdentification;
+
+// Emulated time runs this many times slower than real time, to emulate links faster than the machine can forward:
+// link rates are divided by it, propagation delays and trace packet timestamps are multiplied by it.
+// This is an option of line-router only, to be run by hand with line-traffic --time_dilation and the same factor;
+// line-runner does not pass it. Durations given on the command line (e.g. --estimated_duration) are in real time,
+// and so are all the recorded results: nothing rescales them. The factor is written to simulation.txt for reference.
+// Set by the parameter --time_dilation, default: 1.0
+extern qreal timeDilation;
+
 extern quint64 simulationStartTime;
 extern quint64 tsFirstSentPacket; // 0 = invalid
 // We only record performance statistics after RECORD_STATS_DELAY nanoseconds
@@ -216,11 +406,22 @@ int getInterfaceSpeedMbps(const char *interfaceName);
 #define DEBUG_PACKETS 0
 
 int runPacketFilter(int argc, char **argv);
+// Used by runPacketFilter and by the offline mode (see psimulator.h).
+// argv starts with the graph file name.
+void parseEmulatorArgs(int argc, char **argv, QString &graphFileName, quint64 &intervalSize);
+void prepareExperiment(QString graphFileName, quint64 intervalSize);
+void saveExperimentResults();
 
 void* packet_consumer_thread(void* );
 void print_consumer_stats();
 void* packet_scheduler_thread(void* );
 void print_scheduler_stats();
+// The counters and histograms of print_consumer_stats() and print_scheduler_stats() as JSON objects, for the
+// structured stats file. Safe to call while the emulation runs (the values may be slightly inconsistent).
+QString consumer_stats_json();
+QString scheduler_stats_json();
+// The admission counters and the event lateness of one tenant (see tenants.h)
+QString scheduler_tenant_stats(int tenant);
 
 int bind2core(u_int core_id);
 
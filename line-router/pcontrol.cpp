@@ -0,0 +1,240 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "pcontrol.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "../util/tinyhistogram.h"
+#include "../util/json.h"
+
+SyncQueueType<LinkUpdateBatch*> linkUpdatesIn;
+SyncQueueType<LinkUpdateBatch*> linkUpdatesDone;
+QString controlSocketPath;
+
+// Time from the moment a batch becomes due (received, or its apply time, whichever is later) until it is applied
+static TinyHistogram linkUpdateApplyLatency;
+static quint64 numLinkUpdateBatches;
+static quint64 numLinkUpdates;
+
+LinkUpdate::LinkUpdate()
+{
+	edgeIndex = -1;
+	bandwidth = -1;
+	delay_ms = -1;
+	lossBernoulli = -1;
+	queueLength = -1;
+}
+
+static bool parseLinkUpdate(const QStringList &tokens, LinkUpdate &update, QString &error)
+{
+	bool ok;
+	update = LinkUpdate();
+	update.edgeIndex = tokens.value(1).toInt(&ok);
+	if (!ok || update.edgeIndex < 0 || update.edgeIndex >= netGraph->edges.count()) {
+		error = QString("bad edge index: %1").arg(tokens.value(1));
+		return false;
+	}
+	for (int i = 2; i < tokens.count(); i += 2) {
+		if (i + 1 >= tokens.count()) {
+			error = QString("missing value for %1").arg(tokens[i]);
+			return false;
+		}
+		if (tokens[i] == "bandwidth") {
+			update.bandwidth = tokens[i + 1].toDouble(&ok);
+			ok = ok && update.bandwidth > 0;
+		} else if (tokens[i] == "delay") {
+			update.delay_ms = tokens[i + 1].toInt(&ok);
+			ok = ok && update.delay_ms >= 0;
+		} else if (tokens[i] == "loss") {
+			update.lossBernoulli = tokens[i + 1].toDouble(&ok);
+			ok = ok && update.lossBernoulli >= 0 && update.lossBernoulli <= 1;
+		} else if (tokens[i] == "queue") {
+			update.queueLength = tokens[i + 1].toInt(&ok);
+			ok = ok && update.queueLength > 0;
+		} else {
+			error = QString("unknown parameter: %1").arg(tokens[i]);
+			return false;
+		}
+		if (!ok) {
+			error = QString("bad value for %1: %2").arg(tokens[i]).arg(tokens[i + 1]);
+			return false;
+		}
+	}
+	return true;
+}
+
+static void reply(int fd, QString message)
+{
+	QByteArray data = (message + "\n").toLatin1();
+	if (write(fd, data.constData(), data.length()) < 0) {
+		// The client went away, nothing to do
+	}
+}
+
+static void collectAppliedBatches()
+{
+	LinkUpdateBatch *batch;
+	while (linkUpdatesDone.tryDequeue(batch)) {
+		quint64 latency = batch->tsApplied - batch->tsDue;
+		linkUpdateApplyLatency.recordEvent(latency);
+		printf("Link update batch %llu applied (%d links), latency %s\n",
+			   batch->id,
+			   batch->updates.count(),
+			   time2String(latency).toLatin1().constData());
+		delete batch;
+	}
+}
+
+void* control_thread(void* )
+{
+	pthread_setname_np(pthread_self(), "line-control");
+
+	numLinkUpdateBatches = 0;
+	numLinkUpdates = 0;
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0) {
+		perror("control socket");
+		return NULL;
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, controlSocketPath.toLatin1().constData(), sizeof(address.sun_path) - 1);
+	unlink(address.sun_path);
+	if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+		listen(listenFd, 4) < 0) {
+		perror("control socket bind");
+		close(listenFd);
+		return NULL;
+	}
+	printf("Listening for link updates on %s\n", address.sun_path);
+
+	int clientFd = -1;
+	QByteArray input;
+	LinkUpdateBatch *batch = NULL;
+
+	while (!do_shutdown) {
+		collectAppliedBatches();
+
+		struct pollfd pfd;
+		pfd.fd = clientFd >= 0 ? clientFd : listenFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		if (clientFd < 0) {
+			clientFd = accept(listenFd, NULL, NULL);
+			input.clear();
+			continue;
+		}
+
+		char buffer[4096];
+		ssize_t count = read(clientFd, buffer, sizeof(buffer));
+		if (count <= 0) {
+			close(clientFd);
+			clientFd = -1;
+			delete batch;
+			batch = NULL;
+			continue;
+		}
+		input.append(buffer, count);
+
+		for (int newline = input.indexOf('\n'); newline >= 0; newline = input.indexOf('\n')) {
+			QString line = QString::fromLatin1(input.constData(), newline).trimmed();
+			input.remove(0, newline + 1);
+			QStringList tokens = line.split(' ', QString::SkipEmptyParts);
+			if (tokens.isEmpty())
+				continue;
+			if (!batch) {
+				batch = new LinkUpdateBatch();
+				batch->tsApply = 0;
+				batch->tsDue = 0;
+				batch->tsApplied = 0;
+			}
+			QString error;
+			if (tokens[0] == "edge") {
+				LinkUpdate update;
+				if (parseLinkUpdate(tokens, update, error)) {
+					batch->updates.append(update);
+					continue;
+				}
+			} else if (tokens[0] == "apply") {
+				bool ok = true;
+				if (tokens.count() > 1) {
+					batch->tsApply = tokens[1].toULongLong(&ok);
+				}
+				if (ok) {
+					batch->id = numLinkUpdateBatches;
+					batch->tsReceived = get_current_time();
+					numLinkUpdateBatches++;
+					numLinkUpdates += batch->updates.count();
+					linkUpdatesIn.enqueue(batch);
+					reply(clientFd, QString("ok %1").arg(batch->id));
+					batch = NULL;
+					continue;
+				}
+				error = QString("bad apply time: %1").arg(tokens[1]);
+			} else {
+				error = QString("unknown command: %1").arg(tokens[0]);
+			}
+			reply(clientFd, QString("error %1").arg(error));
+			delete batch;
+			batch = NULL;
+		}
+	}
+
+	if (clientFd >= 0) {
+		close(clientFd);
+	}
+	close(listenFd);
+	unlink(address.sun_path);
+	delete batch;
+
+	return NULL;
+}
+
+void print_control_stats()
+{
+	collectAppliedBatches();
+	printf("===== Control stats ====\n");
+	printf("Link update batches: %s\n", withCommas(numLinkUpdateBatches));
+	printf("Link updates: %s\n", withCommas(numLinkUpdates));
+	printf("Link update apply latency:\n");
+	printf("%s\n", linkUpdateApplyLatency.toString(&time2String).toLatin1().constData());
+}
+
+QString control_stats_json()
+{
+	collectAppliedBatches();
+	JsonObjectPrinter p;
+	jsonObjectPrinterAddMember(p, numLinkUpdateBatches);
+	jsonObjectPrinterAddMember(p, numLinkUpdates);
+	jsonObjectPrinterAddMember(p, linkUpdateApplyLatency);
+	return p.json();
+}
@@ -0,0 +1,75 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef PCONTROL_H
+#define PCONTROL_H
+
+#include <QtCore>
+#include "pconsumer.h"
+
+// A change of the parameters of one link. Negative values mean "unchanged".
+class LinkUpdate {
+public:
+	LinkUpdate();
+
+	qint32 edgeIndex;
+	// KB/s
+	qreal bandwidth;
+	// ms
+	qint32 delay_ms;
+	// probability
+	qreal lossBernoulli;
+	// Ethernet frames (before scaling with --scale_buffers)
+	qint32 queueLength;
+};
+
+// A set of link updates applied together by the scheduler, between two loop iterations.
+class LinkUpdateBatch {
+public:
+	quint64 id;
+	// Time (nanoseconds since the start of the emulation) at which the batch must be applied; 0 = as soon as possible
+	quint64 tsApply;
+	// When the batch has been received by the control thread
+	quint64 tsReceived;
+	// When the batch became due, i.e. the later of tsReceived and tsApply (set by the scheduler)
+	quint64 tsDue;
+	// When the batch has been applied by the scheduler
+	quint64 tsApplied;
+	QVector<LinkUpdate> updates;
+};
+
+// control thread -> scheduler
+extern SyncQueueType<LinkUpdateBatch*> linkUpdatesIn;
+// scheduler -> control thread, for logging and deallocation
+extern SyncQueueType<LinkUpdateBatch*> linkUpdatesDone;
+
+// Path of the Unix domain control socket; if empty, the control thread is not started.
+// Set by the parameter --control_socket.
+extern QString controlSocketPath;
+
+// Accepts link updates on controlSocketPath. One command per line:
+//   edge <edge index (0-based)> [bandwidth <KB/s>] [delay <ms>] [loss <probability>] [queue <frames>]
+//   apply [<time in ns since the start of the emulation>]
+// "edge" lines are accumulated and submitted as a single batch by "apply". The reply is "ok <batch id>"
+// or "error <reason>" (in which case the batch is discarded).
+void* control_thread(void* );
+void print_control_stats();
+// See consumer_stats_json(). Call after the emulation ends.
+QString control_stats_json();
+
+#endif // PCONTROL_H
@@ -0,0 +1,608 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "pdistributed.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "../util/util.h"
+#include "../util/json.h"
+#include "coreplacement.h"
+
+#define TUNNEL_MAGIC 0x4c494e45
+// Clock sync requests are sent to each peer with this period
+#define TUNNEL_SYNC_PERIOD (100ULL * MSEC_TO_NSEC)
+#define TUNNEL_BUSY_WAITING 1
+// The largest UDP payload over IPv4
+#define TUNNEL_MAX_DATAGRAM 65507
+// Packets kept by the tunnel thread for receiving; the others are returned to packetPool
+#define TUNNEL_POOL_SIZE 1000
+
+qint32 partitionIndex;
+QString partitionsFilePath;
+quint64 partitionLookahead;
+EmulationPartitioning partitioning;
+SyncQueueType<Packet*> tunnelOut;
+SyncQueueType<Packet*> tunnelIn;
+SyncQueueType<Packet*> tunnelRecycled;
+
+static quint64 numTunneledOut;
+static quint64 numTunneledIn;
+static quint64 bytesTunneledOut;
+static quint64 bytesTunneledIn;
+static quint64 numTunnelErrors;
+static quint64 numTunnelAllocations;
+// Time left until the packet is due, when it is received (negative values are recorded as 0: late packets)
+static TinyHistogram tunnelSlack;
+static quint64 numTunnelLate;
+
+enum TunnelMessageType {
+	TunnelMessagePacket = 1,
+	TunnelMessageSyncRequest = 2,
+	TunnelMessageSyncReply = 3
+};
+
+struct __attribute__((packed)) TunnelMessageHeader {
+	quint32 magic;
+	quint8 type;
+	quint8 partition;
+};
+
+struct __attribute__((packed)) TunnelSyncMessage {
+	TunnelMessageHeader header;
+	// Clock of the requester when sending the request
+	quint64 tsRequest;
+	// Clock of the replier when receiving the request
+	quint64 tsReply;
+};
+
+#define TUNNEL_FLAG_RECORDED 1
+#define TUNNEL_FLAG_SAMPLED  2
+#define TUNNEL_FLAG_ECN      4
+
+// Followed by traceLength node IDs (qint32), then by captureLength bytes of the frame.
+// Timestamps are in the clock of the sender.
+struct __attribute__((packed)) TunnelPacketMessage {
+	TunnelMessageHeader header;
+	quint64 id;
+	quint64 ts_driver_rx;
+	quint64 ts_userspace_rx;
+	quint64 ts_exit;
+	quint64 theoretical_delay;
+	quint64 flowHash;
+	quint32 src_ip;
+	quint32 dst_ip;
+	qint32 src_id;
+	qint32 dst_id;
+	qint32 path_id;
+	qint32 traffic_class;
+	qint32 length;
+	quint32 tcpSeqNum;
+	quint32 tcpAckNum;
+	quint16 l4_src_port;
+	quint16 l4_dst_port;
+	quint16 tcpReceiveWindow;
+	quint8 l4_protocol;
+	quint8 tcpFlags;
+	qint8 tcpWindowScale;
+	quint8 flags;
+	quint16 traceLength;
+	quint16 captureLength;
+	struct pkt_offset offsets;
+};
+
+EmulationPartitioning::EmulationPartitioning()
+	: local(-1),
+	  numCutEdges(0),
+	  numShortCutEdges(0)
+{
+}
+
+QVector<qint32> EmulationPartitioning::partitionNodes(NetGraph *netGraph, int count)
+{
+	const int n = netGraph->nodes.count();
+	QVector<QList<qint32> > neighbours(n);
+	foreach (NetGraphEdge e, netGraph->edges) {
+		neighbours[e.source].append(e.dest);
+		neighbours[e.dest].append(e.source);
+	}
+
+	// breadth-first order, component by component
+	QVector<qint32> order;
+	order.reserve(n);
+	QVector<bool> visited(n, false);
+	for (int start = 0; start < n; start++) {
+		if (visited[start])
+			continue;
+		visited[start] = true;
+		order.append(start);
+		for (int i = order.count() - 1; i < order.count(); i++) {
+			foreach (qint32 next, neighbours[order[i]]) {
+				if (!visited[next]) {
+					visited[next] = true;
+					order.append(next);
+				}
+			}
+		}
+	}
+
+	QVector<qint32> result(n, 0);
+	const int size = (n + count - 1) / count;
+	for (int i = 0; i < order.count(); i++) {
+		result[order[i]] = i / qMax(1, size);
+	}
+	return result;
+}
+
+bool EmulationPartitioning::load(QString fileName, NetGraph *netGraph, qint32 localIndex)
+{
+	QString text;
+	if (!readFile(fileName, text)) {
+		qDebug() << "Could not read" << fileName;
+		return false;
+	}
+
+	peers.clear();
+	QHash<qint32, qint32> explicitNodes;
+	QStringList lines = text.split('\n');
+	for (int iLine = 0; iLine < lines.count(); iLine++) {
+		QString line = lines[iLine];
+		if (line.contains('#')) {
+			line = line.mid(0, line.indexOf('#'));
+		}
+		QStringList tokens = line.split(' ', QString::SkipEmptyParts);
+		if (tokens.isEmpty())
+			continue;
+		bool ok1 = false, ok2 = false;
+		if (tokens[0] == "partition" && tokens.count() == 4) {
+			int index = tokens[1].toInt(&ok1);
+			quint16 port = tokens[3].toUShort(&ok2);
+			if (ok1 && ok2 && index == peers.count()) {
+				PartitionPeer peer;
+				memset(&peer.address, 0, sizeof(peer.address));
+				peer.host = tokens[2];
+				peer.port = port;
+				peer.clockOffset = 0;
+				peer.clockRtt = ULLONG_MAX;
+				peer.numSyncSamples = 0;
+				peers.append(peer);
+				continue;
+			}
+		} else if (tokens[0] == "node" && tokens.count() == 3) {
+			int node = tokens[1].toInt(&ok1);
+			int partition = tokens[2].toInt(&ok2);
+			if (ok1 && ok2 && node >= 0 && node < netGraph->nodes.count() && partition >= 0) {
+				explicitNodes[node] = partition;
+				continue;
+			}
+		}
+		qDebug() << QString("%1:%2: bad line: %3").arg(fileName).arg(iLine + 1).arg(lines[iLine]);
+		return false;
+	}
+	if (localIndex < 0 || localIndex >= peers.count()) {
+		qDebug() << "Partition" << localIndex << "not defined in" << fileName;
+		return false;
+	}
+	local = localIndex;
+
+	nodePartition = partitionNodes(netGraph, peers.count());
+	foreach (qint32 node, explicitNodes.keys()) {
+		if (explicitNodes[node] >= peers.count()) {
+			qDebug() << "Bad partition for node" << node << "in" << fileName;
+			return false;
+		}
+		nodePartition[node] = explicitNodes[node];
+	}
+
+	cutEdge.fill(false, netGraph->edges.count());
+	numCutEdges = 0;
+	numShortCutEdges = 0;
+	for (int i = 0; i < netGraph->edges.count(); i++) {
+		const NetGraphEdge &e = netGraph->edges[i];
+		if (nodePartition[e.source] == local && nodePartition[e.dest] != local) {
+			cutEdge[i] = true;
+			numCutEdges++;
+			if (quint64(e.delay_ms * MSEC_TO_NSEC * timeDilation) < partitionLookahead) {
+				numShortCutEdges++;
+			}
+		}
+	}
+
+	int numLocalNodes = 0;
+	for (int i = 0; i < nodePartition.count(); i++) {
+		if (nodePartition[i] == local) {
+			numLocalNodes++;
+		}
+	}
+	printf("Partition %d of %d: %d nodes, %d cut edges (%d shorter than the lookahead of %s)\n",
+		   local, peers.count(), numLocalNodes, numCutEdges, numShortCutEdges,
+		   time2String(partitionLookahead).toLatin1().constData());
+	return true;
+}
+
+quint64 EmulationPartitioning::localDelay(qint32 edge, quint64 delay_ns) const
+{
+	if (local < 0 || !cutEdge[edge])
+		return delay_ns;
+	return delay_ns > partitionLookahead ? delay_ns - partitionLookahead : 0;
+}
+
+static bool resolvePeers()
+{
+	for (int i = 0; i < partitioning.peers.count(); i++) {
+		PartitionPeer &peer = partitioning.peers[i];
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		struct addrinfo *info = NULL;
+		if (getaddrinfo(peer.host.toLatin1().constData(), NULL, &hints, &info) != 0 || !info) {
+			fprintf(stderr, "Could not resolve partition %d host %s\n", i, peer.host.toLatin1().constData());
+			return false;
+		}
+		memcpy(&peer.address, info->ai_addr, sizeof(peer.address));
+		peer.address.sin_port = htons(peer.port);
+		freeaddrinfo(info);
+	}
+	return true;
+}
+
+static void sendSyncRequests(int fd)
+{
+	TunnelSyncMessage message;
+	message.header.magic = TUNNEL_MAGIC;
+	message.header.type = TunnelMessageSyncRequest;
+	message.header.partition = partitioning.local;
+	message.tsReply = 0;
+	for (int i = 0; i < partitioning.peers.count(); i++) {
+		if (i == partitioning.local)
+			continue;
+		message.tsRequest = get_current_time();
+		const PartitionPeer &peer = partitioning.peers[i];
+		sendto(fd, &message, sizeof(message), 0, (const struct sockaddr *)&peer.address, sizeof(peer.address));
+	}
+}
+
+static void handleSyncMessage(int fd, TunnelSyncMessage &message, quint64 ts_now)
+{
+	PartitionPeer &peer = partitioning.peers[message.header.partition];
+	if (message.header.type == TunnelMessageSyncRequest) {
+		message.header.type = TunnelMessageSyncReply;
+		message.header.partition = partitioning.local;
+		message.tsReply = ts_now;
+		sendto(fd, &message, sizeof(message), 0, (const struct sockaddr *)&peer.address, sizeof(peer.address));
+		return;
+	}
+	if (ts_now < message.tsRequest)
+		return;
+	quint64 rtt = ts_now - message.tsRequest;
+	qint64 offset = qint64(message.tsReply) - qint64(message.tsRequest + rtt / 2);
+	int slot = peer.numSyncSamples % 16;
+	peer.syncRtt[slot] = rtt;
+	peer.syncOffset[slot] = offset;
+	peer.numSyncSamples++;
+	// keep the offset measured with the smallest RTT among the recent samples
+	int best = 0;
+	for (int i = 1; i < qMin(peer.numSyncSamples, 16); i++) {
+		if (peer.syncRtt[i] < peer.syncRtt[best]) {
+			best = i;
+		}
+	}
+	peer.clockOffset = peer.syncOffset[best];
+	peer.clockRtt = peer.syncRtt[best];
+}
+
+static inline quint64 toLocalTime(quint64 ts, qint64 offset)
+{
+	return ts == 0 ? 0 : quint64(qint64(ts) - offset);
+}
+
+static void sendPacket(int fd, Packet *p, quint8 *buffer)
+{
+	TunnelPacketMessage *message = (TunnelPacketMessage *)buffer;
+	message->header.magic = TUNNEL_MAGIC;
+	message->header.type = TunnelMessagePacket;
+	message->header.partition = partitioning.local;
+	message->id = p->id;
+	message->ts_driver_rx = p->ts_driver_rx;
+	message->ts_userspace_rx = p->ts_userspace_rx;
+	message->ts_exit = p->ts_expected_exit;
+	message->theoretical_delay = p->theoretical_delay;
+	message->flowHash = p->flowHash;
+	message->src_ip = p->src_ip;
+	message->dst_ip = p->dst_ip;
+	message->src_id = p->src_id;
+	message->dst_id = p->dst_id;
+	message->path_id = p->path_id;
+	message->traffic_class = p->traffic_class;
+	message->length = p->length;
+	message->tcpSeqNum = p->tcpSeqNum;
+	message->tcpAckNum = p->tcpAckNum;
+	message->l4_src_port = p->l4_src_port;
+	message->l4_dst_port = p->l4_dst_port;
+	message->l4_protocol = p->l4_protocol;
+	message->tcpFlags = p->tcpFlags;
+	message->tcpReceiveWindow = p->tcpReceiveWindow;
+	message->tcpWindowScale = p->tcpWindowScale;
+	message->flags = (p->recorded ? TUNNEL_FLAG_RECORDED : 0) |
+					 (p->sampledForMeasurements ? TUNNEL_FLAG_SAMPLED : 0) |
+					 (p->ecn_bit_set ? TUNNEL_FLAG_ECN : 0);
+	message->traceLength = p->trace.count();
+	message->captureLength = qMin(p->length, p->bufferSize());
+	message->offsets = p->offsets;
+	quint8 *payload = buffer + sizeof(TunnelPacketMessage);
+	for (int i = 0; i < p->trace.count(); i++) {
+		memcpy(payload, &p->trace[i], sizeof(qint32));
+		payload += sizeof(qint32);
+	}
+	memcpy(payload, p->buffer, message->captureLength);
+	payload += message->captureLength;
+	if (payload - buffer > TUNNEL_MAX_DATAGRAM) {
+		// a super-packet too long for a UDP datagram together with its trace
+		numTunnelErrors++;
+		return;
+	}
+
+	const PartitionPeer &peer = partitioning.peers[partitioning.nodePartition[p->trace.last()]];
+	if (sendto(fd, buffer, payload - buffer, 0, (const struct sockaddr *)&peer.address, sizeof(peer.address)) < 0) {
+		numTunnelErrors++;
+		return;
+	}
+	numTunneledOut++;
+	bytesTunneledOut += p->length;
+}
+
+// Returns false if the message is malformed.
+static bool receivePacket(const quint8 *buffer, ssize_t size, Packet *p, quint64 ts_now)
+{
+	const TunnelPacketMessage *message = (const TunnelPacketMessage *)buffer;
+	if (size < ssize_t(sizeof(TunnelPacketMessage)) ||
+		size != ssize_t(sizeof(TunnelPacketMessage) + message->traceLength * sizeof(qint32) + message->captureLength) ||
+		message->captureLength > MAX_FRAME_SIZE ||
+		message->traceLength == 0 ||
+		message->header.partition >= partitioning.peers.count())
+		return false;
+	const qint64 offset = partitioning.peers[message->header.partition].clockOffset;
+
+	p->init();
+	p->id = message->id;
+	p->ts_driver_rx = toLocalTime(message->ts_driver_rx, offset);
+	p->ts_userspace_rx = toLocalTime(message->ts_userspace_rx, offset);
+	p->ts_expected_exit = toLocalTime(message->ts_exit, offset) + partitionLookahead;
+	p->theoretical_delay = message->theoretical_delay;
+	p->flowHash = message->flowHash;
+	p->src_ip = message->src_ip;
+	p->dst_ip = message->dst_ip;
+	p->src_id = message->src_id;
+	p->dst_id = message->dst_id;
+	p->path_id = message->path_id;
+	p->traffic_class = message->traffic_class;
+	p->length = message->length;
+	p->tcpSeqNum = message->tcpSeqNum;
+	p->tcpAckNum = message->tcpAckNum;
+	p->l4_src_port = message->l4_src_port;
+	p->l4_dst_port = message->l4_dst_port;
+	p->l4_protocol = message->l4_protocol;
+	p->tcpFlags = message->tcpFlags;
+	p->tcpReceiveWindow = message->tcpReceiveWindow;
+	p->tcpWindowScale = message->tcpWindowScale;
+	p->recorded = message->flags & TUNNEL_FLAG_RECORDED;
+	p->sampledForMeasurements = message->flags & TUNNEL_FLAG_SAMPLED;
+	p->ecn_bit_set = message->flags & TUNNEL_FLAG_ECN;
+	p->offsets = message->offsets;
+	const quint8 *payload = buffer + sizeof(TunnelPacketMessage);
+	for (int i = 0; i < message->traceLength; i++) {
+		qint32 node;
+		memcpy(&node, payload, sizeof(qint32));
+		p->trace.append(node);
+		payload += sizeof(qint32);
+	}
+	p->reserveBuffer(message->captureLength);
+	memcpy(p->buffer, payload, message->captureLength);
+	p->setSegmentation(emulatedMtu);
+	if (p->trace.last() < 0 || p->trace.last() >= partitioning.nodePartition.count() ||
+		partitioning.isRemoteNode(p->trace.last()))
+		return false;
+	// the last edge belongs to the sender, its stats must not be updated here
+	p->queue_id = -1;
+
+	if (p->ts_expected_exit >= ts_now) {
+		tunnelSlack.recordEvent(p->ts_expected_exit - ts_now);
+	} else {
+		tunnelSlack.recordEvent(0);
+		numTunnelLate++;
+	}
+	numTunneledIn++;
+	bytesTunneledIn += p->length;
+	return true;
+}
+
+void* tunnel_thread(void* )
+{
+	pthread_setname_np(pthread_self(), "line-tunnel");
+
+	u_int numCPU = sysconf(_SC_NPROCESSORS_ONLN);
+	u_long core_id = corePlacement.cpu(CoreTunnel);
+	if (bind2core(core_id) == 0) {
+		printf("Set thread tunnel affinity to core %lu/%u\n", core_id, numCPU);
+	} else {
+		printf("Failed to set thread tunnel affinity to core %lu/%u\n", core_id, numCPU);
+	}
+
+	numTunneledOut = 0;
+	numTunneledIn = 0;
+	bytesTunneledOut = 0;
+	bytesTunneledIn = 0;
+	numTunnelErrors = 0;
+	numTunnelAllocations = 0;
+	numTunnelLate = 0;
+
+	if (!resolvePeers())
+		return NULL;
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("tunnel socket");
+		return NULL;
+	}
+	int bufferSize = 8 << 20;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(partitioning.peers[partitioning.local].port);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		perror("tunnel socket bind");
+		close(fd);
+		return NULL;
+	}
+	printf("Tunnel for partition %d listening on UDP port %u\n", partitioning.local, partitioning.peers[partitioning.local].port);
+
+	// Packets sent to other partitions are recycled for the packets received from them, up to TUNNEL_POOL_SIZE
+	OVector<Packet*> pool;
+	pool.reserve(TUNNEL_POOL_SIZE);
+	for (int i = 0; i < TUNNEL_POOL_SIZE; i++) {
+		pool.append(new Packet());
+	}
+	OVector<Packet*> outgoing;
+	outgoing.reserve(10000);
+	OVector<Packet*> recycled;
+	recycled.reserve(10000);
+	quint8 buffer[sizeof(TunnelPacketMessage) + 64 * 1024];
+	quint64 tsNextSync = 0;
+
+	while (!do_shutdown) {
+		bool idle = true;
+		quint64 ts_now = get_current_time();
+
+		if (ts_now >= tsNextSync) {
+			sendSyncRequests(fd);
+			tsNextSync = ts_now + TUNNEL_SYNC_PERIOD;
+		}
+
+		tunnelOut.dequeueAll(outgoing);
+		for (int i = 0; i < outgoing.count(); i++) {
+			sendPacket(fd, outgoing[i], buffer);
+			if (pool.count() < TUNNEL_POOL_SIZE) {
+				pool.append(outgoing[i]);
+			} else {
+				recycled.append(outgoing[i]);
+			}
+		}
+		if (!recycled.isEmpty()) {
+			tunnelRecycled.enqueue(recycled);
+			recycled.clear();
+		}
+		idle = idle && outgoing.isEmpty();
+
+		for (int i = 0; i < 64; i++) {
+			ssize_t size = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+			if (size < 0)
+				break;
+			idle = false;
+			const TunnelMessageHeader *header = (const TunnelMessageHeader *)buffer;
+			if (size < ssize_t(sizeof(TunnelMessageHeader)) ||
+				header->magic != TUNNEL_MAGIC ||
+				header->partition >= partitioning.peers.count()) {
+				numTunnelErrors++;
+				continue;
+			}
+			ts_now = get_current_time();
+			if (header->type == TunnelMessagePacket) {
+				Packet *p;
+				if (!pool.isEmpty()) {
+					p = pool.takeLast();
+				} else {
+					p = new Packet();
+					numTunnelAllocations++;
+				}
+				if (receivePacket(buffer, size, p, ts_now)) {
+					tunnelIn.enqueue(p);
+				} else {
+					numTunnelErrors++;
+					pool.append(p);
+				}
+			} else if ((header->type == TunnelMessageSyncRequest || header->type == TunnelMessageSyncReply) &&
+					   size == sizeof(TunnelSyncMessage)) {
+				handleSyncMessage(fd, *(TunnelSyncMessage *)buffer, ts_now);
+			} else {
+				numTunnelErrors++;
+			}
+		}
+
+		if (idle && !TUNNEL_BUSY_WAITING) {
+			usleep(10);
+		}
+	}
+
+	close(fd);
+	for (int i = 0; i < pool.count(); i++) {
+		delete pool[i];
+	}
+	return NULL;
+}
+
+void print_tunnel_stats()
+{
+	printf("===== Tunnel stats ====\n");
+	printf("Partition: %d of %d\n", partitioning.local, partitioning.peers.count());
+	printf("Packets tunneled out: %s (%s B)\n", withCommas(numTunneledOut), withCommas(bytesTunneledOut));
+	printf("Packets tunneled in: %s (%s B)\n", withCommas(numTunneledIn), withCommas(bytesTunneledIn));
+	printf("Packets received after their due time (lookahead too small): %s\n", withCommas(numTunnelLate));
+	printf("Tunnel errors: %s\n", withCommas(numTunnelErrors));
+	printf("Tunnel packet allocations: %s\n", withCommas(numTunnelAllocations));
+	printf("Slack of the received packets (time until due):\n");
+	printf("%s\n", tunnelSlack.toString(&time2String).toLatin1().constData());
+	for (int i = 0; i < partitioning.peers.count(); i++) {
+		if (i == partitioning.local)
+			continue;
+		const PartitionPeer &peer = partitioning.peers[i];
+		printf("Partition %d (%s:%u): clock offset %lld ns, RTT %s, %d sync samples\n",
+			   i,
+			   peer.host.toLatin1().constData(),
+			   peer.port,
+			   peer.clockOffset,
+			   peer.numSyncSamples > 0 ? time2String(peer.clockRtt).toLatin1().constData() : "n/a",
+			   peer.numSyncSamples);
+	}
+}
+
+QString tunnel_stats_json()
+{
+	JsonObjectPrinter p;
+	p.addMember("partition", partitioning.local);
+	p.addMember("partitions", partitioning.peers.count());
+	jsonObjectPrinterAddMember(p, numTunneledOut);
+	jsonObjectPrinterAddMember(p, bytesTunneledOut);
+	jsonObjectPrinterAddMember(p, numTunneledIn);
+	jsonObjectPrinterAddMember(p, bytesTunneledIn);
+	jsonObjectPrinterAddMember(p, numTunnelLate);
+	jsonObjectPrinterAddMember(p, numTunnelErrors);
+	jsonObjectPrinterAddMember(p, numTunnelAllocations);
+	jsonObjectPrinterAddMember(p, tunnelSlack);
+	return p.json();
+}
@@ -0,0 +1,111 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef PDISTRIBUTED_H
+#define PDISTRIBUTED_H
+
+#include <QtCore>
+#include <netinet/in.h>
+
+#include "pconsumer.h"
+#include "../util/tinyhistogram.h"
+
+#define CORE_TUNNEL 4
+
+// Distributed emulation: the graph is partitioned across several line-router processes (on different machines, or
+// on the same machine for testing). Each node belongs to one partition; each edge is emulated by the partition of
+// its source node. When a packet exits an edge towards a node of another partition, it is tunneled over UDP to that
+// partition, together with its scheduled exit time, and routed from there on.
+//
+// To hide the tunnel latency, the propagation delay of the cut edges is shortened by partitionLookahead on the
+// sending side, and the receiving side holds the packet until its exit time plus partitionLookahead. As long as the
+// packet reaches the other partition within partitionLookahead, the emulated delay is exact. The clocks of the
+// partitions are synchronized by exchanging timestamps over the tunnel (NTP-like, minimum RTT filter).
+
+// Index of the local partition; -1 if the emulation is not distributed.
+// Set by the parameter --partition.
+extern qint32 partitionIndex;
+// The partition file (see EmulationPartitioning::load).
+// Set by the parameter --partitions.
+extern QString partitionsFilePath;
+// In nanoseconds. Set by the parameter --partition_lookahead, default 200 us.
+extern quint64 partitionLookahead;
+
+class PartitionPeer {
+public:
+	QString host;
+	quint16 port;
+	struct sockaddr_in address;
+	// Remote clock minus local clock, in nanoseconds
+	qint64 clockOffset;
+	// Round trip time of the sample used for clockOffset
+	quint64 clockRtt;
+	// Last clock sync samples (ring)
+	quint64 syncRtt[16];
+	qint64 syncOffset[16];
+	int numSyncSamples;
+};
+
+class EmulationPartitioning {
+public:
+	EmulationPartitioning();
+
+	// Reads the partition file. One entry per line ('#' starts a comment):
+	//   partition <index> <host> <UDP port>
+	//   node <node index> <partition index>
+	// The nodes that do not appear in "node" lines are assigned automatically (see partitionNodes()).
+	bool load(QString fileName, NetGraph *netGraph, qint32 localIndex);
+
+	// Splits the nodes into count connected-ish groups of equal size, in breadth-first order from node 0.
+	// Deterministic, so that all the partitions compute the same assignment.
+	static QVector<qint32> partitionNodes(NetGraph *netGraph, int count);
+
+	inline bool isRemoteNode(qint32 node) const {
+		return local >= 0 && nodePartition[node] != local;
+	}
+
+	// The propagation delay of an edge, shortened by the lookahead if the edge leads to another partition.
+	quint64 localDelay(qint32 edge, quint64 delay_ns) const;
+
+	qint32 local;
+	QVector<PartitionPeer> peers;
+	QVector<qint32> nodePartition;
+	// Edges from a local node to a remote node
+	QVector<bool> cutEdge;
+	int numCutEdges;
+	// Cut edges with a propagation delay shorter than the lookahead (the packets on them are late)
+	int numShortCutEdges;
+};
+
+extern EmulationPartitioning partitioning;
+
+// scheduler -> tunnel thread: packets that continue in another partition
+extern SyncQueueType<Packet*> tunnelOut;
+// tunnel thread -> scheduler: packets received from other partitions. Packet::ts_expected_exit is the local time
+// at which the packet must be routed (exit time + lookahead).
+extern SyncQueueType<Packet*> tunnelIn;
+// tunnel thread -> sender thread: packets sent to other partitions that the tunnel thread does not keep for
+// receiving. The sender returns them to packetPool, since it is the only thread that may fill it.
+extern SyncQueueType<Packet*> tunnelRecycled;
+
+void* tunnel_thread(void* );
+void print_tunnel_stats();
+// See consumer_stats_json()
+QString tunnel_stats_json();
+
+#endif // PDISTRIBUTED_H
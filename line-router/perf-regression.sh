@@ -0,0 +1,215 @@
+#!/bin/bash
+
+# Emulator performance regression suite.
+#
+# For each topology of the corpus (by default line-topologies-pristine): computes the routes with
+# line-runner --prepare-benchmark, then runs line-router-bench with a fixed synthetic workload.
+# The results are written as a tab-separated file (one line per topology) and compared with a baseline.
+#
+# Usage: perf-regression.sh [--corpus <dir>] [--output <file>] [--baseline <file>] [--save-baseline]
+#                           [--duration <ns>] [--threshold <metric>=<percent>]... [--alloc-guard]
+#
+# To measure the startup time and memory on the scalability graphs, generate them in the Benchmark tab of line-gui
+# (see mainwindow_scalability.cpp) into a directory, and run the suite on it with --corpus <dir> --save-baseline
+# --baseline <file>: the setup_ns and peak_memory_kB columns of the file hold the results, and the log shows the
+# size and build time of the route tables of each graph.
+#
+# With --alloc-guard, the benchmarks run with malloc_profile.so preloaded and --alloc_guard, so that any heap
+# allocation in the emulation loop after the warm-up is reported (with its call sites) and fails the suite.
+#
+# The binaries are taken from $LINE_RUNNER, $LINE_ROUTER_BENCH and $MALLOC_PROFILE if set.
+# Exit status: 0 if there is no regression, 1 if a metric regressed by more than its threshold, the emulation loop
+# allocated, or a topology of the baseline is missing from the results; 2 on errors (including any topology that
+# could not be prepared or benchmarked, and a missing or invalid baseline).
+#
+# The baseline depends on the machine, so none is shipped. Setup: on the reference machine, run the suite once with
+# --save-baseline, which writes the results to the baseline file (by default perf-baseline.tsv next to this
+# script). Without a baseline, the suite refuses to run.
+
+SCRIPT_DIR=$(cd "$(dirname "$0")" && pwd)
+LINE_RUNNER=${LINE_RUNNER:-$SCRIPT_DIR/../line-runner/line-runner}
+LINE_ROUTER_BENCH=${LINE_ROUTER_BENCH:-$SCRIPT_DIR/line-router-bench}
+MALLOC_PROFILE=${MALLOC_PROFILE:-/usr/lib/malloc_profile.so}
+
+CORPUS=$SCRIPT_DIR/../line-topologies-pristine
+OUTPUT=perf-results.tsv
+BASELINE=$SCRIPT_DIR/perf-baseline.tsv
+SAVE_BASELINE=0
+ALLOC_GUARD=0
+DURATION=5000000000
+# Maximum relative change (%) in the bad direction; packets_per_s is higher-is-better, the others lower-is-better
+THRESHOLDS="route_ns=20 setup_ns=20 peak_memory_kB=10 packets_per_s=5 cycles_per_packet=10 loop_p99_ns=25"
+
+# The fixed workload
+WORKLOAD="--rate 500000 --flows 1000 --sizes 64:7,576:4,1500:1 --poisson --warmup 1000000000 --seed 1"
+
+while [ $# -gt 0 ]
+do
+	case "$1" in
+		--corpus) CORPUS=$2; shift 2 ;;
+		--output) OUTPUT=$2; shift 2 ;;
+		--baseline) BASELINE=$2; shift 2 ;;
+		--save-baseline) SAVE_BASELINE=1; shift ;;
+		--duration) DURATION=$2; shift 2 ;;
+		--threshold) THRESHOLDS="$THRESHOLDS $2"; shift 2 ;;
+		--alloc-guard) ALLOC_GUARD=1; shift ;;
+		*) echo "Unknown argument: $1"; exit 2 ;;
+	esac
+done
+
+if [ $SAVE_BASELINE -eq 0 ] && [ ! -f "$BASELINE" ]
+then
+	echo "No baseline ($BASELINE). Run the suite with --save-baseline on the reference machine first."
+	exit 2
+fi
+
+WORK_DIR=$(mktemp -d)
+trap "rm -rf $WORK_DIR" EXIT
+
+BENCH_RESULTS=$WORK_DIR/bench.tsv
+rm -f "$OUTPUT"
+
+PRELOAD=
+GUARD_ARGS=
+if [ $ALLOC_GUARD -eq 1 ]
+then
+	# the guard is armed at the end of the benchmark warm-up
+	PRELOAD="LD_PRELOAD=$MALLOC_PROFILE"
+	GUARD_ARGS="--alloc_guard 1000000000"
+fi
+ALLOC_FAILURES=0
+FAILURES=0
+FAILED_TOPOLOGIES=
+
+for GRAPH in "$CORPUS"/*.graph
+do
+	NAME=$(basename "$GRAPH")
+	echo "===== $NAME"
+	"$LINE_RUNNER" --prepare-benchmark "$GRAPH" "$WORK_DIR/$NAME" > "$WORK_DIR/prepare.log" 2>&1
+	ROUTE_NS=$(grep 'Route computation time:' "$WORK_DIR/prepare.log" | awk '{ print $4 }')
+	if [ -z "$ROUTE_NS" ]
+	then
+		echo "Could not prepare $NAME:"
+		tail -n 5 "$WORK_DIR/prepare.log"
+		FAILURES=$((FAILURES + 1))
+		FAILED_TOPOLOGIES="$FAILED_TOPOLOGIES $NAME"
+		continue
+	fi
+	(cd "$WORK_DIR" && env $PRELOAD "$LINE_ROUTER_BENCH" "$WORK_DIR/$NAME" $WORKLOAD --duration $DURATION --results "$BENCH_RESULTS" $GUARD_ARGS) > "$WORK_DIR/bench.log" 2>&1
+	STATUS=$?
+	# the benchmark fails if the guard has seen heap operations; it has seen them if it could print its report (it
+	# fails without a report if nothing was audited)
+	ALLOCATED=0
+	if [ $ALLOC_GUARD -eq 1 ] && [ $STATUS -ne 0 ] &&
+		grep -q '^Heap operations in the [0-9]* emulation threads ' "$WORK_DIR/bench.log"
+	then
+		echo "ALLOCATIONS in the emulation loop for $NAME:"
+		sed -n '/^===== Allocation guard/,$p' "$WORK_DIR/bench.log"
+		ALLOCATED=1
+		ALLOC_FAILURES=$((ALLOC_FAILURES + 1))
+	fi
+	if [ $STATUS -ne 0 ] && [ $ALLOCATED -eq 0 ]
+	then
+		echo "Benchmark failed for $NAME:"
+		tail -n 5 "$WORK_DIR/bench.log"
+		FAILURES=$((FAILURES + 1))
+		FAILED_TOPOLOGIES="$FAILED_TOPOLOGIES $NAME"
+		continue
+	fi
+	if [ ! -f "$OUTPUT" ]
+	then
+		echo -e "$(head -n 1 "$BENCH_RESULTS")\troute_ns" > "$OUTPUT"
+	fi
+	echo -e "$(tail -n 1 "$BENCH_RESULTS")\t$ROUTE_NS" >> "$OUTPUT"
+	grep -e '^Route tables' -e '^Throughput' -e '^Cycles per packet' -e '^Non-idle loop time' -e '^Setup time' \
+		"$WORK_DIR/bench.log"
+done
+
+if [ ! -f "$OUTPUT" ]
+then
+	echo "No results."
+	exit 2
+fi
+
+if [ $ALLOC_FAILURES -gt 0 ]
+then
+	echo "$ALLOC_FAILURES topologies allocated memory in the emulation loop"
+fi
+if [ $FAILURES -gt 0 ]
+then
+	echo "$FAILURES topologies failed:$FAILED_TOPOLOGIES"
+fi
+
+if [ $SAVE_BASELINE -eq 1 ]
+then
+	if [ $FAILURES -gt 0 ]
+	then
+		echo "Not saving the baseline, since some topologies failed"
+		exit 2
+	fi
+	cp "$OUTPUT" "$BASELINE"
+	echo "Baseline saved to $BASELINE"
+	exit $((ALLOC_FAILURES > 0))
+fi
+
+echo "===== Comparison with $BASELINE"
+awk -F '\t' -v thresholds="$THRESHOLDS" '
+	BEGIN {
+		n = split(thresholds, items, " ")
+		for (i = 1; i <= n; i++) {
+			split(items[i], kv, "=")
+			limit[kv[1]] = kv[2]
+		}
+	}
+	# the baseline
+	FNR == 1 && NR == 1 { for (c = 1; c <= NF; c++) baseColumn[c] = $c; next }
+	NR == FNR {
+		baseTopology[$1] = 1
+		for (c = 2; c <= NF; c++) {
+			if (baseColumn[c] in limit && $c !~ /^[0-9]+(\.[0-9]+)?$/) {
+				printf("INVALID baseline %s %s: %s\n", $1, baseColumn[c], $c)
+				invalid++
+			}
+			base[$1, baseColumn[c]] = $c
+		}
+		next
+	}
+	# the current results
+	FNR == 1 { for (c = 1; c <= NF; c++) column[c] = $c; next }
+	{
+		seen[$1] = 1
+		if (!($1 in baseTopology))
+			printf("NEW %s: not in the baseline\n", $1)
+		for (c = 2; c <= NF; c++) {
+			metric = column[c]
+			if (!(metric in limit) || !(($1, metric) in base) || base[$1, metric] <= 0)
+				continue
+			change = ($c - base[$1, metric]) * 100.0 / base[$1, metric]
+			if (metric == "packets_per_s")
+				change = -change
+			if (change > limit[metric]) {
+				printf("REGRESSION %s %s: %s -> %s (%.1f%% worse, limit %s%%)\n", $1, metric, base[$1, metric], $c, change, limit[metric])
+				regressions++
+			}
+		}
+		compared++
+	}
+	END {
+		for (t in baseTopology) {
+			if (!(t in seen)) {
+				printf("MISSING %s: in the baseline, but no results\n", t)
+				missing++
+			}
+		}
+		printf("%d topologies compared, %d regressions, %d missing\n", compared, regressions, missing)
+		if (invalid > 0)
+			exit 2
+		exit (regressions > 0 || missing > 0)
+	}
+' "$BASELINE" "$OUTPUT"
+REGRESSIONS=$?
+if [ $FAILURES -gt 0 ] || [ $REGRESSIONS -eq 2 ]
+then
+	exit 2
+fi
+exit $((REGRESSIONS != 0 || ALLOC_FAILURES > 0))
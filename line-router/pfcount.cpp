@@ -23,6 +23,16 @@
 
 #include "pconsumer.h"
 #include "psender.h"
+#include "pcontrol.h"
+#include "pdistributed.h"
+#include "emulationimage.h"
+#include "fluidmodel.h"
+#include "accuracymonitor.h"
+#include "tenants.h"
+#include "coreplacement.h"
+#include "flowtable.h"
+#include "allocguard.h"
+#include "../util/json.h"
 
 #include <signal.h>
 #include <sched.h>
@@ -62,9 +72,11 @@
 #define DEFAULT_DEVICE     "eth0"
 
 int verbose = 0, num_threads = 1;
+// The last PF_RING stats read by print_stats() or the stats thread
 pfring_stat pfringStats;
 pthread_rwlock_t statsLock;
 pfring *pd;
+QString emulatorInterface;
 quint8 wait_for_packet; // 1 = blocking read, 0 = busy waiting
 quint8 dna_mode;
 quint8 do_shutdown;
@@ -81,6 +93,7 @@ quint64 intervalMeasurementsSamplingPeriod;
 SampledPathFlowEvents *sampledPathFlowEvents;
 bool flowTracking;
 TrafficTraceRecord *trafficTraceRecord;
+quint64 statsInterval;
 
 /* *************************************** */
 /*
@@ -126,6 +139,7 @@ void print_stats() {
 	deltaMillisec = delta_time(&endTime, &startTime);
 
 	if (pfring_stats(pd, &pfringStat) >= 0) {
+		pfringStats = pfringStat;
 		double thpt;
 		int i;
 		unsigned long long nBytes = 0, nPkts = 0;
@@ -182,6 +196,74 @@ void sigproc(int ) {
 
 /* ******************************** */
 
+// All the counters and histograms of the router, as a JSON object. Safe to call while the emulation runs, except for
+// the final stats that must be taken after the threads have finished (and after print_stats()).
+static QString router_stats_json(bool final)
+{
+	if (!final) {
+		pfring_stat pfringStat;
+		if (pfring_stats(pd, &pfringStat) >= 0) {
+			pfringStats = pfringStat;
+		}
+	}
+
+	JsonObjectPrinter capture;
+	capture.addMember("captureReceived", quint64(pfringStats.recv));
+	capture.addMember("captureDropped", quint64(pfringStats.drop));
+
+	JsonObjectPrinter p;
+	p.addMember("simulationId", simulationId);
+	p.addMember("final", final);
+	p.addMember("time", get_current_time() - simulationStartTime);
+	p.addMember("accuracyViolated", bool(accuracyViolated));
+	p.addRawMember("pfring", capture.json());
+	p.addRawMember("consumer", consumer_stats_json());
+	p.addRawMember("scheduler", scheduler_stats_json());
+	p.addRawMember("sender", sender_stats_json());
+	if (final && !controlSocketPath.isEmpty()) {
+		p.addRawMember("control", control_stats_json());
+	}
+	if (partitionIndex >= 0) {
+		p.addRawMember("tunnel", tunnel_stats_json());
+	}
+	return p.json();
+}
+
+// Writes the final stats to emulator-stats.json. With --stats_interval, the stats are also appended to
+// emulator-stats.jsonl, one object per line.
+static void save_router_stats(bool final)
+{
+	QString json = router_stats_json(final);
+	if (final) {
+		saveFile("emulator-stats.json", json + "\n");
+	}
+	if (statsInterval > 0) {
+		QFile file("emulator-stats.jsonl");
+		if (file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+			// the printer only breaks lines between members
+			file.write(json.replace(QRegExp("\n *"), " ").append("\n").toLatin1());
+		}
+	}
+}
+
+// Takes a stats snapshot every statsInterval nanoseconds. Not bound to a core: it sleeps most of the time.
+static void* stats_thread(void* )
+{
+	quint64 tsNext = get_current_time() + statsInterval;
+	while (!do_shutdown) {
+		quint64 ts_now = get_current_time();
+		if (ts_now >= tsNext) {
+			save_router_stats(false);
+			tsNext += statsInterval;
+		} else {
+			usleep(qMin(tsNext - ts_now, 100 * MSEC_TO_NSEC) / 1000);
+		}
+	}
+	return NULL;
+}
+
+/* ****************************************************** */
+
 void my_sigalarm(int ) {
 	//print_stats();
 	//alarm(ALARM_SLEEP);
@@ -452,6 +534,29 @@ int bind2core(u_int core_id) {
 
 /* *************************************** */
 
+// Each emulation thread calls this before its loop. Allocating blocks of the sizes used during the emulation (packet
+// metadata, the buffers of long frames, vectors of a few hundred items) and freeing them leaves them in the
+// thread cache of the allocator, so that the first allocations in the loop do not reach the central heap.
+void warmMallocCache()
+{
+	const int sizes[] = { 64, 256, 1024, 4096, 16384, int(sizeof(Packet)), MAX_FRAME_SIZE };
+	const int numSizes = sizeof(sizes) / sizeof(sizes[0]);
+	const int blocksPerSize = 64;
+	void *blocks[blocksPerSize];
+	for (int s = 0; s < numSizes; s++) {
+		for (int i = 0; i < blocksPerSize; i++) {
+			blocks[i] = malloc(sizes[s]);
+			// touch the memory, so that the pages are mapped too
+			memset(blocks[i], 0, sizes[s]);
+		}
+		for (int i = 0; i < blocksPerSize; i++) {
+			free(blocks[i]);
+		}
+	}
+}
+
+/* *************************************** */
+
 //void* packet_consumer_thread(void* _id) {
 //	long thread_id = (long)_id;
 //	u_int numCPU = sysconf( _SC_NPROCESSORS_ONLN );
@@ -524,6 +629,29 @@ int bind2core(u_int core_id) {
 //}
 
 quint64 estimatedDuration;
+quint64 flightRecorderThreshold;
+quint64 latenessThreshold;
+qreal latenessAbortFraction;
+int emulatedMtu;
+bool superPacketsEnabled;
+HostIdentification hostIdentification;
+
+int maxFrameLength()
+{
+	return superPacketsEnabled ? MAX_FRAME_SIZE : emulatedMtu + ETH_HLEN;
+}
+
+int maxWireLength()
+{
+	if (!superPacketsEnabled)
+		return maxFrameLength();
+	// Each segment after the first repeats the headers (see Packet::setSegmentation()): at most 8 bytes of
+	// Ethernet and VLAN headers beyond ETH_HLEN, 60 of IP and 60 of TCP, leaving at least emulatedMtu - 120 bytes
+	// of payload per segment.
+	const int maxHeaderLength = ETH_HLEN + 8 + 60 + 60;
+	const int maxSegments = MAX_FRAME_SIZE / qMax(1, emulatedMtu - 120) + 1;
+	return MAX_FRAME_SIZE + (maxSegments - 1) * maxHeaderLength;
+}
 
 int getInterfaceSpeedMbps(const char *interfaceName)
 {
@@ -548,6 +676,391 @@ int getInterfaceSpeedMbps(const char *interfaceName)
 /* *************************************** */
 QString simulationId;
 
+// Parses the arguments that follow the PF_RING ones: <graph file> <simulation ID> [--options...]
+void parseEmulatorArgs(int argc, char **argv, QString &graphFileName, quint64 &intervalSize)
+{
+	if (argc < 2) {
+		fprintf(stderr, "wrong args %s:%d\n", __FILE__, __LINE__);
+		qDebug() << __FILE__ << __LINE__;
+		exit(EXIT_FAILURE);
+	}
+	graphFileName = argv[0];
+	simulationId = argv[1];
+	argc--, argv++;
+	argc--, argv++;
+
+	estimatedDuration = 10 * 1000000000ULL;
+	intervalSize = 5 * 1000000000ULL;
+
+	recordedData = new RecordedData();
+	bufferBloatFactor = 1.0;
+	qosBufferScaling = QosBufferScalingNone;
+	gQueuingDiscipline = QueuingDisciplineDropTail;
+	flowTracking = false;
+	flowTableSize = 131072;
+	allocGuardWarmup = 0;
+	statsInterval = 0;
+	takePathIntervalMeasurements = false;
+	intervalMeasurementsSamplingPeriod = 0;
+	trafficTraceRecord = new TrafficTraceRecord();
+	initDoneFilePath = QString();
+	flightRecorderThreshold = 1 * MSEC_TO_NSEC;
+	latenessThreshold = 100 * USEC_TO_NSEC;
+	latenessAbortFraction = 0;
+	emulatedMtu = 1500;
+	superPacketsEnabled = false;
+	hostIdentification = HostIdentificationNat;
+	ecmpHashFunction = EcmpHashMurmur;
+	ecmpHashSeed = 0;
+	ecmpFlowletGap = 0;
+	eventsAtScheduledTime = true;
+	segmentCollapsing = false;
+	cutThroughEnabled = false;
+	timeDilation = 1.0;
+	controlSocketPath = QString();
+	emulationImagePath = QString();
+	fluidBackgroundPath = QString();
+	partitionIndex = -1;
+	partitionsFilePath = QString();
+	partitionLookahead = 200 * USEC_TO_NSEC;
+	emulatorInterface = REMOTE_DEDICATED_IF_ROUTER;
+
+	while (argc > 0) {
+		if (QString(argv[0]) == "--record") {
+			if (argc < 4) {
+				fprintf(stderr, "wrong args %s:%d\n", __FILE__, __LINE__);
+				qDebug() << __FILE__ << __LINE__;
+				exit(EXIT_FAILURE);
+			}
+			recordedData->recordPackets = true;
+			int recordPacketMaxCount = QString(argv[1]).toInt();
+			int recordPacketQueuedMaxCount = QString(argv[2]).toInt();
+			quint64 recordPacketSamplingPeriod = QString(argv[3]).toULongLong();
+			argc--, argv++;
+			argc--, argv++;
+			argc--, argv++;
+			argc--, argv++;
+			if (recordPacketMaxCount <= 0 || recordPacketQueuedMaxCount <= 0) {
+				fprintf(stderr, "wrong args %s:%d\n", __FILE__, __LINE__);
+				qDebug() << __FILE__ << __LINE__;
+				exit(EXIT_FAILURE);
+			}
+			recordedData->recordedPacketData.reserve(recordPacketMaxCount);
+			recordedData->recordedQueuedPacketData.reserve(recordPacketQueuedMaxCount);
+			recordedData->samplingPeriod = recordPacketSamplingPeriod;
+		} else if (QString(argv[0]) == "--take_path_interval_measurements") {
+			takePathIntervalMeasurements = true;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--interval_measurements_sampling_period") {
+			bool ok;
+			intervalMeasurementsSamplingPeriod = QString(argv[1]).toLongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--estimated_duration") {
+			bool ok;
+			estimatedDuration = QString(argv[1]).toLongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--interval_size") {
+			bool ok;
+			intervalSize = QString(argv[1]).toLongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--scale_buffers") {
+			bool ok;
+			bufferBloatFactor = QString(argv[1]).toDouble(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--track_flows") {
+			flowTracking = true;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--stats_interval") {
+			bool ok;
+			statsInterval = QString(argv[1]).toULongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--alloc_guard") {
+			bool ok;
+			allocGuardWarmup = QString(argv[1]).toULongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--flow_table_size") {
+			bool ok;
+			flowTableSize = QString(argv[1]).toInt(&ok);
+			Q_ASSERT_FORCE(ok && flowTableSize >= 0);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--qos_scale_buffers") {
+			if (QString(argv[1]) == "none") {
+				qosBufferScaling = QosBufferScalingNone;
+			} else if (QString(argv[1]) == "down") {
+				qosBufferScaling = QosBufferScalingDown;
+			} else if (QString(argv[1]) == "up") {
+				qosBufferScaling = QosBufferScalingUp;
+			} else {
+				Q_ASSERT_FORCE(false);
+			}
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--queuing_discipline") {
+			if (QString(argv[1]) == "drop-tail") {
+				gQueuingDiscipline = QueuingDisciplineDropTail;
+			} else if (QString(argv[1]) == "drop-head") {
+				gQueuingDiscipline = QueuingDisciplineDropHead;
+			} else if (QString(argv[1]) == "drop-rand") {
+				gQueuingDiscipline = QueuingDisciplineDropRand;
+			} else {
+				Q_ASSERT_FORCE(false);
+			}
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--ecmp_hash") {
+			if (QString(argv[1]) == "random") {
+				ecmpHashFunction = EcmpHashRandom;
+			} else if (QString(argv[1]) == "xor") {
+				ecmpHashFunction = EcmpHashXor;
+			} else if (QString(argv[1]) == "murmur") {
+				ecmpHashFunction = EcmpHashMurmur;
+			} else {
+				Q_ASSERT_FORCE(false);
+			}
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--ecmp_seed") {
+			bool ok;
+			ecmpHashSeed = QString(argv[1]).toULongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--ecmp_flowlet_gap") {
+			bool ok;
+			ecmpFlowletGap = QString(argv[1]).toULongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--time_dilation") {
+			bool ok;
+			timeDilation = QString(argv[1]).toDouble(&ok);
+			Q_ASSERT_FORCE(ok && timeDilation > 0);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--flight_recorder_threshold") {
+			bool ok;
+			flightRecorderThreshold = QString(argv[1]).toLongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--lateness_threshold") {
+			bool ok;
+			latenessThreshold = QString(argv[1]).toULongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--lateness_abort") {
+			bool ok;
+			latenessAbortFraction = QString(argv[1]).toDouble(&ok);
+			Q_ASSERT_FORCE(ok && latenessAbortFraction >= 0 && latenessAbortFraction <= 1);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--mtu") {
+			bool ok;
+			emulatedMtu = QString(argv[1]).toInt(&ok);
+			Q_ASSERT_FORCE(ok && emulatedMtu >= 576 && emulatedMtu + ETH_HLEN <= MAX_FRAME_SIZE);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--events_at_current_time") {
+			eventsAtScheduledTime = false;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--collapse_segments") {
+			segmentCollapsing = true;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--cut_through") {
+			cutThroughEnabled = true;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--super_packets") {
+			superPacketsEnabled = true;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--host_id") {
+			if (QString(argv[1]) == "nat") {
+				hostIdentification = HostIdentificationNat;
+			} else if (QString(argv[1]) == "vlan") {
+				hostIdentification = HostIdentificationVlan;
+			} else if (QString(argv[1]) == "mac") {
+				hostIdentification = HostIdentificationMac;
+			} else {
+				Q_ASSERT_FORCE(false);
+			}
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--cores") {
+			corePlacementMode = QString(argv[1]);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--steer_irqs") {
+			steerNicIrqs = true;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--control_socket") {
+			controlSocketPath = QString(argv[1]);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--fluid_background") {
+			// resolved now, since the working directory changes to the simulation directory
+			fluidBackgroundPath = QFileInfo(QString(argv[1])).absoluteFilePath();
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--emulation_image") {
+			// resolved now, since the working directory changes to the simulation directory
+			emulationImagePath = QFileInfo(QString(argv[1])).absoluteFilePath();
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--partition") {
+			bool ok;
+			partitionIndex = QString(argv[1]).toInt(&ok);
+			Q_ASSERT_FORCE(ok && partitionIndex >= 0);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--partitions") {
+			// resolved now, since the working directory changes to the simulation directory
+			partitionsFilePath = QFileInfo(QString(argv[1])).absoluteFilePath();
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--partition_lookahead") {
+			bool ok;
+			partitionLookahead = QString(argv[1]).toULongLong(&ok);
+			Q_ASSERT_FORCE(ok);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--interface") {
+			emulatorInterface = QString(argv[1]);
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--tenant") {
+			// resolved now, since the working directory changes to the simulation directory
+			tenants.addTenant(QFileInfo(QString(argv[1])).absoluteFilePath());
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--tenant_rate") {
+			// must follow the --tenant arguments; tenant 0 is the main graph
+			bool ok1, ok2;
+			int tenant = QString(argv[1]).toInt(&ok1);
+			qreal rate = QString(argv[2]).toDouble(&ok2);
+			Q_ASSERT_FORCE(ok1 && ok2 && tenant >= 0 && tenant < tenants.tenants.count() && rate >= 0);
+			tenants.tenants[tenant].maxRate_pps = rate;
+			argc--, argv++;
+			argc--, argv++;
+			argc--, argv++;
+		} else if (QString(argv[0]) == "--init_done_file_path") {
+			initDoneFilePath = QString(argv[1]);
+			argc--, argv++;
+			argc--, argv++;
+		} else {
+			qDebug() << "Could not parse arg" << QString(argv[0]);
+			Q_ASSERT_FORCE(false);
+		}
+	}
+
+	if (partitionIndex >= 0) {
+		if (partitionsFilePath.isEmpty()) {
+			fprintf(stderr, "--partition requires --partitions\n");
+			exit(EXIT_FAILURE);
+		}
+		// The partitions may run on the same machine, so each one saves its results separately
+		if (partitionIndex > 0) {
+			simulationId = QString("%1/partition-%2").arg(simulationId).arg(partitionIndex);
+		}
+	}
+}
+
+// Creates the simulation directory (which becomes the working directory), loads the topology and
+// initializes the measurements.
+void prepareExperiment(QString graphFileName, quint64 intervalSize)
+{
+	QDir dir(".");
+	dir.mkpath(simulationId);
+
+	// The graph is copied into the experiment directory, unless it is already there (offline mode from line-runner)
+	const QString graphBaseName = QFileInfo(graphFileName).fileName();
+	const QString graphCopyName = QString("%1/%2").arg(simulationId).arg(graphBaseName);
+	if (QFileInfo(graphFileName).canonicalFilePath() != QFileInfo(graphCopyName).canonicalFilePath()) {
+		QProcess cp;
+		cp.start("cp", QStringList() << QString("%1").arg(graphFileName) << graphCopyName);
+		if (!cp.waitForStarted()) {
+			fprintf(stderr, "Cannot run cp\n");
+			qDebug() << __FILE__ << __LINE__;
+			exit(EXIT_FAILURE);
+		}
+
+		if (!cp.waitForFinished(-1)){
+			fprintf(stderr, "Cannot run cp (wait)\n");
+			qDebug() << __FILE__ << __LINE__;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	QDir::setCurrent(QString("./%1").arg(simulationId));
+
+	loadTopology(graphBaseName);
+	if (tenants.isMultiTenant()) {
+		tenants.save("tenants.txt");
+		if (!tenants.saveHostAddresses(netGraph)) {
+			qDebug() << "Could not save the host addresses of the tenants";
+		}
+	}
+
+	sampledPathIntervalMeasurements = new ExperimentIntervalMeasurements();
+	quint64 tsStart = get_current_time();
+	sampledPathIntervalMeasurements->initialize(tsStart,
+												takePathIntervalMeasurements ? estimatedDuration : 1,
+												intervalSize,
+												netGraph->edges.count(),
+												netGraph->paths.count(),
+												netGraph->getSparseRoutingMatrixTransposed(),
+												1400);
+
+	rawPathIntervalMeasurements = new ExperimentIntervalMeasurements();
+	rawPathIntervalMeasurements->initialize(tsStart,
+											takePathIntervalMeasurements ? estimatedDuration : 1,
+											intervalSize,
+											netGraph->edges.count(),
+											netGraph->paths.count(),
+											netGraph->getSparseRoutingMatrixTransposed(),
+											1400);
+
+	sampledPathFlowEvents = new SampledPathFlowEvents();
+	sampledPathFlowEvents->initialize(netGraph->paths.count());
+	flowTable.init(flowTracking ? flowTableSize : 0, sampledPathFlowEvents);
+}
+
+// Saves the measurements to the working directory.
+void saveExperimentResults()
+{
+	// save recorded data
+	recordedData->save("recorded.line-rec");
+	delete recordedData;
+
+    // save the interval measurements
+    sampledPathIntervalMeasurements->save("interval-measurements.data");
+    delete sampledPathIntervalMeasurements;
+
+	rawPathIntervalMeasurements->save("raw-interval-measurements.data");
+    delete rawPathIntervalMeasurements;
+
+	// save sampledPathFlowEvents
+	flowTable.flush();
+	sampledPathFlowEvents->save("sampled-path-flows.data");
+	delete sampledPathFlowEvents;
+
+    // save recorded packet injection data
+    trafficTraceRecord->save("injection.data");
+    delete trafficTraceRecord;
+}
+
 int runPacketFilter(int argc, char **argv) {
 	char *device = NULL, buf[32];
 	u_char mac_address[6];
@@ -671,7 +1184,6 @@ int runPacketFilter(int argc, char **argv) {
 #endif
 
 	//if (device == NULL) device = (char*)DEFAULT_DEVICE;
-	device = (char*) REMOTE_DEDICATED_IF_ROUTER;
 	if (num_threads > MAX_NUM_THREADS) num_threads = MAX_NUM_THREADS;
 
 	if (num_threads > 0)
@@ -682,6 +1194,15 @@ int runPacketFilter(int argc, char **argv) {
 		pfring_config(cpu_percentage);
 	}
 
+	QString graphFileName;
+	quint64 intervalSize;
+	argc--, argv++;
+	parseEmulatorArgs(argc, argv, graphFileName, intervalSize);
+	QByteArray deviceName = emulatorInterface.toLatin1();
+	device = deviceName.data();
+	// Frames must not be truncated: jumbo frames and super-packets need a longer capture length
+	snaplen = qMax(snaplen, maxFrameLength());
+
 	pd = pfring_open(device,
 					 snaplen,
 					 PF_RING_LONG_HEADER |
@@ -806,162 +1327,9 @@ int runPacketFilter(int argc, char **argv) {
 	pthread_t sender_thread;
 	pthread_create(&sender_thread, NULL, packet_sender_thread, NULL);
 
-	QString graphFileName;
-	argc--, argv++;
-	if (argc < 2) {
-		fprintf(stderr, "wrong args %s:%d\n", __FILE__, __LINE__);
-		qDebug() << __FILE__ << __LINE__;
-		exit(EXIT_FAILURE);
-	}
-	graphFileName = argv[0];
-	simulationId = argv[1];
-	argc--, argv++;
-	argc--, argv++;
-
-	estimatedDuration = 10 * 1000000000ULL;
-	quint64 intervalSize = 5 * 1000000000ULL;
-
-	recordedData = new RecordedData();
-	bufferBloatFactor = 1.0;
-	qosBufferScaling = QosBufferScalingNone;
-	gQueuingDiscipline = QueuingDisciplineDropTail;
-	flowTracking = false;
-	takePathIntervalMeasurements = false;
-	intervalMeasurementsSamplingPeriod = 0;
-	trafficTraceRecord = new TrafficTraceRecord();
-	initDoneFilePath = QString();
-
-	while (argc > 0) {
-		if (QString(argv[0]) == "--record") {
-			if (argc < 4) {
-				fprintf(stderr, "wrong args %s:%d\n", __FILE__, __LINE__);
-				qDebug() << __FILE__ << __LINE__;
-				exit(EXIT_FAILURE);
-			}
-			recordedData->recordPackets = true;
-			int recordPacketMaxCount = QString(argv[1]).toInt();
-			int recordPacketQueuedMaxCount = QString(argv[2]).toInt();
-			quint64 recordPacketSamplingPeriod = QString(argv[3]).toULongLong();
-			argc--, argv++;
-			argc--, argv++;
-			argc--, argv++;
-			argc--, argv++;
-			if (recordPacketMaxCount <= 0 || recordPacketQueuedMaxCount <= 0) {
-				fprintf(stderr, "wrong args %s:%d\n", __FILE__, __LINE__);
-				qDebug() << __FILE__ << __LINE__;
-				exit(EXIT_FAILURE);
-			}
-			recordedData->recordedPacketData.reserve(recordPacketMaxCount);
-			recordedData->recordedQueuedPacketData.reserve(recordPacketQueuedMaxCount);
-			recordedData->samplingPeriod = recordPacketSamplingPeriod;
-		} else if (QString(argv[0]) == "--take_path_interval_measurements") {
-			takePathIntervalMeasurements = true;
-			argc--, argv++;
-		} else if (QString(argv[0]) == "--interval_measurements_sampling_period") {
-			bool ok;
-			intervalMeasurementsSamplingPeriod = QString(argv[1]).toLongLong(&ok);
-			Q_ASSERT_FORCE(ok);
-			argc--, argv++;
-			argc--, argv++;
-		} else if (QString(argv[0]) == "--estimated_duration") {
-			bool ok;
-			estimatedDuration = QString(argv[1]).toLongLong(&ok);
-			Q_ASSERT_FORCE(ok);
-			argc--, argv++;
-			argc--, argv++;
-		} else if (QString(argv[0]) == "--interval_size") {
-			bool ok;
-			intervalSize = QString(argv[1]).toLongLong(&ok);
-			Q_ASSERT_FORCE(ok);
-			argc--, argv++;
-			argc--, argv++;
-		} else if (QString(argv[0]) == "--scale_buffers") {
-			bool ok;
-			bufferBloatFactor = QString(argv[1]).toDouble(&ok);
-			Q_ASSERT_FORCE(ok);
-			argc--, argv++;
-			argc--, argv++;
-		} else if (QString(argv[0]) == "--track_flows") {
-			flowTracking = true;
-			argc--, argv++;
-		} else if (QString(argv[0]) == "--qos_scale_buffers") {
-			if (QString(argv[1]) == "none") {
-				qosBufferScaling = QosBufferScalingNone;
-			} else if (QString(argv[1]) == "down") {
-				qosBufferScaling = QosBufferScalingDown;
-			} else if (QString(argv[1]) == "up") {
-				qosBufferScaling = QosBufferScalingUp;
-			} else {
-				Q_ASSERT_FORCE(false);
-			}
-			argc--, argv++;
-			argc--, argv++;
-		} else if (QString(argv[0]) == "--queuing_discipline") {
-			if (QString(argv[1]) == "drop-tail") {
-				gQueuingDiscipline = QueuingDisciplineDropTail;
-			} else if (QString(argv[1]) == "drop-head") {
-				gQueuingDiscipline = QueuingDisciplineDropHead;
-			} else if (QString(argv[1]) == "drop-rand") {
-				gQueuingDiscipline = QueuingDisciplineDropRand;
-			} else {
-				Q_ASSERT_FORCE(false);
-			}
-			argc--, argv++;
-			argc--, argv++;
-		} else if (QString(argv[0]) == "--init_done_file_path") {
-			initDoneFilePath = QString(argv[1]);
-			argc--, argv++;
-			argc--, argv++;
-		} else {
-			qDebug() << "Could not parse arg" << QString(argv[0]);
-			Q_ASSERT_FORCE(false);
-		}
-	}
-
-	QDir dir(".");
-	dir.mkpath(simulationId);
-
-	{
-		QProcess cp;
-		cp.start("cp", QStringList() << QString("%1").arg(graphFileName) << QString("%1/%2").arg(simulationId).arg(graphFileName));
-		if (!cp.waitForStarted()) {
-			fprintf(stderr, "Cannot run cp\n");
-			qDebug() << __FILE__ << __LINE__;
-			exit(EXIT_FAILURE);
-		}
-
-		if (!cp.waitForFinished(-1)){
-			fprintf(stderr, "Cannot run cp (wait)\n");
-			qDebug() << __FILE__ << __LINE__;
-			exit(EXIT_FAILURE);
-		}
-	}
-
-	QDir::setCurrent(QString("./%1").arg(simulationId));
-
-	loadTopology(graphFileName);
-
-	sampledPathIntervalMeasurements = new ExperimentIntervalMeasurements();
-	quint64 tsStart = get_current_time();
-	sampledPathIntervalMeasurements->initialize(tsStart,
-												takePathIntervalMeasurements ? estimatedDuration : 1,
-												intervalSize,
-												netGraph->edges.count(),
-												netGraph->paths.count(),
-												netGraph->getSparseRoutingMatrixTransposed(),
-												1400);
-
-	rawPathIntervalMeasurements = new ExperimentIntervalMeasurements();
-	rawPathIntervalMeasurements->initialize(tsStart,
-											takePathIntervalMeasurements ? estimatedDuration : 1,
-											intervalSize,
-											netGraph->edges.count(),
-											netGraph->paths.count(),
-											netGraph->getSparseRoutingMatrixTransposed(),
-											1400);
-
-	sampledPathFlowEvents = new SampledPathFlowEvents();
-	sampledPathFlowEvents->initialize(netGraph->paths.count());
+	prepareExperiment(graphFileName, intervalSize);
+	// The threads bind to their cores after barrierInit, so the sender thread picks this up too
+	setupCorePlacement(emulatorInterface);
 
 	// Preallocate the packet pool
 	qint64 numPackets = 0;
@@ -974,44 +1342,82 @@ int runPacketFilter(int argc, char **argv) {
 	}
 	packetsIn.init(numPackets);
 	packetsOut.init(numPackets);
+	linkUpdatesIn.init(1000);
+	linkUpdatesDone.init(1000);
+	tunnelOut.init(numPackets);
+	tunnelIn.init(numPackets);
+	tunnelRecycled.init(numPackets);
 
 	__sync_synchronize();
 
 	pthread_t scheduler_thread;
 	pthread_create(&scheduler_thread, NULL, packet_scheduler_thread, NULL);
 
+	pthread_t control_thread_handle;
+	if (!controlSocketPath.isEmpty()) {
+		pthread_create(&control_thread_handle, NULL, control_thread, NULL);
+	}
+
+	pthread_t tunnel_thread_handle;
+	if (partitionIndex >= 0) {
+		pthread_create(&tunnel_thread_handle, NULL, tunnel_thread, NULL);
+	}
+
+	pthread_t stats_thread_handle;
+	if (statsInterval > 0) {
+		QFile::remove("emulator-stats.jsonl");
+		pthread_create(&stats_thread_handle, NULL, stats_thread, NULL);
+	}
+
 	packet_consumer_thread(NULL);
+	if (statsInterval > 0) {
+		// it uses pd
+		pthread_join(stats_thread_handle, NULL);
+	}
 	print_stats();
 	pfring_close(pd);
 
 	pthread_join(scheduler_thread, NULL);
 	pthread_join(sender_thread, NULL);
+	if (!controlSocketPath.isEmpty()) {
+		pthread_join(control_thread_handle, NULL);
+	}
+	if (partitionIndex >= 0) {
+		pthread_join(tunnel_thread_handle, NULL);
+	}
 
 	__sync_synchronize();
 
 	print_consumer_stats();
 	print_scheduler_stats();
 	print_sender_stats();
+	if (!controlSocketPath.isEmpty()) {
+		print_control_stats();
+	}
+	if (partitionIndex >= 0) {
+		print_tunnel_stats();
+	}
 	fprintf(stdout, "=========================\n\n");
+	save_router_stats(true);
+	for (int i = 0; tenants.isMultiTenant() && i < tenants.tenants.count(); i++) {
+		saveFile(TenantSet::outputDir(i) + "/stats.txt", scheduler_tenant_stats(i) + sender_tenant_stats(i));
+	}
 
-	// save recorded data
-	recordedData->save("recorded.line-rec");
-	delete recordedData;
-
-    // save the interval measurements
-    sampledPathIntervalMeasurements->save("interval-measurements.data");
-    delete sampledPathIntervalMeasurements;
-
-	rawPathIntervalMeasurements->save("raw-interval-measurements.data");
-    delete rawPathIntervalMeasurements;
-
-	// save sampledPathFlowEvents
-	sampledPathFlowEvents->save("sampled-path-flows.data");
-	delete sampledPathFlowEvents;
-
-    // save recorded packet injection data
-    trafficTraceRecord->save("injection.data");
-    delete trafficTraceRecord;
+	saveExperimentResults();
+
+	int result = 0;
+	if (accuracyViolated) {
+		// Marks the results as invalid, for the post-processing tools
+		saveFile("accuracy-violation.txt",
+				 QString("Aborted: more than %1% of the packets of a path were late by more than %2 ns\n")
+				 .arg(latenessAbortFraction * 100.0)
+				 .arg(latenessThreshold));
+		fprintf(stdout, "Emulation aborted: accuracy limit exceeded (see the lateness stats)\n");
+		result = EXIT_FAILURE;
+	}
+	if (!allocGuardReport()) {
+		result = EXIT_FAILURE;
+	}
 
 	OVector<Packet*> packets;
 	packetPool.dequeueAll(packets);
@@ -1021,5 +1427,5 @@ int runPacketFilter(int argc, char **argv) {
 	}
 	packets.clear();
 
-	return 0;
+	return result;
 }
@@ -52,12 +52,25 @@
 #include "pconsumer.h"
 #include "psender.h"
 #include "qpairingheap.h"
+#include "emulationimage.h"
+#include "fluidmodel.h"
 #include "bitarray.h"
 #include "../util/ovector.h"
 #include "../util/util.h"
 #include "../tomo/tomodata.h"
 #include "../util/tinyhistogram.h"
 #include "compresseddevice.h"
+#include "flightrecorder.h"
+#include "traceinjector.h"
+#include "pcontrol.h"
+#include "pdistributed.h"
+#include "flowtable.h"
+#include "allocguard.h"
+#include "../util/json.h"
+#include "accuracymonitor.h"
+#include "tenants.h"
+#include "coreplacement.h"
+#include "psimulator.h"
 
 /// topology stuff
 
@@ -76,6 +89,14 @@ QosBufferScaling qosBufferScaling;
 
 QueuingDiscipline gQueuingDiscipline;
 
+EcmpHashFunction ecmpHashFunction;
+quint64 ecmpHashSeed;
+quint64 ecmpFlowletGap;
+bool eventsAtScheduledTime;
+bool segmentCollapsing;
+bool cutThroughEnabled;
+qreal timeDilation;
+
 // 1 means no bloat, 2 means double buffers, etc
 // recommended 1 if you want to see some congestion
 // Set by the parameter --scale_buffers, default: 1.0
@@ -89,10 +110,14 @@ qreal bufferBloatFactor;
 
 NetGraph *netGraph;
 
+static TraceInjector traceInjector;
+
+static void revokeCutThrough(Packet *p, qint32 edgeIndex, quint64 ts_now);
+
 void NetGraphEdge::prepareEmulation(int npaths)
 {
 	this->npaths = npaths;
-	rate_Bps = 1000.0 * bandwidth;
+	rate_Bps = 1000.0 * bandwidth / timeDilation;
 	lossRate_int = (int) (RAND_MAX * lossBernoulli);
 	queueLength = bufferBloatFactor * queueLength;
 	qcapacity = queueLength * ETH_FRAME_LEN;
@@ -192,37 +217,137 @@ void NetGraphEdge::postEmulation()
 	qSort(timelineSampled.begin(), timelineSampled.end(), compareEdgeTimelineItem);
 }
 
-NetGraphEdgeQueue::NetGraphEdgeQueue()
-{
-}
-
-NetGraphEdgeQueue::NetGraphEdgeQueue(const NetGraphEdge &edge, qint32 index)
+qreal NetGraphEdge::queueWeight(qint32 index) const
 {
-	edgeIndex = edge.index;
-	queueIndex = index;
-
-	delay_ms = edge.delay_ms;
-	lossBernoulli = edge.lossBernoulli;
-	qreal weight = 1.0;
-	if (edge.queueWeights.count() == edge.queueCount) {
+	if (queueWeights.count() == queueCount) {
 		qreal sum = 0;
 		{
-			foreach (qreal item, edge.queueWeights) {
+			foreach (qreal item, queueWeights) {
 				sum += item;
 			}
 			if (sum >= 1.001) {
 				qDebug() << __FILE__ << __LINE__ << "Sum of queue weights higher than 1.0:" << sum;
 			}
 		}
-		weight = edge.queueWeights[index] / qMax(1.0, sum);
+		return queueWeights[index] / qMax(1.0, sum);
 	} else {
-		if (edge.queueCount > 1) {
+		if (queueCount > 1) {
 			qDebug() << __FILE__ << __LINE__ << __FUNCTION__ <<
 						"Using default queuing weigths for non-neutral link" <<
-						(edge.index + 1);
+						(this->index + 1);
+		}
+		return 1.0 / queueCount;
+	}
+}
+
+qreal NetGraphEdge::policerWeight(qint32 index) const
+{
+	if (policerWeights.count() == policerCount) {
+		{
+			qreal sum = 0;
+			foreach (qreal item, policerWeights) {
+				sum += item;
+			}
+			if (sum >= 1.001) {
+				qDebug() << __FILE__ << __LINE__ << "Sum of token bucket weights higher than 1.0:" << sum;
+			}
+		}
+		return policerWeights[index];
+	} else {
+		if (policerCount > 1) {
+			qDebug() << __FILE__ << __LINE__ << __FUNCTION__ <<
+						"Using default policing weigths for non-neutral link" <<
+						(this->index + 1);
+		}
+		return 1.0 / queueCount;
+	}
+}
+
+void NetGraphEdge::reconfigure(const LinkUpdate &update, quint64 ts_now)
+{
+	if (update.bandwidth > 0) {
+		bandwidth = update.bandwidth;
+		rate_Bps = 1000.0 * bandwidth / timeDilation;
+	}
+	if (update.delay_ms >= 0) {
+		delay_ms = update.delay_ms;
+	}
+	if (update.lossBernoulli >= 0) {
+		lossBernoulli = update.lossBernoulli;
+		lossRate_int = (int) (RAND_MAX * lossBernoulli);
+	}
+	if (update.queueLength > 0) {
+		queueLength = bufferBloatFactor * update.queueLength;
+		qcapacity = queueLength * ETH_FRAME_LEN;
+	}
+	for (int f = 0; f < policers.count(); f++) {
+		policers[f].reconfigure(*this, ts_now);
+	}
+	for (int q = 0; q < queues.count(); q++) {
+		queues[q].reconfigure(*this, ts_now);
+	}
+}
+
+NetGraphEdgeQueue::NetGraphEdgeQueue()
+{
+	cutThroughPacket = nullptr;
+	cutThroughUntil = 0;
+}
+
+void NetGraphEdgeQueue::advance(quint64 ts_now)
+{
+	if (ts_now <= qts_head)
+		return;
+	quint64 delta_t = ts_now - qts_head;
+	// how many bytes were transmitted during delta_t
+	quint64 delta_B = (delta_t * rate_Bps) / SEC_TO_NSEC;
+	if (fluidRate_Bps == 0) {
+		qload -= qMin(delta_B, qload);
+	} else {
+		// Both rates are constant during delta_t, so the fluid queue grows or shrinks linearly
+		quint64 fluid_B = (delta_t * fluidRate_Bps) / SEC_TO_NSEC;
+		fluidBytesIn += fluid_B;
+		quint64 load = qload + fluid_B;
+		load = load > delta_B ? load - delta_B : 0;
+		if (load > qcapacity) {
+			fluidBytesDropped += load - qcapacity;
+			load = qcapacity;
 		}
-		weight = 1.0 / edge.queueCount;
+		qload = load;
+	}
+	qts_head = ts_now;
+}
+
+void NetGraphEdgeQueue::reconfigure(const NetGraphEdge &edge, quint64 ts_now)
+{
+	// Account for the bytes transmitted until now at the old rate
+	if (qload > 0 || fluidRate_Bps > 0) {
+		advance(ts_now);
 	}
+	// The packets already in the queue keep their exit times
+	qreal weight = edge.queueWeight(queueIndex);
+	delay_ms = edge.delay_ms;
+	fullDelay_ns = quint64(delay_ms * MSEC_TO_NSEC * timeDilation);
+	delay_ns = partitioning.localDelay(edgeIndex, fullDelay_ns);
+	lossBernoulli = edge.lossBernoulli;
+	lossRate_int = edge.lossRate_int;
+	queueLength = edge.queueLength * weight;
+	// can be lower than qload; enqueue() drops the arrivals until the queue drains below it
+	qcapacity = queueLength * ETH_FRAME_LEN;
+	bandwidth = edge.bandwidth * weight;
+	rate_Bps = edge.rate_Bps * weight;
+}
+
+NetGraphEdgeQueue::NetGraphEdgeQueue(const NetGraphEdge &edge, qint32 index)
+{
+	edgeIndex = edge.index;
+	queueIndex = index;
+
+	delay_ms = edge.delay_ms;
+	fullDelay_ns = quint64(delay_ms * MSEC_TO_NSEC * timeDilation);
+	delay_ns = partitioning.localDelay(edgeIndex, fullDelay_ns);
+	lossBernoulli = edge.lossBernoulli;
+	qreal weight = edge.queueWeight(index);
 	queueLength = edge.queueLength;
 #if 0
 	if (qosBufferScaling == QosBufferScalingNone) {
@@ -254,6 +379,11 @@ NetGraphEdgeQueue::NetGraphEdgeQueue(const NetGraphEdge &edge, qint32 index)
 
 	qload = 0;
 	qts_head = 0;
+	cutThroughPacket = nullptr;
+	cutThroughUntil = 0;
+	fluidRate_Bps = 0;
+	fluidBytesIn = 0;
+	fluidBytesDropped = 0;
 
 	packets_in = 0;
 	bytes = 0;
@@ -318,6 +448,12 @@ void NetGraph::prepareEmulation()
 {
 	assignPorts();
 
+	// Must be done before creating the queues, which depend on it for the cut edges
+	if (partitionIndex >= 0 && !partitioning.load(partitionsFilePath, this, partitionIndex)) {
+		qDebug() << "Could not load the partitions" << partitionsFilePath;
+		exit(-1);
+	}
+
 	// An extra path is used for recording dummy statistics for injected traffic
 
 	for (int i = 0; i < edges.count(); i++) {
@@ -338,38 +474,301 @@ void NetGraph::prepareEmulation()
 		pathCache.insert(QPair<qint32,qint32>(paths[i].source, paths[i].dest), i);
 	}
 
-	destID2Index.resize(nodes.count());
-	QList<NetGraphNode> hosts = getHostNodes();
-	for (int i = 0; i < hosts.count(); i++) {
-		destID2Index[hosts[i].index] = i;
+	// The route tables and the trace packet counts are taken from the emulation image, if there is a valid one
+	EmulationImage image;
+	bool imageLoaded = !emulationImagePath.isEmpty() && image.load(emulationImagePath, this);
+
+	if (!imageLoaded) {
+		destID2Index.resize(nodes.count());
+		QList<NetGraphNode> hosts = getHostNodes();
+		for (int i = 0; i < hosts.count(); i++) {
+			destID2Index[hosts[i].index] = i;
+		}
+
+		prepareRouteTables();
 	}
 
-	loadBalancedRouteCache.clear();
+	// The traces are streamed during the emulation, not loaded in memory
+	traceInjector.setTimeDilation(timeDilation);
+	if (!traceInjector.open(trafficTraces, image.tracePacketCounts)) {
+		qDebug() << "Could not open pcap file";
+		exit(-1);
+	}
+
+	if (!emulationImagePath.isEmpty() && !imageLoaded) {
+		image.tracePacketCounts = traceInjector.tracePacketCounts;
+		if (!image.save(emulationImagePath, this)) {
+			qDebug() << "Could not save the emulation image" << emulationImagePath;
+		}
+	}
+
+	if (!fluidBackgroundPath.isEmpty() && !fluidModel.load(fluidBackgroundPath, this)) {
+		qDebug() << "Could not load the fluid background traffic" << fluidBackgroundPath;
+		exit(-1);
+	} else if (fluidBackgroundPath.isEmpty()) {
+		fluidModel = FluidModel();
+	}
+
+	for (int i = 0; i < edges.count(); i++) {
+		edges[i].hasExtraTraffic = false;
+	}
+	for (int i = 0; i < fluidModel.changes.count(); i++) {
+		edges[fluidModel.changes[i].edge].hasExtraTraffic = true;
+	}
+	for (int i = 0; i < trafficTraces.count(); i++) {
+		edges[trafficTraces[i].link].hasExtraTraffic = true;
+	}
+
+	// Must be done after loading the fluid traffic and building the route tables
+	collapseSegments();
+
+	if (cutThroughEnabled && (recordedData->recordPackets || !controlSocketPath.isEmpty())) {
+		printf("Cut-through: disabled, %s\n", recordedData->recordPackets ? "packet recording needs every hop" :
+																		  "links can be reconfigured during the emulation");
+		cutThroughEnabled = false;
+	}
+}
+
+// Segment collapsing statistics
+static qint32 numCollapsedSegments;
+static qint32 numCollapsedEdges;
+
+// The shortest frame on the wire (shorter frames are padded).
+#define COLLAPSE_MIN_FRAME_LENGTH 60
+
+// Returns true if the edge has no state that the emulation must track packet by packet, so that it can be crossed
+// as part of another hop.
+static bool isCollapsibleEdge(const NetGraphEdge &e)
+{
+	return e.queueCount == 1 &&
+			!e.hasPolicing &&
+			e.lossBernoulli == 0 &&
+			!e.recordSampledTimeline &&
+			!e.recordFullTimeline &&
+			!e.hasExtraTraffic &&
+			!partitioning.isRemoteNode(e.dest);
+}
+
+// Returns true if the edge e, following the chain head and the edges already collapsed behind it, can never queue.
+// The packets leave the head at least Lmin/r0 apart (the transmission time of the second one at the rate r0 of the
+// head). On each store-and-forward hop j of rate R_j, a frame of Lmin bytes behind a frame of Lmax bytes gains
+// (Lmax - Lmin)/R_j on it, so it reaches hop k after the long frame has left if:
+//   sum_{j<k} (Lmax - Lmin)/R_j + Lmax/R_k <= Lmin/r0
+// gain: the sum over the previous collapsed hops, in seconds; updated if e can be collapsed.
+static bool isUncongestibleEdge(const NetGraphEdge &e, const NetGraphEdge &head, qreal &gain)
+{
+	const qreal minLength = COLLAPSE_MIN_FRAME_LENGTH;
+	const qreal maxLength = maxWireLength();
+	if (e.rate_Bps <= 0 || head.rate_Bps <= 0)
+		return false;
+	if (gain + maxLength / e.rate_Bps > minLength / head.rate_Bps)
+		return false;
+	gain += (maxLength - minLength) / e.rate_Bps;
+	return true;
+}
+
+void NetGraph::collapseSegments()
+{
+	numCollapsedSegments = 0;
+	numCollapsedEdges = 0;
+	for (int i = 0; i < edges.count(); i++) {
+		edges[i].collapsedEdges.clear();
+	}
+	if (!segmentCollapsing)
+		return;
+	if (recordedData->recordPackets) {
+		printf("Segment collapsing: disabled, packet recording needs every hop\n");
+		return;
+	}
+	if (!controlSocketPath.isEmpty()) {
+		printf("Segment collapsing: disabled, links can be reconfigured during the emulation\n");
+		return;
+	}
+
+	// Relay nodes have two neighbors, are not hosts and route every destination to one of their neighbors,
+	// so the packets arriving from one neighbor always leave towards the other.
+	// relayNext[e]: the edge taken by all the packets leaving e, if e.dest is a relay node; otherwise -1.
+	QVector<qint32> relayNext(edges.count(), -1);
+	QVector<qint32> inDegree(nodes.count(), 0);
+	for (int i = 0; i < edges.count(); i++) {
+		inDegree[edges[i].dest]++;
+	}
+	for (int i = 0; i < edges.count(); i++) {
+		const qint32 v = edges[i].dest;
+		if (nodes[v].nodeType == NETGRAPH_NODE_HOST || partitioning.isRemoteNode(v))
+			continue;
+		if (nodePorts[v].count() != 2 || inDegree[v] != 2)
+			continue;
+		const OVector<quint32> &routeTable = routeTables[routeTableIndex[v]];
+		bool routesEverything = true;
+		for (int d = 0; d < routeTable.count(); d++) {
+			if (routeTable[d] == NO_ROUTE || (routeTable[d] & LOAD_BALANCED_ROUTE_MASK)) {
+				routesEverything = false;
+				break;
+			}
+		}
+		if (!routesEverything)
+			continue;
+		for (int port = 0; port < 2; port++) {
+			const NetGraphEdge &out = edges[nodePorts[v][port]];
+			if (out.dest != edges[i].source) {
+				relayNext[i] = out.index;
+			}
+		}
+	}
+
+	for (int i = 0; i < edges.count(); i++) {
+		NetGraphEdge &e = edges[i];
+		if (partitioning.isRemoteNode(e.source) || partitioning.isRemoteNode(e.dest))
+			continue;
+		// the head must send its packets one at a time, and only those routed by the emulator
+		if (e.queueCount != 1 || e.hasExtraTraffic)
+			continue;
+		qreal gain = 0;
+		qint32 next = relayNext[i];
+		while (next >= 0 && next != i && e.collapsedEdges.count() < edges.count() &&
+			   isCollapsibleEdge(edges[next]) &&
+			   isUncongestibleEdge(edges[next], e, gain)) {
+			e.collapsedEdges.append(next);
+			next = relayNext[next];
+		}
+		if (!e.collapsedEdges.isEmpty()) {
+			numCollapsedSegments++;
+			numCollapsedEdges += e.collapsedEdges.count();
+		}
+	}
+	printf("Segment collapsing: %d edges crossed as part of %d other edges\n", numCollapsedEdges, numCollapsedSegments);
+}
+
+// The time a packet spends on a collapsed edge: transmission (there is no queuing) and propagation.
+static inline quint64 collapsedEdgeDelay(const NetGraphEdge &e, const Packet *p)
+{
+	const NetGraphEdgeQueue &q = e.queues[0];
+	return (quint64(p->wireLength) * SEC_TO_NSEC) / q.rate_Bps + q.delay_ns;
+}
 
-	routeCache.clear();
-	routeCache.resize(nodes.count());
-	for (int n = 0; n < nodes.count(); n++) {
-		routeCache[n].resize(hosts.count());
+// The routing table of a single node, computed by RouteTableBuilder.
+class RouteTableJob {
+public:
+	qint32 node;
+	// same encoding as NetGraph::routeTables, but the load balanced entries index loadBalanced
+	QVector<quint32> table;
+	QList<QVector<qint32> > loadBalanced;
+};
+
+class RouteTableBuilder {
+public:
+	typedef void result_type;
+
+	RouteTableBuilder(NetGraph *netGraph, const QList<NetGraphNode> &hosts)
+		: netGraph(netGraph), hosts(hosts) {}
+
+	// Only reads from netGraph, so it can be run in parallel.
+	void operator()(RouteTableJob &job) {
+		const qint32 n = job.node;
+		const OVector<qint32> &ports = netGraph->nodePorts[n];
+		job.table.resize(hosts.count());
+		job.loadBalanced.clear();
 		for (int i = 0; i < hosts.count(); i++) {
-			int h = hosts[i].index;
-			QList<int> nextHops = getNextHop(n, h);
-			if (nextHops.isEmpty()) {
-				routeCache[n][i] = NO_ROUTE;
-			} else if (nextHops.count() == 1) {
-				routeCache[n][i] = nextHops.first();
+			QList<int> nextHops = netGraph->getNextHop(n, hosts[i].index);
+			QVector<qint32> nextPorts;
+			foreach (int nextHop, nextHops) {
+				for (int port = 0; port < ports.count(); port++) {
+					if (netGraph->edges[ports[port]].dest == nextHop) {
+						nextPorts << port;
+						break;
+					}
+				}
+			}
+			if (nextPorts.isEmpty()) {
+				job.table[i] = NO_ROUTE;
+			} else if (nextPorts.count() == 1) {
+				job.table[i] = nextPorts.first();
 			} else {
-				routeCache[n][i] = LOAD_BALANCED_ROUTE_MASK | loadBalancedRouteCache.count();
-				loadBalancedRouteCache.append(nextHops.toVector());
+				job.table[i] = LOAD_BALANCED_ROUTE_MASK | job.loadBalanced.count();
+				job.loadBalanced.append(nextPorts);
 			}
 		}
+		// A packet is never routed at its destination, so a host's own entry can be anything.
+		// Copy a neighbouring entry so that hosts with the same uplink end up with identical tables.
+		if (netGraph->nodes[n].nodeType == NETGRAPH_NODE_HOST && hosts.count() > 1) {
+			quint32 self = netGraph->destID2Index[n];
+			job.table[self] = job.table[self == 0 ? 1 : 0];
+		}
+	}
+
+protected:
+	NetGraph *netGraph;
+	const QList<NetGraphNode> &hosts;
+};
+
+void NetGraph::prepareRouteTables()
+{
+	quint64 tsStart = get_current_time();
+
+	nodePorts.clear();
+	nodePorts.resize(nodes.count());
+	for (int i = 0; i < edges.count(); i++) {
+		nodePorts[edges[i].source].append(i);
 	}
 
-	for (int iTrace = 0; iTrace < trafficTraces.count(); iTrace++) {
-		if (!trafficTraces[iTrace].loadFromPcap()) {
-			qDebug() << "Could not open pcap file";
-			exit(-1);
+	QList<NetGraphNode> hosts = getHostNodes();
+
+	routeTableIndex.clear();
+	routeTableIndex.resize(nodes.count());
+	routeTables.clear();
+	loadBalancedRouteCache.clear();
+
+	// Tables are deduplicated by content
+	QHash<QByteArray, quint32> uniqueTables;
+	QHash<QByteArray, quint32> uniqueLoadBalanced;
+
+	// Compute the tables in batches, so that we never hold the full dense table in memory
+	const int batchSize = 1024;
+	RouteTableBuilder builder(this, hosts);
+	for (int batchStart = 0; batchStart < nodes.count(); batchStart += batchSize) {
+		QList<RouteTableJob> jobs;
+		for (int n = batchStart; n < qMin(batchStart + batchSize, nodes.count()); n++) {
+			RouteTableJob job;
+			job.node = n;
+			jobs << job;
+		}
+		QtConcurrent::blockingMap(jobs, builder);
+
+		for (int iJob = 0; iJob < jobs.count(); iJob++) {
+			RouteTableJob &job = jobs[iJob];
+			// Replace the job-local load balancing indices with global ones
+			for (int i = 0; i < job.table.count(); i++) {
+				if (job.table[i] != NO_ROUTE && (job.table[i] & LOAD_BALANCED_ROUTE_MASK)) {
+					const QVector<qint32> &nextPorts = job.loadBalanced[job.table[i] & LOAD_BALANCED_VALUE_MASK];
+					QByteArray key((const char*)nextPorts.constData(), nextPorts.count() * sizeof(qint32));
+					if (!uniqueLoadBalanced.contains(key)) {
+						uniqueLoadBalanced.insert(key, loadBalancedRouteCache.count());
+						loadBalancedRouteCache.append(OVector<qint32>(nextPorts));
+					}
+					job.table[i] = LOAD_BALANCED_ROUTE_MASK | uniqueLoadBalanced[key];
+				}
+			}
+			QByteArray key((const char*)job.table.constData(), job.table.count() * sizeof(quint32));
+			if (!uniqueTables.contains(key)) {
+				uniqueTables.insert(key, routeTables.count());
+				routeTables.append(OVector<quint32>(job.table));
+			}
+			routeTableIndex[job.node] = uniqueTables[key];
 		}
 	}
+
+	quint64 memory = routeTableIndex.count() * sizeof(quint32) +
+					 quint64(routeTables.count()) * hosts.count() * sizeof(quint32);
+	quint64 memoryDense = quint64(nodes.count()) * hosts.count() * sizeof(quint32);
+	printf("Route tables: %d nodes, %d hosts, %d unique tables, %d load balancing sets, %s B (dense: %s B), built in %s\n",
+		   nodes.count(),
+		   hosts.count(),
+		   routeTables.count(),
+		   loadBalancedRouteCache.count(),
+		   withCommas(memory),
+		   withCommas(memoryDense),
+		   time2String(get_current_time() - tsStart).toLatin1().constData());
 }
 
 void loadTopology(QString graphFileName)
@@ -377,6 +776,10 @@ void loadTopology(QString graphFileName)
 	netGraph = new NetGraph();
 	netGraph->setFileName(graphFileName);
 	netGraph->loadFromFile();
+	// appends the graphs of the other tenants, if any
+	if (!tenants.load(netGraph)) {
+		exit(-1);
+	}
 	netGraph->prepareEmulation();
 }
 
@@ -400,26 +803,7 @@ TokenBucket::TokenBucket(const NetGraphEdge &edge, qint32 index)
 
 	policerIndex = index;
 
-	qreal weight = 1.0;
-	if (edge.policerWeights.count() == edge.policerCount) {
-		{
-			qreal sum = 0;
-			foreach (qreal item, edge.policerWeights) {
-				sum += item;
-			}
-			if (sum >= 1.001) {
-				qDebug() << __FILE__ << __LINE__ << "Sum of token bucket weights higher than 1.0:" << sum;
-			}
-		}
-		weight = edge.policerWeights[index];
-	} else {
-		if (edge.policerCount > 1) {
-			qDebug() << __FILE__ << __LINE__ << __FUNCTION__ <<
-						"Using default policing weigths for non-neutral link" <<
-						(edge.index + 1);
-		}
-		weight = 1.0 / edge.queueCount;
-	}
+	qreal weight = edge.policerWeight(index);
 	capacity = ETH_FRAME_LEN * edge.queueLength;
 
 #if 0
@@ -435,7 +819,7 @@ TokenBucket::TokenBucket(const NetGraphEdge &edge, qint32 index)
 	}
 #endif
 
-	fillRate = (edge.bandwidth / qreal(MSEC_TO_NSEC)) * weight;
+	fillRate = (edge.bandwidth / qreal(MSEC_TO_NSEC) / timeDilation) * weight;
 
 	currentLevel = capacity;
 
@@ -444,6 +828,17 @@ TokenBucket::TokenBucket(const NetGraphEdge &edge, qint32 index)
 	drops_perpath.resize(edge.npaths);
 }
 
+void TokenBucket::reconfigure(const NetGraphEdge &edge, quint64 ts_now)
+{
+	// Account for the tokens accumulated until now at the old rate
+	if (tsLastUpdate > 0 && ts_now >= tsLastUpdate) {
+		update(ts_now);
+	}
+	capacity = ETH_FRAME_LEN * edge.queueLength;
+	fillRate = (edge.bandwidth / qreal(MSEC_TO_NSEC) / timeDilation) * edge.policerWeight(policerIndex);
+	currentLevel = qMin(currentLevel, capacity);
+}
+
 void TokenBucket::init(quint64 ts_now)
 {
 	currentLevel = capacity;
@@ -474,22 +869,22 @@ bool TokenBucket::filter(Packet *p, quint64 ts_now, bool forcePass)
 	update(ts_now);
 #endif
 
-	packets_in++;
-	bytes += p->length;
+	packets_in += p->segments;
+	bytes += p->wireLength;
 
-	packets_in_perpath[p->path_id]++;
-	bytes_in_perpath[p->path_id] += p->length;
+	packets_in_perpath[p->path_id] += p->segments;
+	bytes_in_perpath[p->path_id] += p->wireLength;
 
 #if POLICING_ENABLED
 	if (forcePass)
 		return true;
 	// Check if the packet passes
-	if (currentLevel >= p->length) {
-		currentLevel -= p->length;
+	if (currentLevel >= p->wireLength) {
+		currentLevel -= p->wireLength;
 		return true;
 	} else {
-		drops++;
-		drops_perpath[p->path_id]++;
+		drops += p->segments;
+		drops_perpath[p->path_id] += p->segments;
 		return false;
 	}
 #else
@@ -526,21 +921,20 @@ bool NetGraphEdgeQueue::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 	bool droppedOther = false;
 
 	// update the link ingress stats
-	packets_in++;
-	packets_in_perpath[p->path_id]++;
-	bytes += p->length;
-	bytes_in_perpath[p->path_id] += p->length;
+	packets_in += p->segments;
+	packets_in_perpath[p->path_id] += p->segments;
+	bytes += p->wireLength;
+	bytes_in_perpath[p->path_id] += p->wireLength;
 
 	Q_ASSERT_FORCE(ts_now >= qts_head);
 
-	// update the queue
-	if (qload > 0) {
-		quint64 delta_t = ts_now - qts_head;
-		// how many bytes were transmitted during delta_t
-		quint64 delta_B = (delta_t * rate_Bps) / SEC_TO_NSEC;
-		delta_B = qMin(delta_B, qload);
-		qload -= delta_B;
+	// A packet cutting through the link might have to be transmitted first
+	if (cutThroughPacket != nullptr && ts_now < cutThroughUntil) {
+		revokeCutThrough(cutThroughPacket, edgeIndex, ts_now);
 	}
+
+	// update the queue
+	advance(ts_now);
 	while (!queued_packets.isEmpty()) {
 		quint64 ts_expected_exit = queued_packets.first().ts_exit;
 		if (ts_expected_exit <= ts_now) {
@@ -558,8 +952,8 @@ bool NetGraphEdgeQueue::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 	// random drop?
 	randomVal = rand();
 	if (lossRate_int > 0 && randomVal < lossRate_int) {
-		rdrops++;
-		rdrops_perpath[p->path_id]++;
+		rdrops += p->segments;
+		rdrops_perpath[p->path_id] += p->segments;
 		if (DEBUG_PACKETS)
 			printf("Link: Drop: %d.%d.%d.%d -> %d.%d.%d.%d: lossRate_int = %d, randomVal = %d\n",
 				   NIPQUAD(p->src_ip),
@@ -572,18 +966,22 @@ bool NetGraphEdgeQueue::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 		goto stats;
 	}
 
-	// queue drop?
-	if (qcapacity - qload < (quint64) p->length) {
+	// queue drop? After a reconfiguration that shrinks the queue (see reconfigure()), qload can exceed qcapacity;
+	// the queue is full until it drains below the new capacity, and dropping another packet does not make room.
+	if (qload > qcapacity || qcapacity - qload < (quint64) p->wireLength) {
+		const bool overfull = qload > qcapacity;
 		bool kept = false;
-		if (queuingDiscipline == QueuingDisciplineDropHead && queued_packets.count() > 1) {
+		if (overfull) {
+			// tail drop
+		} else if (queuingDiscipline == QueuingDisciplineDropHead && queued_packets.count() > 1) {
 			for (int i = 1; i < qMin(3, queued_packets.count()); i++) {
 				Packet *p_front = queued_packets[i].packet;
 				p_front->dropped = true;
 				p_front->ts_send = ts_now;
 				asyncDrains.append(p_front);
-				qload -= p_front->length;
-				qdrops++;
-				qdrops_perpath[p_front->path_id]++;
+				qload -= p_front->wireLength;
+				qdrops += p_front->segments;
+				qdrops_perpath[p_front->path_id] += p_front->segments;
 				if (DEBUG_PACKETS)
 					printf("Link: Drop: %d.%d.%d.%d -> %d.%d.%d.%d: plen = %d, qload = %llu, qcap = %llu\n",
 						   NIPQUAD(p_front->src_ip),
@@ -603,9 +1001,9 @@ bool NetGraphEdgeQueue::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 				p_front->dropped = true;
 				p_front->ts_send = ts_now;
 				asyncDrains.append(p_front);
-				qload -= p_front->length;
-				qdrops++;
-				qdrops_perpath[p_front->path_id]++;
+				qload -= p_front->wireLength;
+				qdrops += p_front->segments;
+				qdrops_perpath[p_front->path_id] += p_front->segments;
 				if (DEBUG_PACKETS)
 					printf("Link: Drop: %d.%d.%d.%d -> %d.%d.%d.%d: plen = %d, qload = %llu, qcap = %llu\n",
 						   NIPQUAD(p_front->src_ip),
@@ -620,8 +1018,8 @@ bool NetGraphEdgeQueue::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 			}
 		}
 		if (!kept) {
-			qdrops++;
-			qdrops_perpath[p->path_id]++;
+			qdrops += p->segments;
+			qdrops_perpath[p->path_id] += p->segments;
 			if (DEBUG_PACKETS)
 				printf("Link: Drop: %d.%d.%d.%d -> %d.%d.%d.%d: plen = %d, qload = %llu, qcap = %llu\n",
 					   NIPQUAD(p->src_ip),
@@ -640,7 +1038,7 @@ bool NetGraphEdgeQueue::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 	}
 
 	// we are enqueuing this packet
-	qload += p->length;
+	qload += p->wireLength;
 
 	// add transmission delay
 	qdelay = (qload * SEC_TO_NSEC) / rate_Bps;
@@ -652,11 +1050,21 @@ bool NetGraphEdgeQueue::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 		printf("Queuing delay: %s ns\n", withCommas(qdelay));
 	}
 
-	// add propagation delay
-	ts_exit += delay_ms * MSEC_TO_NSEC;
+	// add propagation delay; the injected packets end on the link, so on a cut edge they are not tunneled and the
+	// lookahead is not taken out of their delay
+	const quint64 propagationDelay = p->injected ? fullDelay_ns : delay_ns;
+	ts_exit += propagationDelay;
 
 	if (DEBUG_PACKETS) {
-		printf("Propagation delay: %s ns\n", withCommas(delay_ms * MSEC_TO_NSEC));
+		printf("Propagation delay: %s ns\n", withCommas(propagationDelay));
+	}
+
+	// add the collapsed segment that follows the link
+	if (!p->injected) {
+		const OVector<qint32> &collapsedEdges = netGraph->edges[edgeIndex].collapsedEdges;
+		for (int i = 0; i < collapsedEdges.count(); i++) {
+			ts_exit += collapsedEdgeDelay(netGraph->edges[collapsedEdges[i]], p);
+		}
 	}
 
 	p->theoretical_delay += ts_exit - ts_now;
@@ -728,15 +1136,15 @@ stats:
 			current.queue_sampled = qload;
 		}
 		// we're in the same time bracket, update the last item
-		timelineSampled.last().arrivals_p++;
-		timelineSampled.last().arrivals_B += p->length;
+		timelineSampled.last().arrivals_p += p->segments;
+		timelineSampled.last().arrivals_B += p->wireLength;
 		if (decision == DECISION_QDROP || droppedOther) {
-			timelineSampled.last().qdrops_p++;
-			timelineSampled.last().qdrops_B += p->length;
+			timelineSampled.last().qdrops_p += p->segments;
+			timelineSampled.last().qdrops_B += p->wireLength;
 		}
 		if (decision == DECISION_RDROP) {
-			timelineSampled.last().rdrops_p++;
-			timelineSampled.last().rdrops_B += p->length;
+			timelineSampled.last().rdrops_p += p->segments;
+			timelineSampled.last().rdrops_B += p->wireLength;
 		}
 		timelineSampled.last().queue_avg += qload;
 		timelineSampled.last().queue_max = qMax(timelineSampled.last().queue_max, qload);
@@ -759,7 +1167,8 @@ stats:
 		}
 	}
 
-	Q_ASSERT_FORCE(qload <= qcapacity);
+	// a queue that has been shrunk can be over capacity, but never accepts a packet that way
+	Q_ASSERT_FORCE(qload <= qcapacity || decision != DECISION_QUEUE);
 
 	// return true if queued, false if dropped
 	return (decision == DECISION_QUEUE);
@@ -819,9 +1228,9 @@ bool NetGraphEdge::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 				// For disciplines that produce async drops (such as random-drop or drop-head), we cannot track the delayed drops
 				// (i.e. the order of the events will be wrong, although the counters will be correct).
 				PathPair dummy;
-				sampledPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, queued, !queued ? 0 : p->ts_expected_exit - p->ts_enqueue);
+				sampledPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, queued, !queued ? 0 : p->ts_expected_exit - p->ts_enqueue, p->segments);
 				if (!queued) {
-					sampledPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, queued, 0);
+					sampledPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, queued, 0, p->segments);
 				}
 			}
 			// We always take raw measurements
@@ -831,11 +1240,11 @@ bool NetGraphEdge::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 				// For disciplines that produce async drops (such as random-drop or drop-head), we cannot track the delayed drops
 				// (i.e. the order of the events will be wrong, although the counters will be correct).
 				PathPair dummy;
-				rawPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, queued, !queued ? 0 : p->ts_expected_exit - p->ts_enqueue);
+				rawPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, queued, !queued ? 0 : p->ts_expected_exit - p->ts_enqueue, p->segments);
 				if (!queued) {
-					rawPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, queued, 0);
+					rawPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, queued, 0, p->segments);
 					if (flowTracking) {
-						sampledPathFlowEvents->handlePacket(p, ts_now);
+						flowTable.handlePacket(p, ts_now);
 					}
 				}
 			}
@@ -856,11 +1265,11 @@ bool NetGraphEdge::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 			current.queue_sampled = overallQload;
 		}
 		// we're in the same time bracket, update the last item
-		timelineSampled.last().arrivals_p++;
-		timelineSampled.last().arrivals_B += p->length;
+		timelineSampled.last().arrivals_p += p->segments;
+		timelineSampled.last().arrivals_B += p->wireLength;
 		if (!queued) {
-			timelineSampled.last().qdrops_p++;
-			timelineSampled.last().qdrops_B += p->length;
+			timelineSampled.last().qdrops_p += p->segments;
+			timelineSampled.last().qdrops_B += p->wireLength;
 		}
 		timelineSampled.last().queue_avg += overallQload;
 		timelineSampled.last().queue_max = qMax(timelineSampled.last().queue_max, overallQload);
@@ -880,12 +1289,270 @@ bool NetGraphEdge::enqueue(Packet *p, quint64 ts_now, quint64 &ts_exit)
 	return queued;
 }
 
-#define PKT_QUEUED    0
-#define PKT_DROPPED   1
-#define PKT_FORWARDED 2
-
 #define BYPASS_QUEUES 0
 #define BYPASS_SCHEDULER 0
+
+// Cycles spent choosing the next hop of load balanced routes
+static TinyHistogram ecmpSelectionCycles;
+static quint64 numFlowlets;
+
+class FlowletEntry {
+public:
+	// Flow hash, 0 = empty
+	quint64 key;
+	// Time when the last packet of the flow has been routed
+	quint64 tsLast;
+	// Index in the load balancing set
+	qint32 port;
+	// Incremented for each new flowlet of the flow
+	quint32 flowletId;
+};
+
+// Indexed by the flow hash. Collisions simply replace the older flow.
+#define FLOWLET_TABLE_SIZE (1 << 16)
+static OVector<FlowletEntry> flowletTable;
+
+void initFlowletTable()
+{
+	numFlowlets = 0;
+	flowletTable.clear();
+	if (ecmpFlowletGap > 0) {
+		flowletTable.resize(FLOWLET_TABLE_SIZE);
+		for (int i = 0; i < flowletTable.count(); i++) {
+			memset(&flowletTable[i], 0, sizeof(FlowletEntry));
+		}
+	}
+}
+
+static inline quint64 ecmpFlowHash(const Packet *p, qint32 node)
+{
+	if (ecmpHashFunction == EcmpHashXor) {
+		quint32 h = quint32(p->flowHash) ^ quint32(ecmpHashSeed) ^ quint32(node);
+		h ^= h >> 16;
+		h ^= h >> 8;
+		return h;
+	}
+	quint64 ports = (quint64(node) << 40) | (quint64(p->l4_protocol) << 32) |
+					(quint64(p->l4_src_port) << 16) | quint64(p->l4_dst_port);
+	return ecmpMix64(p->flowHash ^ ports);
+}
+
+// Returns an index in the load balancing set ports.
+static inline qint32 selectLoadBalancedPort(const Packet *p, qint32 node, const OVector<qint32> &ports, quint64 ts_now)
+{
+	if (ecmpHashFunction == EcmpHashRandom) {
+		return rand() % ports.count();
+	}
+	quint64 hash = ecmpFlowHash(p, node);
+	if (ecmpFlowletGap == 0) {
+		return hash % ports.count();
+	}
+	// 0 marks empty entries
+	hash |= 1;
+	FlowletEntry &flowlet = flowletTable[hash & (FLOWLET_TABLE_SIZE - 1)];
+	if (flowlet.key != hash) {
+		flowlet.key = hash;
+		flowlet.flowletId = 0;
+		flowlet.port = ecmpMix64(hash) % ports.count();
+		numFlowlets++;
+	} else if (ts_now - flowlet.tsLast >= ecmpFlowletGap) {
+		flowlet.flowletId++;
+		flowlet.port = ecmpMix64(hash ^ flowlet.flowletId) % ports.count();
+		numFlowlets++;
+	}
+	flowlet.tsLast = ts_now;
+	return flowlet.port;
+}
+// Cut-through: a packet routed onto a run of idle links crosses all of them in one step, instead of being queued
+// and routed again after each hop. Each link of the run is reserved until the packet finishes transmitting on it;
+// a packet arriving on a reserved link before that revokes the cut-through from that link on, and the cut-through
+// packet continues hop by hop from where it would have been at that time.
+static QBinaryHeap<Packet*, quint64> cutThroughExits(1024, false);
+quint64 numCutThroughPackets;
+quint64 numCutThroughHops;
+quint64 numCutThroughRevocations;
+
+// The bytes left in the queue at ts >= qts_head, as computed by advance(ts), without changing the queue.
+static inline quint64 projectedLoad(const NetGraphEdgeQueue &q, quint64 ts)
+{
+	if (ts <= q.qts_head)
+		return q.qload;
+	quint64 delta_B = ((ts - q.qts_head) * q.rate_Bps) / SEC_TO_NSEC;
+	return q.qload - qMin(delta_B, q.qload);
+}
+
+// Returns true if the packet can cross the edge at time ts without being queued: the queue is empty and has
+// no state that must be updated packet by packet (loss, policing, recording). Edges with fluid background are
+// excluded for the whole emulation, not only while the fluid rate is nonzero: a fluid onset during a run would
+// change the exit times of the packets already cut through.
+// A queue holds a single reservation, so the packet cannot cut through while another packet's reservation has not
+// expired at the current time ts_now, even if it would end before ts: the packet would replace it, and a third
+// packet arriving during the earlier run would no longer revoke it.
+static inline bool canCutThrough(const NetGraphEdge &e, const Packet *p, quint64 ts, quint64 ts_now)
+{
+	if (e.queueCount != 1 || e.hasPolicing || e.hasExtraTraffic || e.recordSampledTimeline ||
+		e.recordFullTimeline || !e.collapsedEdges.isEmpty() || partitioning.isRemoteNode(e.dest))
+		return false;
+	const NetGraphEdgeQueue &q = e.queues[0];
+	return q.lossRate_int == 0 &&
+			q.fluidRate_Bps == 0 &&
+			q.queued_packets.isEmpty() &&
+			q.asyncDrains.isEmpty() &&
+			(q.cutThroughPacket == nullptr || q.cutThroughUntil <= ts_now) &&
+			ts >= q.qts_head &&
+			projectedLoad(q, ts) + quint64(p->wireLength) <= q.qcapacity;
+}
+
+// Adds (sign = 1) or removes (sign = -1) a cut-through hop to the statistics of the edge, as enqueue() would.
+static inline void countCutThroughHop(NetGraphEdge &e, const Packet *p, quint64 qdelay, qint64 sign)
+{
+	NetGraphEdgeQueue &q = e.queues[0];
+	TokenBucket &policer = e.policers[0];
+	q.packets_in += sign * p->segments;
+	q.packets_in_perpath[p->path_id] += sign * p->segments;
+	q.bytes += sign * p->wireLength;
+	q.bytes_in_perpath[p->path_id] += sign * p->wireLength;
+	q.total_qdelay += sign * qdelay;
+	q.qdelay_perpath[p->path_id] += sign * qdelay;
+	policer.packets_in += sign * p->segments;
+	policer.packets_in_perpath[p->path_id] += sign * p->segments;
+	policer.bytes += sign * p->wireLength;
+	policer.bytes_in_perpath[p->path_id] += sign * p->wireLength;
+}
+
+// The time when a cut-through packet exits hop i of its run.
+static inline quint64 cutThroughExit(const Packet *p, int i)
+{
+	return i + 1 < p->cutThroughArrivals.count() ? p->cutThroughArrivals[i + 1] : p->ts_expected_exit;
+}
+
+// Records the link measurements of the first count hops of the run of a cut-through packet.
+static void recordCutThroughHops(Packet *p, int count)
+{
+	for (int i = 0; i < count; i++) {
+		LinkPath ep(p->cutThroughEdges[i], p->path_id);
+		PathPair dummy;
+		const quint64 delay = cutThroughExit(p, i) - p->cutThroughArrivals[i];
+		if (p->sampledForMeasurements) {
+			sampledPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, true, delay, p->segments);
+		}
+		rawPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, true, delay, p->segments);
+	}
+}
+
+// Releases the reservations of the hops from first on, and removes them from the run and from the statistics.
+static void cancelCutThroughHops(Packet *p, int first)
+{
+	const int count = p->cutThroughEdges.count();
+	for (int i = first; i < count; i++) {
+		NetGraphEdge &e = netGraph->edges[p->cutThroughEdges[i]];
+		NetGraphEdgeQueue &q = e.queues[0];
+		if (q.cutThroughPacket == p) {
+			q.cutThroughPacket = nullptr;
+		}
+		countCutThroughHop(e, p, cutThroughExit(p, i) - p->cutThroughArrivals[i] - q.delay_ns, -1);
+	}
+	p->theoretical_delay -= p->ts_expected_exit - cutThroughExit(p, first - 1);
+	// the trace ends with the destination of the last hop
+	p->trace.remove(p->trace.count() - (count - first), count - first);
+	p->ts_expected_exit = cutThroughExit(p, first - 1);
+	p->cutThroughEdges.remove(first, count - first);
+	p->cutThroughArrivals.remove(first, count - first);
+}
+
+// Routes p over edge first and the idle edges after it, in one step. Returns false if first is not idle, in which
+// case the packet must be enqueued normally.
+static bool cutThrough(Packet *p, NetGraphEdge &first, quint64 ts_now, quint64 &ts_next)
+{
+	if (p->injected || !canCutThrough(first, p, ts_now, ts_now))
+		return false;
+	// like enqueue(), start from the current state of the first queue
+	first.queues[0].advance(ts_now);
+	p->cutThroughEdges.clear();
+	p->cutThroughArrivals.clear();
+	quint64 ts = ts_now;
+	NetGraphEdge *e = &first;
+	while (1) {
+		NetGraphEdgeQueue &q = e->queues[0];
+		const quint64 qdelay = ((projectedLoad(q, ts) + p->wireLength) * SEC_TO_NSEC) / q.rate_Bps;
+		q.cutThroughPacket = p;
+		q.cutThroughUntil = ts + qdelay;
+		countCutThroughHop(*e, p, qdelay, 1);
+		p->cutThroughEdges.append(e->index);
+		p->cutThroughArrivals.append(ts);
+		ts += qdelay + q.delay_ns;
+
+		// find the next hop, if the packet can cut through it too
+		const qint32 node = e->dest;
+		if (node == p->dst_id || partitioning.isRemoteNode(node))
+			break;
+		const quint32 port = netGraph->routeTables[netGraph->routeTableIndex[node]][netGraph->destID2Index[p->dst_id]];
+		// load balancing decisions are taken at the time of the hop, so they end the run
+		if (port == NO_ROUTE || (port & LOAD_BALANCED_ROUTE_MASK))
+			break;
+		NetGraphEdge &next = netGraph->edges[netGraph->nodePorts[node][port]];
+		if (!canCutThrough(next, p, ts, ts_now))
+			break;
+		p->trace.append(next.dest);
+		e = &next;
+	}
+	p->queue_id = e->index;
+	p->ts_enqueue = p->cutThroughArrivals.last();
+	p->ts_expected_exit = ts;
+	p->theoretical_delay += ts - ts_now;
+	ts_next = ts;
+	cutThroughExits.insert(p, ts);
+	numCutThroughPackets++;
+	numCutThroughHops += p->cutThroughEdges.count();
+	return true;
+}
+
+// Called when another packet arrives at time ts_now on a link reserved by p, which has not finished transmitting
+// on it yet.
+static void revokeCutThrough(Packet *p, qint32 edgeIndex, quint64 ts_now)
+{
+	const int i = p->cutThroughEdges.indexOf(edgeIndex);
+	if (i < 0) {
+		// stale reservation: the run of p was revoked before reaching this link
+		netGraph->edges[edgeIndex].queues[0].cutThroughPacket = nullptr;
+		return;
+	}
+	numCutThroughRevocations++;
+	const quint64 ts_arrival = p->cutThroughArrivals[i];
+	if (ts_now < ts_arrival) {
+		// p has not reached the link yet: it exits the previous hop as scheduled, and is routed from there
+		cancelCutThroughHops(p, i);
+		p->queue_id = p->cutThroughEdges.last();
+		p->ts_enqueue = p->cutThroughArrivals.last();
+		cutThroughExits.insert(p, p->ts_expected_exit);
+	} else {
+		// p arrived first: it is enqueued on the link at its arrival time, before the new packet
+		cancelCutThroughHops(p, i);
+		p->trace.append(netGraph->edges[edgeIndex].dest);
+		recordCutThroughHops(p, p->cutThroughEdges.count());
+		p->cutThroughEdges.clear();
+		p->cutThroughArrivals.clear();
+		quint64 ts_exit;
+		bool queued = netGraph->edges[edgeIndex].enqueue(p, ts_arrival, ts_exit);
+		Q_ASSERT_FORCE(queued);
+	}
+}
+
+// Ends the run of a cut-through packet that exits its last hop (see drain()).
+static void finishCutThrough(Packet *p)
+{
+	// the last hop is recorded by routePacket(), like a normal queue exit
+	recordCutThroughHops(p, p->cutThroughEdges.count() - 1);
+	for (int i = 0; i < p->cutThroughEdges.count(); i++) {
+		NetGraphEdgeQueue &q = netGraph->edges[p->cutThroughEdges[i]].queues[0];
+		if (q.cutThroughPacket == p) {
+			q.cutThroughPacket = nullptr;
+		}
+	}
+	p->cutThroughEdges.clear();
+	p->cutThroughArrivals.clear();
+}
+
 int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 {
 	if (p->injected) {
@@ -977,8 +1644,8 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 				   NIPQUAD(p->src_ip),
 				   NIPQUAD(p->dst_ip));
 
-		path.packets_in++;
-		path.bytes_in += p->length;
+		path.packets_in += p->segments;
+		path.bytes_in += p->wireLength;
 
 		if (path.recordSampledTimeline) {
 			if (ts_now >= path.timelineSampled.last().timestamp + path.timelineSamplingPeriod) {
@@ -986,8 +1653,8 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 				memset(&current, 0, sizeof(current));
 				current.timestamp = (ts_now / path.timelineSamplingPeriod) * path.timelineSamplingPeriod;
 			}
-			path.timelineSampled.last().arrivals_p++;
-			path.timelineSampled.last().arrivals_B += p->length;
+			path.timelineSampled.last().arrivals_p += p->segments;
+			path.timelineSampled.last().arrivals_B += p->wireLength;
 		}
 	} else {
 #if BYPASS_QUEUES
@@ -1004,13 +1671,34 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 
 	// Measure packet at successful exit from queue (we do this late because of non-FIFO policies)
 	if (!p->dropped && p->queue_id >= 0) {
+		// The packet also crossed the collapsed segment that follows the link, if any: account for each of its
+		// edges as if the packet had been routed over it
+		quint64 collapsedDelay = 0;
+		const OVector<qint32> &collapsedEdges = netGraph->edges[p->queue_id].collapsedEdges;
+		for (int i = 0; i < collapsedEdges.count(); i++) {
+			NetGraphEdge &c = netGraph->edges[collapsedEdges[i]];
+			NetGraphEdgeQueue &q = c.queues[0];
+			const quint64 delay = collapsedEdgeDelay(c, p);
+			collapsedDelay += delay;
+			p->trace.append(c.dest);
+			q.packets_in += p->segments;
+			q.packets_in_perpath[p->path_id] += p->segments;
+			q.bytes += p->wireLength;
+			q.bytes_in_perpath[p->path_id] += p->wireLength;
+			LinkPath ep(c.index, p->path_id);
+			PathPair dummy;
+			if (p->sampledForMeasurements) {
+				sampledPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, true, delay, p->segments);
+			}
+			rawPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, true, delay, p->segments);
+		}
 		if (p->sampledForMeasurements) {
 			LinkPath ep(p->queue_id, p->path_id);
 			// It is currently possible to have correct per-edge event recording only for tail-drop.
 			// For disciplines that produce async drops (such as random-drop or drop-head), we cannot track the delayed drops
 			// (i.e. the order of the events will be wrong, although the counters will be correct).
 			PathPair dummy;
-			sampledPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, true, ts_now - p->ts_enqueue);
+			sampledPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, true, ts_now - p->ts_enqueue - collapsedDelay, p->segments);
 		}
 		// We always take raw measurements
 		{
@@ -1019,10 +1707,15 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 			// For disciplines that produce async drops (such as random-drop or drop-head), we cannot track the delayed drops
 			// (i.e. the order of the events will be wrong, although the counters will be correct).
 			PathPair dummy;
-			rawPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, true, ts_now - p->ts_enqueue);
+			rawPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, true, ts_now - p->ts_enqueue - collapsedDelay, p->segments);
 		}
 	}
 
+	// did it reach a node emulated by another partition?
+	if (!p->dropped && partitioning.isRemoteNode(p->trace.last())) {
+		return PKT_TUNNELED;
+	}
+
 	// did it reach the destination?
 	if (p->trace.last() == p->dst_id) {
 		// yes, forward the packet
@@ -1033,8 +1726,8 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 				   NIPQUAD(p->dst_ip));
 
 		// update path egress stats
-		path.packets_out++;
-		path.bytes_out += p->length;
+		path.packets_out += p->segments;
+		path.bytes_out += p->wireLength;
 		path.total_theor_delay += p->theoretical_delay;
 		path.total_actual_delay += p->ts_start_send - p->ts_userspace_rx;
 		if (path.recordSampledTimeline) {
@@ -1044,28 +1737,28 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 				current.timestamp = (ts_now / path.timelineSamplingPeriod) * path.timelineSamplingPeriod;
 				current.delay_min = ULLONG_MAX;
 			}
-			path.timelineSampled.last().exits_p++;
-			path.timelineSampled.last().exits_B += p->length;
+			path.timelineSampled.last().exits_p += p->segments;
+			path.timelineSampled.last().exits_B += p->wireLength;
 			path.timelineSampled.last().delay_total += p->theoretical_delay;
 			path.timelineSampled.last().delay_max = qMax(path.timelineSampled.last().delay_max, p->theoretical_delay);
 			path.timelineSampled.last().delay_min = qMin(path.timelineSampled.last().delay_min, p->theoretical_delay);
 		}
 		if (flowTracking) {
-			sampledPathFlowEvents->handlePacket(p, ts_now);
+			flowTable.handlePacket(p, ts_now);
 		}
 
 		if (p->sampledForMeasurements) {
 			LinkPath ep(p->queue_id, p->path_id);
 
 			PathPair dummy;
-			sampledPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, true, p->ts_start_send - p->ts_userspace_rx);
+			sampledPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, true, p->ts_start_send - p->ts_userspace_rx, p->segments);
 		}
 		// We always take raw measurements
 		{
 			LinkPath ep(p->queue_id, p->path_id);
 
 			PathPair dummy;
-			rawPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, true, p->ts_start_send - p->ts_userspace_rx);
+			rawPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, true, p->ts_start_send - p->ts_userspace_rx, p->segments);
 		}
 		return PKT_FORWARDED;
 	}
@@ -1084,34 +1777,35 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 				memset(&current, 0, sizeof(current));
 				current.timestamp = (ts_now / path.timelineSamplingPeriod) * path.timelineSamplingPeriod;
 			}
-			path.timelineSampled.last().drops_p++;
-			path.timelineSampled.last().drops_B += p->length;
+			path.timelineSampled.last().drops_p += p->segments;
+			path.timelineSampled.last().drops_B += p->wireLength;
 		}
 		if (flowTracking) {
-			sampledPathFlowEvents->handlePacket(p, ts_now);
+			flowTable.handlePacket(p, ts_now);
 		}
 
 		if (p->sampledForMeasurements) {
 			LinkPath ep(p->queue_id, p->path_id);
 
 			PathPair dummy;
-			sampledPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, false, 0);
-			sampledPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, false, 0);
+			sampledPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, false, 0, p->segments);
+			sampledPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, false, 0, p->segments);
 		}
 		// We always take raw measurements
 		{
 			LinkPath ep(p->queue_id, p->path_id);
 
 			PathPair dummy;
-			rawPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, false, 0);
-			rawPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->length, false, 0);
+			rawPathIntervalMeasurements->recordPacketLink(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, false, 0, p->segments);
+			rawPathIntervalMeasurements->recordPacketPath(dummy, ep, p->ts_userspace_rx, p->ts_userspace_rx, p->wireLength, false, 0, p->segments);
 		}
 		return PKT_DROPPED;
 	}
 
 	// we need to forward it, find the route
-	quint32 nextHop = netGraph->routeCache[p->trace.last()][netGraph->destID2Index[p->dst_id]];
-	if (nextHop == NO_ROUTE) {
+	const qint32 currentNode = p->trace.last();
+	quint32 port = netGraph->routeTables[netGraph->routeTableIndex[currentNode]][netGraph->destID2Index[p->dst_id]];
+	if (port == NO_ROUTE) {
 		// no route, drop and update path stats
 		if (DEBUG_PACKETS)
 			printf("No route for packet %d.%d.%d.%d -> %d.%d.%d.%d, node=%d\n",
@@ -1124,16 +1818,19 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 				memset(&current, 0, sizeof(current));
 				current.timestamp = (ts_now / path.timelineSamplingPeriod) * path.timelineSamplingPeriod;
 			}
-			path.timelineSampled.last().drops_p++;
-			path.timelineSampled.last().drops_B += p->length;
+			path.timelineSampled.last().drops_p += p->segments;
+			path.timelineSampled.last().drops_B += p->wireLength;
 		}
 		return PKT_DROPPED;
 	} else {
-		if ((nextHop & LOAD_BALANCED_ROUTE_MASK) == 1) {
-			nextHop = nextHop & LOAD_BALANCED_VALUE_MASK;
-			nextHop = netGraph->loadBalancedRouteCache[nextHop].at(rand() % netGraph->loadBalancedRouteCache[nextHop].count());
-		}
-		NetGraphEdge &e = netGraph->edgeByNodeIndex(p->trace.last(), nextHop);
+		if (port & LOAD_BALANCED_ROUTE_MASK) {
+			const OVector<qint32> &ports = netGraph->loadBalancedRouteCache[port & LOAD_BALANCED_VALUE_MASK];
+			quint64 tsc_start = rdtsc();
+			port = ports.at(selectLoadBalancedPort(p, currentNode, ports, ts_now));
+			ecmpSelectionCycles.recordEvent(rdtsc() - tsc_start);
+		}
+		NetGraphEdge &e = netGraph->edges[netGraph->nodePorts[currentNode][port]];
+		const qint32 nextHop = e.dest;
 		if (DEBUG_PACKETS)
 			printf("Found route for packet %d.%d.%d.%d -> %d.%d.%d.%d, node=%d, next hop=%d, link=%d\n",
 				   NIPQUAD(p->src_ip),
@@ -1142,6 +1839,9 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 				   nextHop,
 				   e.index);
 		p->trace.append(nextHop);
+		if (cutThroughEnabled && cutThrough(p, e, ts_now, ts_next)) {
+			return PKT_QUEUED;
+		}
 		if (e.enqueue(p, ts_now, ts_next)) {
 			return PKT_QUEUED;
 		} else {
@@ -1152,15 +1852,15 @@ int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next)
 					memset(&current, 0, sizeof(current));
 					current.timestamp = (ts_now / path.timelineSamplingPeriod) * path.timelineSamplingPeriod;
 				}
-				path.timelineSampled.last().drops_p++;
-				path.timelineSampled.last().drops_B += p->length;
+				path.timelineSampled.last().drops_p += p->segments;
+				path.timelineSampled.last().drops_B += p->wireLength;
 			}
 			return PKT_DROPPED;
 		}
 	}
 }
 
-EdgeTimeline computeEdgeTimelinesBinary(NetGraphEdge e, int queue, quint64 tsMin, quint64 tsMax)
+EdgeTimeline computeEdgeTimelinesBinary(const NetGraphEdge &e, int queue, quint64 tsMin, quint64 tsMax)
 {
 	EdgeTimeline timeline;
 
@@ -1190,7 +1890,7 @@ EdgeTimeline computeEdgeTimelinesBinary(NetGraphEdge e, int queue, quint64 tsMin
 	quint64 lastQueueAvg = 0;
 	quint64 lastQueueMax = 0;
 
-	foreach (EdgeTimelineItem item, timelineSampled) {
+	foreach (const EdgeTimelineItem &item, timelineSampled) {
 		// "extrapolate"
 		while (item.timestamp > tsMin + lastTs + samplingPeriod) {
 			quint64 delta = ((e.rate_Bps * samplingPeriod) / SEC_TO_NSEC);
@@ -1233,7 +1933,7 @@ EdgeTimeline computeEdgeTimelinesBinary(NetGraphEdge e, int queue, quint64 tsMin
 	return timeline;
 }
 
-PathTimeline computePathTimelinesBinary(NetGraphPath p, quint64 tsMin, quint64 tsMax)
+PathTimeline computePathTimelinesBinary(const NetGraphPath &p, quint64 tsMin, quint64 tsMax)
 {
 	PathTimeline timeline;
 
@@ -1254,7 +1954,7 @@ PathTimeline computePathTimelinesBinary(NetGraphPath p, quint64 tsMin, quint64 t
 	quint64 lastTs = 0;
 	quint64 samplingPeriod = p.timelineSamplingPeriod;
 
-	foreach (PathTimelineItem item, timelineSampled) {
+	foreach (const PathTimelineItem &item, timelineSampled) {
 		// "extrapolate"
 		while (item.timestamp > tsMin + lastTs + samplingPeriod) {
 			lastTs += samplingPeriod;
@@ -1285,49 +1985,111 @@ PathTimeline computePathTimelinesBinary(NetGraphPath p, quint64 tsMin, quint64 t
 	return timeline;
 }
 
-void saveTimelinesBinary(quint64 tsMin, quint64 tsMax)
-{
-	QFile fileEdges(QString("edge-timelines.dat"));
-	fileEdges.open(QIODevice::WriteOnly);
-	CompressedDevice deviceEdges(&fileEdges);
-	deviceEdges.open(QIODevice::WriteOnly);
-	QDataStream outEdges(&deviceEdges);
-	outEdges.setVersion(QDataStream::Qt_4_0);
+// Computes and serializes the timelines of one edge (all its queues) or one path.
+class TimelineJob {
+public:
+	qint32 index;
+	QByteArray data;
+};
 
-	QFile filePaths(QString("path-timelines.dat"));
-	filePaths.open(QIODevice::WriteOnly);
-	CompressedDevice devicePaths(&filePaths);
-	devicePaths.open(QIODevice::WriteOnly);
-	QDataStream outPaths(&devicePaths);
-	outPaths.setVersion(QDataStream::Qt_4_0);
+class EdgeTimelineSerializer {
+public:
+	typedef void result_type;
 
-	foreach (NetGraphEdge e, netGraph->edges) {
-		if (!e.timelineSampled.isEmpty()) {
-			tsMin = qMin(tsMin, e.timelineSampled.first().timestamp);
+	EdgeTimelineSerializer(quint64 tsMin, quint64 tsMax) : tsMin(tsMin), tsMax(tsMax) {}
+
+	void operator()(TimelineJob &job) {
+		const NetGraphEdge &e = netGraph->edges.at(job.index);
+		QVector<EdgeTimeline> edgeQueueTimelines;
+		for (int queue = -1; queue < e.queueCount; queue++) {
+			edgeQueueTimelines << computeEdgeTimelinesBinary(e, queue, tsMin, tsMax);
 		}
+		QDataStream out(&job.data, QIODevice::WriteOnly);
+		out.setVersion(QDataStream::Qt_4_0);
+		out << edgeQueueTimelines;
 	}
 
-	foreach (NetGraphPath p, netGraph->paths) {
-		if (!p.timelineSampled.isEmpty()) {
-			tsMin = qMin(tsMin, p.timelineSampled.first().timestamp);
+protected:
+	quint64 tsMin;
+	quint64 tsMax;
+};
+
+class PathTimelineSerializer {
+public:
+	typedef void result_type;
+
+	PathTimelineSerializer(quint64 tsMin, quint64 tsMax) : tsMin(tsMin), tsMax(tsMax) {}
+
+	void operator()(TimelineJob &job) {
+		QDataStream out(&job.data, QIODevice::WriteOnly);
+		out.setVersion(QDataStream::Qt_4_0);
+		out << computePathTimelinesBinary(netGraph->paths.at(job.index), tsMin, tsMax);
+	}
+
+protected:
+	quint64 tsMin;
+	quint64 tsMax;
+};
+
+// Writes count items, serialized in parallel in batches (to bound the memory used), in the same format as QVector.
+template <typename Serializer>
+void writeTimelinesParallel(QDataStream &out, int count, Serializer serializer)
+{
+	// Same format as the EdgeTimelines/PathTimelines operator<<
+	const qint32 ver = 1;
+	out << ver;
+	out << quint32(count);
+	const int batchSize = 256;
+	for (int batchStart = 0; batchStart < count; batchStart += batchSize) {
+		QList<TimelineJob> jobs;
+		for (int i = batchStart; i < qMin(batchStart + batchSize, count); i++) {
+			TimelineJob job;
+			job.index = i;
+			jobs << job;
+		}
+		QtConcurrent::blockingMap(jobs, serializer);
+		foreach (const TimelineJob &job, jobs) {
+			out.writeRawData(job.data.constData(), job.data.size());
 		}
 	}
+}
 
-	EdgeTimelines edgeTmelines;
-	foreach (NetGraphEdge e, netGraph->edges) {
-		QVector<EdgeTimeline> edgeQueueTimelines;
-		for (int queue = -1; queue < e.queueCount; queue++) {
-			edgeQueueTimelines << computeEdgeTimelinesBinary(e, queue, tsMin, tsMax);
+// Time spent writing the results, for the stats
+static quint64 teardownEdgeStatsTime;
+static quint64 teardownTomoDataTime;
+static quint64 teardownTimelinesTime;
+static quint64 teardownTotalTime;
+
+void saveTimelinesBinary(quint64 tsMin, quint64 tsMax)
+{
+	QFile fileEdges(QString("edge-timelines.dat"));
+	fileEdges.open(QIODevice::WriteOnly);
+	CompressedDevice deviceEdges(&fileEdges);
+	deviceEdges.open(QIODevice::WriteOnly);
+	QDataStream outEdges(&deviceEdges);
+	outEdges.setVersion(QDataStream::Qt_4_0);
+
+	QFile filePaths(QString("path-timelines.dat"));
+	filePaths.open(QIODevice::WriteOnly);
+	CompressedDevice devicePaths(&filePaths);
+	devicePaths.open(QIODevice::WriteOnly);
+	QDataStream outPaths(&devicePaths);
+	outPaths.setVersion(QDataStream::Qt_4_0);
+
+	foreach (const NetGraphEdge &e, netGraph->edges) {
+		if (!e.timelineSampled.isEmpty()) {
+			tsMin = qMin(tsMin, e.timelineSampled.first().timestamp);
 		}
-		edgeTmelines.timelines << edgeQueueTimelines;
 	}
-	outEdges << edgeTmelines;
 
-	PathTimelines pathTmelines;
-	foreach (NetGraphPath p, netGraph->paths) {
-		pathTmelines.timelines << computePathTimelinesBinary(p, tsMin, tsMax);
+	foreach (const NetGraphPath &p, netGraph->paths) {
+		if (!p.timelineSampled.isEmpty()) {
+			tsMin = qMin(tsMin, p.timelineSampled.first().timestamp);
+		}
 	}
-	outPaths << pathTmelines;
+
+	writeTimelinesParallel(outEdges, netGraph->edges.count(), EdgeTimelineSerializer(tsMin, tsMax));
+	writeTimelinesParallel(outPaths, netGraph->paths.count(), PathTimelineSerializer(tsMin, tsMax));
 }
 
 void saveEdgeStats() {
@@ -1335,7 +2097,7 @@ void saveEdgeStats() {
 	if (edgeStatsFile.open(QFile::WriteOnly | QFile::Truncate | QFile::Text)) {
 		QTextStream edgeStats(&edgeStatsFile);
 
-		foreach (NetGraphEdge e, netGraph->edges) {
+		foreach (const NetGraphEdge &e, netGraph->edges) {
 			if (e.packets_in == 0) {
 				edgeStats << QString("===== Link %1: no traffic").arg(e.index + 1) << endl;
 				continue;
@@ -1404,6 +2166,10 @@ void saveEdgeStats() {
 				edgeStats << QString("      = Queue drops: %1 (%2)").arg(e.queues[q].qdrops).arg(e.queues[q].packets_in ? e.queues[q].qdrops / qreal(e.queues[q].packets_in) : 0) << endl;
 				edgeStats << QString("      = Bernoulli drops: %1 (%2)").arg(e.queues[q].rdrops).arg(e.queues[q].packets_in ? e.queues[q].rdrops / qreal(e.queues[q].packets_in) : 0) << endl;
 				edgeStats << QString("      = Average queuing delay: %1 ms").arg(e.queues[q].packets_in ? e.queues[q].total_qdelay * 1.0e3 / qreal(SEC_TO_NSEC) / qreal(e.queues[q].packets_in) : 0) << endl;
+				if (e.queues[q].fluidBytesIn > 0) {
+					edgeStats << QString("      = Fluid background bytes: %1").arg(e.queues[q].fluidBytesIn) << endl;
+					edgeStats << QString("      = Fluid background drops: %1 bytes (%2)").arg(e.queues[q].fluidBytesDropped).arg(e.queues[q].fluidBytesDropped / qreal(e.queues[q].fluidBytesIn)) << endl;
+				}
 				edgeStats << QString("      =") << endl;
 				edgeStats << QString("      = Event span: %1 s").arg(e.queues[q].tsMin < e.queues[q].tsMax ? (e.queues[q].tsMax - e.queues[q].tsMin) / qreal(SEC_TO_NSEC) : 0) << endl;
 			}
@@ -1437,44 +2203,38 @@ void saveEdgeStats() {
 
 void saveRecordedData()
 {
-	saveFile("simulation.txt", QString("graph=%1").arg(netGraph->fileName.replace(".graph", "").split('/', QString::SkipEmptyParts).last()));
+	// the time dilation is only recorded; the results are in real time (see timeDilation)
+	saveFile("simulation.txt", QString("graph=%1\ntime_dilation=%2")
+			 .arg(netGraph->fileName.replace(".graph", "").split('/', QString::SkipEmptyParts).last())
+			 .arg(timeDilation));
 
+	quint64 tsStartTeardown = get_current_time();
 	saveEdgeStats();
+	teardownEdgeStatsTime = get_current_time() - tsStartTeardown;
 
-	TomoData tomoData;
+	tsStartTeardown = get_current_time();
+	SparseTomoData tomoData;
 
 	tomoData.m = netGraph->paths.count();
 	tomoData.n = netGraph->edges.count();
 
 	// path data: pathCount items
-	foreach (NetGraphPath p, netGraph->paths) {
+	foreach (const NetGraphPath &p, netGraph->paths) {
 		// path starts: src host index
 		tomoData.pathstarts << p.source;
 		// path ends: dest host index
 		tomoData.pathends << p.dest;
 		// the edge list for each path (m items of the form path(index).edges = [id1 ... idx]; these are indices, not real edge ids!
+		// this also defines the routing matrix
 		QList<qint32> edgelist;
-		foreach (NetGraphEdge e, p.edgeList) {
+		foreach (const NetGraphEdge &e, p.edgeList) {
 			edgelist << e.index;
 		}
 		tomoData.pathedges << edgelist;
 	}
 
-	// compute the routing matrix, m x n of quint8 with values of either 0 or 1
-	foreach (NetGraphPath p, netGraph->paths) {
-		QVector<quint8> line;
-		foreach (NetGraphEdge e, netGraph->edges) {
-			if (p.edgeSet.contains(e)) {
-				line << 1;
-			} else {
-				line << 0;
-			}
-		}
-		tomoData.A << line;
-	}
-
 	// write the path transmission rate vector: m x 1 of [0..1]
-	foreach (NetGraphPath p, netGraph->paths) {
+	foreach (const NetGraphPath &p, netGraph->paths) {
 		if (p.packets_in == 0) {
 			tomoData.y << 1.0;
 		} else {
@@ -1483,7 +2243,7 @@ void saveRecordedData()
 	}
 
 	// write the measured edge transmission rate vector: 1 x n of [0..1]
-	foreach (NetGraphEdge e, netGraph->edges) {
+	foreach (const NetGraphEdge &e, netGraph->edges) {
 		if (e.packets_in == 0) {
 			tomoData.xmeasured << 1.0;
 		} else {
@@ -1495,53 +2255,37 @@ void saveRecordedData()
 	tomoData.tsMin = ULLONG_MAX;
 	tomoData.tsMax = 0;
 
-	foreach (NetGraphEdge e, netGraph->edges) {
+	foreach (const NetGraphEdge &e, netGraph->edges) {
 		if (e.tsMin == ULLONG_MAX || e.tsMax == 0)
 			continue;
 		tomoData.tsMin = qMin(tomoData.tsMin, e.tsMin);
 		tomoData.tsMax = qMax(tomoData.tsMax, e.tsMax);
 	}
 
-	tomoData.T.resize(netGraph->paths.count());
-	for (int p = 0; p < netGraph->paths.count(); p++) {
-		tomoData.T[p].resize(netGraph->edges.count());
-		for (int e = 0; e < netGraph->edges.count(); e++) {
-			NetGraphEdge &edge = netGraph->edges[e];
-			tomoData.T[p][e] = (edge.packets_in_perpath[p] == 0) ? 0.0 : (edge.packets_in_perpath[p] - edge.rdrops_perpath[p] - edge.qdrops_perpath[p])/(qreal)(edge.packets_in_perpath[p]);
-		}
-	}
-
-	tomoData.packetCounters.resize(netGraph->paths.count());
-	for (int p = 0; p < netGraph->paths.count(); p++) {
-		tomoData.packetCounters[p].resize(netGraph->edges.count());
-		for (int e = 0; e < netGraph->edges.count(); e++) {
-			NetGraphEdge &edge = netGraph->edges[e];
-			tomoData.packetCounters[p][e] = edge.packets_in_perpath[p];
-		}
-	}
-
-	tomoData.traffic.resize(netGraph->paths.count());
-	for (int p = 0; p < netGraph->paths.count(); p++) {
-		tomoData.traffic[p].resize(netGraph->edges.count());
-		for (int e = 0; e < netGraph->edges.count(); e++) {
-			NetGraphEdge &edge = netGraph->edges[e];
-			tomoData.traffic[p][e] = edge.bytes_in_perpath[p];
-		}
-	}
-
-	tomoData.qdelay.resize(netGraph->paths.count());
-	for (int p = 0; p < netGraph->paths.count(); p++) {
-		tomoData.qdelay[p].resize(netGraph->edges.count());
-		for (int e = 0; e < netGraph->edges.count(); e++) {
-			NetGraphEdge &edge = netGraph->edges[e];
-			tomoData.qdelay[p][e] = edge.qdelay_perpath[p];
+	// per path, per edge measurements: only for the edges that received packets from the path
+	tomoData.entries.resize(netGraph->paths.count());
+	for (int e = 0; e < netGraph->edges.count(); e++) {
+		const NetGraphEdge &edge = netGraph->edges.at(e);
+		for (int p = 0; p < netGraph->paths.count(); p++) {
+			if (edge.packets_in_perpath[p] == 0)
+				continue;
+			SparseTomoDataEntry entry;
+			entry.edge = e;
+			entry.T = (edge.packets_in_perpath[p] - edge.rdrops_perpath[p] - edge.qdrops_perpath[p])/(qreal)(edge.packets_in_perpath[p]);
+			entry.packetCounter = edge.packets_in_perpath[p];
+			entry.traffic = edge.bytes_in_perpath[p];
+			entry.qdelay = edge.qdelay_perpath[p];
+			tomoData.entries[p].append(entry);
 		}
 	}
 
 	tomoData.save("tomo-records.dat");
+	teardownTomoDataTime = get_current_time() - tsStartTeardown;
 
 	// timeline aggregates/samples
+	tsStartTeardown = get_current_time();
 	saveTimelinesBinary(tomoData.tsMin, tomoData.tsMax);
+	teardownTimelinesTime = get_current_time() - tsStartTeardown;
 }
 
 static quint64 total_loop_delay;
@@ -1564,10 +2308,100 @@ static OVector<quint64> highLatencyEventsMem;
 // thread cache
 static OVector<quint64> highLatencyEventsMemThread;
 
+// Set to 1 to measure the cycles spent in each phase of the scheduler loop, and to keep a flight recorder
+// of the last iterations that is dumped when an iteration takes longer than flightRecorderThreshold.
+#define PROFILE_SCHEDULER_PHASES 1
+static FlightRecorder flightRecorder;
+
+// Loop time of the iterations that applied link updates
+static TinyHistogram linkUpdateLoopDelays;
+// How late the packets from other partitions are routed, relative to their due time
+static TinyHistogram tunnelLateness;
+// Per-path lateness of the queue events, relative to the scheduled exit times
+static AccuracyMonitor eventAccuracy;
+
+// Moves the link update batches received from the control thread to pendingLinkUpdates.
+static void receiveLinkUpdates(OVector<LinkUpdateBatch*> &pendingLinkUpdates)
+{
+	for (LinkUpdateBatch *batch; linkUpdatesIn.tryDequeue(batch); ) {
+		pendingLinkUpdates.append(batch);
+	}
+}
+
+// When a link update batch becomes due: at its tsApply, but not before it has been received.
+static inline quint64 linkUpdateDueTime(const LinkUpdateBatch *batch)
+{
+	return qMax(batch->tsReceived, tsStart + batch->tsApply);
+}
+
+// Applies the link update batches that are due. Returns true if any batch has been applied.
+static bool applyLinkUpdates(OVector<LinkUpdateBatch*> &pendingLinkUpdates, quint64 ts_now)
+{
+	bool applied = false;
+	for (int i = 0; i < pendingLinkUpdates.count(); ) {
+		LinkUpdateBatch *batch = pendingLinkUpdates[i];
+		if (ts_now < linkUpdateDueTime(batch)) {
+			i++;
+			continue;
+		}
+		for (int u = 0; u < batch->updates.count(); u++) {
+			netGraph->edges[batch->updates[u].edgeIndex].reconfigure(batch->updates[u], ts_now);
+		}
+		batch->tsDue = linkUpdateDueTime(batch);
+		batch->tsApplied = get_current_time();
+		linkUpdatesDone.enqueue(batch);
+		pendingLinkUpdates.remove(i);
+		applied = true;
+	}
+	return applied;
+}
+
+// The latest time at which the scheduler has routed a packet or applied a change. The state of the queues and
+// policers cannot go back in time, so changes that became due before it are applied at this time.
+static quint64 tsScheduled;
+
+// Applies the link updates and the fluid rate changes that are due before ts (or at ts, if including is true) in
+// time order, each at its due time, or at tsScheduled if that is later. Returns true if any link update batch has
+// been applied.
+static bool applyDueChanges(OVector<LinkUpdateBatch*> &pendingLinkUpdates, quint64 ts, bool including)
+{
+	bool applied = false;
+	while (1) {
+		quint64 tsDue = ULLONG_MAX;
+		for (int i = 0; i < pendingLinkUpdates.count(); i++) {
+			tsDue = qMin(tsDue, linkUpdateDueTime(pendingLinkUpdates[i]));
+		}
+		if (fluidModel.nextChangeTime() != ULLONG_MAX) {
+			tsDue = qMin(tsDue, tsStart + fluidModel.nextChangeTime());
+		}
+		if (tsDue > ts || (tsDue == ts && !including))
+			break;
+		const quint64 tsApply = qMax(tsDue, tsScheduled);
+		applied = applyLinkUpdates(pendingLinkUpdates, tsApply) || applied;
+		fluidModel.apply(netGraph, tsApply, tsApply - tsStart);
+		tsScheduled = tsApply;
+	}
+	return applied;
+}
+
 bool comparePacketDrainEvents(const Packet* a, const Packet* b) {
 	return a->ts_expected_exit < b->ts_expected_exit;
 }
 
+// Appends the cut-through packets that exit their last hop by ts_now.
+static void drainCutThrough(quint64 ts_now, OVector<Packet*> &result)
+{
+	while (!cutThroughExits.isEmpty() && cutThroughExits.findMin().second <= ts_now) {
+		QPair<Packet*, quint64> item = cutThroughExits.takeMin();
+		Packet *p = item.first;
+		// skip the entries left behind by revoked runs
+		if (p->cutThroughEdges.isEmpty() || p->ts_expected_exit != item.second)
+			continue;
+		finishCutThrough(p);
+		result.append(p);
+	}
+}
+
 void drain(quint64 ts_now, OVector<Packet*> &result)
 {
 	result.clear();
@@ -1576,9 +2410,158 @@ void drain(quint64 ts_now, OVector<Packet*> &result)
 			netGraph->edges[iEdge].queues[iQueue].drain(ts_now, result);
 		}
 	}
+	drainCutThrough(ts_now, result);
 	qSort(result.begin(), result.end(), comparePacketDrainEvents);
 }
 
+// Like drain(), for the queues of one edge and the cut-through runs only: routing an event on an edge can queue
+// packets there (the event itself, a revoked cut-through packet) that are due by ts_now. Does not clear result.
+static void drainEdge(qint32 edgeIndex, quint64 ts_now, OVector<Packet*> &result)
+{
+	if (edgeIndex < 0 || edgeIndex >= netGraph->edges.count())
+		return;
+	NetGraphEdge &e = netGraph->edges[edgeIndex];
+	for (int iQueue = 0; iQueue < e.queues.count(); iQueue++) {
+		e.queues[iQueue].drain(ts_now, result);
+	}
+	drainCutThrough(ts_now, result);
+}
+
+// Fills in a packet injected from a traffic trace.
+static inline void initInjectedPacket(Packet *p, qint32 iTrace, qint64 iPacket, const TrafficTracePacket &tracePacket, quint64 ts_now)
+{
+	p->injected = true;
+	p->id = (1ULL << 63) | (quint64(iTrace) << 48) | quint64(iPacket);
+	p->ts_driver_rx = tsStart + tracePacket.timestamp;
+	p->ts_userspace_rx = ts_now;
+	p->length = tracePacket.size;
+	p->wireLength = p->length;
+	p->traffic_class = 0;
+	setFlowHash(p);
+	p->path_id = netGraph->paths.count();
+	p->injection_link_index = netGraph->trafficTraces[iTrace].link;
+}
+
+// Runs after the last iteration of the scheduler loop; tsEnd is the time when the emulation ended.
+static void finishEmulation(quint64 tsEnd)
+{
+	quint64 tsStartTeardown = get_current_time();
+	emulationDuration = tsEnd - tsStart;
+
+	for (int e = 0; e < netGraph->edges.count(); e++) {
+		// integrate the fluid background traffic until the end of the emulation
+		for (int q = 0; q < netGraph->edges[e].queues.count(); q++) {
+			if (netGraph->edges[e].queues[q].fluidRate_Bps > 0) {
+				netGraph->edges[e].queues[q].advance(tsEnd);
+			}
+		}
+		netGraph->edges[e].postEmulation();
+	}
+
+	numActiveQueues = 0;
+	for (int e = 0; e < netGraph->edges.count(); e++) {
+		for (int q = 0; q < netGraph->edges[e].queues.count(); q++) {
+			if (netGraph->edges[e].queues[q].packets_in > 0) {
+				numActiveQueues++;
+			}
+		}
+	}
+
+	saveRecordedData();
+
+	teardownTotalTime = get_current_time() - tsStartTeardown;
+}
+
+void startScheduler(quint64 ts)
+{
+	tsStart = ts;
+	tsScheduled = ts;
+}
+
+// Drained events waiting to be routed, by scheduled time (see routeDueEvents())
+static QBinaryHeap<Packet*, quint64> dueEvents(16384, false);
+static OVector<Packet*> drainedEvents;
+
+// Routes the queuing events due by ts_now, in the order of their scheduled times, so that every queue and policer
+// sees its packets in time order even when the events are routed at their scheduled times (which are earlier than
+// ts_now when the scheduler is late). The link updates and fluid rate changes due in the meantime are applied
+// between the events, at their due times. Must run before the new packets of the iteration are routed at ts_now.
+// The forwarded and dropped packets are appended to toSend (injectedDone for the injected ones), those continuing
+// in another partition to toTunnel. Returns the number of events routed.
+int routeDueEvents(quint64 ts_now, OVector<LinkUpdateBatch*> &pendingLinkUpdates, OVector<Packet*> &toSend,
+				   OVector<Packet*> &injectedDone, OVector<Packet*> &toTunnel, bool &receivedEvents,
+				   bool &appliedLinkUpdates)
+{
+	int numEvents = 0;
+	drain(ts_now, drainedEvents);
+	for (int i = 0; i < drainedEvents.count(); i++) {
+		dueEvents.insert(drainedEvents[i], qMin(drainedEvents[i]->ts_expected_exit, ts_now));
+	}
+	while (!dueEvents.isEmpty()) {
+		numEvents++;
+		QPair<Packet*, quint64> event = dueEvents.takeMin();
+		Packet *p = event.first;
+		if (!p->dropped) {
+			receivedEvents = true;
+			numQueuingEvents++;
+			quint64 event_delay = ts_now - event.second;
+			eventDelays.recordEvent(event_delay);
+			total_event_delay += event_delay;
+			if (eventAccuracy.record(p->path_id, event_delay)) {
+				abortOnAccuracyViolation();
+			}
+		}
+		quint64 ts_next_event;
+		// Routing the event at its scheduled time keeps the spacing of the departures when the scheduler
+		// catches up after a stall; the lateness is recorded above.
+		const quint64 ts_event = eventsAtScheduledTime ? event.second : ts_now;
+		// the changes due before the event go first
+		appliedLinkUpdates = applyDueChanges(pendingLinkUpdates, ts_event, false) || appliedLinkUpdates;
+		tsScheduled = qMax(tsScheduled, ts_event);
+		int pkt_state = routePacket(p, ts_event, ts_next_event);
+		if (pkt_state == PKT_QUEUED) {
+			if (DEBUG_PACKETS)
+				printf("Enqueue: %d.%d.%d.%d -> %d.%d.%d.%d, for time = +%llu ns, tracelen = %d\n",
+					   NIPQUAD(p->src_ip),
+					   NIPQUAD(p->dst_ip),
+					   ts_next_event - ts_event,
+					   p->trace.count());
+		} else if (pkt_state == PKT_DROPPED) {
+			if (DEBUG_PACKETS)
+				printf("Drop: %d.%d.%d.%d -> %d.%d.%d.%d\n",
+					   NIPQUAD(p->src_ip),
+					   NIPQUAD(p->dst_ip));
+			packetsQdropped++;
+			p->dropped = true;
+			if (!p->injected) {
+				toSend.append(p);
+			} else {
+				injectedDone.append(p);
+			}
+		} else if (pkt_state == PKT_FORWARDED) {
+			if (!p->injected) {
+				toSend.append(p);
+			} else {
+				injectedDone.append(p);
+			}
+		} else if (pkt_state == PKT_TUNNELED) {
+			toTunnel.append(p);
+		}
+		// routing the event may have queued packets that are already due, and that go before the events
+		// scheduled after them
+		if (pkt_state == PKT_QUEUED || pkt_state == PKT_DROPPED) {
+			drainedEvents.clear();
+			drainEdge(p->queue_id, ts_now, drainedEvents);
+			for (int i = 0; i < drainedEvents.count(); i++) {
+				dueEvents.insert(drainedEvents[i], qMin(drainedEvents[i]->ts_expected_exit, ts_now));
+			}
+		}
+	}
+	appliedLinkUpdates = applyDueChanges(pendingLinkUpdates, ts_now, true) || appliedLinkUpdates;
+	tsScheduled = ts_now;
+	return numEvents;
+}
+
 void* packet_scheduler_thread(void* )
 {
 	barrierInit.wait();
@@ -1587,7 +2570,7 @@ void* packet_scheduler_thread(void* )
 	pthread_setname_np(pthread_self(), "line-packet-scheduler");
 
 	u_int numCPU = sysconf(_SC_NPROCESSORS_ONLN);
-	u_long core_id = CORE_SCHEDULER;
+	u_long core_id = corePlacement.cpu(CoreScheduler);
 
 	if (bind2core(core_id) == 0) {
 		printf("Set thread scheduler affinity to core %lu/%u\n", core_id, numCPU);
@@ -1603,24 +2586,30 @@ void* packet_scheduler_thread(void* )
 	numQueuingEvents = 0;
 	total_event_delay = 0;
 
+	initFlowletTable();
+	// one more path for the injected traffic
+	eventAccuracy.init("Event", netGraph->paths.count() + 1, latenessThreshold, latenessAbortFraction);
+
+	OVector<LinkUpdateBatch*> pendingLinkUpdates;
+	pendingLinkUpdates.reserve(1000);
+
 	OVector<Packet*> localPacketsToSend;
 	localPacketsToSend.reserve(10000);
+	OVector<Packet*> localPacketsToTunnel;
+	localPacketsToTunnel.reserve(10000);
+	OVector<Packet*> tunneledPackets;
+	tunneledPackets.reserve(10000);
+	// Packets received from other partitions, waiting for their due time
+	QBinaryHeap<Packet*, quint64> tunnelArrivals(1024, false);
 	highLatencyEventsTs.reserve(100000);
 	highLatencyEventsMem.reserve(100000);
 	highLatencyEventsMemThread.reserve(100000);
 
-	OVector<Packet*> events;
-	events.reserve(10000);
+	drainedEvents.reserve(10000);
 	OVector<Packet*> newPackets;
 	newPackets.reserve(10000);
 
-	OVector<int> trafficTraceIndices;
-	trafficTraceIndices.resize(netGraph->trafficTraces.count());
-	int numInjectionEvents = 0;
-	for (int iTrace = 0; iTrace < netGraph->trafficTraces.count(); iTrace++) {
-		numInjectionEvents += netGraph->trafficTraces[iTrace].packets.count();
-	}
-	trafficTraceRecord->events.reserve(numInjectionEvents);
+	trafficTraceRecord->events.reserve(traceInjector.totalPackets());
 
 	OVector<Packet*> injectedPacketPool;
 	qint64 numPackets = 0;
@@ -1635,34 +2624,79 @@ void* packet_scheduler_thread(void* )
 	barrierInitDone.wait();
 	barrierStart.wait();
 
-	tsStart = get_current_time();
+	startScheduler(get_current_time());
 	trafficTraceRecord->tsStart = tsStart;
+#if PROFILE_SCHEDULER_PHASES
+	flightRecorder.calibrate(tsStart);
+#endif
 
 #if DUMP_STACKTRACE_ON_MALLOC
 	malloc_profile_set_trace_cpu_wrapper(1);
 #endif
+	AllocGuard allocGuard("scheduler", tsStart);
 
 	while (1) {
 		if (do_shutdown) {
 			break;
 		}
+		allocGuard.update();
 
 		quint64 ts_now = get_current_time();
+#if PROFILE_SCHEDULER_PHASES
+		quint64 tsc_phase_start = rdtsc();
+		quint64 tsc_phase_end;
+		FlightRecorderEntry phaseStats;
+		phaseStats.ts = ts_now;
+#endif
 
 		if (!localPacketsToSend.isEmpty()) {
 			packetsOut.enqueue(localPacketsToSend/*, 1ULL * MSEC_TO_NSEC*/);
 			localPacketsToSend.clear();
 		}
+		if (!localPacketsToTunnel.isEmpty()) {
+			tunnelOut.enqueue(localPacketsToTunnel);
+			localPacketsToTunnel.clear();
+		}
+
+		// link updates from the control socket; they are applied with the rate changes of the fluid background
+		// traffic, in time order with the events (see routeDueEvents())
+		receiveLinkUpdates(pendingLinkUpdates);
+		bool appliedLinkUpdates = false;
+#if PROFILE_SCHEDULER_PHASES
+		tsc_phase_end = rdtsc();
+		phaseStats.cycles[SchedulerPhaseFlush] = tsc_phase_end - tsc_phase_start;
+		tsc_phase_start = tsc_phase_end;
+#endif
 
 		// process new packets
 		packetsIn.dequeueAll(newPackets/*, 1ULL * MSEC_TO_NSEC*/);
+		if (partitionIndex >= 0) {
+			tunnelIn.dequeueAll(tunneledPackets);
+			for (int i = 0; i < tunneledPackets.count(); i++) {
+				tunnelArrivals.insert(tunneledPackets[i], tunneledPackets[i]->ts_expected_exit);
+			}
+			while (!tunnelArrivals.isEmpty() && tunnelArrivals.findMin().second <= ts_now) {
+				Packet *p = tunnelArrivals.takeMin().first;
+				tunnelLateness.recordEvent(ts_now - p->ts_expected_exit);
+				newPackets.append(p);
+			}
+		}
+#if PROFILE_SCHEDULER_PHASES
+		tsc_phase_end = rdtsc();
+		phaseStats.cycles[SchedulerPhaseDequeue] = tsc_phase_end - tsc_phase_start;
+		tsc_phase_start = tsc_phase_end;
+		phaseStats.numNewPackets = newPackets.count();
+#endif
 
 		// Inject extra packets if configured
-		for (int iTrace = 0; iTrace < netGraph->trafficTraces.count(); iTrace++) {
-			int& iPacket = trafficTraceIndices[iTrace];
-			while (iPacket < netGraph->trafficTraces[iTrace].packets.count()) {
-				if (ts_now < tsStart + netGraph->trafficTraces[iTrace].packets[iPacket].timestamp)
-					break;
+		{
+			qint32 iTrace;
+			qint64 iPacket;
+			TrafficTracePacket tracePacket;
+			while (traceInjector.takeDue(ts_now - tsStart, iTrace, iPacket, tracePacket)) {
+				// Each partition injects the traces of its own links
+				if (partitioning.isRemoteNode(netGraph->edges[netGraph->trafficTraces[iTrace].link].source))
+					continue;
 				// Create a new packet and inject it
 				Packet *p;
 				if (!injectedPacketPool.isEmpty()) {
@@ -1673,18 +2707,15 @@ void* packet_scheduler_thread(void* )
 					// so that this branch never gets executed.
 					p = new Packet();
 				}
-				p->injected = true;
-				p->id = (1ULL << 63) | (quint64(iTrace) << 48) | quint64(iPacket);
-				p->ts_driver_rx = tsStart + netGraph->trafficTraces[iTrace].packets[iPacket].timestamp;
-				p->ts_userspace_rx = ts_now;
-				p->length = netGraph->trafficTraces[iTrace].packets[iPacket].size;
-				p->traffic_class = 0;
-				p->path_id = netGraph->paths.count();
-				p->injection_link_index = netGraph->trafficTraces[iTrace].link;
+				initInjectedPacket(p, iTrace, iPacket, tracePacket, ts_now);
 				newPackets.append(p);
-				iPacket++;
 			}
 		}
+#if PROFILE_SCHEDULER_PHASES
+		tsc_phase_end = rdtsc();
+		phaseStats.cycles[SchedulerPhaseInjection] = tsc_phase_end - tsc_phase_start;
+		tsc_phase_start = tsc_phase_end;
+#endif
 
 		quint64 ts_after_sync = get_current_time();
 		syncDelays.recordEvent(ts_after_sync - ts_now);
@@ -1698,6 +2729,19 @@ void* packet_scheduler_thread(void* )
 		continue;
 #endif
 
+		// process events, before the new packets (see routeDueEvents())
+		bool receivedEvents = false;
+		const int numEvents = routeDueEvents(ts_now, pendingLinkUpdates, localPacketsToSend, injectedPacketPool,
+											 localPacketsToTunnel, receivedEvents, appliedLinkUpdates);
+#if PROFILE_SCHEDULER_PHASES
+		phaseStats.numEvents = numEvents;
+		tsc_phase_end = rdtsc();
+		phaseStats.cycles[SchedulerPhaseDrain] = tsc_phase_end - tsc_phase_start;
+		tsc_phase_start = tsc_phase_end;
+#else
+		Q_UNUSED(numEvents);
+#endif
+
 		bool receivedPackets = !newPackets.isEmpty();
 		for (int iPacket = 0; iPacket < newPackets.count(); iPacket++) {
 			// new packet arrived
@@ -1718,10 +2762,27 @@ void* packet_scheduler_thread(void* )
 				localPacketsToSend.append(p);
 				continue;
 			}
+			if (tenants.isMultiTenant() && !p->injected && p->trace.isEmpty()) {
+				// isolation between tenants (the packets from other partitions have been admitted there)
+				if (!tenants.sameTenant(p->src_id, p->dst_id)) {
+					tenants.crossTenantPackets++;
+					p->dropped = true;
+					localPacketsToSend.append(p);
+					continue;
+				}
+				if (!tenants.admit(p->src_id, ts_now)) {
+					p->dropped = true;
+					localPacketsToSend.append(p);
+					continue;
+				}
+			}
 			numQueuingEvents++;
 			quint64 ts_next_event;
 			//int pkt_state = routePacket(p, p->ts_userspace_rx, ts_next_event);
-			initDelays.recordEvent(ts_now - p->ts_userspace_rx);
+			if (p->trace.isEmpty()) {
+				// not for the packets from other partitions, which are already on their way
+				initDelays.recordEvent(ts_now - p->ts_userspace_rx);
+			}
 			int pkt_state = routePacket(p, ts_now, ts_next_event);
 			if (pkt_state == PKT_QUEUED) {
 				if (DEBUG_PACKETS)
@@ -1748,63 +2809,37 @@ void* packet_scheduler_thread(void* )
 				} else {
 					injectedPacketPool.append(p);
 				}
+			} else if (pkt_state == PKT_TUNNELED) {
+				localPacketsToTunnel.append(p);
 			}
 		}
 		newPackets.clear();
-
-		// process events
-		bool receivedEvents = false;
-		for (drain(ts_now, events); !events.isEmpty(); drain(ts_now, events)) {
-			for (int iPacket = 0; iPacket < events.count(); iPacket++) {
-				Packet *p = events[iPacket];
-				QPair<Packet*, quint64> event(p, p->ts_expected_exit);
-				if (!p->dropped) {
-					receivedEvents = true;
-					numQueuingEvents++;
-					quint64 event_delay = ts_now - event.second;
-					eventDelays.recordEvent(event_delay);
-					total_event_delay += event_delay;
-				}
-				quint64 ts_next_event;
-				//int pkt_state = routePacket(p, event.second, ts_next_event);
-				int pkt_state = routePacket(p, ts_now, ts_next_event);
-				if (pkt_state == PKT_QUEUED) {
-					if (DEBUG_PACKETS)
-						printf("Enqueue: %d.%d.%d.%d -> %d.%d.%d.%d, for time = +%llu ns, tracelen = %d\n",
-							   NIPQUAD(p->src_ip),
-							   NIPQUAD(p->dst_ip),
-							   ts_next_event - ts_now,
-							   p->trace.count());
-				} else if (pkt_state == PKT_DROPPED) {
-					if (DEBUG_PACKETS)
-						printf("Drop: %d.%d.%d.%d -> %d.%d.%d.%d\n",
-							   NIPQUAD(p->src_ip),
-							   NIPQUAD(p->dst_ip));
-					packetsQdropped++;
-					p->dropped = true;
-					if (!p->injected) {
-						localPacketsToSend.append(p);
-					} else {
-						injectedPacketPool.append(p);
-					}
-				} else if (pkt_state == PKT_FORWARDED) {
-					if (!p->injected) {
-						localPacketsToSend.append(p);
-					} else {
-						injectedPacketPool.append(p);
-					}
-				}
-			}
-		}
+#if PROFILE_SCHEDULER_PHASES
+		phaseStats.cycles[SchedulerPhaseRoute] = rdtsc() - tsc_phase_start;
+#endif
 
 		// begin stats
 		if (receivedPackets || receivedEvents) {
+#if PROFILE_SCHEDULER_PHASES
+			flightRecorder.next() = phaseStats;
+#endif
 			if (tsFirstSentPacket == 0) {
 				__sync_synchronize();
 			}
 			if (tsFirstSentPacket > 0) {
 				quint64 ts_after = get_current_time();
 				quint64 loop_delay = ts_after - ts_now;
+#if PROFILE_SCHEDULER_PHASES
+				if (ts_after - tsFirstSentPacket > RECORD_STATS_DELAY) {
+					flightRecorder.recordEvent(phaseStats);
+				}
+				if (loop_delay >= flightRecorderThreshold) {
+					flightRecorder.dump(ts_now, loop_delay);
+				}
+#endif
+				if (appliedLinkUpdates) {
+					linkUpdateLoopDelays.recordEvent(loop_delay);
+				}
 				if (ts_after - tsFirstSentPacket > RECORD_STATS_DELAY) {
 					loopDelays.recordEvent(loop_delay);
 					total_loop_delay += ts_after - ts_now;
@@ -1835,26 +2870,169 @@ void* packet_scheduler_thread(void* )
 		// end stats
 	}
 
+	allocGuard.disarm();
 	malloc_profile_pause_wrapper();
 
-	emulationDuration = get_current_time() - tsStart;
+	quint64 tsEnd = get_current_time();
+#if PROFILE_SCHEDULER_PHASES
+	flightRecorder.calibrate(tsEnd);
+	flightRecorder.save("flight-recorder.txt");
+#endif
+	eventAccuracy.save("path-lateness-events.txt");
 
-	for (int e = 0; e < netGraph->edges.count(); e++) {
-		netGraph->edges[e].postEmulation();
+	finishEmulation(tsEnd);
+
+	return NULL;
+}
+
+// Wall-clock time of the offline emulation (0 for real emulations)
+static quint64 offlineWallTime;
+
+// Routes a packet in offline mode. Packets that are queued (and packets dropped asynchronously by the queue, e.g.
+// with drop-head) are scheduled in exitTimes; the others are done and go back to the pool.
+static inline void routeOffline(Packet *p, quint64 ts_now, QBinaryHeap<qint32, quint64> &exitTimes, OVector<Packet*> &pool)
+{
+	if (!p->dropped) {
+		numQueuingEvents++;
+	}
+	quint64 ts_next_event;
+	int pkt_state = routePacket(p, ts_now, ts_next_event);
+	if (pkt_state != PKT_FORWARDED && p->queue_id >= 0) {
+		const NetGraphEdge &e = netGraph->edges[p->queue_id];
+		for (int q = 0; q < e.queues.count(); q++) {
+			if (!e.queues[q].asyncDrains.isEmpty()) {
+				exitTimes.insert(p->queue_id, ts_now);
+				break;
+			}
+		}
+	}
+	if (pkt_state == PKT_QUEUED) {
+		exitTimes.insert(p->queue_id, ts_next_event);
+	} else {
+		if (pkt_state == PKT_DROPPED) {
+			packetsQdropped++;
+			p->dropped = true;
+		}
+		pool.append(p);
 	}
+}
 
-	numActiveQueues = 0;
-	for (int e = 0; e < netGraph->edges.count(); e++) {
-		for (int q = 0; q < netGraph->edges[e].queues.count(); q++) {
-			if (netGraph->edges[e].queues[q].packets_in > 0) {
-				numActiveQueues++;
+void run_offline_scheduler(TrafficSimulator *traffic, quint64 tsVirtualStart, quint64 duration)
+{
+	quint64 tsWallStart = get_current_time();
+
+	total_loop_delay = 0;
+	total_loops = 0;
+	packetsQdropped = 0;
+	numQueuingEvents = 0;
+	total_event_delay = 0;
+
+	initFlowletTable();
+	// The offline scheduler only tracks the queue exits
+	cutThroughEnabled = false;
+
+	trafficTraceRecord->events.reserve(traceInjector.totalPackets());
+
+	OVector<Packet*> pool;
+	OVector<Packet*> events;
+	events.reserve(10000);
+	// Pending queue events: (edge index, time); an edge can appear several times
+	QBinaryHeap<qint32, quint64> exitTimes(1024, false);
+
+	tsStart = tsVirtualStart;
+	trafficTraceRecord->tsStart = tsStart;
+	tsFirstSentPacket = tsStart;
+	const quint64 tsEnd = tsStart + duration;
+
+	// The virtual clock jumps from one event to the next, so the emulation runs as fast as the CPU allows
+	quint64 ts_now = tsStart;
+	while (!do_shutdown) {
+		quint64 tsNext = traffic->nextTime();
+		if (traceInjector.nextTimestamp() != ULLONG_MAX) {
+			tsNext = qMin(tsNext, tsStart + traceInjector.nextTimestamp());
+		}
+		if (fluidModel.nextChangeTime() != ULLONG_MAX) {
+			tsNext = qMin(tsNext, tsStart + fluidModel.nextChangeTime());
+		}
+		if (!exitTimes.isEmpty()) {
+			tsNext = qMin(tsNext, exitTimes.findMin().second);
+		}
+		if (tsNext >= tsEnd)
+			break;
+		ts_now = qMax(ts_now, tsNext);
+		total_loops++;
+
+		// apply the rate changes of the fluid background traffic
+		fluidModel.apply(netGraph, ts_now, ts_now - tsStart);
+
+		// new packets from the simulated sources
+		while (1) {
+			Packet *p = pool.isEmpty() ? new Packet() : pool.takeLast();
+			if (!traffic->takeDue(ts_now, p)) {
+				pool.append(p);
+				break;
+			}
+			p->ts_start_proc = ts_now;
+			p->ts_expected_exit = 0;
+			routeOffline(p, ts_now, exitTimes, pool);
+		}
+
+		// packets injected from traces
+		{
+			qint32 iTrace;
+			qint64 iPacket;
+			TrafficTracePacket tracePacket;
+			while (traceInjector.takeDue(ts_now - tsStart, iTrace, iPacket, tracePacket)) {
+				Packet *p = pool.isEmpty() ? new Packet() : pool.takeLast();
+				p->init();
+				initInjectedPacket(p, iTrace, iPacket, tracePacket, ts_now);
+				p->ts_start_proc = ts_now;
+				p->ts_expected_exit = 0;
+				routeOffline(p, ts_now, exitTimes, pool);
+			}
+		}
+
+		// queue events; routing them can schedule more events at ts_now
+		while (!exitTimes.isEmpty() && exitTimes.findMin().second <= ts_now) {
+			events.clear();
+			while (!exitTimes.isEmpty() && exitTimes.findMin().second <= ts_now) {
+				NetGraphEdge &e = netGraph->edges[exitTimes.takeMin().first];
+				for (int q = 0; q < e.queues.count(); q++) {
+					e.queues[q].drain(ts_now, events);
+				}
+			}
+			qSort(events.begin(), events.end(), comparePacketDrainEvents);
+			for (int iPacket = 0; iPacket < events.count(); iPacket++) {
+				routeOffline(events[iPacket], ts_now, exitTimes, pool);
 			}
 		}
 	}
 
-	saveRecordedData();
+	finishEmulation(tsEnd);
 
-	return NULL;
+	for (int i = 0; i < pool.count(); i++) {
+		delete pool[i];
+	}
+	offlineWallTime = get_current_time() - tsWallStart;
+}
+
+QString scheduler_tenant_stats(int tenant)
+{
+	const Tenant &t = tenants.tenants[tenant];
+	quint64 packetsIn = 0;
+	quint64 packetsOut = 0;
+	for (int p = t.firstPath; p < t.firstPath + t.numPaths; p++) {
+		packetsIn += netGraph->paths[p].packets_in;
+		packetsOut += netGraph->paths[p].packets_out;
+	}
+	return QString("Tenant %1 (%2): %3 packets admitted, %4 policed, %5 in, %6 out\n")
+			.arg(tenant)
+			.arg(QFileInfo(t.graphFileName).fileName())
+			.arg(intWithCommas2String(t.packetsAdmitted))
+			.arg(intWithCommas2String(t.packetsPoliced))
+			.arg(intWithCommas2String(packetsIn))
+			.arg(intWithCommas2String(packetsOut)) +
+			eventAccuracy.rangeToString(QString("Tenant %1").arg(tenant), t.firstPath, t.numPaths);
 }
 
 void print_scheduler_stats()
@@ -1868,6 +3046,66 @@ void print_scheduler_stats()
 	printf("%s\n", syncDelays.toString(&time2String).toLatin1().constData());
 	printf("Init delay:\n");
 	printf("%s\n", initDelays.toString(&time2String).toLatin1().constData());
+	printf("Scheduler loop time when applying link updates:\n");
+	printf("%s\n", linkUpdateLoopDelays.toString(&time2String).toLatin1().constData());
+	printf("%s\n", eventAccuracy.toString().toLatin1().constData());
+	if (flowTracking) {
+		printf("%s\n", flowTable.toString().toLatin1().constData());
+	}
+	if (tenants.isMultiTenant()) {
+		printf("Tenants: %d, packets rejected between tenants: %s\n",
+			   tenants.tenants.count(),
+			   withCommas(tenants.crossTenantPackets));
+		for (int i = 0; i < tenants.tenants.count(); i++) {
+			printf("%s", scheduler_tenant_stats(i).toLatin1().constData());
+		}
+		printf("\n");
+	}
+#if PROFILE_SCHEDULER_PHASES
+	printf("Cycles per ns: %.3f\n", flightRecorder.cyclesPerNs());
+	for (int phase = 0; phase < SchedulerPhaseCount; phase++) {
+		printf("Scheduler phase %s (cycles):\n", schedulerPhaseName(phase));
+		printf("%s\n", flightRecorder.phaseCycles[phase].toString(&intWithCommas2String).toLatin1().constData());
+	}
+	printf("Flight recorder dumps (loop time >= %s): %d (%d not recorded)\n",
+		   time2String(flightRecorderThreshold).toLatin1().constData(),
+		   flightRecorder.numDumps(),
+		   flightRecorder.numDroppedDumps());
+#endif
+
+	if (offlineWallTime > 0) {
+		printf("Offline emulation: %s of virtual time in %s (%.2fx real time), %s steps\n",
+			   time2String(emulationDuration).toLatin1().constData(),
+			   time2String(offlineWallTime).toLatin1().constData(),
+			   qreal(emulationDuration) / qreal(offlineWallTime),
+			   withCommas(total_loops));
+	}
+
+	printf("Teardown time: %s (edge stats %s, tomo data %s, timelines %s)\n",
+		   time2String(teardownTotalTime).toLatin1().constData(),
+		   time2String(teardownEdgeStatsTime).toLatin1().constData(),
+		   time2String(teardownTomoDataTime).toLatin1().constData(),
+		   time2String(teardownTimelinesTime).toLatin1().constData());
+
+	if (partitionIndex >= 0) {
+		printf("Routing lateness of the packets from other partitions:\n");
+		printf("%s\n", tunnelLateness.toString(&time2String).toLatin1().constData());
+	}
+
+	if (!fluidModel.flows.isEmpty()) {
+		quint64 fluidBytesIn = 0;
+		quint64 fluidBytesDropped = 0;
+		for (int e = 0; e < netGraph->edges.count(); e++) {
+			for (int q = 0; q < netGraph->edges[e].queues.count(); q++) {
+				fluidBytesIn += netGraph->edges[e].queues[q].fluidBytesIn;
+				fluidBytesDropped += netGraph->edges[e].queues[q].fluidBytesDropped;
+			}
+		}
+		printf("Fluid background: %d flows, %s B offered to queues, %s B dropped\n",
+			   fluidModel.flows.count(),
+			   withCommas(fluidBytesIn),
+			   withCommas(fluidBytesDropped));
+	}
 
 	printf("Total packets qdropped: %s\n",
 		   withCommas(packetsQdropped));
@@ -1916,6 +3154,42 @@ void print_scheduler_stats()
 		printf("Traffic shaping (WFQ): disabled\n");
 	}
 
+	if (ecmpHashFunction == EcmpHashRandom) {
+		printf("ECMP next hop selection: random per packet\n");
+	} else if (ecmpHashFunction == EcmpHashXor) {
+		printf("ECMP next hop selection: xor flow hash, seed %llu\n", ecmpHashSeed);
+	} else if (ecmpHashFunction == EcmpHashMurmur) {
+		printf("ECMP next hop selection: murmur flow hash, seed %llu\n", ecmpHashSeed);
+	}
+	if (ecmpFlowletGap > 0) {
+		printf("ECMP flowlet switching: gap %s, %s flowlets\n",
+			   time2String(ecmpFlowletGap).toLatin1().constData(),
+			   withCommas(numFlowlets));
+	} else {
+		printf("ECMP flowlet switching: disabled\n");
+	}
+	printf("Queuing events routed at: %s\n", eventsAtScheduledTime ? "scheduled time" : "current time");
+	if (cutThroughEnabled) {
+		printf("Cut-through: %s packets, %.1f hops per run, %s runs revoked\n",
+			   withCommas(numCutThroughPackets),
+			   numCutThroughPackets ? qreal(numCutThroughHops) / numCutThroughPackets : 0.0,
+			   withCommas(numCutThroughRevocations));
+	} else {
+		printf("Cut-through: disabled\n");
+	}
+	if (numCollapsedSegments > 0) {
+		printf("Collapsed segments: %d, with %d edges\n", numCollapsedSegments, numCollapsedEdges);
+	} else {
+		printf("Collapsed segments: none\n");
+	}
+	printf("ECMP next hop selection (cycles):\n");
+	printf("%s\n", ecmpSelectionCycles.toString(&intWithCommas2String).toLatin1().constData());
+
+	for (int iTrace = 0; iTrace < traceInjector.jitter.count(); iTrace++) {
+		printf("Trace %d injection jitter:\n", iTrace);
+		printf("%s\n", traceInjector.jitter[iTrace].toString(&time2String).toLatin1().constData());
+	}
+
 	for (int i = 0; i < highLatencyEventsTs.count(); i++) {
 		quint64 t = highLatencyEventsTs[i];
 		quint64 mem = highLatencyEventsMem[i];
@@ -1924,3 +3198,45 @@ void print_scheduler_stats()
 			   TS_FORMAT_PARAM(t - tsStart), withCommas(mem), withCommas(tc));
 	}
 }
+
+QString scheduler_stats_json()
+{
+	JsonObjectPrinter p;
+	jsonObjectPrinterAddMember(p, loopDelays);
+	jsonObjectPrinterAddMember(p, eventDelays);
+	jsonObjectPrinterAddMember(p, syncDelays);
+	jsonObjectPrinterAddMember(p, initDelays);
+	jsonObjectPrinterAddMember(p, linkUpdateLoopDelays);
+	jsonObjectPrinterAddMember(p, eventAccuracy);
+	jsonObjectPrinterAddMember(p, eventsAtScheduledTime);
+	jsonObjectPrinterAddMember(p, numCollapsedSegments);
+	jsonObjectPrinterAddMember(p, numCollapsedEdges);
+	jsonObjectPrinterAddMember(p, cutThroughEnabled);
+	jsonObjectPrinterAddMember(p, numCutThroughPackets);
+	jsonObjectPrinterAddMember(p, numCutThroughHops);
+	jsonObjectPrinterAddMember(p, numCutThroughRevocations);
+	if (flowTracking) {
+		jsonObjectPrinterAddMember(p, flowTable);
+	}
+	if (tenants.isMultiTenant()) {
+		jsonObjectPrinterAddMember(p, tenants.crossTenantPackets);
+	}
+#if PROFILE_SCHEDULER_PHASES
+	p.addMember("cyclesPerNs", flightRecorder.cyclesPerNs());
+	for (int phase = 0; phase < SchedulerPhaseCount; phase++) {
+		p.addMember(QString("phaseCycles_%1").arg(schedulerPhaseName(phase)), flightRecorder.phaseCycles[phase]);
+	}
+	p.addMember("flightRecorderDumps", flightRecorder.numDumps());
+#endif
+	if (partitionIndex >= 0) {
+		jsonObjectPrinterAddMember(p, tunnelLateness);
+	}
+	jsonObjectPrinterAddMember(p, total_loops);
+	jsonObjectPrinterAddMember(p, offlineWallTime);
+	jsonObjectPrinterAddMember(p, packetsQdropped);
+	jsonObjectPrinterAddMember(p, numActiveQueues);
+	jsonObjectPrinterAddMember(p, numQueuingEvents);
+	jsonObjectPrinterAddMember(p, numFlowlets);
+	jsonObjectPrinterAddMember(p, ecmpSelectionCycles);
+	return p.json();
+}
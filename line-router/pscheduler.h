@@ -19,10 +19,55 @@
 #ifndef PSCHEDULER_H
 #define PSCHEDULER_H
 
+#include <QtCore>
+
+#include "../util/ovector.h"
+
+class Packet;
+class TrafficSimulator;
+class LinkUpdateBatch;
+
 #define CORE_SCHEDULER 2
 
 #define DUMP_STACKTRACE_ON_MALLOC 0
 
 void* packet_scheduler_thread(void* );
 
+// Return values of routePacket()
+#define PKT_QUEUED    0
+#define PKT_DROPPED   1
+#define PKT_FORWARDED 2
+// The packet continues in another partition (see pdistributed.h)
+#define PKT_TUNNELED  3
+
+// Must be called before the first routePacket() call.
+void initFlowletTable();
+// Routes a new packet, or a packet that has just exited a queue. If the packet is queued, ts_next is the time when it
+// exits the queue.
+int routePacket(Packet *p, quint64 ts_now, quint64 &ts_next);
+// Fills result with the packets that exit the queues until ts_now (including the asynchronous drops), sorted by
+// exit time.
+void drain(quint64 ts_now, OVector<Packet*> &result);
+
+// Sets the start time of the emulation, to which the times of the link updates and fluid rate changes are relative.
+void startScheduler(quint64 ts);
+// One step of the scheduler loop: routes the queuing events due by ts_now, in the order of their scheduled times,
+// with the link updates and fluid rate changes due in the meantime (see pscheduler.cpp). The forwarded and dropped
+// packets are appended to toSend (injectedDone for the injected ones), those continuing in another partition to
+// toTunnel. Returns the number of events routed.
+int routeDueEvents(quint64 ts_now, OVector<LinkUpdateBatch*> &pendingLinkUpdates, OVector<Packet*> &toSend,
+				   OVector<Packet*> &injectedDone, OVector<Packet*> &toTunnel, bool &receivedEvents,
+				   bool &appliedLinkUpdates);
+
+// Cut-through statistics (see --cut_through): packets routed over a run of idle links, links crossed that way, and
+// runs revoked by another packet
+extern quint64 numCutThroughPackets;
+extern quint64 numCutThroughHops;
+extern quint64 numCutThroughRevocations;
+
+// Runs the scheduler in offline mode, in virtual time: there are no NICs, the packets are generated by traffic and
+// by the trace injector, and the clock jumps from one event to the next. Stops after duration nanoseconds of
+// virtual time. Runs in the calling thread.
+void run_offline_scheduler(TrafficSimulator *traffic, quint64 tsVirtualStart, quint64 duration);
+
 #endif // PSCHEDULER_H
@@ -47,6 +47,13 @@
 
 #include "psender.h"
 #include "pconsumer.h"
+#include "accuracymonitor.h"
+#include "tenants.h"
+#include "coreplacement.h"
+#include "flightrecorder.h"
+#include "allocguard.h"
+#include "pdistributed.h"
+#include "../util/json.h"
 #include "../remote_config.h"
 #include <netinet/ip.h>
 #include <netinet/udp.h>
@@ -70,6 +77,11 @@ SyncQueueType<Packet*> packetsOut;
 #define u16 __u16
 #define u8 __u8
 
+#ifndef VLAN_HLEN
+// size of an 802.1Q tag (TCI + ethertype); linux/if_vlan.h is not exported to userspace
+#define VLAN_HLEN 4
+#endif
+
 /**
  * csum_fold - Fold and invert a 32bit checksum.
  * sum: 32bit unfolded sum
@@ -357,6 +369,62 @@ void set_ip_ecn_bit(Packet *p)
 #endif
 }
 
+// Host identification by VLAN: the frame goes back to the traffic generator, tagged with the VLAN of the destination
+// host. The IP header is not touched.
+// Frames whose tag was stripped by the NIC (VLAN offload; the consumer then reads the VLAN ID from the PF_RING
+// metadata) get a new 802.1Q tag inserted after the MAC addresses.
+static quint64 untaggedFrames;
+static quint64 insertedTags;
+void retag_vlan(Packet *p)
+{
+	struct ethhdr *eh = (struct ethhdr *)(p->buffer);
+	for (int i = 0; i < ETH_ALEN; i++) {
+		qSwap(eh->h_dest[i], eh->h_source[i]);
+	}
+	if (eh->h_proto != htons(ETH_P_8021Q)) {
+		if (p->length + VLAN_HLEN > p->bufferSize()) {
+			untaggedFrames++;
+			return;
+		}
+		// move the ethertype and everything after it; the priority bits of the new TCI are zero
+		memmove(p->buffer + 2 * ETH_ALEN + VLAN_HLEN, p->buffer + 2 * ETH_ALEN, p->length - 2 * ETH_ALEN);
+		eh->h_proto = htons(ETH_P_8021Q);
+		__be16 *tci = (__be16 *)(p->buffer + ETH_HLEN);
+		*tci = htons(NetGraphNode::vlanId(p->dst_id));
+		p->length += VLAN_HLEN;
+		p->wireLength += VLAN_HLEN * p->segments;
+		p->offsets.vlan_offset = ETH_HLEN;
+		p->offsets.l3_offset += VLAN_HLEN;
+		p->offsets.l4_offset += VLAN_HLEN;
+		p->offsets.payload_offset += VLAN_HLEN;
+		insertedTags++;
+		return;
+	}
+	// keep the priority bits of the TCI
+	__be16 *tci = (__be16 *)(p->buffer + ETH_HLEN);
+	*tci = htons((ntohs(*tci) & 0xF000) | NetGraphNode::vlanId(p->dst_id));
+}
+
+// Host identification by MAC address: the frame is addressed to the interface of the destination host. The IP header
+// is not touched.
+void set_host_mac(Packet *p)
+{
+	struct ethhdr *eh = (struct ethhdr *)(p->buffer);
+	for (int i = 0; i < ETH_ALEN; i++) {
+		eh->h_source[i] = eh->h_dest[i];
+	}
+	eh->h_dest[0] = HOST_MAC_0;
+	eh->h_dest[1] = HOST_MAC_1;
+	eh->h_dest[2] = HOST_MAC_2;
+	eh->h_dest[3] = (p->dst_id >> 16) & 0xFF;
+	eh->h_dest[4] = (p->dst_id >> 8) & 0xFF;
+	eh->h_dest[5] = p->dst_id & 0xFF;
+}
+
+// CPU cycles spent on preparing each packet for sending (address rewriting, checksums), to compare the
+// host identification modes
+static TinyHistogram prepareCycles;
+
 quint64 packetsSent;
 quint64 tsFirstSentPacket;
 quint64 packetsSentStatsCount;
@@ -369,26 +437,20 @@ quint64 packetsSentSendDelayAvg;
 quint64 packetsSentSendDelayMax;
 quint64 packetsSentSendDelayRelAvg;
 quint64 packetsSentSendDelayRelMax;
+// Per-path lateness of the departures, relative to the exit time from the last link
+static AccuracyMonitor departureAccuracy;
 
-bool send_packet(pfring *pd, Packet *p)
-{
-	quint64 ts_now = get_current_time();
-	p->ts_send = ts_now;
-
-	if (!p->preparedForSend) {
-		fix_addresses(p);
-		if (p->ecn_bit_set) {
-			set_ip_ecn_bit(p);
-		}
-		p->preparedForSend = true;
-	}
+static quint64 superPacketsSent;
+static quint64 segmentsSent;
 
+static void send_frame(pfring *pd, quint8 *frame, int length)
+{
 	while (1) {
 		// 1 = Flush possible transmission queues. If set to 0, you will decrease
 		// your CPU usage but at thecost of sending packets in trains and thus at
 		// larger latency
 		const int flush_packets = 0;
-		int rc = pfring_send(pd, (char*)p->buffer, p->length, flush_packets);
+		int rc = pfring_send(pd, (char*)frame, length, flush_packets);
 		if (rc == PF_RING_ERROR_INVALID_ARGUMENT) {
 			printf("Could not send packet: PF_RING_ERROR_INVALID_ARGUMENT\n");
 			exit(EXIT_FAILURE);
@@ -399,6 +461,78 @@ bool send_packet(pfring *pd, Packet *p)
 		}
 		break;
 	}
+}
+
+// Sends a super-packet as MTU-sized TCP segments. Each segment gets a copy of the headers, with the IP length, ID and
+// checksum and the TCP sequence number, flags and checksum recomputed.
+static void send_segments(pfring *pd, Packet *p)
+{
+	static quint8 frame[MAX_FRAME_SIZE];
+	const int headerLength = p->offsets.payload_offset;
+	const int payloadLength = p->length - headerLength;
+	const struct iphdr *superIp = (const struct iphdr *)(p->buffer + p->offsets.l3_offset);
+	const struct tcphdr *superTcp = (const struct tcphdr *)(p->buffer + p->offsets.l4_offset);
+	struct iphdr *ip = (struct iphdr *)(frame + p->offsets.l3_offset);
+	struct tcphdr *tcp = (struct tcphdr *)(frame + p->offsets.l4_offset);
+
+	memcpy(frame, p->buffer, headerLength);
+	for (int offset = 0, i = 0; offset < payloadLength; offset += p->segmentSize, i++) {
+		const int segmentLength = qMin(p->segmentSize, payloadLength - offset);
+		memcpy(frame + headerLength, p->buffer + headerLength + offset, segmentLength);
+
+		const int l4Length = headerLength - p->offsets.l4_offset + segmentLength;
+		ip->tot_len = htons(headerLength - p->offsets.l3_offset + segmentLength);
+		ip->id = htons(ntohs(superIp->id) + i);
+		ip->check = 0;
+		ip->check = csum_fold(csum_partial(ip, ip->ihl * 4, 0));
+
+		tcp->seq = htonl(ntohl(superTcp->seq) + offset);
+		// CWR only on the first segment, FIN and PSH only on the last one
+		tcp->cwr = i == 0 ? superTcp->cwr : 0;
+		tcp->fin = offset + segmentLength == payloadLength ? superTcp->fin : 0;
+		tcp->psh = offset + segmentLength == payloadLength ? superTcp->psh : 0;
+		struct {
+			__be32 saddr;
+			__be32 daddr;
+			u8 zero;
+			u8 protocol;
+			__be16 length;
+		} __attribute__((packed)) pseudoHeader = { ip->saddr, ip->daddr, 0, IPPROTO_TCP, htons(l4Length) };
+		tcp->check = 0;
+		tcp->check = csum_fold(csum_partial(tcp, l4Length, csum_partial(&pseudoHeader, sizeof(pseudoHeader), 0)));
+
+		send_frame(pd, frame, headerLength + segmentLength);
+		segmentsSent++;
+	}
+	superPacketsSent++;
+}
+
+bool send_packet(pfring *pd, Packet *p)
+{
+	quint64 ts_now = get_current_time();
+	p->ts_send = ts_now;
+
+	if (!p->preparedForSend) {
+		const quint64 tsc = rdtsc();
+		if (hostIdentification == HostIdentificationNat) {
+			fix_addresses(p);
+		} else if (hostIdentification == HostIdentificationVlan) {
+			retag_vlan(p);
+		} else {
+			set_host_mac(p);
+		}
+		if (p->ecn_bit_set) {
+			set_ip_ecn_bit(p);
+		}
+		p->preparedForSend = true;
+		prepareCycles.recordEvent(rdtsc() - tsc);
+	}
+
+	if (p->segments > 1) {
+		send_segments(pd, p);
+	} else {
+		send_frame(pd, p->buffer, p->length);
+	}
 
 	if (tsFirstSentPacket == 0) {
 		tsFirstSentPacket = ts_now;
@@ -406,6 +540,14 @@ bool send_packet(pfring *pd, Packet *p)
 	}
 	packetsSent++;
 
+	// Packets forwarded without being queued (ts_expected_exit == 0) have no scheduled departure
+	if (p->ts_expected_exit > 0) {
+		quint64 lateness = ts_now > p->ts_expected_exit ? ts_now - p->ts_expected_exit : 0;
+		if (departureAccuracy.record(p->path_id, lateness)) {
+			abortOnAccuracyViolation();
+		}
+	}
+
 	if (DEBUG_PACKETS)
 		printf("Sent packet with length %d\n",
 			   p->length - p->offsets.l3_offset);
@@ -463,7 +605,7 @@ void* packet_sender_thread(void* )
 	pthread_setname_np(pthread_self(), "line-packet-sender");
 
 	u_int numCPU = sysconf(_SC_NPROCESSORS_ONLN);
-	u_long core_id = CORE_SENDER;
+	u_long core_id = corePlacement.cpu(CoreSender);
 
 	if (bind2core(core_id) == 0) {
 		printf("Set thread sender affinity to core %lu/%u\n", core_id, numCPU);
@@ -473,9 +615,9 @@ void* packet_sender_thread(void* )
 
 	warmMallocCache();
 
-	pfring *pd = pfring_open(REMOTE_DEDICATED_IF_ROUTER, 1500, 0);
+	pfring *pd = pfring_open(emulatorInterface.toLatin1().data(), 1500, 0);
 	if (pd == NULL) {
-		printf("pfring_open %s error [%s]\n", REMOTE_DEDICATED_IF_ROUTER, strerror(errno));
+		printf("pfring_open %s error [%s]\n", emulatorInterface.toLatin1().constData(), strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
@@ -504,19 +646,28 @@ void* packet_sender_thread(void* )
 	packetsSentSendDelayRelAvg = 0;
 	packetsSentSendDelayRelMax = 0;
     bytesSent = 0;
+	superPacketsSent = 0;
+	segmentsSent = 0;
+	untaggedFrames = 0;
+	prepareCycles = TinyHistogram();
+	departureAccuracy.init("Departure", netGraph->paths.count(), latenessThreshold, latenessAbortFraction);
 
 	OVector<Packet*> newPackets;
     newPackets.reserve(1000);
+	OVector<Packet*> recycledPackets;
+	recycledPackets.reserve(1000);
 
 	barrierInitDone.wait();
 	barrierStart.wait();
 
 	tsStart = get_current_time();
+	AllocGuard allocGuard("sender", tsStart);
 
 	while (1) {
 		if (do_shutdown) {
 			break;
 		}
+		allocGuard.update();
 
 		// process new packets
 		packetsOut.dequeueAll(newPackets);
@@ -533,7 +684,17 @@ void* packet_sender_thread(void* )
 		} else {
 			//sched_yield();
 		}
+
+		// packets sent to other partitions
+		if (partitionIndex >= 0) {
+			tunnelRecycled.dequeueAll(recycledPackets);
+			if (!recycledPackets.isEmpty()) {
+				packetPool.enqueue(recycledPackets);
+				recycledPackets.clear();
+			}
+		}
 	}
+	allocGuard.disarm();
 	malloc_profile_pause_wrapper();
 
 	pfring_close(pd);
@@ -554,6 +715,20 @@ void print_sender_stats()
 		   withCommas(bytesSent));
 	printf("Bits sent per second: %s Mbps\n",
 		   withCommas(qreal(bytesSent) * 8 * 1.0e3 / emulationDuration));
+	printf("Host identification: %s\n",
+		   hostIdentification == HostIdentificationNat ? "NAT (address rewriting)" :
+		   hostIdentification == HostIdentificationVlan ? "VLAN" : "MAC");
+	printf("Send preparation cost (CPU cycles per packet): %s\n",
+		   prepareCycles.toString(&intWithCommas2String).toLatin1().constData());
+	if (insertedTags > 0) {
+		printf("VLAN tags inserted into frames received untagged: %s\n", withCommas(insertedTags));
+	}
+	if (untaggedFrames > 0) {
+		printf("WARNING: %s frames without a VLAN tag could not be retagged (no room for the tag)\n", withCommas(untaggedFrames));
+	}
+	printf("Super-packets sent: %s (as %s segments)\n",
+		   withCommas(superPacketsSent),
+		   withCommas(segmentsSent));
 	printf("Total packets sent with delay error > 10%%: %s (%f%% of total packets)\n",
 		   withCommas(packetsSentErr10p),
 		   packetsSentStatsCount ? (packetsSentErr10p * 100.0)/packetsSentStatsCount : 0);
@@ -572,4 +747,38 @@ void print_sender_stats()
 	printf("Send delay (relative to theoretical, ideally 0): avg %llu%%, max %llu%%\n",
 		   packetsSentSendDelayRelAvg / qMax(packetsSentStatsCount, 1ULL),
 		   packetsSentSendDelayRelMax);
+	printf("%s\n", departureAccuracy.toString().toLatin1().constData());
+	for (int i = 0; tenants.isMultiTenant() && i < tenants.tenants.count(); i++) {
+		printf("%s", sender_tenant_stats(i).toLatin1().constData());
+	}
+	departureAccuracy.save("path-lateness-departures.txt");
+}
+
+QString sender_tenant_stats(int tenant)
+{
+	return departureAccuracy.rangeToString(QString("Tenant %1").arg(tenant),
+										   tenants.tenants[tenant].firstPath,
+										   tenants.tenants[tenant].numPaths);
+}
+
+QString sender_stats_json()
+{
+	JsonObjectPrinter p;
+	jsonObjectPrinterAddMember(p, packetsSent);
+	jsonObjectPrinterAddMember(p, bytesSent);
+	jsonObjectPrinterAddMember(p, superPacketsSent);
+	jsonObjectPrinterAddMember(p, segmentsSent);
+	jsonObjectPrinterAddMember(p, untaggedFrames);
+	jsonObjectPrinterAddMember(p, prepareCycles);
+	jsonObjectPrinterAddMember(p, packetsSentStatsCount);
+	jsonObjectPrinterAddMember(p, packetsSentErr10p);
+	jsonObjectPrinterAddMember(p, packetsSentErr25p);
+	jsonObjectPrinterAddMember(p, packetsSentErr50p);
+	p.addMember("averageRelativeDelayError",
+				packetsSentStatsCount ? packetsSentErrAvg * 0.01 / packetsSentStatsCount : 0.0);
+	p.addMember("maxRelativeDelayError", packetsSentErrpMax * 0.01);
+	p.addMember("sendDelayAverage", packetsSentSendDelayAvg / qMax(packetsSentStatsCount, 1ULL));
+	jsonObjectPrinterAddMember(p, packetsSentSendDelayMax);
+	jsonObjectPrinterAddMember(p, departureAccuracy);
+	return p.json();
 }
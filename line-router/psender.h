@@ -30,5 +30,9 @@ extern SyncQueueType<Packet*> packetsOut;
 
 void* packet_sender_thread(void* );
 void print_sender_stats();
+// See consumer_stats_json()
+QString sender_stats_json();
+// The departure lateness of one tenant (see tenants.h)
+QString sender_tenant_stats(int tenant);
 
 #endif // PSENDER_H
@@ -0,0 +1,161 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "psimulator.h"
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+
+#include "pdistributed.h"
+#include "pscheduler.h"
+#include "../util/util.h"
+
+// Same frame size as the UDP sources of line-traffic (1400 B payload + headers)
+#define SIMULATED_FRAME_SIZE (1400 + 42)
+
+TrafficSimulator::TrafficSimulator()
+	: packetsGenerated(0),
+	  heap(128, false)
+{
+}
+
+void TrafficSimulator::init(NetGraph *netGraph, quint64 tsStart)
+{
+	sources.clear();
+	skipped.clear();
+	foreach (NetGraphConnection c, netGraph->connections) {
+		if (c.maskedOut)
+			continue;
+		if (netGraph->nodes[c.source].maskedOut)
+			continue;
+		if (c.basicType != "UDP-CBR") {
+			skipped << QString("%1 (%2 -> %3): %4").arg(c.index).arg(c.source).arg(c.dest).arg(c.encodedType);
+			continue;
+		}
+		// on/off schedule, as in createOnOffTimers() of line-traffic
+		qreal firstStart = c.onOff ? frand() * (c.onDurationMax + c.offDurationMax) : frand();
+		qreal onDuration = c.onOff ? c.onDurationMin + frand() * (c.onDurationMax - c.onDurationMin) : 0.0;
+		qreal offDuration = c.onOff ? c.offDurationMin + frand() * (c.offDurationMax - c.offDurationMin) : 0.0;
+		for (int i = 0; i < c.multiplier; i++) {
+			SimulatedSource s;
+			s.connection = c.index;
+			s.source = c.source;
+			s.dest = c.dest;
+			s.srcPort = 32768 + sources.count() % 28000;
+			s.dstPort = i < c.ports.count() ? c.ports[i] : 0;
+			s.trafficClass = c.trafficClass;
+			s.rate_Bps = c.rate_Mbps * 1.0e6 / 8.0 / qreal(c.multiplier) / timeDilation;
+			s.poisson = c.poisson;
+			s.tsOn = tsStart + quint64(firstStart * timeDilation * SEC_TO_NSEC);
+			s.onDuration = quint64(onDuration * timeDilation * SEC_TO_NSEC);
+			s.period = c.onOff ? quint64((onDuration + offDuration) * timeDilation * SEC_TO_NSEC) : 0;
+			if (s.rate_Bps <= 0)
+				continue;
+			sources.append(s);
+			schedule(sources.count() - 1, s.tsOn);
+		}
+	}
+}
+
+void TrafficSimulator::schedule(int iSource, quint64 tsAfter)
+{
+	SimulatedSource &s = sources[iSource];
+	quint64 ts = qMax(tsAfter, s.tsOn);
+	if (s.period > 0 && (ts - s.tsOn) % s.period >= s.onDuration) {
+		// off: skip to the start of the next on period
+		ts = s.tsOn + ((ts - s.tsOn) / s.period + 1) * s.period;
+	}
+	s.tsNext = ts;
+	heap.insert(iSource, ts);
+}
+
+bool TrafficSimulator::takeDue(quint64 ts_now, Packet *p)
+{
+	if (heap.isEmpty())
+		return false;
+	QPair<qint32, quint64> head = heap.findMin();
+	if (head.second > ts_now)
+		return false;
+	heap.takeMin();
+	const SimulatedSource &s = sources[head.first];
+
+	p->init();
+	p->generateNewId();
+	p->ts_driver_rx = head.second;
+	p->ts_userspace_rx = head.second;
+	p->length = SIMULATED_FRAME_SIZE;
+	p->wireLength = p->length;
+	p->src_ip = NAT_SUBNET | htonl(s.source + IP_OFFSET);
+	p->dst_ip = NAT_SUBNET | NAT_FOREIGN | htonl(s.dest + IP_OFFSET);
+	p->src_id = s.source;
+	p->dst_id = s.dest;
+	p->l4_protocol = IPPROTO_UDP;
+	p->l4_src_port = s.srcPort;
+	p->l4_dst_port = s.dstPort;
+	p->traffic_class = s.trafficClass;
+	setFlowHash(p);
+	packetsGenerated++;
+
+	qreal interval = SIMULATED_FRAME_SIZE / s.rate_Bps;
+	if (s.poisson) {
+		interval = -log(1.0 - frandex()) * interval;
+	}
+	schedule(head.first, head.second + qMax(1ULL, quint64(interval * SEC_TO_NSEC)));
+	return true;
+}
+
+int runOfflineEmulation(int argc, char **argv)
+{
+	do_shutdown = 0;
+
+	QString graphFileName;
+	quint64 intervalSize;
+	parseEmulatorArgs(argc, argv, graphFileName, intervalSize);
+	if (partitionIndex >= 0) {
+		fprintf(stderr, "Distributed emulation is not supported in offline mode\n");
+		return EXIT_FAILURE;
+	}
+	prepareExperiment(graphFileName, intervalSize);
+
+	// The virtual clock starts at the current time, so that all the timestamps look like those of a real run
+	quint64 tsStart = get_current_time();
+	TrafficSimulator traffic;
+	traffic.init(netGraph, tsStart);
+	if (!traffic.skipped.isEmpty()) {
+		// Leaving them out would silently produce results for a different workload
+		foreach (QString connection, traffic.skipped) {
+			fprintf(stderr, "Connection %s cannot be simulated (only UDP-CBR is supported offline)\n",
+					connection.toLatin1().constData());
+		}
+		fprintf(stderr, "Offline emulation: %d connections cannot be simulated, run the experiment online\n",
+				traffic.skipped.count());
+		return EXIT_FAILURE;
+	}
+	printf("Offline emulation: %d simulated sources\n", traffic.sources.count());
+
+	run_offline_scheduler(&traffic, tsStart, estimatedDuration);
+
+	printf("Offline emulation: %s packets generated\n", withCommas(traffic.packetsGenerated));
+	print_scheduler_stats();
+	fprintf(stdout, "=========================\n\n");
+
+	saveExperimentResults();
+
+	return 0;
+}
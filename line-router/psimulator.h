@@ -0,0 +1,83 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef PSIMULATOR_H
+#define PSIMULATOR_H
+
+#include <QtCore>
+
+#include "pconsumer.h"
+#include "../util/debug.h"
+#include "../util/qbinaryheap.h"
+
+// A packet source in offline mode, generated from a connection of the graph.
+class SimulatedSource {
+public:
+	qint32 connection;
+	qint32 source;
+	qint32 dest;
+	quint16 srcPort;
+	quint16 dstPort;
+	qint32 trafficClass;
+	// Frame rate in B/s (same as the raw rate of line-traffic)
+	qreal rate_Bps;
+	bool poisson;
+	// On/off schedule (in virtual time); period == 0 means always on after tsOn
+	quint64 tsOn;
+	quint64 onDuration;
+	quint64 period;
+	// Time of the next packet
+	quint64 tsNext;
+};
+
+// Generates the packets of the open-loop connections of the graph (UDP-CBR, optionally Poisson and on/off), with
+// the same parameters as line-traffic, in virtual time. Closed-loop connections (TCP) and the other line-traffic
+// models need real endpoints and are not simulated; runOfflineEmulation() refuses graphs that have any.
+class TrafficSimulator
+{
+public:
+	TrafficSimulator();
+
+	// Creates the sources. tsStart is the virtual time at which the simulation starts.
+	void init(NetGraph *netGraph, quint64 tsStart);
+
+	// Time of the next packet, or ULLONG_MAX if there are no more packets.
+	inline quint64 nextTime() {
+		return heap.isEmpty() ? ULLONG_MAX : heap.findMin().second;
+	}
+
+	// If a packet is due at ts_now, fills in p and returns true.
+	bool takeDue(quint64 ts_now, Packet *p);
+
+	QVector<SimulatedSource> sources;
+	// Descriptions of the connections that cannot be simulated
+	QStringList skipped;
+	quint64 packetsGenerated;
+
+protected:
+	void schedule(int iSource, quint64 tsAfter);
+
+	QBinaryHeap<qint32, quint64> heap;
+};
+
+// Offline mode: runs the emulation without NICs or root, in virtual time driven by the traffic simulator, and
+// produces the same result files as a real emulation. argv starts with the graph file name, like the arguments
+// following the PF_RING ones in runPacketFilter; the duration is given by --estimated_duration.
+int runOfflineEmulation(int argc, char **argv);
+
+#endif // PSIMULATOR_H
@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# Runs all the partitions of a distributed emulation on this machine, e.g. to test the partitioning without a
+# cluster.
+#
+# Usage: run-partitions-local.sh [--loopback] <graph file> <simulation id> <partitions file> [<line-router args>...]
+#
+# The partitions file must list 127.0.0.1 (or another local address) with a distinct UDP port for each partition
+# (see EmulationPartitioning::load). Each partition captures on its own interface (--interface):
+#  - by default, a veth pair is created per partition: the emulator uses lrp<index>, and the traffic of the hosts
+#    of that partition must be sent on the peer end, lrp<index>h (e.g. from a network namespace);
+#  - with --loopback, all the partitions share lo; every partition sees every frame, and each one injects only those
+#    sent by its own hosts.
+# The output of partition <index> goes to partition-<index>.log. The veth pairs are removed on exit.
+# Must be run as root (PF_RING and veth setup).
+
+SCRIPT_DIR=$(cd "$(dirname "$0")" && pwd)
+LINE_ROUTER=${LINE_ROUTER:-$SCRIPT_DIR/line-router}
+
+LOOPBACK=0
+if [ "$1" == "--loopback" ]
+then
+	LOOPBACK=1
+	shift
+fi
+
+if [ $# -lt 3 ]
+then
+	echo "Usage: $0 [--loopback] <graph file> <simulation id> <partitions file> [<line-router args>...]" >&2
+	exit 2
+fi
+GRAPH=$1
+SIMULATION_ID=$2
+PARTITIONS=$3
+shift 3
+
+NUM_PARTITIONS=$(grep -c '^[[:space:]]*partition[[:space:]]' "$PARTITIONS")
+if [ "$NUM_PARTITIONS" -lt 1 ]
+then
+	echo "No partitions in $PARTITIONS" >&2
+	exit 2
+fi
+
+cleanup() {
+	kill $PIDS 2>/dev/null
+	if [ $LOOPBACK -eq 0 ]
+	then
+		for i in $(seq 0 $((NUM_PARTITIONS - 1)))
+		do
+			ip link del lrp$i 2>/dev/null
+		done
+	fi
+}
+trap cleanup EXIT INT TERM
+
+PIDS=""
+for i in $(seq 0 $((NUM_PARTITIONS - 1)))
+do
+	if [ $LOOPBACK -eq 1 ]
+	then
+		IFACE=lo
+	else
+		IFACE=lrp$i
+		ip link del $IFACE 2>/dev/null
+		ip link add $IFACE type veth peer name ${IFACE}h || exit 2
+		ip link set $IFACE up || exit 2
+		ip link set ${IFACE}h up || exit 2
+	fi
+	echo "Partition $i: interface $IFACE, log partition-$i.log"
+	"$LINE_ROUTER" "$GRAPH" "$SIMULATION_ID" --partition $i --partitions "$PARTITIONS" --interface $IFACE "$@" \
+		> partition-$i.log 2>&1 &
+	PIDS="$PIDS $!"
+done
+
+STATUS=0
+for PID in $PIDS
+do
+	wait $PID || STATUS=1
+done
+PIDS=""
+exit $STATUS
@@ -0,0 +1,786 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Scheduler tests: small graphs built in memory are run through the routing and queuing code of the scheduler, in
+// virtual time, without PF_RING or NICs. Usage:
+//   line-router-test [<test name>...]
+// Without arguments, runs all the tests. A failed check prints its location and aborts (see util/test.h).
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+
+#include "pconsumer.h"
+#include "pscheduler.h"
+#include "pcontrol.h"
+#include "fluidmodel.h"
+#include "flowtable.h"
+#include "../util/util.h"
+#include "../util/test.h"
+#include "../util/tinyhistogram.h"
+
+// A packet sent by a host in a test scenario. ts is relative to the start of the scenario.
+struct TestArrival {
+	quint64 ts;
+	qint32 source;
+	qint32 dest;
+	int size;
+	quint16 srcPort;
+};
+
+// What happened to the packet of an arrival.
+struct TestOutcome {
+	bool forwarded;
+	// When the packet left the network (forwarded) or was dropped, relative to the start of the scenario
+	quint64 ts;
+	QList<qint32> trace;
+};
+
+// Called once by runScenario() at the given time (relative to the start of the scenario).
+typedef void (*TestAction)(quint64 ts_now);
+
+static QString testDir;
+
+// Routes the packets for dest along the given nodes, and adds the path. The emulator only uses the routes; the path
+// is needed for the statistics.
+static void addRoute(NetGraph &g, QList<qint32> nodes)
+{
+	NetGraphPath path;
+	path.source = nodes.first();
+	path.dest = nodes.last();
+	path.recordSampledTimeline = false;
+	path.timelineSamplingPeriod = SEC_TO_NSEC;
+	path.retraceFailed = false;
+	for (int i = 0; i + 1 < nodes.count(); i++) {
+		g.nodes[nodes[i]].routes.localRoutes.insert(path.dest, Route(path.dest, nodes[i + 1]));
+		foreach (NetGraphEdge e, g.edges) {
+			if (e.source == nodes[i] && e.dest == nodes[i + 1]) {
+				path.edgeList << e;
+				path.edgeSet.insert(e);
+			}
+		}
+	}
+	COMPARE(path.edgeList.count(), nodes.count() - 1);
+	g.paths.append(path);
+}
+
+// Saves the graph and prepares the emulation with the given line-router options, as runPacketFilter() does.
+static void setupEmulation(NetGraph &g, QString name, QStringList options)
+{
+	QDir::setCurrent(testDir);
+	QString graphFileName = QString("%1/%2.graph").arg(testDir).arg(name);
+	g.setFileName(graphFileName);
+	ASSERT(g.saveToFile());
+
+	QList<QByteArray> args;
+	args << graphFileName.toLatin1() << name.toLatin1();
+	foreach (QString option, options) {
+		args << option.toLatin1();
+	}
+	QVector<char*> argv;
+	for (int i = 0; i < args.count(); i++) {
+		argv << args[i].data();
+	}
+	QString parsedGraphFileName;
+	quint64 intervalSize;
+	parseEmulatorArgs(argv.count(), argv.data(), parsedGraphFileName, intervalSize);
+	prepareExperiment(parsedGraphFileName, intervalSize);
+	initFlowletTable();
+}
+
+// Makes the packet of an arrival, received at tsBase + a.ts.
+static Packet* makeArrivalPacket(const TestArrival &a, int id, quint64 tsBase)
+{
+	Packet *p = new Packet();
+	p->id = id;
+	p->ts_driver_rx = tsBase + a.ts;
+	p->ts_userspace_rx = tsBase + a.ts;
+	p->ts_start_proc = tsBase + a.ts;
+	p->length = a.size;
+	p->wireLength = p->length;
+	p->src_ip = NAT_SUBNET | htonl(a.source + IP_OFFSET);
+	p->dst_ip = NAT_SUBNET | NAT_FOREIGN | htonl(a.dest + IP_OFFSET);
+	p->src_id = a.source;
+	p->dst_id = a.dest;
+	p->l4_protocol = IPPROTO_UDP;
+	p->l4_src_port = a.srcPort;
+	p->l4_dst_port = 5001;
+	setFlowHash(p);
+	return p;
+}
+
+// Runs the arrivals through the scheduler code, in virtual time and in timestamp order: the packets leaving the
+// queues are routed at their scheduled exit time, before the new packets that arrive at the same time. Returns when
+// all the packets have left the network, with the outcome of each arrival.
+static QList<TestOutcome> runScenario(QList<TestArrival> arrivals, quint64 tsAction = 0, TestAction action = NULL)
+{
+	// the virtual clock starts at the current time, as in the offline mode, so that the timestamps are valid for
+	// the interval measurements
+	const quint64 tsBase = get_current_time();
+
+	QList<TestOutcome> outcomes;
+	QVector<Packet*> packets;
+	for (int i = 0; i < arrivals.count(); i++) {
+		Q_ASSERT_FORCE(i == 0 || arrivals[i].ts >= arrivals[i - 1].ts);
+		packets << makeArrivalPacket(arrivals[i], i, tsBase);
+		outcomes << TestOutcome();
+	}
+
+	// Drained packets waiting to be routed, by exit time
+	QMultiMap<quint64, Packet*> pending;
+	OVector<Packet*> events;
+	events.reserve(1000);
+	int numInFlight = 0;
+	int nextArrival = 0;
+	bool actionDone = action == NULL;
+	quint64 ts_now = tsBase;
+	while (nextArrival < arrivals.count() || numInFlight > 0 || !actionDone) {
+		quint64 horizon = ts_now + MSEC_TO_NSEC;
+		if (nextArrival < arrivals.count()) {
+			horizon = qMin(horizon, tsBase + arrivals[nextArrival].ts);
+		}
+		if (!actionDone) {
+			horizon = qMin(horizon, tsBase + tsAction);
+		}
+		if (fluidModel.nextChangeTime() != ULLONG_MAX) {
+			horizon = qMin(horizon, tsBase + fluidModel.nextChangeTime());
+		}
+		// the queue exits until the horizon, including those caused by routing the earlier ones
+		while (1) {
+			drain(horizon, events);
+			for (int i = 0; i < events.count(); i++) {
+				// the packets dropped by another arrival are done at the time of the drop
+				pending.insert(qMin(events[i]->ts_expected_exit, horizon), events[i]);
+			}
+			if (pending.isEmpty())
+				break;
+			QMultiMap<quint64, Packet*>::iterator next = pending.begin();
+			const quint64 ts_event = qMax(ts_now, next.key());
+			Packet *p = next.value();
+			pending.erase(next);
+			numInFlight--;
+			ts_now = ts_event;
+			quint64 ts_next;
+			int state = routePacket(p, ts_now, ts_next);
+			Q_ASSERT_FORCE(state != PKT_TUNNELED);
+			if (state == PKT_QUEUED) {
+				numInFlight++;
+			} else {
+				TestOutcome &outcome = outcomes[p->id];
+				outcome.forwarded = state == PKT_FORWARDED && !p->dropped;
+				outcome.ts = ts_now - tsBase;
+				outcome.trace = p->trace.toList();
+			}
+		}
+		ts_now = horizon;
+		fluidModel.apply(netGraph, ts_now, ts_now - tsBase);
+		if (!actionDone && ts_now == tsBase + tsAction) {
+			action(ts_now);
+			actionDone = true;
+		}
+		for (; nextArrival < arrivals.count() && tsBase + arrivals[nextArrival].ts == ts_now; nextArrival++) {
+			Packet *p = packets[nextArrival];
+			quint64 ts_next;
+			int state = routePacket(p, ts_now, ts_next);
+			if (state == PKT_QUEUED) {
+				numInFlight++;
+			} else {
+				TestOutcome &outcome = outcomes[p->id];
+				outcome.forwarded = false;
+				outcome.ts = ts_now - tsBase;
+				outcome.trace = p->trace.toList();
+			}
+		}
+	}
+
+	for (int i = 0; i < packets.count(); i++) {
+		delete packets[i];
+	}
+	return outcomes;
+}
+
+// A host sending through a router over a fast link to another host behind a slow link, which is where packets queue.
+// Node 0: sender, 1: router, 2: receiver. Edge 0: sender -> router, edge 1: router -> receiver.
+static NetGraph* makeBottleneckGraph(qreal bottleneck_KBps, int queueLength)
+{
+	NetGraph *g = new NetGraph();
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addNode(NETGRAPH_NODE_ROUTER);
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addEdge(0, 1, 100000, 1, 0, 100);
+	g->addEdge(1, 2, bottleneck_KBps, 1, 0, queueLength);
+	g->addEdge(2, 1, 100000, 1, 0, 100);
+	g->addEdge(1, 0, 100000, 1, 0, 100);
+	addRoute(*g, QList<qint32>() << 0 << 1 << 2);
+	addRoute(*g, QList<qint32>() << 2 << 1 << 0);
+	return g;
+}
+
+static void shrinkBottleneck(quint64 ts_now)
+{
+	LinkUpdate update;
+	update.edgeIndex = 1;
+	update.queueLength = 10;
+	netGraph->edges[update.edgeIndex].reconfigure(update, ts_now);
+}
+
+// A control socket update shrinks a queue below its current load: the packets already queued keep their exit
+// times, and the queue drops the new packets until it has drained below the new capacity.
+static void testShrinkLoadedQueue()
+{
+	foreach (QString discipline, QStringList() << "drop-tail" << "drop-head" << "drop-rand") {
+		NetGraph *g = makeBottleneckGraph(1000, 100);
+		setupEmulation(*g, "shrink-loaded-queue", QStringList() << "--queuing_discipline" << discipline);
+		delete g;
+
+		QList<TestArrival> arrivals;
+		// 50 frames back to back, which queue on the 1 MB/s bottleneck (75 ms of backlog)
+		for (int i = 0; i < 50; i++) {
+			TestArrival a = { i * 20 * USEC_TO_NSEC, 0, 2, 1500, 10000 };
+			arrivals << a;
+		}
+		// 20 frames after the queue is shrunk to 10 frames; the backlog is still above 60 KB
+		for (int i = 0; i < 20; i++) {
+			TestArrival a = { 5 * MSEC_TO_NSEC + i * 100 * USEC_TO_NSEC, 0, 2, 1500, 10001 };
+			arrivals << a;
+		}
+		// 5 frames once the queue has drained
+		for (int i = 0; i < 5; i++) {
+			TestArrival a = { 200 * MSEC_TO_NSEC + i * 2 * MSEC_TO_NSEC, 0, 2, 1500, 10002 };
+			arrivals << a;
+		}
+		QList<TestOutcome> outcomes = runScenario(arrivals, 4 * MSEC_TO_NSEC, shrinkBottleneck);
+
+		for (int i = 0; i < 50; i++) {
+			ASSERT(outcomes[i].forwarded);
+		}
+		for (int i = 50; i < 70; i++) {
+			ASSERT(!outcomes[i].forwarded);
+		}
+		for (int i = 70; i < 75; i++) {
+			ASSERT(outcomes[i].forwarded);
+		}
+		COMPARE(netGraph->edges[1].queues[0].qcapacity, quint64(10 * ETH_FRAME_LEN));
+		printf("%s: OK (%s)\n", __FUNCTION__, discipline.toLatin1().constData());
+	}
+}
+
+// Two hosts sending through a router to a third host behind a slow link.
+// Node 0: foreground sender, 1: router, 2: receiver, 3: background sender. Edge 1: router -> receiver.
+static NetGraph* makeSharedBottleneckGraph(qreal bottleneck_KBps, int queueLength)
+{
+	NetGraph *g = new NetGraph();
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addNode(NETGRAPH_NODE_ROUTER);
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addEdge(0, 1, 100000, 1, 0, 100);
+	g->addEdge(1, 2, bottleneck_KBps, 1, 0, queueLength);
+	g->addEdge(2, 1, 100000, 1, 0, 100);
+	g->addEdge(1, 0, 100000, 1, 0, 100);
+	g->addEdge(3, 1, 100000, 1, 0, 100);
+	g->addEdge(1, 3, 100000, 1, 0, 100);
+	addRoute(*g, QList<qint32>() << 0 << 1 << 2);
+	addRoute(*g, QList<qint32>() << 2 << 1 << 0);
+	addRoute(*g, QList<qint32>() << 3 << 1 << 2);
+	addRoute(*g, QList<qint32>() << 2 << 1 << 3);
+	return g;
+}
+
+// Validates the fluid background model against packet-level background traffic: the same aggregate (CBR above the
+// capacity of the bottleneck for 500 ms, then silent) is emulated once as packets and once as fluid, and the delays
+// of foreground probes sharing the bottleneck are compared. The fluid queue must follow the packet queue within the
+// transmission time of a background frame, plus 5%.
+static void testFluidBackgroundAccuracy()
+{
+	const qreal bottleneck_KBps = 1000;
+	const qreal background_KBps = 1200;
+	const int frameSize = 1500;
+	const quint64 backgroundStop = 500 * MSEC_TO_NSEC;
+
+	QList<TestArrival> probes;
+	for (quint64 ts = 5 * MSEC_TO_NSEC; ts < 1000 * MSEC_TO_NSEC; ts += 10 * MSEC_TO_NSEC) {
+		TestArrival a = { ts, 0, 2, 100, 10000 };
+		probes << a;
+	}
+
+	// Packet-level background
+	QList<quint64> packetDelays;
+	{
+		NetGraph *g = makeSharedBottleneckGraph(bottleneck_KBps, 1000);
+		setupEmulation(*g, "fluid-accuracy-packets", QStringList());
+		delete g;
+
+		QList<TestArrival> arrivals;
+		QList<int> probeIndices;
+		const quint64 period = quint64(frameSize * 1.0e9 / (background_KBps * 1000.0));
+		quint64 tsBackground = 0;
+		for (int i = 0; i < probes.count(); i++) {
+			for (; tsBackground < backgroundStop && tsBackground <= probes[i].ts; tsBackground += period) {
+				TestArrival a = { tsBackground, 3, 2, frameSize, 20000 };
+				arrivals << a;
+			}
+			probeIndices << arrivals.count();
+			arrivals << probes[i];
+		}
+		for (; tsBackground < backgroundStop; tsBackground += period) {
+			TestArrival a = { tsBackground, 3, 2, frameSize, 20000 };
+			arrivals << a;
+		}
+		QList<TestOutcome> outcomes = runScenario(arrivals);
+		for (int i = 0; i < outcomes.count(); i++) {
+			ASSERT(outcomes[i].forwarded);
+		}
+		foreach (int i, probeIndices) {
+			packetDelays << outcomes[i].ts - arrivals[i].ts;
+		}
+	}
+
+	// Fluid background
+	QList<quint64> fluidDelays;
+	{
+		QString fluidFileName = QString("%1/fluid-accuracy.txt").arg(testDir);
+		ASSERT(saveFile(fluidFileName, QString("3 2 %1 0 %2\n").arg(background_KBps).arg(backgroundStop * 1.0e-9)));
+		NetGraph *g = makeSharedBottleneckGraph(bottleneck_KBps, 1000);
+		setupEmulation(*g, "fluid-accuracy-fluid", QStringList() << "--fluid_background" << fluidFileName);
+		delete g;
+
+		QList<TestOutcome> outcomes = runScenario(probes);
+		for (int i = 0; i < outcomes.count(); i++) {
+			ASSERT(outcomes[i].forwarded);
+			fluidDelays << outcomes[i].ts - probes[i].ts;
+		}
+	}
+
+	const quint64 frameTime = quint64(frameSize * 1.0e9 / (bottleneck_KBps * 1000.0));
+	quint64 maxPacketDelay = 0;
+	quint64 maxError = 0;
+	for (int i = 0; i < probes.count(); i++) {
+		quint64 error = packetDelays[i] > fluidDelays[i] ? packetDelays[i] - fluidDelays[i] : fluidDelays[i] - packetDelays[i];
+		ASSERT(error <= frameTime + packetDelays[i] / 20);
+		maxPacketDelay = qMax(maxPacketDelay, packetDelays[i]);
+		maxError = qMax(maxError, error);
+	}
+	// The background must have built up a queue, otherwise the comparison is meaningless: 200 KB/s of excess during
+	// 500 ms is 100 ms of queuing at the end
+	ASSERT(maxPacketDelay > 90 * MSEC_TO_NSEC);
+	printf("%s: OK (max packet delay %s, max error %s)\n", __FUNCTION__,
+		   time2String(maxPacketDelay).toLatin1().constData(), time2String(maxError).toLatin1().constData());
+}
+
+// Runs the packet sequence through the table several times; returns the time spent in the first pass and the
+// average of the later passes.
+static void runFlowTracking(FlowTable &table, const QVector<quint32> &sequence, int numPaths,
+							quint64 &nsFirst, quint64 &nsSteady)
+{
+	Packet *p = new Packet();
+	p->init();
+	p->l4_protocol = IPPROTO_UDP;
+	p->length = 1500;
+	// the first pass starts every flow, the following ones only find them
+	const int numPasses = 4;
+	quint64 tsVirtual = 0;
+	nsFirst = nsSteady = 0;
+	for (int pass = 0; pass < numPasses; pass++) {
+		const quint64 tsStart = get_current_time();
+		for (int i = 0; i < sequence.count(); i++) {
+			const quint32 flow = sequence[i];
+			p->path_id = flow % numPaths;
+			p->l4_src_port = 1024 + (flow / numPaths) % 60000;
+			p->l4_dst_port = 80 + (flow / numPaths) / 60000;
+			table.handlePacket(p, tsVirtual);
+			tsVirtual += 100;
+		}
+		const quint64 elapsed = get_current_time() - tsStart;
+		if (pass == 0) {
+			nsFirst = elapsed;
+		} else {
+			nsSteady += elapsed;
+		}
+	}
+	nsSteady /= numPasses - 1;
+	table.flush();
+	delete p;
+}
+
+// Feeds the packets of 100k flows through the flow table and through the per-path QHash store it replaced, checks
+// that both record the same events, and prints the cost per packet of each. The numbers depend on the machine, so
+// they are only reported, not checked.
+static void testFlowTableCost()
+{
+	const int numFlows = 100000;
+	const int numPaths = 16;
+	// each flow appears 10 times per pass, in random order
+	QVector<quint32> sequence;
+	for (int i = 0; i < 10; i++) {
+		for (int flow = 0; flow < numFlows; flow++) {
+			sequence << flow;
+		}
+	}
+	for (int i = sequence.count() - 1; i > 0; i--) {
+		qSwap(sequence[i], sequence[rand() % (i + 1)]);
+	}
+
+	SampledPathFlowEvents hashStore;
+	hashStore.initialize(numPaths);
+	FlowTable hashOnly;
+	hashOnly.init(0, &hashStore);
+	quint64 hashFirst, hashSteady;
+	runFlowTracking(hashOnly, sequence, numPaths, hashFirst, hashSteady);
+
+	SampledPathFlowEvents tableStore;
+	tableStore.initialize(numPaths);
+	FlowTable table;
+	table.init(flowTableSize, &tableStore);
+	quint64 tableFirst, tableSteady;
+	runFlowTracking(table, sequence, numPaths, tableFirst, tableSteady);
+
+	// 100k flows fit in the default table, so nothing was evicted and both stores must be identical
+	COMPARE(table.evictions, quint64(0));
+	COMPARE(table.peakCount, numFlows);
+	int numStored = 0;
+	for (int path = 0; path < numPaths; path++) {
+		COMPARE(tableStore.pathFlows[path].count(), hashStore.pathFlows[path].count());
+		foreach (quint64 key, hashStore.pathFlows[path].keys()) {
+			ASSERT(tableStore.pathFlows[path].contains(key));
+			const SampledFlowEvents &a = hashStore.pathFlows[path][key];
+			const SampledFlowEvents &b = tableStore.pathFlows[path][key];
+			COMPARE(b.flowEvents.count(), a.flowEvents.count());
+			for (int i = 0; i < a.flowEvents.count(); i++) {
+				COMPARE(b.flowEvents[i].tsEvent, a.flowEvents[i].tsEvent);
+				COMPARE(b.flowEvents[i].packetsTotal, a.flowEvents[i].packetsTotal);
+			}
+			numStored++;
+		}
+	}
+	COMPARE(numStored, numFlows);
+
+	const qreal packets = sequence.count();
+	printf("%s: OK (%d flows, %d packets per pass; ns/packet, first pass / later passes: "
+		   "QHash %.1f / %.1f, flow table %.1f / %.1f, %.2f probes per lookup)\n",
+		   __FUNCTION__, numFlows, sequence.count(),
+		   hashFirst / packets, hashSteady / packets,
+		   tableFirst / packets, tableSteady / packets,
+		   table.lookups > 0 ? qreal(table.probes) / table.lookups : 0.0);
+}
+
+// A chain: host 0 -> routers 1, 2, 3 -> host 4, and back. Edge 0 (0 -> 1) runs at head_KBps, edges 1 to 3 (the
+// relays towards host 4) at chain_KBps; the reverse edges are fast.
+static NetGraph* makeChainGraph(qreal head_KBps, qreal chain_KBps)
+{
+	NetGraph *g = new NetGraph();
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addNode(NETGRAPH_NODE_ROUTER);
+	g->addNode(NETGRAPH_NODE_ROUTER);
+	g->addNode(NETGRAPH_NODE_ROUTER);
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addEdge(0, 1, head_KBps, 1, 0, 1000);
+	g->addEdge(1, 2, chain_KBps, 1, 0, 1000);
+	g->addEdge(2, 3, chain_KBps, 1, 0, 1000);
+	g->addEdge(3, 4, chain_KBps, 1, 0, 1000);
+	g->addEdge(4, 3, 100000, 1, 0, 1000);
+	g->addEdge(3, 2, 100000, 1, 0, 1000);
+	g->addEdge(2, 1, 100000, 1, 0, 1000);
+	g->addEdge(1, 0, 100000, 1, 0, 1000);
+	addRoute(*g, QList<qint32>() << 0 << 1 << 2 << 3 << 4);
+	addRoute(*g, QList<qint32>() << 4 << 3 << 2 << 1 << 0);
+	return g;
+}
+
+// Segment collapsing must not change the outcome of any packet: bursts of long and short frames queue on the head
+// of a chain and leave it back to back, which is the worst case for a short frame catching up with a long one on
+// the collapsed hops. Also checks that chains where that can happen are not collapsed.
+static void testCollapsedSegmentAccuracy()
+{
+	QList<TestArrival> arrivals;
+	const int sizes[] = { ETH_FRAME_LEN, 60, 60, ETH_FRAME_LEN, 60, ETH_FRAME_LEN, ETH_FRAME_LEN, 60 };
+	const int burstLength = sizeof(sizes) / sizeof(sizes[0]);
+	for (int burst = 0; burst < 100; burst++) {
+		for (int i = 0; i < burstLength; i++) {
+			TestArrival a = { burst * 10 * MSEC_TO_NSEC + i * USEC_TO_NSEC, 0, 4, sizes[i], quint16(10000 + i) };
+			arrivals << a;
+		}
+	}
+
+	// 1 MB/s into 100 MB/s relays: a 60 B frame takes 60 us on the head, a 1514 B frame 15 us per relay
+	NetGraph *g = makeChainGraph(1000, 100000);
+	setupEmulation(*g, "collapse-reference", QStringList());
+	ASSERT(netGraph->edges[0].collapsedEdges.isEmpty());
+	QList<TestOutcome> reference = runScenario(arrivals);
+	setupEmulation(*g, "collapse-collapsed", QStringList() << "--collapse_segments");
+	delete g;
+	COMPARE(netGraph->edges[0].collapsedEdges.count(), 3);
+	QList<TestOutcome> collapsed = runScenario(arrivals);
+
+	quint64 maxError = 0;
+	for (int i = 0; i < arrivals.count(); i++) {
+		ASSERT(reference[i].forwarded);
+		COMPARE(collapsed[i].forwarded, reference[i].forwarded);
+		COMPARE(collapsed[i].trace, reference[i].trace);
+		const quint64 error = collapsed[i].ts > reference[i].ts ? collapsed[i].ts - reference[i].ts :
+																   reference[i].ts - collapsed[i].ts;
+		maxError = qMax(maxError, error);
+	}
+	// only the rounding of the transmission times to nanoseconds
+	ASSERT(maxError <= 10);
+
+	// Relays only 10 times faster than the head, or as fast: a short frame can catch up with a long one
+	foreach (qreal chain_KBps, QList<qreal>() << 10000 << 1000) {
+		g = makeChainGraph(1000, chain_KBps);
+		setupEmulation(*g, "collapse-refused", QStringList() << "--collapse_segments");
+		delete g;
+		ASSERT(netGraph->edges[0].collapsedEdges.isEmpty());
+	}
+	printf("%s: OK (max exit time difference %s)\n", __FUNCTION__, time2String(maxError).toLatin1().constData());
+}
+
+// Two hosts merging on a router: hosts 0 and 1 -> routers 2, 3, 4 -> host 5, and back. The edges from the hosts
+// are fast, the chain of routers runs at chain_KBps with queues of queueLength frames.
+static NetGraph* makeMergingGraph(qreal chain_KBps, int queueLength)
+{
+	NetGraph *g = new NetGraph();
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addNode(NETGRAPH_NODE_ROUTER);
+	g->addNode(NETGRAPH_NODE_ROUTER);
+	g->addNode(NETGRAPH_NODE_ROUTER);
+	g->addNode(NETGRAPH_NODE_HOST);
+	g->addEdge(0, 2, 100000, 1, 0, 100);
+	g->addEdge(1, 2, 100000, 1, 0, 100);
+	g->addEdge(2, 3, chain_KBps, 1, 0, queueLength);
+	g->addEdge(3, 4, chain_KBps, 1, 0, queueLength);
+	g->addEdge(4, 5, chain_KBps, 1, 0, queueLength);
+	g->addEdge(5, 4, 100000, 1, 0, 100);
+	g->addEdge(4, 3, 100000, 1, 0, 100);
+	g->addEdge(3, 2, 100000, 1, 0, 100);
+	g->addEdge(2, 0, 100000, 1, 0, 100);
+	g->addEdge(2, 1, 100000, 1, 0, 100);
+	addRoute(*g, QList<qint32>() << 0 << 2 << 3 << 4 << 5);
+	addRoute(*g, QList<qint32>() << 1 << 2 << 3 << 4 << 5);
+	addRoute(*g, QList<qint32>() << 5 << 4 << 3 << 2 << 0);
+	addRoute(*g, QList<qint32>() << 5 << 4 << 3 << 2 << 1);
+	return g;
+}
+
+// Cut-through must give exactly the outcome of per-hop processing: two hosts send random bursts of a few flows that
+// merge at router 2, so runs of one flow follow each other closely and packets of the other host arrive on links
+// that are still reserved. Compares which packets are dropped and when each packet leaves the network. The second
+// case adds fluid background on the last two links of the chain, starting and stopping in the middle of the bursts:
+// those links must never be cut through, since an onset during a run would not delay the packets already reserved.
+static void testCutThroughMerge()
+{
+	const int sizes[] = { 60, 576, ETH_FRAME_LEN };
+	QList<TestArrival> streams[2];
+	for (int host = 0; host < 2; host++) {
+		quint64 ts = host * 7 * USEC_TO_NSEC;
+		for (int i = 0; i < 1500; i++) {
+			// mostly back to back, with idle gaps that let the chain empty
+			ts += (rand() % 4 == 0) ? quint64(rand() % 2000) * USEC_TO_NSEC : quint64(rand() % 100) * USEC_TO_NSEC;
+			TestArrival a = { ts, host, 5, sizes[rand() % 3], quint16(10000 + 100 * host + rand() % 3) };
+			streams[host] << a;
+		}
+	}
+	QList<TestArrival> arrivals;
+	for (int i0 = 0, i1 = 0; i0 < streams[0].count() || i1 < streams[1].count(); ) {
+		if (i1 >= streams[1].count() || (i0 < streams[0].count() && streams[0][i0].ts <= streams[1][i1].ts)) {
+			arrivals << streams[0][i0++];
+		} else {
+			arrivals << streams[1][i1++];
+		}
+	}
+
+	// 10 MB/s: a 1514 B frame takes 150 us per hop, so the hosts often overload the chain and fill the queues
+	QString fluidFileName = QString("%1/cut-through-fluid.txt").arg(testDir);
+	ASSERT(saveFile(fluidFileName, "3 5 3000 0.1 0.3\n"));
+	foreach (QStringList options, QList<QStringList>() << QStringList()
+			 << (QStringList() << "--fluid_background" << fluidFileName)) {
+		NetGraph *g = makeMergingGraph(10000, 20);
+		setupEmulation(*g, "cut-through-reference", options);
+		QList<TestOutcome> reference = runScenario(arrivals);
+		setupEmulation(*g, "cut-through-merge", options + (QStringList() << "--cut_through"));
+		delete g;
+		ASSERT(cutThroughEnabled);
+		const quint64 cutThroughPacketsBefore = numCutThroughPackets;
+		const quint64 cutThroughHopsBefore = numCutThroughHops;
+		const quint64 revocationsBefore = numCutThroughRevocations;
+		QList<TestOutcome> cutThrough = runScenario(arrivals);
+		const quint64 cutThroughPackets = numCutThroughPackets - cutThroughPacketsBefore;
+		const quint64 cutThroughHops = numCutThroughHops - cutThroughHopsBefore;
+		const quint64 revocations = numCutThroughRevocations - revocationsBefore;
+
+		int numDropped = 0;
+		quint64 maxError = 0;
+		for (int i = 0; i < arrivals.count(); i++) {
+			COMPARE(cutThrough[i].forwarded, reference[i].forwarded);
+			COMPARE(cutThrough[i].trace, reference[i].trace);
+			const quint64 error = cutThrough[i].ts > reference[i].ts ? cutThrough[i].ts - reference[i].ts :
+																	   reference[i].ts - cutThrough[i].ts;
+			maxError = qMax(maxError, error);
+			numDropped += reference[i].forwarded ? 0 : 1;
+		}
+		// only the rounding of the queue drain to whole bytes
+		ASSERT(maxError <= 10);
+		// both the fast path and the fallback must have been exercised
+		ASSERT(cutThroughPackets > 0);
+		ASSERT(numDropped > 0);
+		if (!options.isEmpty()) {
+			// runs stop before the links with fluid background: at most the host link and the first chain link
+			ASSERT(cutThroughHops <= 2 * cutThroughPackets);
+		}
+		printf("%s: OK (%s, %s packets cut through, %s revocations, %d drops, max exit time difference %s)\n",
+			   __FUNCTION__, options.isEmpty() ? "no background" : "fluid background", withCommas(cutThroughPackets),
+			   withCommas(revocations), numDropped, time2String(maxError).toLatin1().constData());
+	}
+}
+
+static void widenBottleneck(quint64 ts_now)
+{
+	LinkUpdate update;
+	update.edgeIndex = 1;
+	update.bandwidth = 2000;
+	netGraph->edges[update.edgeIndex].reconfigure(update, ts_now);
+}
+
+// The scheduler loop stalls while a fluid rate change and a link update become due: when it wakes up, the queuing
+// events of the stall must be routed with the changes applied in between, at their due times, as if the loop had
+// not stalled. A burst queues on a 1.5 MB/s access link and feeds the 1 MB/s bottleneck for 40 ms; fluid background
+// starts on the bottleneck at 10 ms, and the bottleneck is widened to 2 MB/s at 20 ms. The loop routes the burst and
+// then sleeps until 200 ms. Compares the exit times with a run in virtual time.
+static void testStalledLoopChanges()
+{
+	const quint64 tsUpdate = 20 * MSEC_TO_NSEC;
+	const quint64 tsWakeUp = 200 * MSEC_TO_NSEC;
+	QList<TestArrival> arrivals;
+	for (int i = 0; i < 40; i++) {
+		TestArrival a = { i * 10 * USEC_TO_NSEC, 0, 2, 1500, 10000 };
+		arrivals << a;
+	}
+	QString fluidFileName = QString("%1/stalled-loop-changes.txt").arg(testDir);
+	ASSERT(saveFile(fluidFileName, "3 2 300 0.010 0.040\n"));
+	NetGraph *g = makeSharedBottleneckGraph(1000, 100);
+	g->edges[0].bandwidth = 1500;
+
+	setupEmulation(*g, "stalled-loop-reference", QStringList() << "--fluid_background" << fluidFileName);
+	QList<TestOutcome> reference = runScenario(arrivals, tsUpdate, widenBottleneck);
+
+	setupEmulation(*g, "stalled-loop-changes", QStringList() << "--fluid_background" << fluidFileName);
+	delete g;
+	const quint64 tsBase = get_current_time();
+	startScheduler(tsBase);
+	OVector<LinkUpdateBatch*> pendingLinkUpdates;
+	OVector<Packet*> toSend;
+	OVector<Packet*> injectedDone;
+	OVector<Packet*> toTunnel;
+	bool receivedEvents = false;
+	bool appliedLinkUpdates = false;
+	// the link update is sent in advance, as a batch with a due time
+	LinkUpdateBatch *batch = new LinkUpdateBatch();
+	batch->id = 1;
+	batch->tsApply = tsUpdate;
+	batch->tsReceived = tsBase;
+	batch->updates.resize(1);
+	batch->updates[0].edgeIndex = 1;
+	batch->updates[0].bandwidth = 2000;
+	pendingLinkUpdates.append(batch);
+	QVector<Packet*> packets;
+	for (int i = 0; i < arrivals.count(); i++) {
+		const quint64 ts_now = tsBase + arrivals[i].ts;
+		routeDueEvents(ts_now, pendingLinkUpdates, toSend, injectedDone, toTunnel, receivedEvents,
+					   appliedLinkUpdates);
+		Packet *p = makeArrivalPacket(arrivals[i], i, tsBase);
+		packets << p;
+		quint64 ts_next;
+		COMPARE(routePacket(p, ts_now, ts_next), int(PKT_QUEUED));
+	}
+	// the loop sleeps until tsWakeUp, while the changes become due
+	routeDueEvents(tsBase + tsWakeUp, pendingLinkUpdates, toSend, injectedDone, toTunnel, receivedEvents,
+				   appliedLinkUpdates);
+	ASSERT(appliedLinkUpdates);
+	ASSERT(pendingLinkUpdates.isEmpty());
+	ASSERT(fluidModel.nextChangeTime() == ULLONG_MAX);
+	COMPARE(toSend.count(), arrivals.count());
+	ASSERT(injectedDone.isEmpty());
+	ASSERT(toTunnel.isEmpty());
+
+	quint64 maxError = 0;
+	quint64 maxReferenceDelay = 0;
+	for (int i = 0; i < packets.count(); i++) {
+		Packet *p = packets[i];
+		ASSERT(reference[i].forwarded);
+		ASSERT(!p->dropped);
+		COMPARE(p->trace.toList(), reference[i].trace);
+		const quint64 ts = p->ts_start_send - tsBase;
+		const quint64 error = ts > reference[i].ts ? ts - reference[i].ts : reference[i].ts - ts;
+		maxError = qMax(maxError, error);
+		maxReferenceDelay = qMax(maxReferenceDelay, reference[i].ts - arrivals[i].ts);
+		delete p;
+	}
+	// only the rounding of the queue drain to whole bytes
+	ASSERT(maxError <= 10);
+	// the burst must still be in the network when the bottleneck is widened
+	ASSERT(maxReferenceDelay > tsUpdate);
+	COMPARE(netGraph->edges[1].bandwidth, 2000.0);
+	LinkUpdateBatch *done;
+	ASSERT(linkUpdatesDone.tryDequeue(done));
+	COMPARE(done, batch);
+	COMPARE(done->tsDue, tsBase + tsUpdate);
+	delete done;
+	printf("%s: OK (max exit time difference %s)\n", __FUNCTION__, time2String(maxError).toLatin1().constData());
+}
+
+typedef void (*TestFunction)();
+
+int main(int argc, char *argv[])
+{
+	QList<QPair<QString, TestFunction> > tests;
+	tests << QPair<QString, TestFunction>("shrink-loaded-queue", testShrinkLoadedQueue);
+	tests << QPair<QString, TestFunction>("fluid-background-accuracy", testFluidBackgroundAccuracy);
+	tests << QPair<QString, TestFunction>("flow-table-cost", testFlowTableCost);
+	tests << QPair<QString, TestFunction>("collapsed-segment-accuracy", testCollapsedSegmentAccuracy);
+	tests << QPair<QString, TestFunction>("cut-through-merge", testCutThroughMerge);
+	tests << QPair<QString, TestFunction>("stalled-loop-changes", testStalledLoopChanges);
+
+	QStringList selected;
+	for (int i = 1; i < argc; i++) {
+		selected << argv[i];
+	}
+
+	QDir dir(QDir::tempPath());
+	testDir = dir.absoluteFilePath(QString("line-router-test-%1").arg(getpid()));
+	dir.mkpath(testDir);
+
+	// as in runPacketFilter()
+	linkUpdatesIn.init(1000);
+	linkUpdatesDone.init(1000);
+
+	srand(1);
+	do_shutdown = 0;
+	int numRun = 0;
+	for (int i = 0; i < tests.count(); i++) {
+		if (!selected.isEmpty() && !selected.contains(tests[i].first))
+			continue;
+		tests[i].second();
+		numRun++;
+	}
+	if (numRun == 0) {
+		fprintf(stderr, "No such test\n");
+		return EXIT_FAILURE;
+	}
+	printf("%d tests passed\n", numRun);
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "tenants.h"
+
+#include "../util/util.h"
+
+TenantSet tenants;
+
+Tenant::Tenant()
+	: firstNode(0),
+	  numNodes(0),
+	  firstEdge(0),
+	  numEdges(0),
+	  firstConnection(0),
+	  numConnections(0),
+	  firstPath(0),
+	  numPaths(0),
+	  firstTrace(0),
+	  numTraces(0),
+	  maxRate_pps(0),
+	  burst(0),
+	  tokens(0),
+	  tsLastUpdate(0),
+	  packetsAdmitted(0),
+	  packetsPoliced(0)
+{
+}
+
+TenantSet::TenantSet()
+	: crossTenantPackets(0)
+{
+	// the main graph
+	tenants.resize(1);
+}
+
+void TenantSet::addTenant(QString graphFileName)
+{
+	Tenant tenant;
+	tenant.graphFileName = graphFileName;
+	tenants.append(tenant);
+}
+
+// Shifts the next hops (and the destinations, for node routes) of a routing table.
+static QMultiHash<int, Route> shiftRoutes(const QMultiHash<int, Route> &routes, qint32 nodeOffset, bool nodeDestinations)
+{
+	QMultiHash<int, Route> result;
+	foreach (int key, routes.uniqueKeys()) {
+		// values() returns the most recently inserted first; keep the order of the load balanced next hops
+		QList<Route> values = routes.values(key);
+		for (int i = values.count() - 1; i >= 0; i--) {
+			Route r = values[i];
+			r.nextHop += nodeOffset;
+			if (nodeDestinations) {
+				r.destination += nodeOffset;
+			}
+			result.insert(nodeDestinations ? key + nodeOffset : key, r);
+		}
+	}
+	return result;
+}
+
+static inline NetGraphEdge shiftEdge(NetGraphEdge e, qint32 nodeOffset, qint32 edgeOffset)
+{
+	e.index += edgeOffset;
+	e.source += nodeOffset;
+	e.dest += nodeOffset;
+	return e;
+}
+
+void TenantSet::append(NetGraph *netGraph, NetGraph &g)
+{
+	const qint32 nodeOffset = netGraph->nodes.count();
+	const qint32 edgeOffset = netGraph->edges.count();
+	const qint32 connectionOffset = netGraph->connections.count();
+
+	foreach (NetGraphNode n, g.nodes) {
+		n.index += nodeOffset;
+		n.routes.localRoutes = shiftRoutes(n.routes.localRoutes, nodeOffset, true);
+#if AS_AGGREGATION
+		n.routes.interASroutes = shiftRoutes(n.routes.interASroutes, nodeOffset, false);
+#else
+		n.routes.aggregateInterASroutes = shiftRoutes(n.routes.aggregateInterASroutes, nodeOffset, false);
+#endif
+		netGraph->nodes << n;
+	}
+
+	foreach (NetGraphEdge e, g.edges) {
+		netGraph->edges << shiftEdge(e, nodeOffset, edgeOffset);
+	}
+
+	foreach (NetGraphConnection c, g.connections) {
+		c.index += connectionOffset;
+		c.source += nodeOffset;
+		c.dest += nodeOffset;
+		netGraph->connections << c;
+	}
+
+	foreach (NetGraphPath p, g.paths) {
+		p.source += nodeOffset;
+		p.dest += nodeOffset;
+		QList<NetGraphEdge> edgeList;
+		foreach (NetGraphEdge e, p.edgeList) {
+			edgeList << shiftEdge(e, nodeOffset, edgeOffset);
+		}
+		p.edgeList = edgeList;
+		QSet<NetGraphEdge> edgeSet;
+		foreach (NetGraphEdge e, p.edgeSet) {
+			edgeSet << shiftEdge(e, nodeOffset, edgeOffset);
+		}
+		p.edgeSet = edgeSet;
+		QSet<qint32> connections;
+		foreach (qint32 c, p.connections) {
+			connections << c + connectionOffset;
+		}
+		p.connections = connections;
+		netGraph->paths << p;
+	}
+
+	foreach (TrafficTrace t, g.trafficTraces) {
+		t.link += edgeOffset;
+		netGraph->trafficTraces << t;
+	}
+}
+
+bool TenantSet::load(NetGraph *netGraph)
+{
+	tenants[0].graphFileName = netGraph->fileName;
+	for (int i = 0; i < tenants.count(); i++) {
+		Tenant &tenant = tenants[i];
+		tenant.firstNode = netGraph->nodes.count();
+		tenant.firstEdge = netGraph->edges.count();
+		tenant.firstConnection = netGraph->connections.count();
+		tenant.firstPath = netGraph->paths.count();
+		tenant.firstTrace = netGraph->trafficTraces.count();
+		if (i == 0) {
+			tenant.firstNode = tenant.firstEdge = tenant.firstConnection = tenant.firstPath = tenant.firstTrace = 0;
+		} else {
+			NetGraph g;
+			g.setFileName(tenant.graphFileName);
+			if (!g.loadFromFile()) {
+				qDebug() << "Could not load the graph of tenant" << i << tenant.graphFileName;
+				return false;
+			}
+			append(netGraph, g);
+		}
+		tenant.numNodes = netGraph->nodes.count() - tenant.firstNode;
+		tenant.numEdges = netGraph->edges.count() - tenant.firstEdge;
+		tenant.numConnections = netGraph->connections.count() - tenant.firstConnection;
+		tenant.numPaths = netGraph->paths.count() - tenant.firstPath;
+		tenant.numTraces = netGraph->trafficTraces.count() - tenant.firstTrace;
+
+		// allow bursts of 1 ms at the maximum rate
+		tenant.burst = qMax(32.0, tenant.maxRate_pps * 1.0e-3);
+		tenant.tokens = tenant.burst;
+		tenant.tsLastUpdate = 0;
+	}
+
+	nodeTenant.resize(netGraph->nodes.count());
+	for (int i = 0; i < tenants.count(); i++) {
+		for (int n = tenants[i].firstNode; n < tenants[i].firstNode + tenants[i].numNodes; n++) {
+			nodeTenant[n] = i;
+		}
+	}
+	crossTenantPackets = 0;
+	return true;
+}
+
+QString TenantSet::toString() const
+{
+	QString result;
+	result += "# tenant graph first_node nodes first_edge edges first_connection connections first_path paths "
+			  "first_trace traces first_ip last_ip max_rate_pps\n";
+	for (int i = 0; i < tenants.count(); i++) {
+		const Tenant &tenant = tenants[i];
+		result += QString("%1 %2 %3 %4 %5 %6 %7 %8 %9 %10 %11 %12 %13 %14 %15\n")
+				  .arg(i)
+				  .arg(tenant.graphFileName)
+				  .arg(tenant.firstNode)
+				  .arg(tenant.numNodes)
+				  .arg(tenant.firstEdge)
+				  .arg(tenant.numEdges)
+				  .arg(tenant.firstConnection)
+				  .arg(tenant.numConnections)
+				  .arg(tenant.firstPath)
+				  .arg(tenant.numPaths)
+				  .arg(tenant.firstTrace)
+				  .arg(tenant.numTraces)
+				  .arg(NetGraphNode::ip(tenant.firstNode))
+				  .arg(NetGraphNode::ip(tenant.firstNode + tenant.numNodes - 1))
+				  .arg(tenant.maxRate_pps);
+	}
+	return result;
+}
+
+bool TenantSet::save(QString fileName) const
+{
+	return saveFile(fileName, toString());
+}
+
+QString TenantSet::outputDir(int tenant)
+{
+	return QString("tenant-%1").arg(tenant);
+}
+
+bool TenantSet::saveHostAddresses(NetGraph *netGraph) const
+{
+	for (int i = 0; i < tenants.count(); i++) {
+		const Tenant &tenant = tenants[i];
+		if (!QDir().mkpath(outputDir(i)))
+			return false;
+		QString content = QString("# Tenant %1 (%2): the address of each host in the shared emulator\n"
+								  "# node (in the tenant graph) node (in the emulator) ip\n")
+						  .arg(i)
+						  .arg(tenant.graphFileName);
+		for (int n = tenant.firstNode; n < tenant.firstNode + tenant.numNodes; n++) {
+			if (netGraph->nodes[n].nodeType != NETGRAPH_NODE_HOST)
+				continue;
+			content += QString("%1 %2 %3\n").arg(n - tenant.firstNode).arg(n).arg(NetGraphNode::ip(n));
+		}
+		if (!saveFile(outputDir(i) + "/hosts.txt", content))
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,131 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef TENANTS_H
+#define TENANTS_H
+
+#include <QtCore>
+
+#include "netgraph.h"
+#include "../util/ovector.h"
+
+// Multi-tenant emulation: several independent experiments share one line-router instance (the I/O threads and the
+// scheduler). The graphs of the tenants are appended to the main graph (tenant 0), with all their indices shifted,
+// so each tenant owns a contiguous range of nodes, edges, connections and paths. Since the host addresses are
+// derived from the node indices, tenant i uses the addresses 1.0.0.0 + IP_OFFSET + [firstNode, firstNode + numNodes)
+// (its hosts must be configured with these, e.g. with NetGraphNode::customIp). The address of each host is saved to
+// tenant-<i>/hosts.txt in the simulation directory; configuring the hosts from it is up to the experiment tooling.
+//
+// Outputs: the stats of each tenant (admission counters, event and departure lateness) are saved to
+// tenant-<i>/stats.txt. The recorded data (recorded packets, interval measurements, flows, injection records) is
+// saved once for the whole merged graph; the index ranges in tenants.txt tell which edges and paths belong to which
+// tenant.
+//
+// Isolation: packets between different tenants are rejected, and each tenant can be given a maximum ingress packet
+// rate, enforced by a token bucket, so that a tenant cannot overload the shared scheduler. The accuracy each tenant
+// actually gets is measured by its lateness statistics (see AccuracyMonitor).
+
+class Tenant {
+public:
+	Tenant();
+
+	QString graphFileName;
+	qint32 firstNode;
+	qint32 numNodes;
+	qint32 firstEdge;
+	qint32 numEdges;
+	qint32 firstConnection;
+	qint32 numConnections;
+	qint32 firstPath;
+	qint32 numPaths;
+	qint32 firstTrace;
+	qint32 numTraces;
+
+	// Ingress policing; 0 = unlimited
+	qreal maxRate_pps;
+	qreal burst;
+	qreal tokens;
+	quint64 tsLastUpdate;
+
+	// Stats
+	quint64 packetsAdmitted;
+	quint64 packetsPoliced;
+};
+
+class TenantSet {
+public:
+	TenantSet();
+
+	// Tenant 0 is the main graph; the others are added by --tenant.
+	QVector<Tenant> tenants;
+	// vector index: node ID; value: tenant index
+	OVector<qint32> nodeTenant;
+	// Packets rejected because the source and the destination belong to different tenants
+	quint64 crossTenantPackets;
+
+	// Adds a tenant (before load()).
+	void addTenant(QString graphFileName);
+
+	// Sets the ranges of tenant 0 from netGraph, then loads the graphs of the other tenants and appends them to
+	// netGraph. Must be called before NetGraph::prepareEmulation().
+	bool load(NetGraph *netGraph);
+
+	inline bool isMultiTenant() const {
+		return tenants.count() > 1;
+	}
+
+	inline bool sameTenant(qint32 node1, qint32 node2) const {
+		return nodeTenant[node1] == nodeTenant[node2];
+	}
+
+	// Returns false if the packet exceeds the rate of the tenant of the source node.
+	inline bool admit(qint32 sourceNode, quint64 ts_now) {
+		Tenant &tenant = tenants[nodeTenant[sourceNode]];
+		if (tenant.maxRate_pps > 0) {
+			if (ts_now > tenant.tsLastUpdate) {
+				tenant.tokens = qMin(tenant.burst,
+									 tenant.tokens + (ts_now - tenant.tsLastUpdate) * 1.0e-9 * tenant.maxRate_pps);
+				tenant.tsLastUpdate = ts_now;
+			}
+			if (tenant.tokens < 1.0) {
+				tenant.packetsPoliced++;
+				return false;
+			}
+			tenant.tokens -= 1.0;
+		}
+		tenant.packetsAdmitted++;
+		return true;
+	}
+
+	// The index ranges and the address range of each tenant.
+	QString toString() const;
+	bool save(QString fileName) const;
+
+	// The output directory of a tenant, relative to the simulation directory.
+	static QString outputDir(int tenant);
+	// Creates the output directories and saves the address of each host to <output dir>/hosts.txt.
+	bool saveHostAddresses(NetGraph *netGraph) const;
+
+protected:
+	// Appends g to netGraph, shifting the indices.
+	static void append(NetGraph *netGraph, NetGraph &g);
+};
+
+extern TenantSet tenants;
+
+#endif // TENANTS_H
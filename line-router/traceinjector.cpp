@@ -0,0 +1,74 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "traceinjector.h"
+
+TraceInjector::TraceInjector()
+	: heap(128, false),
+	  numPackets(0),
+	  dilation(1.0)
+{
+}
+
+TraceInjector::~TraceInjector()
+{
+	close();
+}
+
+bool TraceInjector::open(const QList<TrafficTrace> &traces, const QVector<qint64> &packetCounts)
+{
+	close();
+
+	Q_ASSERT_FORCE(packetCounts.isEmpty() || packetCounts.count() == traces.count());
+	this->traces.resize(traces.count());
+	tracePacketCounts.resize(traces.count());
+	jitter.resize(traces.count());
+	heap = QBinaryHeap<qint32, quint64>(traces.count(), false);
+	for (int iTrace = 0; iTrace < traces.count(); iTrace++) {
+		this->traces[iTrace].reader = NULL;
+	}
+	for (int iTrace = 0; iTrace < traces.count(); iTrace++) {
+		TraceState &trace = this->traces[iTrace];
+		trace.reader = new MmapPcapReader();
+		trace.tsFirst = 0;
+		trace.packetIndex = -1;
+		QString fileName = traces[iTrace].resolvePcapFilePath();
+		if (fileName.isEmpty() || !trace.reader->open(fileName)) {
+			return false;
+		}
+		qint64 count = packetCounts.isEmpty() ? trace.reader->countPackets() : packetCounts[iTrace];
+		tracePacketCounts[iTrace] = count;
+		qDebug() << "Streaming trace" << fileName << "with numPackets" << count;
+		numPackets += count;
+		advance(iTrace);
+	}
+	return true;
+}
+
+void TraceInjector::close()
+{
+	for (int iTrace = 0; iTrace < traces.count(); iTrace++) {
+		delete traces[iTrace].reader;
+		traces[iTrace].reader = NULL;
+	}
+	traces.clear();
+	jitter.clear();
+	tracePacketCounts.clear();
+	heap = QBinaryHeap<qint32, quint64>(128, false);
+	numPackets = 0;
+}
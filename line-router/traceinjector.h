@@ -0,0 +1,114 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef TRACEINJECTOR_H
+#define TRACEINJECTOR_H
+
+#include <QtCore>
+
+#include "../tomo/mmappcap.h"
+#include "../util/debug.h"
+#include "../util/qbinaryheap.h"
+#include "../util/tinyhistogram.h"
+#include "../line-gui/traffictrace.h"
+
+// Streams the packets of the traffic traces from memory-mapped pcap files, in timestamp order.
+// A min-heap keyed on the next packet timestamp of each trace is used, so that only the traces
+// that have packets due are touched.
+class TraceInjector
+{
+public:
+	TraceInjector();
+	~TraceInjector();
+
+	// Opens all the traces. Returns false on error.
+	// If packetCounts is not empty, it must hold the packet count of each trace (e.g. from an emulation image),
+	// which saves a full pass over the pcap files.
+	bool open(const QList<TrafficTrace> &traces, const QVector<qint64> &packetCounts = QVector<qint64>());
+	void close();
+
+	// The packet timestamps are multiplied by factor (see timeDilation). Call before open().
+	void setTimeDilation(qreal factor) { dilation = factor; }
+
+	// Total number of packets in all the traces.
+	qint64 totalPackets() const { return numPackets; }
+	// Number of packets in each trace.
+	QVector<qint64> tracePacketCounts;
+
+	// If a packet is due at time tsRelative (nanoseconds since the start of the emulation), removes it from
+	// its trace and returns true; the jitter of the injection is measured against tsNowRelative.
+	inline bool takeDue(quint64 tsNowRelative, qint32 &traceIndex, qint64 &packetIndex, TrafficTracePacket &packet) {
+		if (heap.isEmpty())
+			return false;
+		QPair<qint32, quint64> head = heap.findMin();
+		if (head.second > tsNowRelative)
+			return false;
+		heap.takeMin();
+		traceIndex = head.first;
+		TraceState &trace = traces[traceIndex];
+		packetIndex = trace.packetIndex;
+		packet = trace.nextPacket;
+		jitter[traceIndex].recordEvent(tsNowRelative - packet.timestamp);
+		advance(traceIndex);
+		return true;
+	}
+
+	// Timestamp (relative to the start of the emulation) of the next packet, or ULLONG_MAX if there are none left.
+	inline quint64 nextTimestamp() {
+		return heap.isEmpty() ? ULLONG_MAX : heap.findMin().second;
+	}
+
+	// Per trace injection jitter (lateness relative to the trace timestamp).
+	QVector<TinyHistogram> jitter;
+
+protected:
+	class TraceState {
+	public:
+		MmapPcapReader *reader;
+		// Timestamp of the first packet of the trace; all timestamps are relative to it
+		quint64 tsFirst;
+		TrafficTracePacket nextPacket;
+		qint64 packetIndex;
+	};
+
+	// Reads the next packet of the trace and puts the trace back in the heap; does nothing at the end of the trace.
+	inline void advance(qint32 traceIndex) {
+		TraceState &trace = traces[traceIndex];
+		quint64 timestamp;
+		quint32 length;
+		if (!trace.reader->next(timestamp, length))
+			return;
+		if (trace.packetIndex < 0) {
+			trace.tsFirst = timestamp;
+		}
+		trace.packetIndex++;
+		trace.nextPacket.timestamp = timestamp >= trace.tsFirst ? timestamp - trace.tsFirst : 0;
+		if (dilation != 1.0) {
+			trace.nextPacket.timestamp = quint64(trace.nextPacket.timestamp * dilation);
+		}
+		trace.nextPacket.size = qMin(length, quint32(0xFFFF));
+		heap.insert(traceIndex, trace.nextPacket.timestamp);
+	}
+
+	QVector<TraceState> traces;
+	QBinaryHeap<qint32, quint64> heap;
+	qint64 numPackets;
+	qreal dilation;
+};
+
+#endif // TRACEINJECTOR_H
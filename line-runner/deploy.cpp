@@ -21,7 +21,7 @@
 #include "../remote_config.h"
 #include "util.h"
 
-void generateHostDeploymentScript(NetGraph &g, bool realRouting);
+void generateHostDeploymentScript(NetGraph &g, bool realRouting, QString hostIdentification);
 
 bool deploy(QString paramsFileName) {
 	RunParams runParams;
@@ -64,12 +64,30 @@ bool deploy(QString paramsFileName) {
 	return true;
 }
 
+QString partitionsFileName(const NetGraph &g)
+{
+	return QString(g.fileName).replace(".graph", ".partitions");
+}
+
+QString partitionsFileContent(const RunParams &params)
+{
+	QString result;
+	result += "# partition <index> <host> <UDP port>\n";
+	for (int i = 0; i < params.emulatorHostNames.count(); i++) {
+		// distinct ports, so that several partitions can run on the same host
+		result += QString("partition %1 %2 %3\n")
+				  .arg(i)
+				  .arg(params.emulatorHostNames[i])
+				  .arg(LINE_TUNNEL_PORT + i);
+	}
+	return result;
+}
+
 bool deploy(NetGraph &g, const RunParams &params) {
 	QString description;
 	QString command;
 	QStringList args;
 	QString graphName = g.fileName;
-	QString core = params.coreHostName;
 	QString corePort = params.corePort;
 	QString client = params.clientHostName;
 	QString clientPort = params.clientPort;
@@ -148,6 +166,24 @@ bool deploy(NetGraph &g, const RunParams &params) {
 		}
 	}
 
+	if (!params.realRouting && params.hostIdentification != "nat") {
+		if (params.hostIdentification != "vlan" && params.hostIdentification != "mac") {
+			qError() << "Unknown host identification mode:" << params.hostIdentification;
+			return false;
+		}
+		qDebug() << QString("Identifying the hosts by %1, without NAT...").arg(params.hostIdentification);
+		// The hosts reach each other on their own addresses; the emulator does not rewrite them
+		for (int i = 0; i < g.nodes.count(); i++) {
+			if (g.nodes[i].nodeType != NETGRAPH_NODE_HOST)
+				continue;
+			if (params.hostIdentification == "vlan" && NetGraphNode::vlanId(i) > HOST_VLAN_MAX) {
+				qError() << "Too many hosts for VLAN-based identification:" << g.nodes.count();
+				return false;
+			}
+			g.nodes[i].customIpForeign = g.nodes[i].ip();
+		}
+	}
+
 	qDebug() << "Saving...";
 	if (!g.saveToFile())
 		return false;
@@ -157,33 +193,54 @@ bool deploy(NetGraph &g, const RunParams &params) {
 		return true;
 	}
 
-	foreach (TrafficTrace trace, g.trafficTraces) {
-		// rsync -avz --checksum -e 'ssh -p 22' /path/to/file root@host:/path/to/
-
-		description = QString("Uploading trace file %1 to the router emulator").arg(trace.pcapFileName);
-		command = "rsync";
-		args = QStringList() << "-avz"
-							 << "--checksum"
-							 << "-e"
-							 << QString("ssh -p %1").arg(corePort)
-							 << trace.pcapFullFilePath
-							 << QString("root@%1:~/").arg(core);
-		if (!runCommand(command, args, description)) {
-			qError() << "Deployment aborted.";
+	if (params.isDistributed()) {
+		qDebug() << "Saving the partitions...";
+		if (!saveFile(partitionsFileName(g), partitionsFileContent(params)))
 			return false;
+	}
+
+	foreach (QString core, params.emulatorHosts().toSet()) {
+		foreach (TrafficTrace trace, g.trafficTraces) {
+			// rsync -avz --checksum -e 'ssh -p 22' /path/to/file root@host:/path/to/
+
+			description = QString("Uploading trace file %1 to the router emulator").arg(trace.pcapFileName);
+			command = "rsync";
+			args = QStringList() << "-avz"
+								 << "--checksum"
+								 << "-e"
+								 << QString("ssh -p %1").arg(corePort)
+								 << trace.pcapFullFilePath
+								 << QString("root@%1:~/").arg(core);
+			if (!runCommand(command, args, description)) {
+				qError() << "Deployment aborted.";
+				return false;
+			}
 		}
 	}
 
-	generateHostDeploymentScript(g, params.realRouting);
+	generateHostDeploymentScript(g, params.realRouting, params.hostIdentification);
 
 	if (!params.realRouting) {
-		description = "Uploading the graph file to the router emulator";
-		command = "scp";
-		args = QStringList() << "-P" << corePort <<
-								graphName << QString("root@%1:~").arg(core);
-		if (!runCommand(command, args, description)) {
-			qError() << "Deployment aborted.";
-			return false;
+		foreach (QString core, params.emulatorHosts().toSet()) {
+			description = "Uploading the graph file to the router emulator";
+			command = "scp";
+			args = QStringList() << "-P" << corePort <<
+									graphName << QString("root@%1:~").arg(core);
+			if (!runCommand(command, args, description)) {
+				qError() << "Deployment aborted.";
+				return false;
+			}
+
+			if (params.isDistributed()) {
+				description = "Uploading the partitions to the router emulator";
+				command = "scp";
+				args = QStringList() << "-P" << corePort <<
+										partitionsFileName(g) << QString("root@%1:~").arg(core);
+				if (!runCommand(command, args, description)) {
+					qError() << "Deployment aborted.";
+					return false;
+				}
+			}
 		}
 	}
 
@@ -401,7 +458,7 @@ bool deploy(NetGraph &g, const RunParams &params) {
 		}
 	} else {
 		foreach (QString host, QStringList() << params.clientHostName
-											 << params.coreHostName) {
+											 << params.emulatorHosts()) {
 			description = "Turning off traffic control";
 			command = "ssh";
 			args = QStringList() << "-f" << QString("root@%1").arg(host) <<
@@ -532,58 +589,61 @@ bool deploy(NetGraph &g, const RunParams &params) {
 	}
 
 	if (!params.realRouting) {
-		description = "Running the deployment script on the router emulator";
-		command = "ssh";
-		args = QStringList() << "-f" << QString("root@%1").arg(core) << "-p" << corePort << "sh -c '(/usr/bin/deploycore.pl 1> deploy.log 2> deploy.err &)'";
-		if (!runCommand(command, args, description)) {
-			qError() << "Deployment aborted.";
-			return false;
-		}
-
-		qDebug() << "Waiting...";
-		int fastSleeps = 5;
-		while (1) {
+		// once per machine, even if it runs several partitions
+		foreach (QString core, params.emulatorHosts().toSet()) {
+			description = "Running the deployment script on the router emulator";
 			command = "ssh";
-			args = QStringList() << QString("root@%1").arg(core) << "-p" << corePort << "sh -c 'pstree | grep deploycore.pl || /bin/true'";
-			description = "Waiting...";
-			QString output;
-			if (!runCommand(command, args, description, false, output)) {
+			args = QStringList() << "-f" << QString("root@%1").arg(core) << "-p" << corePort << "sh -c '(/usr/bin/deploycore.pl 1> deploy.log 2> deploy.err &)'";
+			if (!runCommand(command, args, description)) {
 				qError() << "Deployment aborted.";
 				return false;
 			}
-			output = output.trimmed();
-			if (output.isEmpty())
-				break;
-			if (fastSleeps > 0) {
-				sleep(1);
-				fastSleeps--;
-			} else {
-				sleep(5);
-			}
-		}
 
-		description = "Showing the deploy log for the router emulator";
-		command = "ssh";
-		args = QStringList() << QString("root@%1").arg(core) << "-p" << corePort << "sh -c 'cat deploy.log'";
-		if (!runCommand(command, args, description)) {
-			qError() << "Deployment aborted.";
-			return false;
-		}
+			qDebug() << "Waiting...";
+			int fastSleeps = 5;
+			while (1) {
+				command = "ssh";
+				args = QStringList() << QString("root@%1").arg(core) << "-p" << corePort << "sh -c 'pstree | grep deploycore.pl || /bin/true'";
+				description = "Waiting...";
+				QString output;
+				if (!runCommand(command, args, description, false, output)) {
+					qError() << "Deployment aborted.";
+					return false;
+				}
+				output = output.trimmed();
+				if (output.isEmpty())
+					break;
+				if (fastSleeps > 0) {
+					sleep(1);
+					fastSleeps--;
+				} else {
+					sleep(5);
+				}
+			}
 
-		description = "Checking for deploy errors for the router emulator";
-		command = "ssh";
-		{
-			args = QStringList() << QString("root@%1").arg(core) << "-p" << corePort << "sh -c 'cat deploy.err'";
-			QString output;
-			if (!runCommand(command, args, description, false, output)) {
+			description = "Showing the deploy log for the router emulator";
+			command = "ssh";
+			args = QStringList() << QString("root@%1").arg(core) << "-p" << corePort << "sh -c 'cat deploy.log'";
+			if (!runCommand(command, args, description)) {
 				qError() << "Deployment aborted.";
 				return false;
 			}
-			output = output.trimmed();
-			if (!output.isEmpty()) {
-				qError() << output;
-				qError() << "Deployment aborted.";
-				return false;
+
+			description = "Checking for deploy errors for the router emulator";
+			command = "ssh";
+			{
+				args = QStringList() << QString("root@%1").arg(core) << "-p" << corePort << "sh -c 'cat deploy.err'";
+				QString output;
+				if (!runCommand(command, args, description, false, output)) {
+					qError() << "Deployment aborted.";
+					return false;
+				}
+				output = output.trimmed();
+				if (!output.isEmpty()) {
+					qError() << output;
+					qError() << "Deployment aborted.";
+					return false;
+				}
 			}
 		}
 	}
@@ -592,7 +652,7 @@ bool deploy(NetGraph &g, const RunParams &params) {
 	return true;
 }
 
-void generateHostDeploymentScript(NetGraph &g, bool realRouting) {
+void generateHostDeploymentScript(NetGraph &g, bool realRouting, QString hostIdentification) {
 	//QMutexLockerDbg locker(g.mutex, __FUNCTION__); Q_UNUSED(locker);
 	QStringList lines;
 	lines << QString("#!/usr/bin/perl");
@@ -629,6 +689,16 @@ void generateHostDeploymentScript(NetGraph &g, bool realRouting) {
 	lines << QString("command \"sh -c '/sbin/ifdown %1 2> /dev/null'\";").arg(netdev);
 	lines << QString("command \"sh -c '/sbin/ifup %1 2> /dev/null'\";").arg(netdev);
 	if (!realRouting) {
+		lines << QString("# Remove the per-host interfaces and routing rules of a previous deployment");
+		lines << QString("foreach my $dev (`ip -o link show | awk -F': ' '{print \\$2}' | cut -d@ -f1 | grep '^line'`) {\n"
+						 "chomp $dev;\n"
+						 "command(\"ip link del $dev\");\n"
+						 "}");
+		lines << QString("command \"sh -c 'while ip rule del pref 10 2>/dev/null ; do true ; done'\";");
+	}
+	if (!realRouting && hostIdentification == "nat") {
+		lines << QString("command \"sh -c 'ip rule show pref 0 | grep -q local || ip rule add pref 0 lookup local'\";");
+		lines << QString("command \"sh -c 'ip rule del pref 100 lookup local 2>/dev/null || true'\";");
 		foreach (NetGraphNode n, g.nodes) {
 			if (n.nodeType != NETGRAPH_NODE_HOST)
 				continue;
@@ -636,6 +706,36 @@ void generateHostDeploymentScript(NetGraph &g, bool realRouting) {
 				continue;
 			lines << QString("command \"sh -c '/sbin/ifconfig %1:%2 %3 netmask 255.128.0.0'\";").arg(netdev).arg(n.index).arg(n.ip());
 		}
+	} else if (!realRouting) {
+		// Each host gets its own interface (a VLAN or a macvlan), through which it reaches all the other hosts via
+		// the emulator. Locally generated packets are routed by source address (the rules at pref 10) before the
+		// local table is consulted (moved to pref 100), so that they are not delivered locally.
+		QString gateway = REMOTE_DEDICATED_IP_ROUTER;
+		lines << QString("command \"sh -c 'ping -c 1 -W 1 %1 1>/dev/null 2>/dev/null'\";").arg(gateway);
+		lines << QString("my $routerMac = `ip neigh show %1 dev %2 | awk '{print \\$5}'`;\n"
+						 "chomp $routerMac;").arg(gateway).arg(netdev);
+		lines << QString("command \"sh -c 'ip rule show pref 100 | grep -q local || ip rule add pref 100 lookup local'\";");
+		lines << QString("command \"sh -c 'ip rule del pref 0 lookup local 2>/dev/null || true'\";");
+		foreach (NetGraphNode n, g.nodes) {
+			if (n.nodeType != NETGRAPH_NODE_HOST)
+				continue;
+			if (!n.used)
+				continue;
+			QString dev = QString("line%1").arg(n.index);
+			int table = 10000 + n.index;
+			if (hostIdentification == "vlan") {
+				lines << QString("command \"ip link add link %1 name %2 type vlan id %3\";")
+						 .arg(netdev).arg(dev).arg(NetGraphNode::vlanId(n.index));
+			} else {
+				lines << QString("command \"ip link add link %1 name %2 address %3 type macvlan mode vepa\";")
+						 .arg(netdev).arg(dev).arg(NetGraphNode::macAddress(n.index));
+			}
+			lines << QString("command \"ip addr add %1/32 dev %2\";").arg(n.ip()).arg(dev);
+			lines << QString("command \"ip link set %1 up\";").arg(dev);
+			lines << QString("command \"ip neigh replace %1 lladdr $routerMac dev %2 nud permanent\";").arg(gateway).arg(dev);
+			lines << QString("command \"ip route add 1.0.0.0/8 via %1 dev %2 onlink table %3\";").arg(gateway).arg(dev).arg(table);
+			lines << QString("command \"ip rule add pref 10 iif lo from %1 lookup %2\";").arg(n.ip()).arg(table);
+		}
 	}
 	lines << QString("command \"sh -c '/sbin/ifconfig %1 mtu 1500'\";").arg(netdev);
 	if (realRouting) {
@@ -716,7 +816,7 @@ void generateHostDeploymentScript(NetGraph &g, bool realRouting) {
     // Disable Slow-Start Restart (required to generate DASH video traffic).
     lines << QString("command \"sh -c 'echo 0 > /proc/sys/net/ipv4/tcp_slow_start_after_idle'\";");
 
-	if (!realRouting) {
+	if (!realRouting && hostIdentification == "nat") {
 		if (QString(REMOTE_DEDICATED_IP_HOSTS) != "127.0.0.1") {
 			QString gateway = REMOTE_DEDICATED_IP_ROUTER;
 			lines << QString("command \"sh -c '/sbin/route add -net 1.128.0.0/9 gw %1'\"").arg(gateway);
@@ -26,4 +26,12 @@ bool deploy(QString paramsFileName);
 
 bool deploy(NetGraph &g, const RunParams &runParams);
 
+// Distributed emulation: partition i listens for the packets of the other partitions on UDP port
+// LINE_TUNNEL_PORT + i.
+#define LINE_TUNNEL_PORT 9500
+
+// The partition file uploaded to the emulator hosts (see --partitions in line-router).
+QString partitionsFileName(const NetGraph &g);
+QString partitionsFileContent(const RunParams &params);
+
 #endif // DEPLOY_H
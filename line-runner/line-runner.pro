@@ -74,6 +74,7 @@ SOURCES += main.cpp \
     deploy.cpp \
     ../tomo/tomodata.cpp \
     simulate_experiment.cpp \
+    prepare_benchmark.cpp \
     export_matlab.cpp \
     ../util/bitarray.cpp \
     ../line-gui/traffictrace.cpp \
@@ -115,6 +116,7 @@ HEADERS += \
     deploy.h \
     ../tomo/tomodata.h \
     simulate_experiment.h \
+    prepare_benchmark.h \
     export_matlab.h \
     result_processing.h \
     ../util/bitarray.h \
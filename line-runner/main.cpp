@@ -22,6 +22,7 @@
 #include "deploy.h"
 #include "export_matlab.h"
 #include "run_experiment.h"
+#include "prepare_benchmark.h"
 #include "result_processing.h"
 #include "tinyhistogram.h"
 #include "util.h"
@@ -238,6 +239,11 @@ int main(int argc, char **argv) {
 					param = shiftCmdLineArg(argc, argv);
 					extraParams << param;
 				}
+			} else if (arg == "--prepare-benchmark") {
+				command = arg;
+				extraParams.clear();
+				extraParams << shiftCmdLineArg(argc, argv, command);
+				extraParams << shiftCmdLineArg(argc, argv, command);
 			} else if (arg == "--log-dir") {
 				QString logDir = shiftCmdLineArg(argc, argv, arg);
 				setupLogging(logDir);
@@ -266,6 +272,12 @@ int main(int argc, char **argv) {
 			processedParams << paramsFileName;
 		}
 
+		if (command == "--prepare-benchmark") {
+			if (!prepareBenchmarkGraph(extraParams[0], extraParams[1])) {
+				exit(-1);
+			}
+		}
+
 		if (command == "--check-trace") {
 			QString recordedFileName = extraParams.takeFirst();
 			checkTrace(recordedFileName, extraParams);
@@ -0,0 +1,64 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "prepare_benchmark.h"
+
+#include "netgraph.h"
+#include "chronometer.h"
+#include "debug.h"
+
+bool prepareBenchmarkGraph(QString inputFileName, QString outputFileName)
+{
+	NetGraph g;
+	g.setFileName(inputFileName);
+	if (!g.loadFromFile()) {
+		qDebug() << "Could not load" << inputFileName;
+		return false;
+	}
+
+	// The pristine topologies contain only the core; attach a host to each gateway (or to each node if there are
+	// no gateways), with the same link parameters as the BRITE import.
+	if (g.getHostNodes().isEmpty()) {
+		bool haveGateways = false;
+		foreach (NetGraphNode n, g.nodes) {
+			haveGateways = haveGateways || n.nodeType == NETGRAPH_NODE_GATEWAY;
+		}
+		foreach (NetGraphNode n, g.nodes) {
+			if (haveGateways && n.nodeType != NETGRAPH_NODE_GATEWAY)
+				continue;
+			int host = g.addNode(NETGRAPH_NODE_HOST, QPointF(), n.ASNumber);
+			g.addEdgeSym(host, n.index, 300, 1, 0, 20);
+		}
+	}
+
+	quint64 tsStart = getCurrentTimeNanosec();
+	if (!g.computeFullRoutes()) {
+		qDebug() << "Could not compute the routes for" << inputFileName;
+		return false;
+	}
+	quint64 routeTime = getCurrentTimeNanosec() - tsStart;
+	printf("Route computation time: %llu ns\n", routeTime);
+	printf("Nodes: %d, edges: %d, paths: %d\n", g.nodes.count(), g.edges.count(), g.paths.count());
+
+	g.setFileName(outputFileName);
+	if (!g.saveToFile()) {
+		qDebug() << "Could not save" << outputFileName;
+		return false;
+	}
+	return true;
+}
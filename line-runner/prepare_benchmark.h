@@ -0,0 +1,29 @@
+/*
+ *	Copyright (C) 2011 Ovidiu Mara
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; either version 2 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef PREPARE_BENCHMARK_H
+#define PREPARE_BENCHMARK_H
+
+#include <QtCore>
+
+// Makes an emulator benchmark graph (for line-router-bench, see line-router/perf-regression.sh) out of a topology
+// such as those in line-topologies-pristine: adds hosts if there are none, computes the full mesh of routes and
+// saves the result. Prints the route computation time as "Route computation time: <ns> ns".
+bool prepareBenchmarkGraph(QString inputFileName, QString outputFileName);
+
+#endif // PREPARE_BENCHMARK_H
@@ -115,6 +115,11 @@ bool doGenericSimulation(NetGraph &g, const RunParams &runParams)
 	// Experiment duration in seconds
 	int timeout = runParams.estimatedDuration / 1000000000ULL;
 
+	if (runParams.fakeEmulation) {
+		// Offline simulation on this machine, nothing to deploy
+		return runSimulation(g, runParams);
+	}
+
 	qDebug() << "Redeploying...";
 	if (!deploy(g, runParams)) {
 		qError() << "Deployment failed";
@@ -125,11 +130,6 @@ bool doGenericSimulation(NetGraph &g, const RunParams &runParams)
 		return false;
 	}
 
-	if (runParams.fakeEmulation) {
-		qError() << "Simulations not implemented";
-		return false;
-	}
-
 	QList<QSharedPointer<RemoteProcessSsh> > sshHosts;
 	if (!runParams.realRouting) {
 		sshHosts << QSharedPointer<RemoteProcessSsh>(new RemoteProcessSsh("traffic-generator"));
@@ -149,10 +149,16 @@ bool doGenericSimulation(NetGraph &g, const RunParams &runParams)
 
 	QList<QSharedPointer<RemoteProcessSsh> > sshCores;
 	if (!runParams.realRouting) {
-		sshCores << QSharedPointer<RemoteProcessSsh>(new RemoteProcessSsh("network-emulator"));
-		if (!sshCores.last()->connect("root", runParams.coreHostName, runParams.corePort)) {
-			qError() << "Connect to core failed";
-			return false;
+		// one per partition (a single one unless the emulation is distributed)
+		QList<QString> emulatorHosts = runParams.emulatorHosts();
+		for (int i = 0; i < emulatorHosts.count(); i++) {
+			sshCores << QSharedPointer<RemoteProcessSsh>(new RemoteProcessSsh(runParams.isDistributed() ?
+																				  QString("network-emulator-%1").arg(i) :
+																				  QString("network-emulator")));
+			if (!sshCores.last()->connect("root", emulatorHosts[i], runParams.corePort)) {
+				qError() << "Connect to core failed";
+				return false;
+			}
 		}
 	} else {
 		foreach (QString host, runParams.routerHostNames) {
@@ -219,9 +225,11 @@ bool doGenericSimulation(NetGraph &g, const RunParams &runParams)
 			QString netstatKey = ssh->startProcess("netstat", QStringList() << "-ntp");
 			while (!mustStop && ssh->isProcessRunning(netstatKey)) {}
 			QString output = ssh->readAllStdout(netstatKey) + "\n" + ssh->readAllStderr(netstatKey);
-			if (!output.contains(" 1.128."))
+			// Without NAT, the hosts connect to each other's 1.0.0.0/8 addresses
+			QString remotePrefix = runParams.hostIdentification == "nat" ? " 1.128." : " 1.";
+			if (!output.contains(remotePrefix))
 				break;
-			qDebug() << QString("Found %1 leftover connections. Waiting...").arg(output.count(" 1.128."));
+			qDebug() << QString("Found %1 leftover connections. Waiting...").arg(output.count(remotePrefix));
 			sleep(5);
 		}
 	}
@@ -252,15 +260,23 @@ bool doGenericSimulation(NetGraph &g, const RunParams &runParams)
 		}
 	}
 
-	QString initDoneFileName = "/root/init.done";
+	// The partitions of a distributed emulation may run on the same machine, so each one has its own file
+	QHash<RemoteProcessSsh*, QString> initDoneFileNames;
+	for (int i = 0; i < sshCores.count(); i++) {
+		initDoneFileNames[sshCores[i].data()] = runParams.isDistributed() ?
+													QString("/root/init.done.%1").arg(i) :
+													QString("/root/init.done");
+	}
 
 	if (!mustStop) {
 		// Start the emulator
 		foreach (PointerSsh ssh, sshCores) {
-			QString key = ssh->startProcess("rm", QStringList() << "-f" << initDoneFileName);
+			QString key = ssh->startProcess("rm", QStringList() << "-f" << initDoneFileNames[ssh.data()]);
 			while (!mustStop && ssh->isProcessRunning(key)) {}
 		}
-		foreach (PointerSsh ssh, sshCores) {
+		for (int iCore = 0; iCore < sshCores.count(); iCore++) {
+			PointerSsh ssh = sshCores[iCore];
+			QString initDoneFileName = initDoneFileNames[ssh.data()];
 			QString emulatorCmd;
 			if (!runParams.realRouting) {
 				emulatorCmd = QString("LD_PRELOAD=/usr/lib/malloc_profile.so line-router %1.graph %2 %3 %4 %5 %6 %7 %8 %9 %10 %11")
@@ -284,9 +300,14 @@ bool doGenericSimulation(NetGraph &g, const RunParams &runParams)
 								   .arg(runParams.qosBufferScaling))
 							  .arg(QString("--queuing_discipline %1")
                                    .arg(runParams.queuingDiscipline))
-							  .arg(QString(""))
-							  .arg(QString("--init_done_file_path %1")
-								   .arg(initDoneFileName));
+							  .arg(runParams.isDistributed()
+								   ? QString("--partition %1 --partitions %2.partitions")
+									 .arg(iCore)
+									 .arg(runParams.graphName)
+								   : QString(""))
+							  .arg(QString("--init_done_file_path %1 --host_id %2")
+								   .arg(initDoneFileName)
+								   .arg(runParams.hostIdentification));
 			} else {
 				emulatorCmd = QString("bash -c 'echo real; while true ; do sleep 5; done'");
 			}
@@ -313,7 +334,7 @@ bool doGenericSimulation(NetGraph &g, const RunParams &runParams)
 		bool initialized = true;
 		// Check that the emulator is ready to route
 		foreach (PointerSsh ssh, sshCores) {
-			if (!ssh->fileExists(initDoneFileName)) {
+			if (!ssh->fileExists(initDoneFileNames[ssh.data()])) {
 				initialized = false;
 				break;
 			}
@@ -488,9 +509,12 @@ bool doGenericSimulation(NetGraph &g, const RunParams &runParams)
 	}
 
 	// Save emulator output
-	foreach (PointerSsh ssh, sshCores) {
+	for (int iCore = 0; iCore < sshCores.count(); iCore++) {
+		PointerSsh ssh = sshCores[iCore];
 		QString emulatorKey = emulatorKeys[ssh.data()];
-		QString suffix = runParams.realRouting ? QString("-%1").arg(ssh->getHostname()) : QString("");
+		QString suffix = runParams.realRouting ? QString("-%1").arg(ssh->getHostname()) :
+												 runParams.isDistributed() ? QString("-partition-%1").arg(iCore) :
+																			 QString("");
 		QString key = ssh->startProcess("cp", QStringList() <<
 										QString("%1.out").arg(emulatorKey) <<
 										QString("%1/emulator%2.out").arg(testId).arg(suffix));
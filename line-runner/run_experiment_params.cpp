@@ -77,7 +77,7 @@ bool dumpRunParams(const RunParams &runParams,
 }
 
 QDataStream& operator<<(QDataStream& s, const RunParams& d) {
-	qint32 ver = 7;
+	qint32 ver = 9;
 	s << ver;
 
 	if (ver >= 1) {
@@ -140,6 +140,12 @@ QDataStream& operator<<(QDataStream& s, const RunParams& d) {
 	if (ver >= 7) {
 		s << d.intervalSamplingPeriod;
 	}
+	if (ver >= 8) {
+		s << d.emulatorHostNames;
+	}
+	if (ver >= 9) {
+		s << d.hostIdentification;
+	}
 
 	return s;
 }
@@ -217,7 +223,17 @@ QDataStream& operator>>(QDataStream& s, RunParams& d) {
 	} else {
 		d.intervalSamplingPeriod = 0;
 	}
-	if (ver < 1 || ver > 7) {
+	if (ver >= 8) {
+		s >> d.emulatorHostNames;
+	} else {
+		d.emulatorHostNames.clear();
+	}
+	if (ver >= 9) {
+		s >> d.hostIdentification;
+	} else {
+		d.hostIdentification = "nat";
+	}
+	if (ver < 1 || ver > 9) {
 		qDebug() << __FILE__ << __LINE__ << "Read error";
 		exit(-1);
 	}
@@ -262,6 +278,8 @@ QTextStream& operator<<(QTextStream& s, const RunParams& d) {
 	s << "corePort = " << d.corePort << endl;
 	s << "clientHostNames = " << QStringList(d.clientHostNames).join(" ") << endl;
 	s << "routerHostNames = " << QStringList(d.routerHostNames).join(" ") << endl;
+	s << "emulatorHostNames = " << QStringList(d.emulatorHostNames).join(" ") << endl;
+	s << "hostIdentification = " << d.hostIdentification << endl;
 	s << "congestedLinkFraction = " << d.congestedLinkFraction << endl;
 	s << "minProbCongestedLinkIsCongested = " << d.minProbCongestedLinkIsCongested << endl;
 	s << "maxProbCongestedLinkIsCongested = " << d.maxProbCongestedLinkIsCongested << endl;
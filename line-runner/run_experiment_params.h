@@ -104,6 +104,7 @@ public:
 		  corePort(corePort),
 		  clientHostNames(clientHostNames),
 		  routerHostNames(routerHostNames),
+		  hostIdentification("nat"),
 		  congestedLinkFraction(congestedLinkFraction),
 		  minProbCongestedLinkIsCongested(minProbCongestedLinkIsCongested),
 		  maxProbCongestedLinkIsCongested(maxProbCongestedLinkIsCongested),
@@ -157,6 +158,13 @@ public:
 	// Used only for realRouting
 	QList<QString> clientHostNames;
 	QList<QString> routerHostNames;
+	// Distributed emulation: if there are at least two, the graph is partitioned across these emulator hosts
+	// (partition i runs on emulatorHostNames[i]) instead of running on coreHostName. A host may appear several times.
+	QList<QString> emulatorHostNames;
+	// How line-router identifies the emulated hosts: "nat" (the 1.0.0.0/8 and 1.128.0.0/9 address pair of each host,
+	// rewritten by the emulator), "vlan" (one VLAN per host) or "mac" (one MAC address per host). The last two need
+	// no rewriting of the IP header.
+	QString hostIdentification;
 	qreal congestedLinkFraction;
 	// The probability that the links from the congested pool are congested, per interval, is sampled from a uniform
 	// distribution bounded by these two values.
@@ -182,6 +190,15 @@ public:
 	qreal congestedRateNoise;
 	qreal goodRateNoise;
 
+	inline bool isDistributed() const {
+		return !realRouting && emulatorHostNames.count() > 1;
+	}
+
+	// The hosts that run line-router, one per partition
+	inline QList<QString> emulatorHosts() const {
+		return isDistributed() ? emulatorHostNames : (QList<QString>() << coreHostName);
+	}
+
 	inline bool canRunInParallelWith(const RunParams &other) {
 		if (!fakeEmulation && !other.fakeEmulation)
 			return false;
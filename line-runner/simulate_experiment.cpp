@@ -19,5 +19,71 @@
 #include "simulate_experiment.h"
 
 #include "intervalmeasurements.h"
+#include "tomodata.h"
 #include "util.h"
 
+// Runs line-router in offline mode on this machine: no NICs, no root and no traffic generators are needed. The
+// router simulates the open-loop connections of the graph in virtual time and writes the same result files as an
+// emulation into runParams.workingDir.
+bool runSimulation(NetGraph &g, RunParams runParams)
+{
+	// Prefer the binary from the source tree, so that it matches the version of line-runner
+	QString emulator = QString(SRCDIR) + "/line-router/line-router";
+	if (!QFile::exists(emulator)) {
+		emulator = "line-router";
+	}
+
+	QString parentDir = parentDirFromDir(runParams.workingDir);
+	QString testId = runParams.workingDir.split('/', QString::SkipEmptyParts).last();
+
+	QStringList args;
+	args << "--offline"
+		 << g.fileName
+		 << testId;
+	if (runParams.capture) {
+		args << "--record"
+			 << QString::number(runParams.capturePacketLimit)
+			 << QString::number(runParams.captureEventLimit)
+			 << QString::number(runParams.captureSamplingPeriod);
+	}
+	if (runParams.takePathIntervalMeasurements) {
+		args << "--take_path_interval_measurements";
+	}
+	args << "--interval_size" << QString::number(runParams.intervalSize)
+		 << "--estimated_duration" << QString::number(runParams.estimatedDuration)
+		 << "--interval_measurements_sampling_period" << QString::number(runParams.intervalSamplingPeriod)
+		 << "--scale_buffers" << QString::number(runParams.bufferBloatFactor)
+		 << "--qos_scale_buffers" << runParams.qosBufferScaling
+		 << "--queuing_discipline" << runParams.queuingDiscipline;
+	qDebug() << QString("Emulator command: %1 %2").arg(emulator).arg(args.join(" "));
+
+	QProcess process;
+	process.setWorkingDirectory(parentDir);
+	process.start(emulator, args);
+	if (!process.waitForStarted()) {
+		qError() << "Could not start" << emulator;
+		return false;
+	}
+	process.waitForFinished(-1);
+
+	saveFile(runParams.workingDir + "/emulator.out", process.readAllStandardOutput());
+	saveFile(runParams.workingDir + "/emulator.err", process.readAllStandardError());
+	saveFile(runParams.workingDir + "/graph.txt",  g.toText());
+
+	bool exitOk = process.exitStatus() == QProcess::NormalExit && process.exitCode() == 0;
+	if (!exitOk) {
+		qError() << QString("Emulator exit code: %1").arg(process.exitCode());
+		return false;
+	}
+
+	// Export tomodata
+	{
+		TomoData tomoData;
+		tomoData.load(runParams.workingDir + "/" + "tomo-records.dat");
+		dumpTomoData(tomoData, runParams.workingDir + "/" + "tomo-records.txt");
+	}
+
+	qDebug() << QString("Test done.");
+	return true;
+}
+
@@ -54,6 +54,9 @@
 
 NetGraph netGraph;
 QHash<ev_timer *, int> onOffTimer2Connection;
+// Must match the --time_dilation of line-router (which line-runner does not set). Set by the parameter
+// --time_dilation.
+qreal timeDilation = 1.0;
 
 void poissonStartConnectionTimeoutHandler(int revents, void *arg);
 void connectionTransferCompletedHandler(void *arg, int client_fd);
@@ -438,6 +441,26 @@ void timeout_stop_connection(struct ev_loop *loop, ev_timer *w, int revents)
     }
 }
 
+// Slows down the open-loop traffic sources by timeDilation, to match an emulator running with time dilation.
+// TCP is paced by the emulated network and needs no adjustment.
+void applyTimeDilation()
+{
+	if (timeDilation == 1.0)
+		return;
+	for (int c = 0; c < netGraph.connections.count(); c++) {
+		NetGraphConnection &conn = netGraph.connections[c];
+		conn.rate_Mbps /= timeDilation;
+		conn.bufferingRate_Mbps /= timeDilation;
+		conn.poissonRate /= timeDilation;
+		conn.bufferingTime_s *= timeDilation;
+		conn.streamingPeriod_s *= timeDilation;
+		conn.onDurationMin *= timeDilation;
+		conn.onDurationMax *= timeDilation;
+		conn.offDurationMin *= timeDilation;
+		conn.offDurationMax *= timeDilation;
+	}
+}
+
 void createOnOffTimers()
 {
 	qDebugT();
@@ -755,6 +778,14 @@ int main(int argc, char **argv)
 			argc--, argv++;
 			numWorkers = QString(argv[0]).toInt();
 			argc--, argv++;
+		} else if (arg == "--time_dilation" && argc >= 1) {
+			bool ok;
+			timeDilation = QString(argv[0]).toDouble(&ok);
+			if (!ok || timeDilation <= 0) {
+				fprintf(stderr, "Wrong args\n");
+				exit(-1);
+			}
+			argc--, argv++;
 		} else {
 			fprintf(stderr, "Wrong args\n");
 			exit(-1);
@@ -770,6 +801,8 @@ int main(int argc, char **argv)
 	// Assign ports
 	netGraph.assignPorts();
 
+	applyTimeDilation();
+
 	for (int c = 0; c < netGraph.connections.count(); c++) {
 		netGraph.connections[c].maskedOut = c % numWorkers != workerIndex;
 	}
@@ -49,6 +49,10 @@ qint64 malloc_profile_get_alloc_count();
 qint64 malloc_profile_get_alloc_count_cpu();
 qint64 malloc_profile_get_alloc_count_by_size(size_t size);
 qint64 malloc_profile_get_alloc_count_cpu_by_size();
+void malloc_profile_guard_arm(const char *name);
+void malloc_profile_guard_disarm();
+qint64 malloc_profile_guard_get_count();
+void malloc_profile_guard_print_report();
 
 static int __attribute__ ((constructor(101))) malloc_profile_load();
 static void __attribute__ ((destructor)) malloc_profile_destroy();
@@ -212,6 +216,93 @@ static quint32 delay_counters[kMaxCPUs][kNumDelayCounters];
 static quint64 trace_masks[kMaxCPUs];
 static quint64 trace_mask_global;
 
+// Guard mode: the calls from armed threads are counted per thread and per call site (the last kGuardCallSiteDepth
+// return addresses). Nothing is allocated here, the tables are static.
+#define kMaxGuardThreads 16
+#define kMaxGuardCallSites 256
+#define kGuardCallSiteDepth 12
+
+typedef struct {
+	char name[32];
+	quint64 allocs;
+	quint64 frees;
+} guard_thread_t;
+
+typedef struct {
+	int thread;
+	int num_frames;
+	void *frames[kGuardCallSiteDepth];
+	quint64 allocs;
+	quint64 frees;
+} guard_call_site_t;
+
+static guard_thread_t guard_threads[kMaxGuardThreads];
+static int guard_num_threads;
+static guard_call_site_t guard_call_sites[kMaxGuardCallSites];
+static int guard_num_call_sites;
+static quint64 guard_dropped_call_sites;
+static volatile int guard_lock;
+
+static __thread int guard_index = -1;
+static __thread int guard_armed = 0;
+// Set while recording, in case unwinding calls malloc
+static __thread int guard_busy = 0;
+
+static void guard_record(int is_free)
+{
+	if (guard_busy)
+		return;
+	guard_busy = 1;
+
+	void *frames[kGuardCallSiteDepth];
+	int num_frames = 0;
+	unw_cursor_t cursor;
+	unw_context_t context;
+	unw_getcontext(&context);
+	unw_init_local(&cursor, &context);
+	while (num_frames < kGuardCallSiteDepth && unw_step(&cursor) > 0) {
+		unw_word_t ip;
+		unw_get_reg(&cursor, UNW_REG_IP, &ip);
+		frames[num_frames++] = (void*)ip;
+	}
+
+	while (__sync_lock_test_and_set(&guard_lock, 1)) {}
+	guard_thread_t *thread = &guard_threads[guard_index];
+	if (is_free) {
+		thread->frees++;
+	} else {
+		thread->allocs++;
+	}
+	guard_call_site_t *site = NULL;
+	for (int i = 0; i < guard_num_call_sites; i++) {
+		if (guard_call_sites[i].thread == guard_index &&
+			guard_call_sites[i].num_frames == num_frames &&
+			memcmp(guard_call_sites[i].frames, frames, num_frames * sizeof(void*)) == 0) {
+			site = &guard_call_sites[i];
+			break;
+		}
+	}
+	if (!site && guard_num_call_sites < kMaxGuardCallSites) {
+		site = &guard_call_sites[guard_num_call_sites++];
+		site->thread = guard_index;
+		site->num_frames = num_frames;
+		memcpy(site->frames, frames, num_frames * sizeof(void*));
+		site->allocs = site->frees = 0;
+	}
+	if (site) {
+		if (is_free) {
+			site->frees++;
+		} else {
+			site->allocs++;
+		}
+	} else {
+		guard_dropped_call_sites++;
+	}
+	__sync_lock_release(&guard_lock);
+
+	guard_busy = 0;
+}
+
 static void show_backtrace() {
 	unw_cursor_t cursor;
 	unw_context_t context;
@@ -376,6 +467,91 @@ void malloc_profile_set_trace_cpu(size_t size)
 	trace_masks[get_cpu()] = size;
 }
 
+void malloc_profile_guard_arm(const char *name)
+{
+	if (guard_index < 0) {
+		while (__sync_lock_test_and_set(&guard_lock, 1)) {}
+		if (guard_num_threads < kMaxGuardThreads) {
+			guard_index = guard_num_threads++;
+			strncpy(guard_threads[guard_index].name, name, sizeof(guard_threads[guard_index].name) - 1);
+		}
+		__sync_lock_release(&guard_lock);
+		if (guard_index < 0) {
+			fprintf(stderr, "malloc_profile: too many guarded threads, not guarding %s\n", name);
+			return;
+		}
+	}
+	guard_armed = 1;
+	__sync_synchronize();
+}
+
+void malloc_profile_guard_disarm()
+{
+	guard_armed = 0;
+	__sync_synchronize();
+}
+
+qint64 malloc_profile_guard_get_count()
+{
+	qint64 result = 0;
+	while (__sync_lock_test_and_set(&guard_lock, 1)) {}
+	for (int i = 0; i < guard_num_threads; i++) {
+		result += guard_threads[i].allocs + guard_threads[i].frees;
+	}
+	__sync_lock_release(&guard_lock);
+	return result;
+}
+
+void malloc_profile_guard_print_report()
+{
+	// Frames inside this library (malloc, free etc.) are not printed
+	Dl_info self;
+	if (!dladdr((void*)malloc_profile_guard_print_report, &self)) {
+		self.dli_fbase = NULL;
+	}
+
+	while (__sync_lock_test_and_set(&guard_lock, 1)) {}
+	fprintf(stderr, "Allocation guard\n");
+	for (int t = 0; t < guard_num_threads; t++) {
+		char buffer1[50];
+		char buffer2[50];
+		with_commas(guard_threads[t].allocs, buffer1);
+		with_commas(guard_threads[t].frees, buffer2);
+		fprintf(stderr, "Thread %s: %s allocations, %s frees\n", guard_threads[t].name, buffer1, buffer2);
+		for (int i = 0; i < guard_num_call_sites; i++) {
+			guard_call_site_t *site = &guard_call_sites[i];
+			if (site->thread != t)
+				continue;
+			with_commas(site->allocs, buffer1);
+			with_commas(site->frees, buffer2);
+			fprintf(stderr, "  %s allocations, %s frees at:\n", buffer1, buffer2);
+			for (int f = 0; f < site->num_frames; f++) {
+				Dl_info info;
+				int resolved = dladdr(site->frames[f], &info);
+				if (resolved && self.dli_fbase && info.dli_fbase == self.dli_fbase)
+					continue;
+				if (resolved && info.dli_sname) {
+					fprintf(stderr, "    %s+0x%lx (%s)\n", info.dli_sname,
+							(unsigned long)((char*)site->frames[f] - (char*)info.dli_saddr), info.dli_fname);
+				} else if (resolved) {
+					fprintf(stderr, "    %p (%s+0x%lx)\n", site->frames[f], info.dli_fname,
+							(unsigned long)((char*)site->frames[f] - (char*)info.dli_fbase));
+				} else {
+					fprintf(stderr, "    %p\n", site->frames[f]);
+				}
+			}
+		}
+	}
+	if (guard_dropped_call_sites > 0) {
+		char buffer[50];
+		with_commas(guard_dropped_call_sites, buffer);
+		fprintf(stderr, "%s calls from other call sites (table full)\n", buffer);
+	}
+	fprintf(stderr, "\n");
+	fflush(stderr);
+	__sync_lock_release(&guard_lock);
+}
+
 static void malloc_profile_load_pointers()
 {
 	realloc_original = dlsym(RTLD_NEXT, "realloc");
@@ -485,6 +661,9 @@ void *realloc(void *p, size_t size)
 		!realloc_original) {
 		return NULL;
 	}
+	if (guard_armed) {
+		guard_record(0);
+	}
 	if (paused) {
 		return realloc_original(p, size);
 	}
@@ -507,6 +686,9 @@ void *calloc(size_t count, size_t size)
 		!calloc_original) {
 		return NULL;
 	}
+	if (guard_armed) {
+		guard_record(0);
+	}
 	if (paused) {
 		return calloc_original(count, size);
 	}
@@ -529,6 +711,9 @@ void *malloc(size_t size)
 		!malloc_original) {
 		return NULL;
 	}
+	if (guard_armed) {
+		guard_record(0);
+	}
 	if (paused) {
 		return malloc_original(size);
 	}
@@ -551,6 +736,9 @@ void free(void *p)
 		!free_original) {
 		return;
 	}
+	if (guard_armed && p) {
+		guard_record(1);
+	}
 	if (paused) {
 		free_original(p);
 		return;
@@ -79,5 +79,18 @@ int main()
 
 	malloc_profile_pause_wrapper();
 
+	fprintf(stdout, "Checking the allocation guard...\n");
+
+	malloc_profile_guard_arm_wrapper("test");
+	char *guarded = allocate(100);
+	free(guarded);
+	malloc_profile_guard_disarm_wrapper();
+	free(allocate(100));
+
+	const long long guarded_calls = malloc_profile_guard_get_count_wrapper();
+	fprintf(stdout, "Guarded calls: real %d, measured %lld\n", 2, guarded_calls);
+	assert(guarded_calls == 2);
+	malloc_profile_guard_print_report_wrapper();
+
     return 0;
 }
@@ -105,3 +105,36 @@ void malloc_profile_print_stats_wrapper()
         malloc_profile_print_stats();
     }
 }
+
+void malloc_profile_guard_arm_wrapper(const char *name)
+{
+	void (*malloc_profile_guard_arm)(const char *) = dlsym(RTLD_DEFAULT, "malloc_profile_guard_arm");
+	if (malloc_profile_guard_arm) {
+		malloc_profile_guard_arm(name);
+	}
+}
+
+void malloc_profile_guard_disarm_wrapper()
+{
+	void (*malloc_profile_guard_disarm)() = dlsym(RTLD_DEFAULT, "malloc_profile_guard_disarm");
+	if (malloc_profile_guard_disarm) {
+		malloc_profile_guard_disarm();
+	}
+}
+
+long long malloc_profile_guard_get_count_wrapper()
+{
+	long long (*malloc_profile_guard_get_count)() = dlsym(RTLD_DEFAULT, "malloc_profile_guard_get_count");
+	if (malloc_profile_guard_get_count) {
+		return malloc_profile_guard_get_count();
+	}
+	return -1;
+}
+
+void malloc_profile_guard_print_report_wrapper()
+{
+	void (*malloc_profile_guard_print_report)() = dlsym(RTLD_DEFAULT, "malloc_profile_guard_print_report");
+	if (malloc_profile_guard_print_report) {
+		malloc_profile_guard_print_report();
+	}
+}
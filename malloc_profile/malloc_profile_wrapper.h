@@ -36,6 +36,12 @@ long long malloc_profile_get_alloc_count_wrapper();
 long long malloc_profile_get_alloc_count_cpu_wrapper();
 long long malloc_profile_get_alloc_count_by_size_wrapper(size_t size);
 long long malloc_profile_get_alloc_count_cpu_by_size_wrapper(size_t size);
+// Guard mode: counts the allocations and frees of the calling thread while armed, per call site.
+void malloc_profile_guard_arm_wrapper(const char *name);
+void malloc_profile_guard_disarm_wrapper();
+// Returns -1 if the library is not loaded.
+long long malloc_profile_guard_get_count_wrapper();
+void malloc_profile_guard_print_report_wrapper();
 
 #ifdef __cplusplus
 }
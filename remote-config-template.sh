@@ -13,6 +13,14 @@ REMOTE_HOST_ROUTER="TODO TO BE FILLED IN!!!"
 REMOTE_PORT_ROUTER='22'
 REMOTE_DEDICATED_IP_ROUTER='192.168.77.1'
 REMOTE_DEDICATED_IF_ROUTER='TODO TO BE FILLED IN!!!'
+# Distributed emulation (optional): the IP addresses of the machines running line-router, one per graph partition,
+# separated by spaces. The same address may appear several times (e.g. 127.0.0.1 for testing on one machine).
+# Leave empty to run a single line-router on REMOTE_HOST_ROUTER.
+REMOTE_HOSTS_EMULATORS=''
+# How line-router identifies the emulated hosts: 'nat' (address rewriting, the default), 'vlan' (one VLAN per host)
+# or 'mac' (one macvlan interface per host). vlan and mac avoid rewriting the IP header and fixing the checksums of
+# every packet, but require iproute2 with VLAN/macvlan support on the traffic generator.
+REMOTE_HOST_IDENTIFICATION='nat'
 
 # For a debug build of line-router:
 #BUILD_CONFIG_ROUTER='CONFIG-=release\ CONFIG+=debug'
@@ -44,6 +52,8 @@ export REMOTE_HOST_ROUTER
 export REMOTE_PORT_ROUTER
 export REMOTE_DEDICATED_IP_ROUTER
 export REMOTE_DEDICATED_IF_ROUTER
+export REMOTE_HOSTS_EMULATORS
+export REMOTE_HOST_IDENTIFICATION
 export BUILD_CONFIG_ROUTER
 export REMOTE_USER_HOSTS
 export REMOTE_HOST_HOSTS
@@ -60,6 +70,8 @@ echo "REMOTE_HOST_ROUTER=$REMOTE_HOST_ROUTER"
 echo "REMOTE_PORT_ROUTER=$REMOTE_PORT_ROUTER"
 echo "REMOTE_DEDICATED_IP_ROUTER=$REMOTE_DEDICATED_IP_ROUTER"
 echo "REMOTE_DEDICATED_IF_ROUTER=$REMOTE_DEDICATED_IF_ROUTER"
+echo "REMOTE_HOSTS_EMULATORS=$REMOTE_HOSTS_EMULATORS"
+echo "REMOTE_HOST_IDENTIFICATION=$REMOTE_HOST_IDENTIFICATION"
 echo "BUILD_CONFIG_ROUTER=$BUILD_CONFIG_ROUTER"
 echo "REMOTE_USER_HOSTS=$REMOTE_USER_HOSTS"
 echo "REMOTE_HOST_HOSTS=$REMOTE_HOST_HOSTS"
@@ -80,6 +92,8 @@ then
   echo "#define REMOTE_PORT_ROUTER \"$REMOTE_PORT_ROUTER\"" >> "$HEADER"
   echo "#define REMOTE_DEDICATED_IP_ROUTER \"$REMOTE_DEDICATED_IP_ROUTER\"" >> "$HEADER"
   echo "#define REMOTE_DEDICATED_IF_ROUTER \"$REMOTE_DEDICATED_IF_ROUTER\"" >> "$HEADER"
+  echo "#define REMOTE_HOSTS_EMULATORS \"$REMOTE_HOSTS_EMULATORS\"" >> "$HEADER"
+  echo "#define REMOTE_HOST_IDENTIFICATION \"$REMOTE_HOST_IDENTIFICATION\"" >> "$HEADER"
   echo "#define BUILD_CONFIG_ROUTER \"$BUILD_CONFIG_ROUTER\"" >> "$HEADER"
   echo "#define REMOTE_USER_HOSTS \"$REMOTE_USER_HOSTS\"" >> "$HEADER"
   echo "#define REMOTE_HOST_HOSTS \"$REMOTE_HOST_HOSTS\"" >> "$HEADER"
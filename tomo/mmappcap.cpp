@@ -0,0 +1,109 @@
+#include "mmappcap.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4U
+#define PCAP_MAGIC_NSEC 0xa1b23c4dU
+
+MmapPcapReader::MmapPcapReader()
+	: fd(-1),
+	  data(NULL),
+	  size(0),
+	  offset(0),
+	  swapped(false),
+	  nanosecond(false)
+{
+}
+
+MmapPcapReader::~MmapPcapReader()
+{
+	close();
+}
+
+bool MmapPcapReader::open(QString fileName)
+{
+	close();
+
+	fd = ::open(fileName.toLatin1().constData(), O_RDONLY);
+	if (fd < 0) {
+		qDebug() << __FILE__ << __LINE__ << "Failed to open file:" << fileName;
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(PcapHeader)) {
+		qDebug() << __FILE__ << __LINE__ << "Not a pcap file:" << fileName;
+		close();
+		return false;
+	}
+	size = st.st_size;
+
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED) {
+		qDebug() << __FILE__ << __LINE__ << "Failed to map file:" << fileName;
+		data = NULL;
+		close();
+		return false;
+	}
+	data = (const quint8 *)mapping;
+	// The file is read once, from start to end
+	madvise(mapping, size, MADV_SEQUENTIAL);
+
+	quint32 magic = ((const PcapHeader *)data)->magic_number;
+	if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC) {
+		swapped = false;
+	} else if (__builtin_bswap32(magic) == PCAP_MAGIC_USEC || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC) {
+		swapped = true;
+		magic = __builtin_bswap32(magic);
+	} else {
+		qDebug() << __FILE__ << __LINE__ << "Bad pcap magic number in file:" << fileName;
+		close();
+		return false;
+	}
+	nanosecond = magic == PCAP_MAGIC_NSEC;
+
+	rewind();
+	return true;
+}
+
+void MmapPcapReader::close()
+{
+	if (data) {
+		munmap((void *)data, size);
+		data = NULL;
+	}
+	if (fd >= 0) {
+		::close(fd);
+		fd = -1;
+	}
+	size = 0;
+	offset = 0;
+}
+
+bool MmapPcapReader::isOk()
+{
+	return data != NULL;
+}
+
+qint64 MmapPcapReader::countPackets()
+{
+	size_t savedOffset = offset;
+	rewind();
+	qint64 count = 0;
+	quint64 timestamp;
+	quint32 length;
+	while (next(timestamp, length)) {
+		count++;
+	}
+	offset = savedOffset;
+	return count;
+}
+
+void MmapPcapReader::rewind()
+{
+	offset = sizeof(PcapHeader);
+}
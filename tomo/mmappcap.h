@@ -0,0 +1,58 @@
+#ifndef MMAPPCAP_H
+#define MMAPPCAP_H
+
+#include <QtCore>
+
+#include "pcap-common.h"
+
+// Sequential reader of pcap files that maps the file in memory instead of copying the packets.
+// Only the record headers are parsed; packet contents are never touched.
+class MmapPcapReader
+{
+public:
+	MmapPcapReader();
+	~MmapPcapReader();
+
+	bool open(QString fileName);
+	void close();
+	bool isOk();
+
+	// Number of records in the file. Walks over all the record headers, does not change the read position.
+	qint64 countPackets();
+
+	// Reads the next record header. The timestamp is in nanoseconds.
+	// Returns false at the end of the file.
+	inline bool next(quint64 &timestamp, quint32 &length) {
+		if (offset + sizeof(PcapPacketHeader) > size)
+			return false;
+		PcapPacketHeader header = *(const PcapPacketHeader *)(data + offset);
+		if (swapped) {
+			header.ts_sec = __builtin_bswap32(header.ts_sec);
+			header.ts_nsec = __builtin_bswap32(header.ts_nsec);
+			header.incl_len = __builtin_bswap32(header.incl_len);
+			header.orig_len = __builtin_bswap32(header.orig_len);
+		}
+		if (offset + sizeof(PcapPacketHeader) + header.incl_len > size)
+			return false;
+		offset += sizeof(PcapPacketHeader) + header.incl_len;
+		timestamp = quint64(header.ts_sec) * 1000ULL * 1000ULL * 1000ULL +
+					quint64(header.ts_nsec) * (nanosecond ? 1ULL : 1000ULL);
+		length = header.orig_len;
+		return true;
+	}
+
+	// Moves the read position to the first record.
+	void rewind();
+
+protected:
+	int fd;
+	const quint8 *data;
+	size_t size;
+	size_t offset;
+	// True if the file has the opposite byte order
+	bool swapped;
+	// True if the timestamps have nanosecond resolution
+	bool nanosecond;
+};
+
+#endif // MMAPPCAP_H
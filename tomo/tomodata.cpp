@@ -1355,6 +1355,22 @@ QDataStream& operator>>(QDataStream& s, TomoData& data)
 {
 	qint32 ver;
 	s >> ver;
+	if (ver >= 5) {
+		// sparse form
+		SparseTomoData sparse;
+		s >> sparse.m;
+		s >> sparse.n;
+		s >> sparse.pathstarts;
+		s >> sparse.pathends;
+		s >> sparse.pathedges;
+		s >> sparse.y;
+		s >> sparse.xmeasured;
+		s >> sparse.tsMin;
+		s >> sparse.tsMax;
+		s >> sparse.entries;
+		sparse.toDense(data);
+		return s;
+	}
 	s >> data.m;
 	s >> data.n;
 	s >> data.pathstarts;
@@ -1412,6 +1428,101 @@ QDataStream& operator<<(QDataStream& s, const TomoData& data)
 	return s;
 }
 
+SparseTomoData::SparseTomoData()
+{
+	m = n = 0;
+	tsMin = tsMax = 0;
+}
+
+bool SparseTomoData::save(QString fileName) const
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly)) {
+		qDebug() << __FILE__ << __LINE__ << "Failed to open file:" << fileName;
+		return false;
+	}
+	QDataStream out(&file);
+	out.setVersion(QDataStream::Qt_4_0);
+
+	out << *this;
+	if (out.status() != QDataStream::Ok) {
+		qDebug() << __FILE__ << __LINE__ << "Error writing file:" << fileName;
+		return false;
+	}
+
+	return true;
+}
+
+void SparseTomoData::toDense(TomoData &data) const
+{
+	data.m = m;
+	data.n = n;
+	data.pathstarts = pathstarts;
+	data.pathends = pathends;
+	data.pathedges = pathedges;
+	data.y = y;
+	data.xmeasured = xmeasured;
+	data.tsMin = tsMin;
+	data.tsMax = tsMax;
+
+	data.A = QVector<QVector<quint8> >(m, QVector<quint8>(n, 0));
+	data.T = QVector<QVector<qreal> >(m, QVector<qreal>(n, 0.0));
+	data.packetCounters = data.T;
+	data.traffic = data.T;
+	data.qdelay = data.T;
+	for (int p = 0; p < m; p++) {
+		foreach (qint32 e, pathedges[p]) {
+			data.A[p][e] = 1;
+		}
+		foreach (const SparseTomoDataEntry &entry, entries[p]) {
+			data.T[p][entry.edge] = entry.T;
+			data.packetCounters[p][entry.edge] = entry.packetCounter;
+			data.traffic[p][entry.edge] = entry.traffic;
+			data.qdelay[p][entry.edge] = entry.qdelay;
+		}
+	}
+}
+
+QDataStream& operator<<(QDataStream& s, const SparseTomoDataEntry& d)
+{
+	s << d.edge;
+	s << d.T;
+	s << d.packetCounter;
+	s << d.traffic;
+	s << d.qdelay;
+	return s;
+}
+
+QDataStream& operator>>(QDataStream& s, SparseTomoDataEntry& d)
+{
+	s >> d.edge;
+	s >> d.T;
+	s >> d.packetCounter;
+	s >> d.traffic;
+	s >> d.qdelay;
+	return s;
+}
+
+QDataStream& operator<<(QDataStream& s, const SparseTomoData& data)
+{
+	// TomoData stream version; 5 and above are sparse
+	const qint32 ver = 5;
+	s << ver;
+
+	s << data.m;
+	s << data.n;
+	s << data.pathstarts;
+	s << data.pathends;
+	s << data.pathedges;
+	s << data.y;
+	s << data.xmeasured;
+	s << data.tsMin;
+	s << data.tsMax;
+	s << data.entries;
+
+	return s;
+}
+
 void dumpTomoData(TomoData &data, QString outputFile)
 {
 	QFile file(outputFile);
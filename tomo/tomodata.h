@@ -175,10 +175,48 @@ protected:
 	QList<TomoData> dataSeparated;
 };
 
+// The per-path, per-edge measurements of TomoData for one edge of a path.
+class SparseTomoDataEntry {
+public:
+	qint32 edge;
+	qreal T;
+	qreal packetCounter;
+	qreal traffic;
+	qreal qdelay;
+};
+
+// Same content as TomoData, but the m x n matrices (A, T, packetCounters, traffic and qdelay) are stored sparsely:
+// A is given by pathedges, and only the edges that received packets of a path have entries.
+// Saved in the same file format as TomoData (stream version 5), which TomoData::load() expands to the dense form.
+class SparseTomoData {
+public:
+	SparseTomoData();
+
+	qint32 m;
+	qint32 n;
+	QVector<qint32> pathstarts;
+	QVector<qint32> pathends;
+	QVector<QList<qint32> > pathedges;
+	QVector<qreal> y;
+	QVector<qreal> xmeasured;
+	quint64 tsMin;
+	quint64 tsMax;
+	// entries[pindex] = the non-zero measurements of path pindex, ordered by edge index
+	QVector<QVector<SparseTomoDataEntry> > entries;
+
+	bool save(QString fileName) const;
+	void toDense(TomoData &data) const;
+};
+
 void dumpTomoData(TomoData &data, QString outputFile);
 
 QDataStream& operator>>(QDataStream& s, TomoData& exp);
 
 QDataStream& operator<<(QDataStream& s, const TomoData& exp);
 
+QDataStream& operator<<(QDataStream& s, const SparseTomoDataEntry& d);
+QDataStream& operator>>(QDataStream& s, SparseTomoDataEntry& d);
+
+QDataStream& operator<<(QDataStream& s, const SparseTomoData& d);
+
 #endif // TOMODATA_H
@@ -94,6 +94,12 @@ public:
 		values.append(toJson(value));
 	}
 
+	// value must already be valid JSON (e.g. the output of another printer)
+	void addRawMember(const QString &name, const QString &value) {
+		names.append(toJson(name));
+		values.append(value);
+	}
+
 	QString json() {
 		QString result = "{\n";
 		QStringList parts;
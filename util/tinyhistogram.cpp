@@ -18,6 +18,8 @@
 
 #include "tinyhistogram.h"
 
+#include "json.h"
+
 // essentialy the integer base 2 logarithm
 static inline quint64 bit_scan_reverse_asm64(quint64 v)
 {
@@ -86,6 +88,28 @@ QString TinyHistogram::toString(QString (*valuePrinter)(quint64))
 	return result;
 }
 
+// Called from the stats thread while the histogram is being updated: the bins are read by index, because foreach or
+// toList() would share the vector, and the next recordEvent() would then detach (allocate and copy) it.
+QString toJson(const TinyHistogram &d)
+{
+	quint64 count = 0;
+	QList<quint32> bins;
+	bins.reserve(d.bins.count());
+	for (int i = 0; i < d.bins.count(); i++) {
+		const quint32 counter = d.bins.at(i);
+		bins.append(counter);
+		count += counter;
+	}
+
+	JsonObjectPrinter p;
+	p.addMember("count", count);
+	p.addMember("min", count ? d.min : 0ULL);
+	p.addMember("max", d.max);
+	p.addMember("average", count ? d.sum / count : 0ULL);
+	p.addMember("bins", bins);
+	return p.json();
+}
+
 QString intWithCommas2String(quint64 value)
 {
 	return QLocale(QLocale::English).toString(value);
@@ -30,6 +30,8 @@ public:
 
 	QString toString(QString (*valuePrinter)(quint64) = NULL);
 
+	friend QString toJson(const TinyHistogram &d);
+
 protected:
 	QVector<quint32> bins;
 	quint64 min;
@@ -37,6 +39,10 @@ protected:
 	quint64 sum;
 };
 
+// Object with count, min, max, average and bins, where bin i counts the values in [2^i, 2^(i+1)) (the last bin
+// has no upper bound).
+QString toJson(const TinyHistogram &d);
+
 QString time2String(quint64 nanoseconds);
 QString intWithCommas2String(quint64 value);
 